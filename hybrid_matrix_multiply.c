@@ -0,0 +1,702 @@
+/* 
+ * Picks between the dense kernels of matrix_multiply.c and the sparse ones
+ * of sparse_matrix_multiply.c by the density of the operands, see
+ * hybrid_matrix_multiply. Both files are built in to this one, so compile
+ * just this file, e.g. gcc -O2 -fopenmp hybrid_matrix_multiply.c; the options
+ * of both files (-DKERNEL_TRACE, -DSPARSE_INDEX_64 and so on) still apply.
+ */
+#define MATRIX_LIBRARY
+#include "matrix_multiply.c"
+#include "sparse_matrix_multiply.c"
+
+
+/* 
+ * The kernels hybrid_matrix_multiply picks from. The dense ones give a 2D
+ * array, the sparse one a CSR matrix.
+ *  - HYBRID_DENSE: matrix_multiply, with both operands as 2D arrays
+ *  - HYBRID_SPARSE_DENSE: sparse_dense_matrix_multiply, X as CSR (SpMM)
+ *  - HYBRID_DENSE_SPARSE: dense_sparse_matrix_multiply, Y as CSR
+ *  - HYBRID_SPARSE: rowwise_sparse_matrix_multiply, both as CSR (SpGEMM)
+ */
+enum Hybrid_Kernel {
+	HYBRID_DENSE,
+	HYBRID_SPARSE_DENSE,
+	HYBRID_DENSE_SPARSE,
+	HYBRID_SPARSE,
+	HYBRID_NUM_KERNELS
+};
+
+static const char *const hybrid_kernel_names[HYBRID_NUM_KERNELS] = {
+	"dense", "sparse-dense", "dense-sparse", "sparse"
+};
+
+/* 
+ * An operand or result of hybrid_matrix_multiply, in either format: exactly
+ * one of dense and sparse is set.
+ */
+struct Hybrid_Matrix {
+	int **dense;  /* A num_rows x num_cols 2D array, or NULL */
+	struct CSR_Matrix *sparse;  /* A CSR matrix, or NULL */
+	int num_rows;
+	int num_cols;
+};
+
+/* 
+ * How fast this machine runs each part of a product, which
+ * hybrid_matrix_multiply divides the work of each kernel by to estimate its
+ * time. The defaults are a guess; calibrate_hybrid_cost_model measures them.
+ */
+struct Hybrid_Cost_Model {
+	double dense_rate;  /* Multiply-adds a second of matrix_multiply */
+	double sparse_dense_rate;  /* Of sparse_dense_matrix_multiply */
+	double dense_sparse_rate;  /* Of dense_sparse_matrix_multiply */
+	double sparse_rate;  /* Of rowwise_sparse_matrix_multiply */
+	double scan_rate;  /* Elements of a 2D array a second, converting or scanning it */
+};
+
+/* 
+ * What hybrid_matrix_multiply picked and why: the densities it saw and the
+ * time it estimated for each kernel, including converting the operands.
+ */
+struct Hybrid_Report {
+	enum Hybrid_Kernel kernel;
+	double x_density;
+	double y_density;
+	double z_density;  /* Estimated */
+	double flops;  /* Multiplications of non-zero values, estimated unless both are CSR */
+	double estimated_seconds[HYBRID_NUM_KERNELS];
+	double seconds;  /* Taken, including the estimates */
+};
+
+#ifndef HYBRID_DENSE_RATE
+#define HYBRID_DENSE_RATE 2e10
+#endif
+#ifndef HYBRID_SPARSE_DENSE_RATE
+#define HYBRID_SPARSE_DENSE_RATE 4e9
+#endif
+#ifndef HYBRID_DENSE_SPARSE_RATE
+#define HYBRID_DENSE_SPARSE_RATE 5e8
+#endif
+#ifndef HYBRID_SPARSE_RATE
+#define HYBRID_SPARSE_RATE 2e8
+#endif
+#ifndef HYBRID_SCAN_RATE
+#define HYBRID_SCAN_RATE 2e9
+#endif
+
+/* The density of a product of two CSR matrices is sampled, rather than
+*  assumed uniform, when the sparse kernel is estimated to take at most this
+*  many times as long as the best of the others */
+#ifndef HYBRID_SAMPLE_RATIO
+#define HYBRID_SAMPLE_RATIO 2
+#endif
+
+/* At most one row in this many of X is sampled (and at most
+*  SPGEMM_NNZ_SAMPLES), so that picking stays small next to the product */
+#ifndef HYBRID_SAMPLE_FRACTION
+#define HYBRID_SAMPLE_FRACTION 16
+#endif
+
+static struct Hybrid_Cost_Model hybrid_cost_model = {
+	HYBRID_DENSE_RATE, HYBRID_SPARSE_DENSE_RATE, HYBRID_DENSE_SPARSE_RATE,
+	HYBRID_SPARSE_RATE, HYBRID_SCAN_RATE
+};
+
+/* Wraps a 2D array, without copying it */
+struct Hybrid_Matrix hybrid_of_dense(int **R, int num_rows, int num_cols) {
+	struct Hybrid_Matrix H = {R, NULL, num_rows, num_cols};
+	return H;
+}
+
+/* Wraps a CSR matrix, without copying it */
+struct Hybrid_Matrix hybrid_of_CSR(struct CSR_Matrix *R) {
+	struct Hybrid_Matrix H = {NULL, R, (int) R->num_rows, (int) R->num_cols};
+	return H;
+}
+
+/* Frees whichever of the formats R holds */
+void free_hybrid_matrix(struct Hybrid_Matrix *R) {
+	if (R->dense != NULL) free_2d_array(R->dense, R->num_rows, R->num_cols);
+	if (R->sparse != NULL) free_CSR_matrix(R->sparse);
+	R->dense = NULL;
+	R->sparse = NULL;
+}
+
+/* 
+ * Function: convert_dense_to_CSR
+ * ---------------------------- 
+ *   Converts a 2D array to a CSR matrix of its non-zero values, counting
+ *   them first so the matrix is allocated exactly.
+ * 
+ *   R: the 2D array
+ *   num_rows: the number of rows
+ *   num_cols: the number of columns
+ * 
+ *   returns: the CSR matrix
+ */
+struct CSR_Matrix *convert_dense_to_CSR(int **R, int num_rows, int num_cols) {
+	sparse_ptr_t *row_ptr = (sparse_ptr_t *) Malloc(((size_t) num_rows + 1) * \
+		sizeof(sparse_ptr_t));
+
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < num_rows; i++) {
+		sparse_ptr_t count = 0;
+		for (int j = 0; j < num_cols; j++) count += R[i][j] != 0;
+		row_ptr[i + 1] = count;
+	}
+
+	row_ptr[0] = 0;
+	for (int i = 0; i < num_rows; i++) row_ptr[i + 1] += row_ptr[i];
+
+	struct CSR_Matrix *C = init_CSR_matrix(row_ptr[num_rows], num_rows, num_cols);
+	free(C->row_ptr);
+	C->row_ptr = row_ptr;
+
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < num_rows; i++) {
+		sparse_ptr_t pos = row_ptr[i];
+		for (int j = 0; j < num_cols; j++)
+			if (R[i][j] != 0) {
+				C->val[pos] = R[i][j];
+				C->col_ind[pos++] = j;
+			}
+	}
+
+	return C;
+}
+
+/* 
+ * Function: convert_CSR_to_dense
+ * ---------------------------- 
+ *   Converts a CSR matrix to a 2D array, with zeros for its implicit values.
+ * 
+ *   R: the CSR matrix
+ * 
+ *   returns: the 2D array, R->num_rows x R->num_cols
+ */
+int** convert_CSR_to_dense(struct CSR_Matrix *R) {
+	int **D = init_2d_array((int) R->num_rows, (int) R->num_cols);
+
+	#pragma omp parallel for schedule(static)
+	for (sparse_ind_t i = 0; i < R->num_rows; i++) {
+		memset(D[i], 0, (size_t) R->num_cols * sizeof(int));
+		for (sparse_ptr_t p = R->row_ptr[i]; p < R->row_ptr[i + 1]; p++)
+			D[i][R->col_ind[p]] = R->val[p];
+	}
+
+	return D;
+}
+
+/* 
+ * Function: sparse_dense_rows
+ * ---------------------------- 
+ *   Computes rows i0 to i1 - 1 of X * Y for a CSR X and a 2D array Y: each
+ *   is the sum of the rows of Y picked by the row of X, scaled by its
+ *   values, 8 columns at a time.
+ * 
+ *   X: the CSR matrix
+ *   Y: the 2D array
+ *   n: the number of columns of Y
+ *   i0, i1: the first row and one past the last
+ *   Z: the result, of which rows i0 to i1 - 1 are written
+ */
+GEMM_INLINE void sparse_dense_rows(struct CSR_Matrix *X, int **Y, int n, int i0,
+	int i1, int **Z) {
+	for (int i = i0; i < i1; i++) {
+		int *z = Z[i];
+		memset(z, 0, (size_t) n * sizeof(int));
+
+		for (sparse_ptr_t p = X->row_ptr[i]; p < X->row_ptr[i + 1]; p++) {
+			const int *y = Y[X->col_ind[p]];
+			int a = X->val[p], j = 0;
+			for (; j + 8 <= n; j += 8) {
+				int8_vector y_vector, z_vector;
+				memcpy(&y_vector, y + j, sizeof(y_vector));
+				memcpy(&z_vector, z + j, sizeof(z_vector));
+				z_vector += y_vector * a;
+				memcpy(z + j, &z_vector, sizeof(z_vector));
+			}
+			for (; j < n; j++) z[j] += a * y[j];
+		}
+	}
+}
+
+typedef void (*Sparse_Dense_Kernel)(struct CSR_Matrix *X, int **Y, int n, int i0,
+	int i1, int **Z);
+
+static void sparse_dense_rows_generic(struct CSR_Matrix *X, int **Y, int n, int i0,
+	int i1, int **Z) {
+	sparse_dense_rows(X, Y, n, i0, i1, Z);
+}
+
+#ifdef GEMM_AVX2
+__attribute__((target("avx2")))
+static void sparse_dense_rows_avx2(struct CSR_Matrix *X, int **Y, int n, int i0,
+	int i1, int **Z) {
+	sparse_dense_rows(X, Y, n, i0, i1, Z);
+}
+#endif
+
+/* The rows of X that sparse_dense_matrix_multiply hands out at a time */
+#define HYBRID_ROW_CHUNK 32
+
+/* 
+ * Function: sparse_dense_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for a CSR X and a 2D array Y (SpMM), in to a 2D array.
+ *   The work is one scaled row of Y per non-zero value of X, so it is worth
+ *   it whenever X is sparse and Y is not. Rows of X are handed out to the
+ *   threads in chunks, as they may differ a lot in length.
+ * 
+ *   X: the m x k CSR matrix
+ *   Y: the k x n 2D array
+ *   n: the number of columns of Y
+ * 
+ *   returns: the m x n product as a 2D array
+ */
+int** sparse_dense_matrix_multiply(struct CSR_Matrix *X, int **Y, int n) {
+	int m = (int) X->num_rows;
+	int **Z = init_2d_array(m, n);
+
+	Sparse_Dense_Kernel kernel = sparse_dense_rows_generic;
+#ifdef GEMM_AVX2
+	if (__builtin_cpu_supports("avx2")) kernel = sparse_dense_rows_avx2;
+#endif
+
+	TRACE_BEGIN(compute, "sparse_dense_matrix_multiply", "compute");
+	TRACE_COUNT(compute, 2.0 * X->row_ptr[m] * n, ((double) X->row_ptr[m] * (n + 2) + \
+		(double) m * n) * sizeof(int));
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int i0 = 0; i0 < m; i0 += HYBRID_ROW_CHUNK)
+		kernel(X, Y, n, i0, m - i0 < HYBRID_ROW_CHUNK ? m : i0 + HYBRID_ROW_CHUNK, Z);
+
+	TRACE_END(compute);
+	return Z;
+}
+
+/* 
+ * Function: dense_sparse_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for a 2D array X and a CSR Y, in to a 2D array. Each row
+ *   of the product is the sum of the rows of Y picked by the non-zero
+ *   values in the row of X, scattered in to it, so zeros in X cost one
+ *   comparison each. Rows are split evenly between the threads.
+ * 
+ *   X: the m x k 2D array
+ *   Y: the k x n CSR matrix
+ *   m: the number of rows of X
+ * 
+ *   returns: the m x n product as a 2D array
+ */
+int** dense_sparse_matrix_multiply(int **X, struct CSR_Matrix *Y, int m) {
+	int k = (int) Y->num_rows, n = (int) Y->num_cols;
+	int **Z = init_2d_array(m, n);
+
+	TRACE_BEGIN(compute, "dense_sparse_matrix_multiply", "compute");
+	TRACE_COUNT(compute, 0, ((double) m * k + (double) m * n) * sizeof(int));
+
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < m; i++) {
+		int *z = Z[i];
+		const int *x = X[i];
+		memset(z, 0, (size_t) n * sizeof(int));
+
+		for (int p = 0; p < k; p++) {
+			int a = x[p];
+			if (a == 0) continue;
+			for (sparse_ptr_t q = Y->row_ptr[p]; q < Y->row_ptr[p + 1]; q++)
+				z[Y->col_ind[q]] += a * Y->val[q];
+		}
+	}
+
+	TRACE_END(compute);
+	return Z;
+}
+
+/* The number of non-zero values in a 2D array */
+static sparse_ptr_t count_dense_nnz(int **R, int num_rows, int num_cols) {
+	sparse_ptr_t nnz = 0;
+
+	#pragma omp parallel for reduction(+:nnz)
+	for (int i = 0; i < num_rows; i++)
+		for (int j = 0; j < num_cols; j++) nnz += R[i][j] != 0;
+
+	return nnz;
+}
+
+/* 
+ * Function: set_hybrid_cost_model
+ * ---------------------------- 
+ *   Replaces the rates hybrid_matrix_multiply estimates with, e.g. with
+ *   those measured by calibrate_hybrid_cost_model on an earlier run. Exits
+ *   with an error if any rate is not positive.
+ * 
+ *   model: the rates to use
+ */
+void set_hybrid_cost_model(const struct Hybrid_Cost_Model *model) {
+	if (!(model->dense_rate > 0 && model->sparse_dense_rate > 0 && \
+		model->dense_sparse_rate > 0 && model->sparse_rate > 0 && model->scan_rate > 0)) {
+		fprintf(stderr, "Hybrid cost model rates must be positive.\n");
+		exit(EXIT_FAILURE);
+	}
+	hybrid_cost_model = *model;
+}
+
+struct Hybrid_Cost_Model get_hybrid_cost_model() {
+	return hybrid_cost_model;
+}
+
+/* 
+ * Function: choose_hybrid_kernel
+ * ---------------------------- 
+ *   Estimates how long each kernel would take for X * Y, and picks the
+ *   fastest. The work of each is divided by its rate in the cost model:
+ *    - dense: m * k * n multiply-adds
+ *    - sparse-dense: n multiply-adds per non-zero value of X
+ *    - dense-sparse: a scan of X, and the flops (multiplications of two
+ *      non-zero values)
+ *    - sparse: the flops, and writing the estimated non-zero values of the
+ *      product
+ *   plus, at the scan rate, converting each operand the kernel needs in the
+ *   other format and, for the dense results, writing all m * n values.
+ * 
+ *   The flops are exact when both are CSR matrices, and the density of the
+ *   product is sampled (see estimate_product_nnz) when the sparse kernel is
+ *   a contender, see HYBRID_SAMPLE_RATIO and HYBRID_SAMPLE_FRACTION, adding
+ *   the cost of sampling to the sparse kernel's estimate. Otherwise they assume the
+ *   non-zero values are spread uniformly, see product_density. A 2D array
+ *   operand costs one pass to count its non-zero values.
+ * 
+ *   X: the left operand
+ *   Y: the right operand
+ *   report: filled in with the densities and estimates, if not NULL
+ * 
+ *   returns: the kernel with the lowest estimate
+ */
+enum Hybrid_Kernel choose_hybrid_kernel(struct Hybrid_Matrix *X, struct Hybrid_Matrix *Y,
+	struct Hybrid_Report *report) {
+	if (X->num_cols != Y->num_rows) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	const struct Hybrid_Cost_Model *C = &hybrid_cost_model;
+	double m = X->num_rows, k = X->num_cols, n = Y->num_cols;
+	double x_size = m * k, y_size = k * n, z_size = m * n;
+
+	double x_nnz = X->sparse != NULL ? (double) X->sparse->row_ptr[X->num_rows] : \
+		(double) count_dense_nnz(X->dense, X->num_rows, X->num_cols);
+	double y_nnz = Y->sparse != NULL ? (double) Y->sparse->row_ptr[Y->num_rows] : \
+		(double) count_dense_nnz(Y->dense, Y->num_rows, Y->num_cols);
+	double x_density = x_size > 0 ? x_nnz / x_size : 0;
+	double y_density = y_size > 0 ? y_nnz / y_size : 0;
+
+	int both_sparse = X->sparse != NULL && Y->sparse != NULL;
+	double flops = both_sparse ? (double) count_flops(X->sparse, Y->sparse) : \
+		k > 0 ? x_nnz * y_nnz / k : 0;
+	double z_nnz = z_size * product_density(x_density, y_density, X->num_cols);
+	if (z_nnz > flops) z_nnz = flops;
+
+	/* Converting an operand to the format a kernel needs */
+	double x_to_dense = X->dense == NULL ? x_size / C->scan_rate : 0;
+	double y_to_dense = Y->dense == NULL ? y_size / C->scan_rate : 0;
+	double x_to_sparse = X->sparse == NULL ? x_size / C->scan_rate : 0;
+	double y_to_sparse = Y->sparse == NULL ? y_size / C->scan_rate : 0;
+	double dense_output = z_size / C->scan_rate;
+
+	double estimate[HYBRID_NUM_KERNELS];
+	estimate[HYBRID_DENSE] = m * k * n / C->dense_rate + x_to_dense + y_to_dense + \
+		dense_output;
+	estimate[HYBRID_SPARSE_DENSE] = x_nnz * n / C->sparse_dense_rate + x_to_sparse + \
+		y_to_dense + dense_output;
+	estimate[HYBRID_DENSE_SPARSE] = flops / C->dense_sparse_rate + x_size / C->scan_rate + \
+		x_to_dense + y_to_sparse + dense_output;
+	estimate[HYBRID_SPARSE] = flops / C->sparse_rate + z_nnz / C->scan_rate + \
+		x_to_sparse + y_to_sparse;
+
+	enum Hybrid_Kernel best = HYBRID_DENSE;
+	for (int kernel = 1; kernel < HYBRID_NUM_KERNELS; kernel++)
+		if (estimate[kernel] < estimate[best] && kernel != HYBRID_SPARSE)
+			best = (enum Hybrid_Kernel) kernel;
+
+	/* Sampling the product costs a pass over X and the sparse kernel on the
+	*  sampled rows, so only when the sparse kernel is in the running, and the
+	*  sparse kernel is charged for it */
+	int num_samples = X->num_rows / HYBRID_SAMPLE_FRACTION;
+	if (num_samples > SPGEMM_NNZ_SAMPLES) num_samples = SPGEMM_NNZ_SAMPLES;
+	if (num_samples < 1) num_samples = 1;
+	double sampling = x_nnz / C->scan_rate + (m > 0 ? flops * num_samples / m : 0) / \
+		C->sparse_rate;
+
+	if (both_sparse && estimate[HYBRID_SPARSE] + sampling < \
+		HYBRID_SAMPLE_RATIO * estimate[best]) {
+		z_nnz = estimate_product_nnz(X->sparse, Y->sparse, num_samples).nnz;
+		estimate[HYBRID_SPARSE] = flops / C->sparse_rate + z_nnz / C->scan_rate + sampling;
+	}
+	if (estimate[HYBRID_SPARSE] < estimate[best]) best = HYBRID_SPARSE;
+
+	if (report != NULL) {
+		report->kernel = best;
+		report->x_density = x_density;
+		report->y_density = y_density;
+		report->z_density = z_size > 0 ? z_nnz / z_size : 0;
+		report->flops = flops;
+		for (int kernel = 0; kernel < HYBRID_NUM_KERNELS; kernel++)
+			report->estimated_seconds[kernel] = estimate[kernel];
+	}
+
+	return best;
+}
+
+/* 
+ * Function: run_hybrid_kernel
+ * ---------------------------- 
+ *   Computes X * Y with the given kernel, converting the operands to the
+ *   formats it needs and freeing the copies afterwards.
+ * 
+ *   kernel: the kernel to use
+ *   X: the left operand
+ *   Y: the right operand
+ * 
+ *   returns: the product, as a 2D array or a CSR matrix depending on kernel
+ */
+struct Hybrid_Matrix run_hybrid_kernel(enum Hybrid_Kernel kernel, struct Hybrid_Matrix *X,
+	struct Hybrid_Matrix *Y) {
+	if (X->num_cols != Y->num_rows) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int m = X->num_rows, k = X->num_cols, n = Y->num_cols;
+	int need_dense_x = kernel == HYBRID_DENSE || kernel == HYBRID_DENSE_SPARSE;
+	int need_dense_y = kernel == HYBRID_DENSE || kernel == HYBRID_SPARSE_DENSE;
+
+	int **x_dense = X->dense, **y_dense = Y->dense;
+	struct CSR_Matrix *x_sparse = X->sparse, *y_sparse = Y->sparse;
+	if (need_dense_x && x_dense == NULL) x_dense = convert_CSR_to_dense(x_sparse);
+	if (!need_dense_x && x_sparse == NULL) x_sparse = convert_dense_to_CSR(x_dense, m, k);
+	if (need_dense_y && y_dense == NULL) y_dense = convert_CSR_to_dense(y_sparse);
+	if (!need_dense_y && y_sparse == NULL) y_sparse = convert_dense_to_CSR(y_dense, k, n);
+
+	struct Hybrid_Matrix Z = {NULL, NULL, m, n};
+	switch (kernel) {
+	case HYBRID_DENSE:
+		Z.dense = matrix_multiply(x_dense, y_dense, m, k, k, n);
+		break;
+	case HYBRID_SPARSE_DENSE:
+		Z.dense = sparse_dense_matrix_multiply(x_sparse, y_dense, n);
+		break;
+	case HYBRID_DENSE_SPARSE:
+		Z.dense = dense_sparse_matrix_multiply(x_dense, y_sparse, m);
+		break;
+	default:
+		Z.sparse = rowwise_sparse_matrix_multiply(x_sparse, y_sparse);
+		break;
+	}
+
+	if (x_dense != X->dense) free_2d_array(x_dense, m, k);
+	if (x_sparse != X->sparse) free_CSR_matrix(x_sparse);
+	if (y_dense != Y->dense) free_2d_array(y_dense, k, n);
+	if (y_sparse != Y->sparse) free_CSR_matrix(y_sparse);
+
+	return Z;
+}
+
+/* 
+ * Function: hybrid_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y with whichever of the dense and sparse kernels the cost
+ *   model expects to be fastest for the density of the operands and of the
+ *   product, see choose_hybrid_kernel, converting the operands as needed.
+ * 
+ *   X: the left operand, as a 2D array or a CSR matrix
+ *   Y: the right operand, likewise
+ *   report: filled in with what was picked and why, if not NULL
+ * 
+ *   returns: the product, as a 2D array from the dense and mixed kernels or
+ *     a CSR matrix from the sparse one; free it with free_hybrid_matrix
+ */
+struct Hybrid_Matrix hybrid_matrix_multiply(struct Hybrid_Matrix *X,
+	struct Hybrid_Matrix *Y, struct Hybrid_Report *report) {
+	double start = wall_time();
+	struct Hybrid_Report own;
+	if (report == NULL) report = &own;
+
+	enum Hybrid_Kernel kernel = choose_hybrid_kernel(X, Y, report);
+	struct Hybrid_Matrix Z = run_hybrid_kernel(kernel, X, Y);
+
+	report->seconds = wall_time() - start;
+	return Z;
+}
+
+/* A num_rows x num_cols 2D array with each value non-zero (1 to 9) with
+*  probability density */
+static int **random_dense_matrix(int num_rows, int num_cols, double density) {
+	int **R = init_2d_array(num_rows, num_cols);
+	for (int i = 0; i < num_rows; i++)
+		for (int j = 0; j < num_cols; j++)
+			R[i][j] = rand() < density * ((double) RAND_MAX + 1) ? rand() % 9 + 1 : 0;
+	return R;
+}
+
+/* Times one kernel on X * Y, as the best of a few runs */
+static double time_hybrid_kernel(enum Hybrid_Kernel kernel, struct Hybrid_Matrix *X,
+	struct Hybrid_Matrix *Y) {
+	double best = 0;
+	for (int r = 0; r < 3; r++) {
+		double start = wall_time();
+		struct Hybrid_Matrix Z = run_hybrid_kernel(kernel, X, Y);
+		double t = wall_time() - start;
+		if (r == 0 || t < best) best = t;
+		free_hybrid_matrix(&Z);
+	}
+	return best;
+}
+
+/* 
+ * Function: calibrate_hybrid_cost_model
+ * ---------------------------- 
+ *   Measures the rates of the cost model on this machine, with each kernel
+ *   run on operands already in its formats, and uses them from then on.
+ *   Takes about a second.
+ * 
+ *   verbose: whether to print the rates
+ * 
+ *   returns: the rates measured
+ */
+struct Hybrid_Cost_Model calibrate_hybrid_cost_model(int verbose) {
+	struct Hybrid_Cost_Model C;
+	srand(1);
+
+	/* Dense: a product big enough to take the blocked kernel */
+	int size = 384;
+	int **A = random_dense_matrix(size, size, 1), **B = random_dense_matrix(size, size, 1);
+	struct Hybrid_Matrix X = hybrid_of_dense(A, size, size);
+	struct Hybrid_Matrix Y = hybrid_of_dense(B, size, size);
+	C.dense_rate = (double) size * size * size / time_hybrid_kernel(HYBRID_DENSE, &X, &Y);
+
+	/* Converting: the time to find the non-zero values of a 2D array */
+	double start = wall_time();
+	struct CSR_Matrix *S = convert_dense_to_CSR(A, size, size);
+	C.scan_rate = (double) size * size / (wall_time() - start);
+	free_CSR_matrix(S);
+	free_2d_array(A, size, size);
+	free_2d_array(B, size, size);
+
+	/* The mixed kernels: a 1% sparse operand and a dense one */
+	int rows = 4096, cols = 128;
+	A = random_dense_matrix(rows, rows, 0.01);
+	S = convert_dense_to_CSR(A, rows, rows);
+	free_2d_array(A, rows, rows);
+	B = random_dense_matrix(rows, cols, 1);
+	X = hybrid_of_CSR(S);
+	Y = hybrid_of_dense(B, rows, cols);
+	C.sparse_dense_rate = (double) S->row_ptr[rows] * cols / \
+		time_hybrid_kernel(HYBRID_SPARSE_DENSE, &X, &Y);
+	free_2d_array(B, rows, cols);
+
+	B = random_dense_matrix(cols, rows, 1);
+	X = hybrid_of_dense(B, cols, rows);
+	Y = hybrid_of_CSR(S);
+	double t = time_hybrid_kernel(HYBRID_DENSE_SPARSE, &X, &Y) - (double) cols * rows / \
+		C.scan_rate;
+	C.dense_sparse_rate = (double) cols * S->row_ptr[rows] / (t > 0 ? t : 1e-9);
+	free_2d_array(B, cols, rows);
+
+	/* Sparse: the square of the 1% sparse operand */
+	X = hybrid_of_CSR(S);
+	Y = hybrid_of_CSR(S);
+	struct NNZ_Estimate estimate = estimate_product_nnz(S, S, 0);
+	t = time_hybrid_kernel(HYBRID_SPARSE, &X, &Y) - estimate.nnz / C.scan_rate;
+	C.sparse_rate = (double) estimate.flops / (t > 0 ? t : 1e-9);
+	free_CSR_matrix(S);
+
+	if (verbose)
+		printf("Multiply-adds a second: dense %.3g, sparse-dense %.3g, dense-sparse %.3g, "
+			"sparse %.3g; scanned values a second %.3g\n", C.dense_rate,
+			C.sparse_dense_rate, C.dense_sparse_rate, C.sparse_rate, C.scan_rate);
+
+	set_hybrid_cost_model(&C);
+	return C;
+}
+
+
+/* --------------------------------------------------------- */
+/* Below are additional functions that were used for testing */
+/* --------------------------------------------------------- */
+
+/* Whether two products are the same, whatever their formats */
+static int same_hybrid_matrix(struct Hybrid_Matrix *A, struct Hybrid_Matrix *B) {
+	int **a = A->dense != NULL ? A->dense : convert_CSR_to_dense(A->sparse);
+	int **b = B->dense != NULL ? B->dense : convert_CSR_to_dense(B->sparse);
+	int same = 1;
+	for (int i = 0; i < A->num_rows && same; i++)
+		same = memcmp(a[i], b[i], (size_t) A->num_cols * sizeof(int)) == 0;
+
+	if (a != A->dense) free_2d_array(a, A->num_rows, A->num_cols);
+	if (b != B->dense) free_2d_array(b, B->num_rows, B->num_cols);
+	return same;
+}
+
+/* Runs every kernel on size x size CSR operands of a range of densities,
+*  and compares them with the one the cost model picks */
+void benchmark_hybrid(int size) {
+	const double densities[] = {0.0005, 0.002, 0.01, 0.05, 0.2, 1};
+	int num_densities = (int) (sizeof(densities) / sizeof(densities[0]));
+	srand(2);
+
+	printf("%dx%d by %dx%d, seconds per kernel (* picked)\n", size, size, size, size);
+	printf("%8s %8s", "X", "Y");
+	for (int kernel = 0; kernel < HYBRID_NUM_KERNELS; kernel++)
+		printf(" %13s", hybrid_kernel_names[kernel]);
+	printf(" %9s %9s\n", "vs best", "picking");
+
+	for (int dx = 0; dx < num_densities; dx++)
+		for (int dy = 0; dy < num_densities; dy += 2) {
+			int **A = random_dense_matrix(size, size, densities[dx]);
+			int **B = random_dense_matrix(size, size, densities[dy]);
+			struct CSR_Matrix *S = convert_dense_to_CSR(A, size, size);
+			struct CSR_Matrix *T = convert_dense_to_CSR(B, size, size);
+			free_2d_array(A, size, size);
+			free_2d_array(B, size, size);
+
+			/* The operands come in sparse, as they would from a sparse code */
+			struct Hybrid_Matrix X = hybrid_of_CSR(S), Y = hybrid_of_CSR(T);
+			struct Hybrid_Report report;
+			struct Hybrid_Matrix Z = hybrid_matrix_multiply(&X, &Y, &report);
+
+			printf("%8.4f %8.4f", densities[dx], densities[dy]);
+			double best = 0, picked = 0;
+			int correct = 1;
+			for (int kernel = 0; kernel < HYBRID_NUM_KERNELS; kernel++) {
+				double t = time_hybrid_kernel((enum Hybrid_Kernel) kernel, &X, &Y);
+				if (kernel == 0 || t < best) best = t;
+				if (kernel == (int) report.kernel) picked = t;
+				printf(" %12.4f%c", t, kernel == (int) report.kernel ? '*' : ' ');
+
+				struct Hybrid_Matrix W = run_hybrid_kernel((enum Hybrid_Kernel) kernel, &X, &Y);
+				correct &= same_hybrid_matrix(&Z, &W);
+				free_hybrid_matrix(&W);
+			}
+			/* How much slower the pick was than the best kernel, and the time
+			*  spent picking it */
+			double choose_start = wall_time();
+			choose_hybrid_kernel(&X, &Y, NULL);
+			printf(" %8.2fx %9.4f%s\n", picked / best, wall_time() - choose_start,
+				correct ? "" : " WRONG");
+
+			free_hybrid_matrix(&Z);
+			free_CSR_matrix(S);
+			free_CSR_matrix(T);
+		}
+}
+
+int main(int argc, char **argv) {
+	/* "calibrate" measures the cost model on this machine and stops */
+	calibrate_hybrid_cost_model(1);
+	if (argc > 1 && strcmp(argv[1], "calibrate") == 0) return 0;
+
+	benchmark_hybrid(argc > 1 ? atoi(argv[1]) : 1000);
+	return 0;
+}
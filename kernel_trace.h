@@ -0,0 +1,365 @@
+/* 
+ * Optional instrumentation of the matrix kernels: how long each phase of a
+ * kernel took (e.g. pack and compute, or symbolic, numeric and stitch), the
+ * flops and bytes it moved, and, on Linux, hardware counters read with
+ * perf_event_open. Each phase is handed to a callback as a Trace_Event, and
+ * can be recorded and written out as a Chrome trace (chrome://tracing or
+ * ui.perfetto.dev).
+ * 
+ * Compile with -DKERNEL_TRACE to build it in. Without it, the TRACE_ macros
+ * expand to nothing, so the kernels are exactly as fast as before, and the
+ * functions below do not exist. They are static inline, so that each of the
+ * kernel files can include this on its own.
+ * 
+ * Include this before any system header, as perf_event_open needs
+ * _DEFAULT_SOURCE.
+ */
+#ifndef KERNEL_TRACE_H
+#define KERNEL_TRACE_H
+
+#ifdef KERNEL_TRACE
+
+#if defined(__linux__)
+#define TRACE_PERF
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef TRACE_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#define trace_thread_num() omp_get_thread_num()
+#define trace_in_parallel() omp_in_parallel()
+#else
+#define trace_thread_num() 0
+#define trace_in_parallel() 0
+#endif
+
+/* The hardware counters, where the CPU and kernel allow them */
+enum Trace_Counter {
+	TRACE_CYCLES,
+	TRACE_INSTRUCTIONS,
+	TRACE_LLC_MISSES,
+	TRACE_NUM_COUNTERS
+};
+
+static const char *const trace_counter_names[TRACE_NUM_COUNTERS] = {
+	"cycles", "instructions", "llc_misses"
+};
+
+/* 
+ * One phase of one kernel. A phase begun outside a parallel region covers
+ * the whole OpenMP team, and its counters are summed over the threads; one
+ * begun inside a parallel region covers just the thread that began it.
+ */
+struct Trace_Event {
+	const char *kernel;
+	const char *phase;
+	int thread;
+	double start;  /* Seconds since the epoch */
+	double seconds;
+	double flops;  /* Multiplications and additions, as counted by the kernel */
+	double bytes;  /* Read and written, as counted by the kernel */
+	int has_counters;  /* Whether counters holds the hardware counts */
+	int active;  /* Whether trace_begin timed it, as there was somewhere to send it */
+	long long counters[TRACE_NUM_COUNTERS];
+};
+
+typedef void (*Trace_Callback)(const struct Trace_Event *event, void *data);
+
+static Trace_Callback trace_callback;
+static void *trace_callback_data;
+static int trace_counters_enabled;
+static int trace_recording;
+static struct Trace_Event *trace_events;
+static size_t trace_num_events;
+static size_t trace_events_capacity;
+
+/* Each thread's group of counters: -1 until it is opened, then the fd of the
+*  leader, or -2 if it could not be opened */
+static _Thread_local int trace_leader_fd = -1;
+static _Thread_local int trace_fds[TRACE_NUM_COUNTERS];
+
+/* 
+ * Function: trace_set_callback
+ * ---------------------------- 
+ *   Sets the function to call at the end of each phase. It may be called by
+ *   several threads at once.
+ * 
+ *   callback: the function, or NULL for none
+ *   data: passed to callback with each event
+ */
+static inline void trace_set_callback(Trace_Callback callback, void *data) {
+	trace_callback = callback;
+	trace_callback_data = data;
+}
+
+static inline void trace_close_counters();
+
+/* Turns the hardware counters on or off. They cost a few system calls per
+*  phase and thread, so they are off by default. Turning them off closes
+*  them, see trace_close_counters */
+static inline void trace_enable_counters(int enable) {
+	trace_counters_enabled = enable;
+	if (!enable) trace_close_counters();
+}
+
+/* Starts or stops keeping the events for trace_write_chrome_json */
+static inline void trace_record(int enable) {
+	trace_recording = enable;
+}
+
+/* Drops the events kept so far */
+static inline void trace_clear() {
+	free(trace_events);
+	trace_events = NULL;
+	trace_num_events = trace_events_capacity = 0;
+}
+
+static inline double trace_time() {
+	struct timespec t;
+	timespec_get(&t, TIME_UTC);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+#ifdef TRACE_PERF
+static inline void trace_open_counters() {
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[TRACE_NUM_COUNTERS] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		/* Usually the last level cache, see perf_event_open(2) */
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}
+	};
+
+	trace_leader_fd = -2;
+	for (int c = 0; c < TRACE_NUM_COUNTERS; c++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[c].type;
+		attr.config = events[c].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.disabled = c == 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		trace_fds[c] = (int) syscall(SYS_perf_event_open, &attr, 0, -1,
+			c == 0 ? -1 : trace_fds[0], 0);
+		if (trace_fds[c] < 0) {
+			for (int o = 0; o < c; o++) close(trace_fds[o]);
+			return;
+		}
+	}
+
+	ioctl(trace_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	trace_leader_fd = trace_fds[0];
+}
+#endif
+
+/* Closes the counters of the calling thread, if it has opened them */
+static inline void trace_close_thread_counters() {
+#ifdef TRACE_PERF
+	if (trace_leader_fd >= 0)
+		for (int c = 0; c < TRACE_NUM_COUNTERS; c++) close(trace_fds[c]);
+#endif
+	trace_leader_fd = -1;
+}
+
+/* 
+ * Function: trace_close_counters
+ * ---------------------------- 
+ *   Closes the counters of the calling thread or, outside a parallel region,
+ *   of each thread of the team, so their file descriptors are not kept for
+ *   the life of the threads. Threads of other teams keep theirs until they
+ *   call it themselves. Counters are opened again the next time a phase is
+ *   traced with them enabled.
+ */
+static inline void trace_close_counters() {
+	if (trace_in_parallel()) {
+		trace_close_thread_counters();
+		return;
+	}
+
+	#pragma omp parallel
+	trace_close_thread_counters();
+}
+
+/* Adds the counts of the calling thread to counters, opening its counters
+*  the first time. Returns 0 if they are not available */
+static inline int trace_read_thread_counters(long long *counters) {
+#ifdef TRACE_PERF
+	if (trace_leader_fd == -1) trace_open_counters();
+	if (trace_leader_fd < 0) return 0;
+
+	uint64_t values[1 + TRACE_NUM_COUNTERS];
+	if (read(trace_leader_fd, values, sizeof(values)) != (ssize_t) sizeof(values))
+		return 0;
+	for (int c = 0; c < TRACE_NUM_COUNTERS; c++) counters[c] += (long long) values[1 + c];
+	return 1;
+#else
+	(void) counters;
+	return 0;
+#endif
+}
+
+/* Reads the counters of the calling thread or, outside a parallel region,
+*  the sum over the threads of the team. Returns 0 if any are unavailable */
+static inline int trace_read_counters(long long *counters) {
+	memset(counters, 0, TRACE_NUM_COUNTERS * sizeof(long long));
+	if (trace_in_parallel()) return trace_read_thread_counters(counters);
+
+	int valid = 1;
+	#pragma omp parallel
+	{
+		long long own[TRACE_NUM_COUNTERS] = {0};
+		int own_valid = trace_read_thread_counters(own);
+
+		#pragma omp critical(kernel_trace)
+		{
+			for (int c = 0; c < TRACE_NUM_COUNTERS; c++) counters[c] += own[c];
+			valid &= own_valid;
+		}
+	}
+	return valid;
+}
+
+/* 
+ * Function: trace_begin
+ * ---------------------------- 
+ *   Starts timing a phase, see TRACE_BEGIN.
+ * 
+ *   event: the event to fill in
+ *   kernel: the name of the kernel, a string that outlives the trace
+ *   phase: the name of the phase, likewise
+ */
+static inline void trace_begin(struct Trace_Event *event, const char *kernel,
+	const char *phase) {
+	event->kernel = kernel;
+	event->phase = phase;
+	event->flops = event->bytes = 0;
+	event->has_counters = 0;
+	event->active = trace_callback != NULL || trace_recording;
+	if (!event->active) return;
+
+	event->thread = trace_thread_num();
+	if (trace_counters_enabled) event->has_counters = trace_read_counters(event->counters);
+	event->start = trace_time();
+}
+
+/* 
+ * Function: trace_end
+ * ---------------------------- 
+ *   Finishes a phase and passes it to the callback and the recording, see
+ *   TRACE_END. Phases begun while there was neither are dropped.
+ * 
+ *   event: the event started by trace_begin
+ */
+static inline void trace_end(struct Trace_Event *event) {
+	/* A phase begun with tracing off is dropped, even if it was turned on since */
+	if (!event->active || (trace_callback == NULL && !trace_recording)) return;
+
+	event->seconds = trace_time() - event->start;
+	if (event->has_counters) {
+		long long end[TRACE_NUM_COUNTERS];
+		event->has_counters = trace_read_counters(end);
+		for (int c = 0; c < TRACE_NUM_COUNTERS; c++) event->counters[c] = end[c] - \
+			event->counters[c];
+	}
+
+	if (trace_callback != NULL) trace_callback(event, trace_callback_data);
+
+	if (trace_recording) {
+		#pragma omp critical(kernel_trace)
+		{
+			if (trace_num_events == trace_events_capacity) {
+				size_t capacity = trace_events_capacity ? 2 * trace_events_capacity : 256;
+				struct Trace_Event *events = (struct Trace_Event *) realloc(trace_events,
+					capacity * sizeof(struct Trace_Event));
+				if (events == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+				trace_events = events;
+				trace_events_capacity = capacity;
+			}
+			trace_events[trace_num_events++] = *event;
+		}
+	}
+}
+
+/* 
+ * Function: trace_write_chrome_json
+ * ---------------------------- 
+ *   Writes the events recorded so far in the Chrome trace event format, one
+ *   complete ("X") event per phase, with the flops, bytes and counters as
+ *   its arguments.
+ * 
+ *   path: the file to write
+ * 
+ *   returns: 0, or -1 if the file could not be written
+ */
+static inline int trace_write_chrome_json(const char *path) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	double origin = trace_num_events > 0 ? trace_events[0].start : 0;
+	for (size_t e = 0; e < trace_num_events; e++)
+		if (trace_events[e].start < origin) origin = trace_events[e].start;
+
+	fprintf(f, "{\"traceEvents\": [");
+	for (size_t e = 0; e < trace_num_events; e++) {
+		const struct Trace_Event *event = &trace_events[e];
+		fprintf(f, "%s\n  {\"name\": \"%s %s\", \"cat\": \"%s\", \"ph\": \"X\", "
+			"\"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+			"\"args\": {\"flops\": %.0f, \"bytes\": %.0f", e ? "," : "",
+			event->kernel, event->phase, event->kernel, event->thread,
+			(event->start - origin) * 1e6, event->seconds * 1e6, event->flops,
+			event->bytes);
+		if (event->has_counters)
+			for (int c = 0; c < TRACE_NUM_COUNTERS; c++)
+				fprintf(f, ", \"%s\": %lld", trace_counter_names[c], event->counters[c]);
+		fprintf(f, "}}");
+	}
+	fprintf(f, "\n]}\n");
+
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+/* Times the code up to TRACE_END(event) as a phase of a kernel */
+#define TRACE_BEGIN(event, kernel, phase) \
+	struct Trace_Event event; \
+	trace_begin(&event, kernel, phase)
+/* Counts work done in the phase; the arguments are not evaluated unless
+*  KERNEL_TRACE is defined */
+#define TRACE_COUNT(event, num_flops, num_bytes) \
+	((event).flops += (double) (num_flops), (event).bytes += (double) (num_bytes))
+#define TRACE_END(event) trace_end(&event)
+
+#else
+
+#define TRACE_BEGIN(event, kernel, phase) do {} while (0)
+#define TRACE_COUNT(event, num_flops, num_bytes) ((void) 0)
+#define TRACE_END(event) ((void) 0)
+
+#endif
+
+#endif
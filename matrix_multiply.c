@@ -1,55 +1,3155 @@
+/* Compile with -DUSE_LIBNUMA (and -lnuma) to place memory on NUMA nodes
+*  explicitly, see init_2d_array_numa */
+#ifdef USE_LIBNUMA
+#define _GNU_SOURCE
+#endif
+
+/* Compile with -DKERNEL_TRACE to time the phases of the kernels, see
+*  kernel_trace.h */
+#include "kernel_trace.h"
+
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
-int** init_2d_array(int num_rows, int num_cols);
-void* Malloc(size_t size);
+#ifdef USE_LIBNUMA
+#include <numa.h>
+#include <sched.h>
+#endif
+
+/* Compile with -DUSE_MPI (using mpicc) for the distributed products, see
+*  summa_matrix_multiply */
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+/* Compile with -fopenmp to run the blocked kernels on every core */
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#define omp_get_num_threads() 1
+#define omp_get_thread_num() 0
+#endif
+
+int** init_2d_array(int num_rows, int num_cols);
+float** init_2d_float_array(int num_rows, int num_cols);
+void free_2d_array(int** R, int num_rows, int num_cols);
+void* Malloc(size_t size);
+
+
+/* 
+ * Block sizes of the blocked kernel: each task computes a GEMM_MC x GEMM_NC
+ * block of the product, GEMM_KC terms of the dot products at a time, from
+ * copies of the operands packed in to the order the micro-kernel reads
+ * them. A GEMM_MC x GEMM_KC block of X should fit in the L2 cache, and a
+ * GEMM_KC x GEMM_NC panel of Y in the L3 cache. GEMM_MC must be a multiple
+ * of GEMM_MR and GEMM_NC a multiple of GEMM_NR. These are the defaults of
+ * the int kernel, which autotune_matrix_multiply can replace per machine.
+ */
+#ifndef GEMM_MC
+#define GEMM_MC 72
+#endif
+#ifndef GEMM_KC
+#define GEMM_KC 256
+#endif
+#ifndef GEMM_NC
+#define GEMM_NC 512
+#endif
+
+/* The blocked kernel packs Y once per NUMA node, rather than once per task,
+*  when it is read by more than one row block and a copy takes at most this
+*  many bytes */
+#ifndef GEMM_PREPACK_LIMIT
+#define GEMM_PREPACK_LIMIT ((size_t) 256 << 20)
+#endif
+
+/* The micro-kernel keeps a GEMM_MR x GEMM_NR block of the product in
+*  registers, as GEMM_MR x 2 vectors of 8 ints. It is also compiled for 4 and
+*  GEMM_MAX_MR rows, for the autotuner to pick from, see struct Gemm_Tuning */
+#define GEMM_MR 6
+#define GEMM_NR 16
+#define GEMM_MAX_MR 8
+
+typedef int int8_vector __attribute__((vector_size(32)));
+typedef float float8_vector __attribute__((vector_size(32)));
+
+/* The kernels are compiled a second time for AVX2 on x86, picked at run time,
+*  as the baseline has no instruction to multiply vectors of ints */
+#if defined(__x86_64__) || defined(__i386__)
+#define GEMM_AVX2
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define GEMM_INLINE static inline __attribute__((always_inline))
+
+/* The quantized micro-kernel computes a QGEMM_MR x QGEMM_NR block of int32s,
+*  four terms of the dot products at a time, from QGEMM_KC terms of packed
+*  operands (a multiple of 4). Its blocks of the product are GEMM_MC x GEMM_NC,
+*  packed whole, so GEMM_MC must be a multiple of QGEMM_MR and GEMM_NC one of
+*  QGEMM_NR */
+#define QGEMM_MR 8
+#define QGEMM_NR 16
+#ifndef QGEMM_KC
+#define QGEMM_KC 1024
+#endif
+#if QGEMM_KC % 4 != 0
+#error "QGEMM_KC must be a multiple of 4"
+#endif
+#if GEMM_MC % QGEMM_MR != 0 || GEMM_NC % QGEMM_NR != 0
+#error "GEMM_MC and GEMM_NC must be multiples of QGEMM_MR and QGEMM_NR"
+#endif
+
+/* The matrix-vector kernels stream GEMV_ROWS rows of the matrix at a time, so
+*  each vector of the vector they are multiplied by is loaded once per group.
+*  The vector-matrix kernel adds to GEVM_NC elements of its result at a time,
+*  which stay in the L1 cache while the rows stream past. Products with fewer
+*  than GEMV_PARALLEL_WORK multiplications run on one thread */
+#define GEMV_ROWS 4
+#ifndef GEVM_NC
+#define GEVM_NC 2048
+#endif
+#ifndef GEMV_PARALLEL_WORK
+#define GEMV_PARALLEL_WORK 65536
+#endif
+
+/* 
+ * The instruction sets the blocked kernel is compiled for.
+ */
+enum Gemm_Kernel {
+	GEMM_KERNEL_AUTO,  /* The best one the CPU has */
+	GEMM_KERNEL_GENERIC,
+	GEMM_KERNEL_AVX2
+};
+
+/* 
+ * The parameters of the blocked kernel. They start as GEMM_MC, GEMM_KC,
+ * GEMM_NC and GEMM_MR, and are replaced by those found for this CPU by
+ * autotune_matrix_multiply, see load_gemm_tuning.
+ */
+struct Gemm_Tuning {
+	int mc;  /* A multiple of mr */
+	int kc;
+	int nc;  /* A multiple of GEMM_NR */
+	int mr;  /* The rows of the micro-kernel: 4, 6 or GEMM_MAX_MR */
+	int num_threads;  /* 0 for omp_get_max_threads() */
+	enum Gemm_Kernel kernel;
+};
+
+/* The file the blocked kernel loads its parameters from the first time it
+*  runs, if it is set, see load_gemm_tuning */
+#define GEMM_TUNING_ENV "GEMM_TUNING_FILE"
+
+/* 
+ * The shapes of product matrix_multiply has a kernel for, see
+ * classify_dense_product.
+ */
+enum Dense_Shape {
+	DENSE_SMALL,  /* Too little work to be worth packing */
+	DENSE_GEMV,  /* Y has one column */
+	DENSE_GEVM,  /* X has one row */
+	DENSE_OUTER,  /* X has one column */
+	DENSE_TALL_SKINNY,  /* Many rows, and few columns in X and Y */
+	DENSE_SHORT_FAT,  /* Few rows */
+	DENSE_SQUARE  /* Everything else */
+};
+
+/* Products with at most DENSE_SMALL_WORK multiplications are DENSE_SMALL */
+#ifndef DENSE_SMALL_WORK
+#define DENSE_SMALL_WORK 32768
+#endif
+/* Products with at most DENSE_FAT_ROWS rows are DENSE_SHORT_FAT */
+#ifndef DENSE_FAT_ROWS
+#define DENSE_FAT_ROWS 16
+#endif
+/* Products whose X and Y have at most DENSE_SKINNY_COLS columns, and at least
+*  DENSE_SKINNY_RATIO times as many rows, are DENSE_TALL_SKINNY */
+#ifndef DENSE_SKINNY_COLS
+#define DENSE_SKINNY_COLS 256
+#endif
+#ifndef DENSE_SKINNY_RATIO
+#define DENSE_SKINNY_RATIO 16
+#endif
+
+/* 
+ * A dense operand of a kernel: a 2D array, read either as it is or as its
+ * transpose, so transposing never needs a copy.
+ */
+struct Dense_Operand {
+	int **rows;
+	int transposed;
+};
+
+/* 
+ * A term added to the product as it is stored: scale * op, elementwise.
+ */
+struct Dense_Addend {
+	int scale;
+	struct Dense_Operand op;
+};
+
+/* 
+ * The elementwise activation of an epilogue.
+ */
+enum Dense_Activation {
+	ACTIVATION_NONE,
+	ACTIVATION_RELU  /* Negative values become 0 */
+};
+
+/* 
+ * What is done to each value of a product as it is stored, in this order:
+ *  - the biases are added
+ *  - the activation is applied
+ *  - when multiplier is not 0, the value is requantized: scaled by
+ *    multiplier / 2^shift, rounded to the nearest integer, then zero_point
+ *    is added, saturating to the range of int
+ *  - when clamp is set, the value is clamped to [clamp_min, clamp_max], e.g.
+ *    [-128, 127] for int8 outputs
+ * A zeroed descriptor does nothing.
+ */
+struct Dense_Epilogue {
+	const int *row_bias;  /* One value per row, or NULL */
+	const int *col_bias;  /* One value per column, or NULL */
+	enum Dense_Activation activation;
+	int multiplier;
+	int shift;  /* From 0 to 62 */
+	int zero_point;
+	int clamp;
+	int clamp_min;
+	int clamp_max;
+};
+
+/* The bf16 micro-kernel computes a HGEMM_MR x QGEMM_NR block of floats, two
+*  terms of the dot products at a time. The fp32 one uses GEMM_MR x GEMM_NR */
+#define HGEMM_MR 8
+
+/* 
+ * The formats of 16-bit floats: bfloat16, the top half of a float, and IEEE
+ * half precision.
+ */
+enum Half_Format {
+	HALF_BF16,
+	HALF_FP16
+};
+
+/* 
+ * The int8 right operand of a quantized product, packed once so that it can
+ * be reused. Its columns are split in to panels of QGEMM_NR (the last padded
+ * with zeros), and for every 4 rows (the last padded with zeros) a panel
+ * stores the 4 values of each column next to each other, as vpdpbusd reads
+ * them: Y[4 * p + q][QGEMM_NR * panel + c] is
+ * data[node][(panel * padded_rows + 4 * p) * QGEMM_NR + 4 * c + q].
+ * There is one copy on each NUMA node, since every thread reads all of it.
+ */
+struct Packed_Int8_Matrix {
+	int8_t **data;  /* One copy per NUMA node */
+	size_t size;  /* Of each copy */
+	int num_nodes;
+	int *col_sums;  /* Of each column, to apply the zero points */
+	int num_rows;
+	int num_cols;
+	int padded_rows;  /* num_rows rounded up to 4 */
+};
+
+/* 
+ * Where init_2d_array_numa places the pages of a 2D array.
+ */
+enum Numa_Placement {
+	NUMA_FIRST_TOUCH,  /* Each block of rows on the node of the thread that owns it */
+	NUMA_INTERLEAVE  /* Round robin over the nodes; needs USE_LIBNUMA */
+};
+
+/* 
+ * The tasks of a blocked kernel, GEMM_MC x GEMM_NC blocks of the product,
+ * queued by the thread that owns their rows, see next_task.
+ */
+struct Task_Queues {
+	int *next;  /* The next task of each queue, TASK_QUEUE_PAD apart */
+	int *node;  /* The NUMA node of each thread */
+	int m_blocks;
+	int n_blocks;
+	int num_threads;
+};
+
+/* Keeps the counters of different queues on different cache lines */
+#define TASK_QUEUE_PAD 16
+
+#ifdef USE_MPI
+/* 
+ * A grid of MPI processes for the distributed products: layers layers of
+ * grid_rows x grid_cols processes. Process (row, col) of the first layer
+ * holds block (row, col) of each distributed matrix, see grid_block_range;
+ * the other layers hold copies while a 2.5D product runs.
+ */
+struct Process_Grid {
+	MPI_Comm comm;
+	MPI_Comm row_comm;  /* The processes of this grid row and layer, by column */
+	MPI_Comm col_comm;  /* The processes of this grid column and layer, by row */
+	MPI_Comm layer_comm;  /* The processes at this row and column, by layer */
+	int grid_rows;
+	int grid_cols;
+	int layers;
+	int row;
+	int col;
+	int layer;
+};
+
+/* 
+ * What a distributed product cost, as seen by one process.
+ */
+struct Summa_Report {
+	double bytes;  /* Received (or sent, in reductions) by this process */
+	double total_bytes;  /* By all the processes */
+	double compute_seconds;
+	double communication_seconds;
+	double seconds;
+};
+#endif
+
+/* 
+ * The operations in an expression graph, see init_expr_graph.
+ */
+enum Expr_Op {
+	EXPR_MATRIX,
+	EXPR_MULTIPLY,
+	EXPR_ADD,
+	EXPR_TRANSPOSE,
+	EXPR_SCALE
+};
+
+/* 
+ * A node of an expression graph. Nodes may be shared between expressions.
+ */
+struct Matrix_Expr {
+	enum Expr_Op op;
+	int num_rows;
+	int num_cols;
+	int **data;  /* The 2D array of an EXPR_MATRIX, not owned by the graph */
+	int scale;  /* The factor of an EXPR_SCALE */
+	struct Matrix_Expr *left;  /* The operand(s) of the other operations */
+	struct Matrix_Expr *right;
+	struct Matrix_Expr *next;  /* The node created before this one */
+};
+
+/* 
+ * A scratch 2D array kept by an expression graph to hold intermediate
+ * results, reused for as long as the graph lives.
+ */
+struct Dense_Buffer {
+	int **rows;
+	int *data;
+	size_t capacity;
+	int rows_capacity;
+	int in_use;
+	struct Dense_Buffer *next;
+};
+
+/* 
+ * Owns the nodes of one or more expressions, and the buffers used to
+ * evaluate them.
+ */
+struct Expr_Graph {
+	struct Matrix_Expr *nodes;
+	struct Dense_Buffer *buffers;
+	double multiplications;  /* Done by all evaluations so far */
+};
+
+/* 
+ * What a chain of products was estimated to cost, and what it did cost,
+ * counted in scalar multiplications.
+ */
+struct Chain_Report {
+	double estimated_cost;  /* In the order chosen */
+	double left_to_right_cost;  /* In the order written, for comparison */
+	double actual_cost;
+	double seconds;
+};
+
+/* 
+ * While an expression is evaluated, it is rewritten as a sum of terms, each
+ * a scaled chain of factors to multiply. A factor is a leaf matrix or a sum
+ * (evaluated in to a buffer first), either of them possibly transposed.
+ */
+struct Expr_Factor {
+	struct Matrix_Expr *node;
+	int transposed;
+	struct Dense_Buffer *buffer;  /* Holds the value of a sum once evaluated */
+};
+
+struct Expr_Term {
+	int scale;
+	int num_factors;
+	int capacity;
+	struct Expr_Factor *factors;
+};
+
+struct Term_List {
+	struct Expr_Term *terms;
+	int count;
+	int capacity;
+};
+
+
+/* 
+ * Function: iterative_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y with an interative algorithm, for products too small to
+ *   be worth packing (DENSE_SMALL).
+ * 
+ *   X: 2D matrix to left-multiply
+ *   Y: 2D matrix to right-multiply
+ *   z_rows: the number of rows in X
+ *   x_cols: the number of columns in X
+ *   z_cols: the number of columns in Y
+ *   Z: the z_rows x z_cols result
+ */
+static void iterative_matrix_multiply(int** X, int** Y, int z_rows, int x_cols,
+	int z_cols, int **Z) {
+	TRACE_BEGIN(compute, "iterative_matrix_multiply", "compute");
+	TRACE_COUNT(compute, 2.0 * z_rows * x_cols * z_cols, \
+		((double) z_rows * x_cols + (double) x_cols * z_cols + \
+		(double) z_rows * z_cols) * sizeof(int));
+
+	// Assume X and Y are initialized and filled such that for X[i][j] or
+	// Y[i][j], i refers to the row number and j refers to the column number
+	// This also means that X and Y are 2D arrays
+	for (int cur_z_row = 0; cur_z_row < z_rows; cur_z_row++) {
+		for (int cur_z_col = 0; cur_z_col < z_cols; cur_z_col++) {
+			int dot_product = 0;
+
+			for (int dot_index = 0; dot_index < x_cols; dot_index++)
+				// Assume that these are valid indices, that is, X contains
+				// exactly x_rows and x_cols, and Y contains exactly y_rows
+				// and y_cols
+				dot_product += X[cur_z_row][dot_index] * Y[dot_index][cur_z_col];
+
+			Z[cur_z_row][cur_z_col] = dot_product;
+		}
+	}
+
+	TRACE_END(compute);
+}
+
+/* 
+ * Function: operand_at
+ * ---------------------------- 
+ *   Reads one element of a dense operand.
+ * 
+ *   A: the operand
+ *   i: the row, after any transposition
+ *   j: the column, after any transposition
+ * 
+ *   returns: the element
+ */
+static inline int operand_at(const struct Dense_Operand *A, int i, int j) {
+	return A->transposed ? A->rows[j][i] : A->rows[i][j];
+}
+
+/* 
+ * Function: pack_x_block
+ * ---------------------------- 
+ *   Copies an mb x kb block of X in to micro-panels of mr rows, each stored
+ *   column by column, in the order the micro-kernel reads them. Rows past mb
+ *   are padded with zeros.
+ * 
+ *   X: the left operand
+ *   i0: the first row of the block
+ *   mb: the number of rows in the block
+ *   p0: the first column of the block
+ *   kb: the number of columns in the block
+ *   mr: the rows of the micro-kernel
+ *   buf: the mc x kc buffer to pack in to
+ */
+static void pack_x_block(const struct Dense_Operand *X, int i0, int mb, int p0,
+	int kb, int mr, int *buf) {
+	for (int ir = 0; ir < mb; ir += mr) {
+		int *panel = buf + (size_t) ir * kb;
+
+		for (int r = 0; r < mr; r++) {
+			if (ir + r >= mb) {
+				for (int p = 0; p < kb; p++) panel[p * mr + r] = 0;
+			} else if (X->transposed) {
+				for (int p = 0; p < kb; p++)
+					panel[p * mr + r] = X->rows[p0 + p][i0 + ir + r];
+			} else {
+				const int *x_row = X->rows[i0 + ir + r] + p0;
+				for (int p = 0; p < kb; p++) panel[p * mr + r] = x_row[p];
+			}
+		}
+	}
+}
+
+/* 
+ * Function: pack_y_panel
+ * ---------------------------- 
+ *   Copies a kb x nb panel of Y in to micro-panels of GEMM_NR columns, each
+ *   stored row by row, in the order the micro-kernel reads them. Columns
+ *   past nb are padded with zeros.
+ * 
+ *   Y: the right operand
+ *   p0: the first row of the panel
+ *   kb: the number of rows in the panel
+ *   j0: the first column of the panel
+ *   nb: the number of columns in the panel
+ *   buf: the kc x nc buffer to pack in to
+ */
+static void pack_y_panel(const struct Dense_Operand *Y, int p0, int kb, int j0,
+	int nb, int *buf) {
+	for (int jr = 0; jr < nb; jr += GEMM_NR) {
+		int *panel = buf + (size_t) jr * kb;
+		int width = nb - jr < GEMM_NR ? nb - jr : GEMM_NR;
+
+		for (int p = 0; p < kb; p++) {
+			int *dst = panel + p * GEMM_NR;
+			for (int c = 0; c < width; c++)
+				dst[c] = Y->transposed ? Y->rows[j0 + jr + c][p0 + p] : \
+					Y->rows[p0 + p][j0 + jr + c];
+			for (int c = width; c < GEMM_NR; c++) dst[c] = 0;
+		}
+	}
+}
+
+/* 
+ * Function: gemm_micro_kernel
+ * ---------------------------- 
+ *   Adds the product of a packed mr x kb micro-panel of X and a packed
+ *   kb x GEMM_NR micro-panel of Y to an mr x GEMM_NR block of c, keeping
+ *   the block in registers for the whole length of the dot products.
+ * 
+ *   mr: the rows of the block, a constant once inlined
+ *   kb: the length of the dot products
+ *   a: the micro-panel of X, from pack_x_block
+ *   b: the micro-panel of Y, from pack_y_panel
+ *   c: the block to add to
+ *   ldc: the distance between rows of c
+ */
+GEMM_INLINE void gemm_micro_kernel(int mr, int kb, const int *a, const int *b,
+	int *c, int ldc) {
+	int8_vector acc[GEMM_MAX_MR][2];
+	#pragma GCC unroll 8
+	for (int r = 0; r < mr; r++) acc[r][0] = acc[r][1] = (int8_vector) {0};
+
+	for (int p = 0; p < kb; p++) {
+		int8_vector b0, b1;
+		memcpy(&b0, b + p * GEMM_NR, sizeof(b0));
+		memcpy(&b1, b + p * GEMM_NR + 8, sizeof(b1));
+
+		#pragma GCC unroll 8
+		for (int r = 0; r < mr; r++) {
+			acc[r][0] += b0 * a[p * mr + r];
+			acc[r][1] += b1 * a[p * mr + r];
+		}
+	}
+
+	#pragma GCC unroll 8
+	for (int r = 0; r < mr; r++) {
+		int8_vector c0, c1;
+		memcpy(&c0, c + r * ldc, sizeof(c0));
+		memcpy(&c1, c + r * ldc + 8, sizeof(c1));
+		c0 += acc[r][0];
+		c1 += acc[r][1];
+		memcpy(c + r * ldc, &c0, sizeof(c0));
+		memcpy(c + r * ldc + 8, &c1, sizeof(c1));
+	}
+}
+
+/* 
+ * Function: multiply_block
+ * ---------------------------- 
+ *   Adds the product of rows i0 to i0 + mb - 1 of X and columns j0 to
+ *   j0 + nb - 1 of Y to a tile, kc terms of the dot products at a time.
+ * 
+ *   X: the left operand
+ *   Y: the right operand
+ *   i0, mb: the first row and the number of rows
+ *   j0, nb: the first column and the number of columns
+ *   k: the length of the dot products
+ *   T: the block sizes and the rows of the micro-kernel
+ *   x_pack: an mc x kc buffer to pack X in to
+ *   y_pack: a kc x nc buffer to pack Y in to
+ *   y_packed: if not NULL, the panels of these columns of Y packed already,
+ *     kc x nc apart, and y_pack is not used
+ *   tile: the tile to add to, with its rows padded to mr
+ *   ld: the distance between rows of the tile, a multiple of GEMM_NR
+ */
+GEMM_INLINE void multiply_block(const struct Dense_Operand *X,
+	const struct Dense_Operand *Y, int i0, int mb, int j0, int nb, int k,
+	const struct Gemm_Tuning *T, int *x_pack, int *y_pack, const int *y_packed,
+	int *tile, int ld) {
+	int mr = T->mr, kc = T->kc;
+
+	for (int p0 = 0; p0 < k; p0 += kc) {
+		int kb = k - p0 < kc ? k - p0 : kc;
+		const int *y_panel = y_pack;
+		if (y_packed != NULL) y_panel = y_packed + (size_t) (p0 / kc) * kc * T->nc;
+		else pack_y_panel(Y, p0, kb, j0, nb, y_pack);
+		pack_x_block(X, i0, mb, p0, kb, mr, x_pack);
+
+		/* One copy of the loop per shape, so each micro-kernel is unrolled */
+		for (int jr = 0; jr < nb; jr += GEMM_NR)
+			for (int ir = 0; ir < mb; ir += mr) {
+				const int *a = x_pack + (size_t) ir * kb, *b = y_panel + (size_t) jr * kb;
+				int *c = tile + (size_t) ir * ld + jr;
+				if (mr == 4) gemm_micro_kernel(4, kb, a, b, c, ld);
+				else if (mr == GEMM_MAX_MR) gemm_micro_kernel(GEMM_MAX_MR, kb, a, b, c, ld);
+				else gemm_micro_kernel(GEMM_MR, kb, a, b, c, ld);
+			}
+	}
+}
+
+typedef void (*Gemm_Block_Kernel)(const struct Dense_Operand *X,
+	const struct Dense_Operand *Y, int i0, int mb, int j0, int nb, int k,
+	const struct Gemm_Tuning *T, int *x_pack, int *y_pack, const int *y_packed,
+	int *tile, int ld);
+
+static void multiply_block_generic(const struct Dense_Operand *X,
+	const struct Dense_Operand *Y, int i0, int mb, int j0, int nb, int k,
+	const struct Gemm_Tuning *T, int *x_pack, int *y_pack, const int *y_packed,
+	int *tile, int ld) {
+	multiply_block(X, Y, i0, mb, j0, nb, k, T, x_pack, y_pack, y_packed, tile, ld);
+}
+
+#ifdef GEMM_AVX2
+__attribute__((target("avx2")))
+static void multiply_block_avx2(const struct Dense_Operand *X,
+	const struct Dense_Operand *Y, int i0, int mb, int j0, int nb, int k,
+	const struct Gemm_Tuning *T, int *x_pack, int *y_pack, const int *y_packed,
+	int *tile, int ld) {
+	multiply_block(X, Y, i0, mb, j0, nb, k, T, x_pack, y_pack, y_packed, tile, ld);
+}
+#endif
+
+/* 
+ * Function: add_addends
+ * ---------------------------- 
+ *   Adds the epilogue terms to part of one row of a result.
+ * 
+ *   z_row: the first element of the row to add to
+ *   i: the row
+ *   j0: the first column
+ *   nb: the number of columns
+ *   addends: the terms to add
+ *   num_addends: the number of terms
+ */
+static void add_addends(int *z_row, int i, int j0, int nb,
+	const struct Dense_Addend *addends, int num_addends) {
+	for (int a = 0; a < num_addends; a++) {
+		int scale = addends[a].scale;
+		const struct Dense_Operand *op = &addends[a].op;
+
+		if (op->transposed)
+			for (int j = 0; j < nb; j++) z_row[j] += scale * op->rows[j0 + j][i];
+		else {
+			const int *row = op->rows[i] + j0;
+			for (int j = 0; j < nb; j++) z_row[j] += scale * row[j];
+		}
+	}
+}
+
+/* 
+ * Function: apply_epilogue
+ * ---------------------------- 
+ *   Applies an epilogue to part of one row of a result, while it is still in
+ *   cache. See struct Dense_Epilogue.
+ * 
+ *   z_row: the first element of the row
+ *   i: the row
+ *   j0: the first column
+ *   nb: the number of columns
+ *   epilogue: what to apply
+ */
+static void apply_epilogue(int *z_row, int i, int j0, int nb,
+	const struct Dense_Epilogue *epilogue) {
+	if (epilogue->row_bias != NULL) {
+		int bias = epilogue->row_bias[i];
+		for (int j = 0; j < nb; j++) z_row[j] += bias;
+	}
+
+	if (epilogue->col_bias != NULL) {
+		const int *bias = epilogue->col_bias + j0;
+		for (int j = 0; j < nb; j++) z_row[j] += bias[j];
+	}
+
+	if (epilogue->activation == ACTIVATION_RELU)
+		for (int j = 0; j < nb; j++) z_row[j] = z_row[j] < 0 ? 0 : z_row[j];
+
+	if (epilogue->multiplier != 0) {
+		long long multiplier = epilogue->multiplier;
+		int shift = epilogue->shift, zero_point = epilogue->zero_point;
+		long long round = shift > 0 ? 1LL << (shift - 1) : 0;
+		for (int j = 0; j < nb; j++) {
+			/* Saturate in 64 bits, so the clamp below sees the real value */
+			long long value = ((z_row[j] * multiplier + round) >> shift) + zero_point;
+			z_row[j] = value < INT_MIN ? INT_MIN : (value > INT_MAX ? INT_MAX : (int) value);
+		}
+	}
+
+	if (epilogue->clamp) {
+		int lo = epilogue->clamp_min, hi = epilogue->clamp_max;
+		for (int j = 0; j < nb; j++)
+			z_row[j] = z_row[j] < lo ? lo : (z_row[j] > hi ? hi : z_row[j]);
+	}
+}
+
+/* 
+ * Function: owned_row_blocks
+ * ---------------------------- 
+ *   Splits row blocks evenly between the threads. The blocked kernels run
+ *   the tasks of a thread's row blocks on that thread first, and
+ *   init_2d_array_numa has the same thread touch those rows first (in blocks
+ *   of the tuned mc rows), so that they are placed on its NUMA node.
+ * 
+ *   m_blocks: the number of row blocks
+ *   thread: the thread
+ *   num_threads: the number of threads
+ *   first: set to the first row block of the thread
+ *   last: set to one past its last row block
+ */
+static void owned_row_blocks(int m_blocks, int thread, int num_threads, int *first,
+	int *last) {
+	*first = (int) ((long long) m_blocks * thread / num_threads);
+	*last = (int) ((long long) m_blocks * (thread + 1) / num_threads);
+}
+
+/* Returns the NUMA node of the CPU the calling thread runs on */
+static int current_numa_node() {
+#ifdef USE_LIBNUMA
+	if (numa_available() >= 0) {
+		int node = numa_node_of_cpu(sched_getcpu());
+		if (node >= 0) return node;
+	}
+#endif
+	return 0;
+}
+
+/* Returns the number of NUMA nodes, 1 without USE_LIBNUMA */
+static int numa_node_count() {
+#ifdef USE_LIBNUMA
+	if (numa_available() >= 0) return numa_max_node() + 1;
+#endif
+	return 1;
+}
+
+/* Allocates memory on a NUMA node, or anywhere without USE_LIBNUMA */
+static void *malloc_on_node(size_t size, int node) {
+#ifdef USE_LIBNUMA
+	if (numa_available() >= 0) {
+		void *to_ret = numa_alloc_onnode(size, node);
+		if (to_ret == NULL) {
+			perror("numa_alloc_onnode");
+			exit(EXIT_FAILURE);
+		}
+		return to_ret;
+	}
+#endif
+	(void) node;
+	return Malloc(size);
+}
+
+static void free_on_node(void *ptr, size_t size) {
+#ifdef USE_LIBNUMA
+	if (numa_available() >= 0) {
+		numa_free(ptr, size);
+		return;
+	}
+#endif
+	(void) size;
+	free(ptr);
+}
+
+/* 
+ * Function: init_task_queues
+ * ---------------------------- 
+ *   Queues the tasks of a blocked kernel by the thread that owns their rows,
+ *   see owned_row_blocks. The queues are used from one parallel region,
+ *   after each thread has called start_task_queue.
+ * 
+ *   Q: the queues to set up
+ *   m_blocks: the number of row blocks
+ *   n_blocks: the number of column blocks
+ */
+static void init_task_queues(struct Task_Queues *Q, int m_blocks, int n_blocks) {
+	int max_threads = omp_get_max_threads();
+	Q->next = (int *) calloc((size_t) max_threads * TASK_QUEUE_PAD, sizeof(int));
+	if (Q->next == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	Q->node = (int *) Malloc(max_threads * sizeof(int));
+	Q->m_blocks = m_blocks;
+	Q->n_blocks = n_blocks;
+	Q->num_threads = max_threads;
+}
+
+/* Records the node of the calling thread; the threads of the parallel region
+*  must all call it before any calls next_task */
+static void start_task_queue(struct Task_Queues *Q) {
+	#pragma omp single
+	Q->num_threads = omp_get_num_threads();
+	Q->node[omp_get_thread_num()] = current_numa_node();
+	#pragma omp barrier
+}
+
+/* 
+ * Function: next_task
+ * ---------------------------- 
+ *   Takes the next task for a thread: from its own queue while it has any,
+ *   then from the queues of the threads on its NUMA node, then from any
+ *   queue, so that threads keep to the data on their node but none idles
+ *   while work is left.
+ * 
+ *   Q: the queues
+ *   thread: the calling thread
+ * 
+ *   returns: the task, row block + m_blocks * column block, or -1 when all
+ *     are taken
+ */
+static int next_task(struct Task_Queues *Q, int thread) {
+	for (int pass = 0; pass < 2; pass++) {
+		for (int s = 0; s < Q->num_threads; s++) {
+			int t = (thread + s) % Q->num_threads;
+			if ((Q->node[t] == Q->node[thread]) != (pass == 0)) continue;
+
+			int first, last;
+			owned_row_blocks(Q->m_blocks, t, Q->num_threads, &first, &last);
+			int owned = last - first;
+			if (owned == 0) continue;
+
+			int local;
+			#pragma omp atomic capture
+			local = Q->next[t * TASK_QUEUE_PAD]++;
+
+			if (local < owned * Q->n_blocks)
+				return first + local % owned + Q->m_blocks * (local / owned);
+		}
+	}
+
+	return -1;
+}
+
+static void free_task_queues(struct Task_Queues *Q) {
+	free(Q->next);
+	free(Q->node);
+}
+
+/* The parameters of the blocked kernel, see current_gemm_tuning */
+static struct Gemm_Tuning gemm_tuning = {GEMM_MC, GEMM_KC, GEMM_NC, GEMM_MR, 0,
+	GEMM_KERNEL_AUTO};
+static int gemm_tuning_loaded;
+
+static const char *const gemm_kernel_names[] = {"auto", "generic", "avx2"};
+
+/* Writes the name of the CPU model, its brand string on x86, which keys the
+*  tuning file */
+static void cpu_model_name(char *name, size_t size) {
+	snprintf(name, size, "unknown");
+#ifdef GEMM_AVX2
+	unsigned int regs[13] = {0};
+	if (__get_cpuid_max(0x80000000, NULL) < 0x80000004) return;
+	for (int i = 0; i < 3; i++)
+		__get_cpuid(0x80000002 + i, &regs[4 * i], &regs[4 * i + 1], &regs[4 * i + 2],
+			&regs[4 * i + 3]);
+
+	/* The brand string is padded with spaces */
+	char *brand = (char *) regs;
+	while (*brand == ' ') brand++;
+	size_t len = strlen(brand);
+	while (len > 0 && brand[len - 1] == ' ') brand[--len] = '\0';
+	if (len > 0) snprintf(name, size, "%s", brand);
+#endif
+}
+
+static int valid_gemm_tuning(const struct Gemm_Tuning *T) {
+	return (T->mr == 4 || T->mr == GEMM_MR || T->mr == GEMM_MAX_MR) && \
+		T->mc >= T->mr && T->mc <= 4096 && T->mc % T->mr == 0 && \
+		T->kc > 0 && T->kc <= 65536 && \
+		T->nc >= GEMM_NR && T->nc <= 65536 && T->nc % GEMM_NR == 0 && \
+		T->num_threads >= 0 && \
+		(T->kernel == GEMM_KERNEL_AUTO || T->kernel == GEMM_KERNEL_GENERIC || \
+		T->kernel == GEMM_KERNEL_AVX2);
+}
+
+/* 
+ * Function: set_gemm_tuning
+ * ---------------------------- 
+ *   Sets the parameters of the blocked kernel used by the products from now
+ *   on, in place of those from the tuning file.
+ * 
+ *   T: the parameters
+ */
+void set_gemm_tuning(const struct Gemm_Tuning *T) {
+	if (!valid_gemm_tuning(T)) {
+		fprintf(stderr, "Invalid parameters for the blocked kernel.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	#pragma omp critical(gemm_tuning)
+	{
+		gemm_tuning = *T;
+		gemm_tuning_loaded = 1;
+	}
+}
+
+/* Reads the parameters saved for this CPU model in a tuning file in to T.
+*  Returns 0 if there are none, see load_gemm_tuning */
+static int read_gemm_tuning(const char *path, struct Gemm_Tuning *T) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) return 0;
+
+	char model[64], line[256];
+	cpu_model_name(model, sizeof(model));
+	size_t model_len = strlen(model);
+	int found = 0;
+
+	while (!found && fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#' || strncmp(line, model, model_len) != 0 || \
+			line[model_len] != '\t')
+			continue;
+
+		char kernel[16];
+		int kernel_found = 0;
+		if (sscanf(line + model_len + 1, "%d %d %d %d %d %15s", &T->mc, &T->kc, &T->nc,
+			&T->mr, &T->num_threads, kernel) == 6)
+			for (int i = 0; i <= GEMM_KERNEL_AVX2; i++)
+				if (strcmp(kernel, gemm_kernel_names[i]) == 0) {
+					T->kernel = (enum Gemm_Kernel) i;
+					kernel_found = 1;
+				}
+
+		if (!kernel_found || !valid_gemm_tuning(T)) {
+			fprintf(stderr, "Malformed entry for this CPU in %s.\n", path);
+			exit(EXIT_FAILURE);
+		}
+		found = 1;
+	}
+
+	fclose(f);
+	return found;
+}
+
+/* 
+ * Function: load_gemm_tuning
+ * ---------------------------- 
+ *   Sets the parameters of the blocked kernel to those saved for this CPU
+ *   model by autotune_matrix_multiply. The blocked kernel does this itself,
+ *   the first time it runs, with the file named by the GEMM_TUNING_FILE
+ *   environment variable.
+ * 
+ *   path: the tuning file, with one line per CPU model: the model, a tab,
+ *     then mc, kc, nc, mr, the number of threads and the kernel
+ * 
+ *   returns: 1 if the file has parameters for this CPU, 0 if not (they are
+ *     left as they are)
+ */
+int load_gemm_tuning(const char *path) {
+	struct Gemm_Tuning T;
+	if (!read_gemm_tuning(path, &T)) return 0;
+	set_gemm_tuning(&T);
+	return 1;
+}
+
+/* 
+ * Function: save_gemm_tuning
+ * ---------------------------- 
+ *   Saves parameters of the blocked kernel for this CPU model in a tuning
+ *   file, replacing any saved before, see load_gemm_tuning.
+ * 
+ *   path: the tuning file, created if it does not exist
+ *   T: the parameters
+ */
+void save_gemm_tuning(const char *path, const struct Gemm_Tuning *T) {
+	char model[64], line[256];
+	cpu_model_name(model, sizeof(model));
+	size_t model_len = strlen(model);
+
+	/* Keep the lines of the other models */
+	char *kept = NULL;
+	size_t kept_len = 0;
+	FILE *f = fopen(path, "r");
+	if (f != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (strncmp(line, model, model_len) == 0 && line[model_len] == '\t') continue;
+			size_t len = strlen(line);
+			kept = (char *) realloc(kept, kept_len + len + 1);
+			if (kept == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+			memcpy(kept + kept_len, line, len + 1);
+			kept_len += len;
+		}
+		fclose(f);
+	}
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror("fopen");
+		exit(EXIT_FAILURE);
+	}
+	if (kept_len > 0) fputs(kept, f);
+	else fputs("# model\tmc kc nc mr threads kernel\n", f);
+	fprintf(f, "%s\t%d %d %d %d %d %s\n", model, T->mc, T->kc, T->nc, T->mr,
+		T->num_threads, gemm_kernel_names[T->kernel]);
+
+	free(kept);
+	if (fclose(f) != 0) {
+		perror("fclose");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Returns the parameters of the blocked kernel, loading the tuning file the
+*  first time, see load_gemm_tuning */
+static const struct Gemm_Tuning *current_gemm_tuning() {
+	#pragma omp critical(gemm_tuning)
+	if (!gemm_tuning_loaded) {
+		const char *path = getenv(GEMM_TUNING_ENV);
+		struct Gemm_Tuning T;
+		if (path != NULL && read_gemm_tuning(path, &T)) gemm_tuning = T;
+		gemm_tuning_loaded = 1;
+	}
+	return &gemm_tuning;
+}
+
+struct Gemm_Tuning get_gemm_tuning() {
+	return *current_gemm_tuning();
+}
+
+/* The number of threads of the blocked kernel */
+static inline int gemm_thread_count(const struct Gemm_Tuning *T) {
+	int num_threads = omp_get_max_threads();
+	return T->num_threads > 0 && T->num_threads < num_threads ? T->num_threads : \
+		num_threads;
+}
+
+/* 
+ * Function: blocked_matrix_multiply
+ * ---------------------------- 
+ *   Computes Z = alpha * X * Y + the addends (+ Z when accumulating) with a
+ *   blocked, packed kernel. Each task computes one mc x nc block of the
+ *   product (see current_gemm_tuning) in to a tile that stays in cache, and
+ *   the epilogue
+ *   (alpha, the addends, the old Z, then the biases, activation and
+ *   requantization of a Dense_Epilogue) is applied as the tile is stored,
+ *   so Z is written exactly once and nothing else is.
+ * 
+ *   Tasks run first on the thread that owns their rows (see next_task), so
+ *   that X and Z are read and written on the NUMA node they were placed on
+ *   by init_2d_array_numa. Y, which every row block reads, is packed once
+ *   up front, with one copy on each node.
+ * 
+ *   X: the left operand, m x k after any transposition
+ *   Y: the right operand, k x n after any transposition
+ *   m, k, n: the sizes of the product
+ *   alpha: the scale of the product
+ *   addends: m x n terms added to the product, or NULL
+ *   num_addends: the number of addends
+ *   accumulate: whether to add to Z rather than overwrite it
+ *   epilogue: applied last to each value, or NULL
+ *   Z: the m x n result
+ */
+static void blocked_matrix_multiply(const struct Dense_Operand *X,
+	const struct Dense_Operand *Y, int m, int k, int n, int alpha,
+	const struct Dense_Addend *addends, int num_addends, int accumulate,
+	const struct Dense_Epilogue *epilogue, int **Z) {
+	/* A copy, so that a new tuning cannot change the sizes part way */
+	struct Gemm_Tuning T = *current_gemm_tuning();
+	int mc = T.mc, kc = T.kc, nc = T.nc;
+	int m_blocks = (m + mc - 1) / mc;
+	int n_blocks = (n + nc - 1) / nc;
+	int k_blocks = (k + kc - 1) / kc;
+
+	Gemm_Block_Kernel multiply_block = multiply_block_generic;
+#ifdef GEMM_AVX2
+	if (T.kernel != GEMM_KERNEL_GENERIC && __builtin_cpu_supports("avx2"))
+		multiply_block = multiply_block_avx2;
+#endif
+
+	/* One copy of the packed Y per node, each panel kc x nc */
+	int num_nodes = numa_node_count();
+	size_t packed_size = (size_t) n_blocks * k_blocks * kc * nc * sizeof(int);
+	int **y_packed = NULL;
+
+	if (m_blocks > 1 && k > 0 && packed_size <= GEMM_PREPACK_LIMIT) {
+		TRACE_BEGIN(pack, "blocked_matrix_multiply", "pack");
+		TRACE_COUNT(pack, 0, (double) k * n * sizeof(int) + (double) num_nodes * packed_size);
+		y_packed = (int **) Malloc(num_nodes * sizeof(int *));
+		for (int node = 0; node < num_nodes; node++)
+			y_packed[node] = (int *) malloc_on_node(packed_size, node);
+
+		#pragma omp parallel for schedule(dynamic, 1) num_threads(gemm_thread_count(&T))
+		for (int panel = 0; panel < num_nodes * n_blocks * k_blocks; panel++) {
+			int node = panel / (n_blocks * k_blocks), rest = panel % (n_blocks * k_blocks);
+			int j0 = rest / k_blocks * nc, p0 = rest % k_blocks * kc;
+			pack_y_panel(Y, p0, k - p0 < kc ? k - p0 : kc, j0, n - j0 < nc ? n - j0 : nc,
+				y_packed[node] + (size_t) rest * kc * nc);
+		}
+		TRACE_END(pack);
+	}
+
+	struct Task_Queues queues;
+	init_task_queues(&queues, m_blocks, n_blocks);
+
+	#pragma omp parallel num_threads(gemm_thread_count(&T))
+	{
+		int *x_pack = (int *) Malloc((size_t) mc * kc * sizeof(int));
+		int *y_pack = (int *) Malloc((size_t) kc * nc * sizeof(int));
+		int *tile = (int *) Malloc((size_t) mc * nc * sizeof(int));
+		int thread = omp_get_thread_num();
+		start_task_queue(&queues);
+		const int *node_packed = y_packed != NULL ? y_packed[queues.node[thread]] : NULL;
+		TRACE_BEGIN(compute, "blocked_matrix_multiply", "compute");
+
+		for (int task = next_task(&queues, thread); task >= 0;
+			task = next_task(&queues, thread)) {
+			int i0 = (task % m_blocks) * mc, j0 = (task / m_blocks) * nc;
+			int mb = m - i0 < mc ? m - i0 : mc;
+			int nb = n - j0 < nc ? n - j0 : nc;
+			int ld = (nb + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+			int mb_padded = (mb + T.mr - 1) / T.mr * T.mr;
+			TRACE_COUNT(compute, 2.0 * mb * nb * k, ((double) mb * k + (double) k * nb + \
+				(double) mb * nb) * sizeof(int));
+
+			memset(tile, 0, (size_t) mb_padded * ld * sizeof(int));
+			multiply_block(X, Y, i0, mb, j0, nb, k, &T, x_pack, y_pack,
+				node_packed != NULL ? node_packed + (size_t) (task / m_blocks) * \
+				k_blocks * kc * nc : NULL, tile, ld);
+
+			/* Epilogue */
+			for (int i = 0; i < mb; i++) {
+				int *z_row = Z[i0 + i] + j0;
+				const int *t_row = tile + (size_t) i * ld;
+
+				if (accumulate)
+					for (int j = 0; j < nb; j++) z_row[j] += alpha * t_row[j];
+				else
+					for (int j = 0; j < nb; j++) z_row[j] = alpha * t_row[j];
+				add_addends(z_row, i0 + i, j0, nb, addends, num_addends);
+				if (epilogue != NULL) apply_epilogue(z_row, i0 + i, j0, nb, epilogue);
+			}
+		}
+
+		TRACE_END(compute);
+		free(x_pack);
+		free(y_pack);
+		free(tile);
+	}
+
+	free_task_queues(&queues);
+	if (y_packed != NULL) {
+		for (int node = 0; node < num_nodes; node++) free_on_node(y_packed[node], packed_size);
+		free(y_packed);
+	}
+}
+
+/* Adds up the lanes of a vector */
+GEMM_INLINE int sum_int8_vector(const int8_vector *v) {
+	int sum = 0;
+	for (int l = 0; l < 8; l++) sum += (*v)[l];
+	return sum;
+}
+
+/* 
+ * Function: gemv_rows
+ * ---------------------------- 
+ *   Computes rows i0 to i1 - 1 of X * y, GEMV_ROWS dot products at a time,
+ *   8 terms at a time.
+ * 
+ *   X: the matrix
+ *   y: the vector, of k elements
+ *   i0, i1: the first row and one past the last
+ *   k: the number of columns of X
+ *   z: the result, of which rows i0 to i1 - 1 are written
+ */
+GEMM_INLINE void gemv_rows(int **X, const int *y, int i0, int i1, int k, int *z) {
+	int i = i0;
+	for (; i + GEMV_ROWS <= i1; i += GEMV_ROWS) {
+		const int *x[GEMV_ROWS];
+		int8_vector acc[GEMV_ROWS];
+		for (int r = 0; r < GEMV_ROWS; r++) {
+			x[r] = X[i + r];
+			acc[r] = (int8_vector) {0};
+		}
+
+		int p = 0;
+		for (; p + 8 <= k; p += 8) {
+			int8_vector y_vector;
+			memcpy(&y_vector, y + p, sizeof(y_vector));
+			#pragma GCC unroll 4
+			for (int r = 0; r < GEMV_ROWS; r++) {
+				int8_vector x_vector;
+				memcpy(&x_vector, x[r] + p, sizeof(x_vector));
+				acc[r] += x_vector * y_vector;
+			}
+		}
+
+		for (int r = 0; r < GEMV_ROWS; r++) {
+			int dot_product = sum_int8_vector(&acc[r]);
+			for (int q = p; q < k; q++) dot_product += x[r][q] * y[q];
+			z[i + r] = dot_product;
+		}
+	}
+
+	for (; i < i1; i++) {
+		const int *x = X[i];
+		int8_vector acc = {0};
+		int p = 0;
+		for (; p + 8 <= k; p += 8) {
+			int8_vector x_vector, y_vector;
+			memcpy(&x_vector, x + p, sizeof(x_vector));
+			memcpy(&y_vector, y + p, sizeof(y_vector));
+			acc += x_vector * y_vector;
+		}
+
+		int dot_product = sum_int8_vector(&acc);
+		for (; p < k; p++) dot_product += x[p] * y[p];
+		z[i] = dot_product;
+	}
+}
+
+/* 
+ * Function: gevm_cols
+ * ---------------------------- 
+ *   Computes columns j0 to j1 - 1 of x * Y, GEVM_NC columns at a time, to
+ *   which GEMV_ROWS rows of Y are added at a time, 8 columns at a time.
+ * 
+ *   x: the vector, of k elements
+ *   Y: the matrix
+ *   k: the number of rows of Y
+ *   j0, j1: the first column and one past the last
+ *   z: the result, of which columns j0 to j1 - 1 are written
+ */
+GEMM_INLINE void gevm_cols(const int *x, int **Y, int k, int j0, int j1, int *z) {
+	for (int c0 = j0; c0 < j1; c0 += GEVM_NC) {
+		int c1 = j1 - c0 < GEVM_NC ? j1 : c0 + GEVM_NC;
+		memset(z + c0, 0, (size_t) (c1 - c0) * sizeof(int));
+
+		int p = 0;
+		for (; p + GEMV_ROWS <= k; p += GEMV_ROWS) {
+			const int *y[GEMV_ROWS];
+			int a[GEMV_ROWS];
+			for (int r = 0; r < GEMV_ROWS; r++) {
+				y[r] = Y[p + r];
+				a[r] = x[p + r];
+			}
+
+			int j = c0;
+			for (; j + 8 <= c1; j += 8) {
+				int8_vector acc;
+				memcpy(&acc, z + j, sizeof(acc));
+				#pragma GCC unroll 4
+				for (int r = 0; r < GEMV_ROWS; r++) {
+					int8_vector y_vector;
+					memcpy(&y_vector, y[r] + j, sizeof(y_vector));
+					acc += y_vector * a[r];
+				}
+				memcpy(z + j, &acc, sizeof(acc));
+			}
+			for (; j < c1; j++)
+				for (int r = 0; r < GEMV_ROWS; r++) z[j] += a[r] * y[r][j];
+		}
+
+		for (; p < k; p++) {
+			const int *y = Y[p];
+			int a = x[p];
+			for (int j = c0; j < c1; j++) z[j] += a * y[j];
+		}
+	}
+}
+
+typedef void (*Gemv_Kernel)(int **X, const int *y, int i0, int i1, int k, int *z);
+typedef void (*Gevm_Kernel)(const int *x, int **Y, int k, int j0, int j1, int *z);
+
+static void gemv_rows_generic(int **X, const int *y, int i0, int i1, int k, int *z) {
+	gemv_rows(X, y, i0, i1, k, z);
+}
+
+static void gevm_cols_generic(const int *x, int **Y, int k, int j0, int j1, int *z) {
+	gevm_cols(x, Y, k, j0, j1, z);
+}
+
+#ifdef GEMM_AVX2
+__attribute__((target("avx2")))
+static void gemv_rows_avx2(int **X, const int *y, int i0, int i1, int k, int *z) {
+	gemv_rows(X, y, i0, i1, k, z);
+}
+
+__attribute__((target("avx2")))
+static void gevm_cols_avx2(const int *x, int **Y, int k, int j0, int j1, int *z) {
+	gevm_cols(x, Y, k, j0, j1, z);
+}
+#endif
+
+/* 
+ * Function: matrix_vector_multiply
+ * ---------------------------- 
+ *   Computes X * y for a vector y, in to a plain array. It reads X once, as
+ *   it streams past, so it runs at about the memory bandwidth; each thread
+ *   computes one contiguous block of rows.
+ * 
+ *   X: the m x k matrix
+ *   y: the vector, of k elements
+ *   m: the number of rows of X
+ *   k: the number of columns of X
+ *   z: the result, of m elements
+ */
+void matrix_vector_multiply(int **X, const int *y, int m, int k, int *z) {
+	Gemv_Kernel kernel = gemv_rows_generic;
+#ifdef GEMM_AVX2
+	if (__builtin_cpu_supports("avx2")) kernel = gemv_rows_avx2;
+#endif
+
+	TRACE_BEGIN(compute, "matrix_vector_multiply", "compute");
+	TRACE_COUNT(compute, 2.0 * m * k, ((double) m * k + k + m) * sizeof(int));
+
+	#pragma omp parallel if ((long long) m * k >= GEMV_PARALLEL_WORK)
+	{
+		int thread = omp_get_thread_num(), num_threads = omp_get_num_threads();
+		int first = (int) ((long long) m * thread / num_threads);
+		int last = (int) ((long long) m * (thread + 1) / num_threads);
+		kernel(X, y, first, last, k, z);
+	}
+
+	TRACE_END(compute);
+}
+
+/* 
+ * Function: vector_matrix_multiply
+ * ---------------------------- 
+ *   Computes x * Y for a (row) vector x, in to a plain array. It reads Y once,
+ *   as it streams past, so it runs at about the memory bandwidth; each thread
+ *   computes one contiguous block of columns, of whole cache lines.
+ * 
+ *   x: the vector, of k elements
+ *   Y: the k x n matrix
+ *   k: the number of rows of Y
+ *   n: the number of columns of Y
+ *   z: the result, of n elements
+ */
+void vector_matrix_multiply(const int *x, int **Y, int k, int n, int *z) {
+	Gevm_Kernel kernel = gevm_cols_generic;
+#ifdef GEMM_AVX2
+	if (__builtin_cpu_supports("avx2")) kernel = gevm_cols_avx2;
+#endif
+	int num_lines = (n + GEMM_NR - 1) / GEMM_NR;
+
+	TRACE_BEGIN(compute, "vector_matrix_multiply", "compute");
+	TRACE_COUNT(compute, 2.0 * k * n, ((double) k * n + k + n) * sizeof(int));
+
+	#pragma omp parallel if ((long long) k * n >= GEMV_PARALLEL_WORK)
+	{
+		int thread = omp_get_thread_num(), num_threads = omp_get_num_threads();
+		int first = (int) ((long long) num_lines * thread / num_threads) * GEMM_NR;
+		int last = (int) ((long long) num_lines * (thread + 1) / num_threads) * GEMM_NR;
+		if (last > n) last = n;
+		if (first < last) kernel(x, Y, k, first, last, z);
+	}
+
+	TRACE_END(compute);
+}
+
+/* 
+ * Function: gemv_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for a Y of one column (DENSE_GEMV), with
+ *   matrix_vector_multiply on a copy of the column.
+ * 
+ *   X: the m x k left operand
+ *   Y: the k x 1 right operand
+ *   m, k: the sizes of the product
+ *   Z: the m x 1 result
+ */
+static void gemv_matrix_multiply(int **X, int **Y, int m, int k, int **Z) {
+	int *y = (int *) Malloc(((size_t) k + 1) * sizeof(int));
+	int *z = (int *) Malloc(((size_t) m + 1) * sizeof(int));
+	for (int p = 0; p < k; p++) y[p] = Y[p][0];
+
+	matrix_vector_multiply(X, y, m, k, z);
+	for (int i = 0; i < m; i++) Z[i][0] = z[i];
+
+	free(y);
+	free(z);
+}
+
+/* 
+ * Function: outer_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for an X of one column (DENSE_OUTER), the outer product
+ *   of the column and the row of Y. Each row of Z is the row of Y scaled,
+ *   and the rows are split evenly between the threads.
+ * 
+ *   X: the m x 1 left operand
+ *   Y: the 1 x n right operand
+ *   m, n: the sizes of the product
+ *   Z: the m x n result
+ */
+static void outer_matrix_multiply(int **X, int **Y, int m, int n, int **Z) {
+	TRACE_BEGIN(compute, "outer_matrix_multiply", "compute");
+	TRACE_COUNT(compute, (double) m * n, ((double) m + n + (double) m * n) * sizeof(int));
+
+	const int *y_row = Y[0];
+
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < m; i++) {
+		int *z_row = Z[i], x = X[i][0];
+		for (int j = 0; j < n; j++) z_row[j] = x * y_row[j];
+	}
+
+	TRACE_END(compute);
+}
+
+/* 
+ * Function: tall_skinny_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for many rows and a small Y (DENSE_TALL_SKINNY). Y is
+ *   packed once, as a single panel that stays in cache, and each thread
+ *   computes one contiguous panel of rows, a few rows at a time, straight
+ *   in to Z: there are no tasks to queue, and each thread reads and writes
+ *   only its own rows of X and Z.
+ * 
+ *   X: the m x k left operand
+ *   Y: the k x n right operand
+ *   m, k, n: the sizes of the product
+ *   Z: the m x n result
+ */
+static void tall_skinny_matrix_multiply(int **X, int **Y, int m, int k, int n,
+	int **Z) {
+	/* The whole of Y is one kc x nc panel */
+	struct Gemm_Tuning T = *current_gemm_tuning();
+	int ld = (n + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+	T.kc = k;
+	T.nc = ld;
+	int rows = T.mr * 4;
+
+	Gemm_Block_Kernel multiply_block = multiply_block_generic;
+#ifdef GEMM_AVX2
+	if (T.kernel != GEMM_KERNEL_GENERIC && __builtin_cpu_supports("avx2"))
+		multiply_block = multiply_block_avx2;
+#endif
+
+	struct Dense_Operand x_operand = {X, 0}, y_operand = {Y, 0};
+	int *y_packed = (int *) Malloc((size_t) k * ld * sizeof(int));
+	TRACE_BEGIN(pack, "tall_skinny_matrix_multiply", "pack");
+	pack_y_panel(&y_operand, 0, k, 0, n, y_packed);
+	TRACE_COUNT(pack, 0, ((double) k * n + (double) k * ld) * sizeof(int));
+	TRACE_END(pack);
+
+	#pragma omp parallel num_threads(gemm_thread_count(&T))
+	{
+		int *x_pack = (int *) Malloc((size_t) rows * k * sizeof(int));
+		int *tile = (int *) Malloc((size_t) rows * ld * sizeof(int));
+		int thread = omp_get_thread_num(), num_threads = omp_get_num_threads();
+		int first = (int) ((long long) m * thread / num_threads);
+		int last = (int) ((long long) m * (thread + 1) / num_threads);
+		TRACE_BEGIN(compute, "tall_skinny_matrix_multiply", "compute");
+		TRACE_COUNT(compute, 2.0 * (last - first) * k * n, ((double) (last - first) * \
+			(k + n) + (double) k * ld) * sizeof(int));
+
+		for (int i0 = first; i0 < last; i0 += rows) {
+			int mb = last - i0 < rows ? last - i0 : rows;
+			memset(tile, 0, (size_t) rows * ld * sizeof(int));
+			multiply_block(&x_operand, &y_operand, i0, mb, 0, n, k, &T, x_pack, NULL,
+				y_packed, tile, ld);
+			for (int i = 0; i < mb; i++)
+				memcpy(Z[i0 + i], tile + (size_t) i * ld, n * sizeof(int));
+		}
+
+		TRACE_END(compute);
+		free(x_pack);
+		free(tile);
+	}
+
+	free(y_packed);
+}
+
+/* 
+ * Function: short_fat_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for few rows (DENSE_SHORT_FAT). There are too few rows to
+ *   split, so each thread computes one contiguous panel of columns instead,
+ *   of a multiple of GEMM_NR, with its own small copy of X.
+ * 
+ *   X: the m x k left operand
+ *   Y: the k x n right operand
+ *   m, k, n: the sizes of the product
+ *   Z: the m x n result
+ */
+static void short_fat_matrix_multiply(int **X, int **Y, int m, int k, int n,
+	int **Z) {
+	struct Gemm_Tuning T = *current_gemm_tuning();
+	int mc = T.mc, nc = T.nc;
+	int num_panels = (n + GEMM_NR - 1) / GEMM_NR;
+
+	Gemm_Block_Kernel multiply_block = multiply_block_generic;
+#ifdef GEMM_AVX2
+	if (T.kernel != GEMM_KERNEL_GENERIC && __builtin_cpu_supports("avx2"))
+		multiply_block = multiply_block_avx2;
+#endif
+
+	struct Dense_Operand x_operand = {X, 0}, y_operand = {Y, 0};
+
+	#pragma omp parallel num_threads(gemm_thread_count(&T))
+	{
+		int *x_pack = (int *) Malloc((size_t) mc * T.kc * sizeof(int));
+		int *y_pack = (int *) Malloc((size_t) T.kc * nc * sizeof(int));
+		int *tile = (int *) Malloc((size_t) mc * nc * sizeof(int));
+		int thread = omp_get_thread_num(), num_threads = omp_get_num_threads();
+		int first = (int) ((long long) num_panels * thread / num_threads) * GEMM_NR;
+		int last = (int) ((long long) num_panels * (thread + 1) / num_threads) * GEMM_NR;
+		if (last > n) last = n;
+		TRACE_BEGIN(compute, "short_fat_matrix_multiply", "compute");
+		TRACE_COUNT(compute, 2.0 * m * k * (last > first ? last - first : 0), 0);
+
+		for (int j0 = first; j0 < last; j0 += nc) {
+			int nb = last - j0 < nc ? last - j0 : nc;
+			int ld = (nb + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+
+			for (int i0 = 0; i0 < m; i0 += mc) {
+				int mb = m - i0 < mc ? m - i0 : mc;
+				int mb_padded = (mb + T.mr - 1) / T.mr * T.mr;
+				memset(tile, 0, (size_t) mb_padded * ld * sizeof(int));
+				multiply_block(&x_operand, &y_operand, i0, mb, j0, nb, k, &T, x_pack,
+					y_pack, NULL, tile, ld);
+				for (int i = 0; i < mb; i++)
+					memcpy(Z[i0 + i] + j0, tile + (size_t) i * ld, nb * sizeof(int));
+			}
+		}
+
+		TRACE_END(compute);
+		free(x_pack);
+		free(y_pack);
+		free(tile);
+	}
+}
+
+/* 
+ * Function: classify_dense_product
+ * ---------------------------- 
+ *   Picks the kernel matrix_multiply uses for a product of a given shape.
+ * 
+ *   m, k, n: the sizes of the product, m x k times k x n
+ * 
+ *   returns: the shape of the product
+ */
+enum Dense_Shape classify_dense_product(int m, int k, int n) {
+	int widest = k > n ? k : n;
+
+	if ((double) m * k * n <= DENSE_SMALL_WORK) return DENSE_SMALL;
+	if (n == 1) return DENSE_GEMV;
+	if (m == 1) return DENSE_GEVM;
+	if (k == 1) return DENSE_OUTER;
+	if (m <= DENSE_FAT_ROWS) return DENSE_SHORT_FAT;
+	if (widest <= DENSE_SKINNY_COLS && m / DENSE_SKINNY_RATIO >= widest)
+		return DENSE_TALL_SKINNY;
+	return DENSE_SQUARE;
+}
+
+/* 
+ * Function: matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y with the kernel for the shape of the product, see
+ *   classify_dense_product: matrix_vector_multiply for a single column,
+ *   vector_matrix_multiply for a single row, scaled rows for a single inner
+ *   dimension, panels of rows for tall and
+ *   thin products, panels of columns for short and wide ones, and the
+ *   2D blocks of blocked_matrix_multiply for the rest.
+ * 
+ *   X: 2D matrix to left-multiply
+ *   Y: 2D matrix to right-multiply
+ *   x_rows: the number of rows in X
+ *   x_cols: the number of columns in X
+ *   y_rows: the number of rows in Y
+ *   y_cols: the number of columns in Y
+ * 
+ *   returns: the matrix X * Y as a 2D array
+ */
+int** matrix_multiply(int** X, int** Y, int x_rows, int x_cols, int y_rows, int y_cols) {
+	// Check whether X and Y are compatible
+	if (x_cols != y_rows) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int m = x_rows, k = x_cols, n = y_cols;
+
+	// Allocate the product array Z
+	int **Z = init_2d_array(m, n);
+
+	struct Dense_Operand left = {X, 0}, right = {Y, 0};
+
+	switch (classify_dense_product(m, k, n)) {
+	case DENSE_SMALL:
+		iterative_matrix_multiply(X, Y, m, k, n, Z);
+		break;
+	case DENSE_GEMV:
+		gemv_matrix_multiply(X, Y, m, k, Z);
+		break;
+	case DENSE_GEVM:
+		vector_matrix_multiply(X[0], Y, k, n, Z[0]);
+		break;
+	case DENSE_OUTER:
+		outer_matrix_multiply(X, Y, m, n, Z);
+		break;
+	case DENSE_TALL_SKINNY:
+		tall_skinny_matrix_multiply(X, Y, m, k, n, Z);
+		break;
+	case DENSE_SHORT_FAT:
+		short_fat_matrix_multiply(X, Y, m, k, n, Z);
+		break;
+	case DENSE_SQUARE:
+		blocked_matrix_multiply(&left, &right, m, k, n, 1, NULL, 0, 0, NULL, Z);
+		break;
+	}
+
+	return Z;
+}
+
+/* 
+ * Function: combine_addends
+ * ---------------------------- 
+ *   Computes Z = the sum of the addends, for expressions without a product.
+ * 
+ *   addends: the m x n terms to add
+ *   num_addends: the number of terms
+ *   m, n: the size of Z
+ *   Z: the result
+ */
+static void combine_addends(const struct Dense_Addend *addends, int num_addends,
+	int m, int n, int **Z) {
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < m; i++) {
+		memset(Z[i], 0, n * sizeof(int));
+		add_addends(Z[i], i, 0, n, addends, num_addends);
+	}
+}
+
+/* 
+ * Function: matrix_chain_order
+ * ---------------------------- 
+ *   Finds the cheapest order to multiply a chain of matrices in, by dynamic
+ *   programming over the number of multiplications: the cheapest way to
+ *   multiply factors i to j splits them at the s for which the cost of both
+ *   sides plus dims[i] * dims[s + 1] * dims[j + 1] is least.
+ * 
+ *   dims: the num + 1 sizes of the chain; factor i is dims[i] x dims[i + 1]
+ *   num: the number of factors
+ *   cost: a num x num array, filled with the least cost of each sub-chain
+ *   split: a num x num array, filled with the split of each sub-chain; the
+ *     last factor of the left side of factors i to j is split[i * num + j]
+ */
+static void matrix_chain_order(const int *dims, int num, double *cost, int *split) {
+	for (int i = 0; i < num; i++) cost[i * num + i] = 0;
+
+	for (int len = 2; len <= num; len++) {
+		for (int i = 0; i + len - 1 < num; i++) {
+			int j = i + len - 1;
+			cost[i * num + j] = -1;
+
+			for (int s = i; s < j; s++) {
+				double c = cost[i * num + s] + cost[(s + 1) * num + j] + \
+					(double) dims[i] * dims[s + 1] * dims[j + 1];
+				if (cost[i * num + j] < 0 || c < cost[i * num + j]) {
+					cost[i * num + j] = c;
+					split[i * num + j] = s;
+				}
+			}
+		}
+	}
+}
+
+/* 
+ * Function: init_expr_graph
+ * ---------------------------- 
+ *   Allocates an empty expression graph. Expressions are built up from 2D
+ *   arrays with expr_matrix, expr_multiply, expr_add, expr_transpose and
+ *   expr_scale, none of which compute anything, and are then computed with
+ *   evaluate_expr. Evaluation rewrites the expression as a sum of scaled
+ *   chains of products, so that:
+ *    - transposes are pushed down to the matrices and read in place
+ *    - scales are applied as the result is stored
+ *    - each chain is multiplied in the cheapest order for its shapes
+ *    - the matrices added to the products are added as the last product is
+ *      stored, rather than in separate passes
+ *    - intermediate results reuse the buffers of earlier ones
+ * 
+ *   returns: the allocated graph
+ */
+struct Expr_Graph *init_expr_graph() {
+	struct Expr_Graph *G = (struct Expr_Graph *) Malloc(sizeof(struct Expr_Graph));
+	G->nodes = NULL;
+	G->buffers = NULL;
+	G->multiplications = 0;
+	return G;
+}
+
+/* 
+ * Function: new_expr_node
+ * ---------------------------- 
+ *   Allocates a node of an expression graph.
+ * 
+ *   G: the graph to add the node to
+ *   op: the operation of the node
+ *   num_rows: the number of rows of its value
+ *   num_cols: the number of columns of its value
+ * 
+ *   returns: the node, with its operands unset
+ */
+static struct Matrix_Expr *new_expr_node(struct Expr_Graph *G, enum Expr_Op op,
+	int num_rows, int num_cols) {
+	struct Matrix_Expr *E = (struct Matrix_Expr *) Malloc(sizeof(struct Matrix_Expr));
+	E->op = op;
+	E->num_rows = num_rows;
+	E->num_cols = num_cols;
+	E->data = NULL;
+	E->scale = 1;
+	E->left = E->right = NULL;
+	E->next = G->nodes;
+	G->nodes = E;
+	return E;
+}
+
+/* 
+ * Function: expr_matrix
+ * ---------------------------- 
+ *   Makes a leaf of an expression from a 2D array. The array is read when
+ *   the expression is evaluated, not copied.
+ * 
+ *   G: the graph to add to
+ *   R: the 2D array
+ *   num_rows: the number of rows in R
+ *   num_cols: the number of columns in R
+ * 
+ *   returns: the expression R
+ */
+struct Matrix_Expr *expr_matrix(struct Expr_Graph *G, int **R, int num_rows,
+	int num_cols) {
+	struct Matrix_Expr *E = new_expr_node(G, EXPR_MATRIX, num_rows, num_cols);
+	E->data = R;
+	return E;
+}
+
+/* 
+ * Function: expr_multiply
+ * ---------------------------- 
+ *   G: the graph to add to
+ *   X: the expression to left-multiply
+ *   Y: the expression to right-multiply
+ * 
+ *   returns: the expression X * Y
+ */
+struct Matrix_Expr *expr_multiply(struct Expr_Graph *G, struct Matrix_Expr *X,
+	struct Matrix_Expr *Y) {
+	// Check whether X and Y are compatible
+	if (X->num_cols != Y->num_rows) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct Matrix_Expr *E = new_expr_node(G, EXPR_MULTIPLY, X->num_rows, Y->num_cols);
+	E->left = X;
+	E->right = Y;
+	return E;
+}
+
+/* 
+ * Function: expr_add
+ * ---------------------------- 
+ *   G: the graph to add to
+ *   X, Y: the expressions to add
+ * 
+ *   returns: the expression X + Y
+ */
+struct Matrix_Expr *expr_add(struct Expr_Graph *G, struct Matrix_Expr *X,
+	struct Matrix_Expr *Y) {
+	if (X->num_rows != Y->num_rows || X->num_cols != Y->num_cols) {
+		fprintf(stderr, "Matrix sizes are incompatible for addition.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct Matrix_Expr *E = new_expr_node(G, EXPR_ADD, X->num_rows, X->num_cols);
+	E->left = X;
+	E->right = Y;
+	return E;
+}
+
+/* 
+ * Function: expr_transpose
+ * ---------------------------- 
+ *   G: the graph to add to
+ *   X: the expression to transpose
+ * 
+ *   returns: the expression X^T
+ */
+struct Matrix_Expr *expr_transpose(struct Expr_Graph *G, struct Matrix_Expr *X) {
+	struct Matrix_Expr *E = new_expr_node(G, EXPR_TRANSPOSE, X->num_cols, X->num_rows);
+	E->left = X;
+	return E;
+}
+
+/* 
+ * Function: expr_scale
+ * ---------------------------- 
+ *   G: the graph to add to
+ *   X: the expression to scale
+ *   scale: the factor to scale by
+ * 
+ *   returns: the expression scale * X
+ */
+struct Matrix_Expr *expr_scale(struct Expr_Graph *G, struct Matrix_Expr *X,
+	int scale) {
+	struct Matrix_Expr *E = new_expr_node(G, EXPR_SCALE, X->num_rows, X->num_cols);
+	E->left = X;
+	E->scale = scale;
+	return E;
+}
+
+/* 
+ * Function: acquire_buffer
+ * ---------------------------- 
+ *   Finds a free buffer of the graph big enough for a num_rows x num_cols
+ *   intermediate result, or allocates a new one.
+ * 
+ *   G: the graph
+ *   num_rows: the number of rows needed
+ *   num_cols: the number of columns needed
+ * 
+ *   returns: the buffer, with its rows set up for the size asked for
+ */
+static struct Dense_Buffer *acquire_buffer(struct Expr_Graph *G, int num_rows,
+	int num_cols) {
+	size_t size = (size_t) num_rows * num_cols;
+	struct Dense_Buffer *B = G->buffers;
+
+	while (B != NULL && (B->in_use || B->capacity < size || \
+		B->rows_capacity < num_rows))
+		B = B->next;
+
+	if (B == NULL) {
+		B = (struct Dense_Buffer *) Malloc(sizeof(struct Dense_Buffer));
+		B->data = (int *) Malloc((size + 1) * sizeof(int));
+		B->rows = (int **) Malloc(((size_t) num_rows + 1) * sizeof(int *));
+		B->capacity = size;
+		B->rows_capacity = num_rows;
+		B->next = G->buffers;
+		G->buffers = B;
+	}
+
+	for (int i = 0; i < num_rows; i++) B->rows[i] = B->data + (size_t) i * num_cols;
+	B->in_use = 1;
+	return B;
+}
+
+/* 
+ * Function: add_expr_factor
+ * ---------------------------- 
+ *   Appends the factors of an expression to a chain, flattening nested
+ *   products and pulling transposes and scales out of them.
+ * 
+ *   E: the expression
+ *   transposed: whether E is transposed
+ *   term: the chain to append to
+ */
+static void add_expr_factor(struct Matrix_Expr *E, int transposed,
+	struct Expr_Term *term) {
+	switch (E->op) {
+	case EXPR_MULTIPLY:
+		/* (X * Y)^T = Y^T * X^T */
+		add_expr_factor(transposed ? E->right : E->left, transposed, term);
+		add_expr_factor(transposed ? E->left : E->right, transposed, term);
+		return;
+	case EXPR_TRANSPOSE:
+		add_expr_factor(E->left, !transposed, term);
+		return;
+	case EXPR_SCALE:
+		term->scale *= E->scale;
+		add_expr_factor(E->left, transposed, term);
+		return;
+	case EXPR_MATRIX:
+	case EXPR_ADD:
+		break;
+	}
+
+	if (term->num_factors == term->capacity) {
+		term->capacity = term->capacity ? 2 * term->capacity : 4;
+		struct Expr_Factor *factors = (struct Expr_Factor *) Malloc(term->capacity * \
+			sizeof(struct Expr_Factor));
+		if (term->num_factors > 0)
+			memcpy(factors, term->factors, term->num_factors * sizeof(struct Expr_Factor));
+		free(term->factors);
+		term->factors = factors;
+	}
+
+	struct Expr_Factor factor = {E, transposed, NULL};
+	term->factors[term->num_factors++] = factor;
+}
+
+/* 
+ * Function: add_expr_terms
+ * ---------------------------- 
+ *   Rewrites an expression as a sum of scaled chains, appending them to a
+ *   list.
+ * 
+ *   E: the expression
+ *   transposed: whether E is transposed
+ *   scale: the factor E is scaled by
+ *   list: the list to append to
+ */
+static void add_expr_terms(struct Matrix_Expr *E, int transposed, int scale,
+	struct Term_List *list) {
+	switch (E->op) {
+	case EXPR_ADD:
+		add_expr_terms(E->left, transposed, scale, list);
+		add_expr_terms(E->right, transposed, scale, list);
+		return;
+	case EXPR_TRANSPOSE:
+		add_expr_terms(E->left, !transposed, scale, list);
+		return;
+	case EXPR_SCALE:
+		add_expr_terms(E->left, transposed, scale * E->scale, list);
+		return;
+	case EXPR_MATRIX:
+	case EXPR_MULTIPLY:
+		break;
+	}
+
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? 2 * list->capacity : 4;
+		struct Expr_Term *terms = (struct Expr_Term *) Malloc(list->capacity * \
+			sizeof(struct Expr_Term));
+		if (list->count > 0)
+			memcpy(terms, list->terms, list->count * sizeof(struct Expr_Term));
+		free(list->terms);
+		list->terms = terms;
+	}
+
+	struct Expr_Term *term = &list->terms[list->count++];
+	term->scale = scale;
+	term->num_factors = 0;
+	term->capacity = 0;
+	term->factors = NULL;
+	add_expr_factor(E, transposed, term);
+}
+
+/* 
+ * Function: factor_operand
+ * ---------------------------- 
+ *   factor: a factor of a chain, evaluated if it is a sum
+ * 
+ *   returns: the factor as an operand of the kernels
+ */
+static struct Dense_Operand factor_operand(const struct Expr_Factor *factor) {
+	struct Dense_Operand op = {factor->buffer != NULL ? factor->buffer->rows : \
+		factor->node->data, factor->transposed};
+	return op;
+}
+
+/* 
+ * Function: multiply_sub_chain
+ * ---------------------------- 
+ *   Multiplies factors i to j of a chain in the order found by
+ *   matrix_chain_order, in to a buffer of the graph.
+ * 
+ *   G: the graph
+ *   term: the chain
+ *   dims, split: as in matrix_chain_order
+ *   i: the first factor
+ *   j: the last factor
+ *   buffer: set to the buffer holding the result, or NULL if i == j and
+ *     the result is the factor itself
+ * 
+ *   returns: the result as an operand of the kernels
+ */
+static struct Dense_Operand multiply_sub_chain(struct Expr_Graph *G,
+	struct Expr_Term *term, const int *dims, const int *split, int i, int j,
+	struct Dense_Buffer **buffer) {
+	if (i == j) {
+		*buffer = NULL;
+		return factor_operand(&term->factors[i]);
+	}
+
+	int s = split[i * term->num_factors + j];
+	struct Dense_Buffer *left_buffer, *right_buffer;
+	struct Dense_Operand left = multiply_sub_chain(G, term, dims, split, i, s,
+		&left_buffer);
+	struct Dense_Operand right = multiply_sub_chain(G, term, dims, split, s + 1, j,
+		&right_buffer);
+
+	*buffer = acquire_buffer(G, dims[i], dims[j + 1]);
+	blocked_matrix_multiply(&left, &right, dims[i], dims[s + 1], dims[j + 1], 1,
+		NULL, 0, 0, NULL, (*buffer)->rows);
+	G->multiplications += (double) dims[i] * dims[s + 1] * dims[j + 1];
+
+	if (left_buffer != NULL) left_buffer->in_use = 0;
+	if (right_buffer != NULL) right_buffer->in_use = 0;
+
+	struct Dense_Operand result = {(*buffer)->rows, 0};
+	return result;
+}
+
+/* 
+ * Function: evaluate_expr_into
+ * ---------------------------- 
+ *   Computes the value of an expression in to a 2D array.
+ * 
+ *   G: the graph
+ *   E: the expression
+ *   Z: the 2D array of the size of E to compute in to
+ */
+static void evaluate_expr_into(struct Expr_Graph *G, struct Matrix_Expr *E, int **Z) {
+	struct Term_List list = {NULL, 0, 0};
+	add_expr_terms(E, 0, 1, &list);
+
+	/* Sums inside chains are computed first, in to buffers */
+	for (int t = 0; t < list.count; t++) {
+		for (int f = 0; f < list.terms[t].num_factors; f++) {
+			struct Expr_Factor *factor = &list.terms[t].factors[f];
+			if (factor->node->op != EXPR_ADD) continue;
+
+			factor->buffer = acquire_buffer(G, factor->node->num_rows,
+				factor->node->num_cols);
+			evaluate_expr_into(G, factor->node, factor->buffer->rows);
+		}
+	}
+
+	/* The terms without a product are added in the epilogue of the first
+	*  product */
+	struct Dense_Addend *addends = (struct Dense_Addend *) Malloc((list.count + 1) * \
+		sizeof(struct Dense_Addend));
+	int num_addends = 0;
+	for (int t = 0; t < list.count; t++) {
+		if (list.terms[t].num_factors != 1) continue;
+		addends[num_addends].scale = list.terms[t].scale;
+		addends[num_addends].op = factor_operand(&list.terms[t].factors[0]);
+		num_addends++;
+	}
+
+	int num_products = 0;
+	for (int t = 0; t < list.count; t++) {
+		struct Expr_Term *term = &list.terms[t];
+		int num = term->num_factors;
+		if (num == 1) continue;
+
+		int *dims = (int *) Malloc((num + 1) * sizeof(int));
+		double *cost = (double *) Malloc((size_t) num * num * sizeof(double));
+		int *split = (int *) Malloc((size_t) num * num * sizeof(int));
+
+		for (int f = 0; f < num; f++) {
+			struct Matrix_Expr *node = term->factors[f].node;
+			dims[f] = term->factors[f].transposed ? node->num_cols : node->num_rows;
+			dims[f + 1] = term->factors[f].transposed ? node->num_rows : node->num_cols;
+		}
+		matrix_chain_order(dims, num, cost, split);
+
+		/* The last product of the chain goes straight in to Z */
+		int s = split[num - 1];
+		struct Dense_Buffer *left_buffer, *right_buffer;
+		struct Dense_Operand left = multiply_sub_chain(G, term, dims, split, 0, s,
+			&left_buffer);
+		struct Dense_Operand right = multiply_sub_chain(G, term, dims, split, s + 1,
+			num - 1, &right_buffer);
+
+		int first = num_products++ == 0;
+		blocked_matrix_multiply(&left, &right, dims[0], dims[s + 1], dims[num],
+			term->scale, first ? addends : NULL, first ? num_addends : 0, !first, NULL,
+			Z);
+		G->multiplications += (double) dims[0] * dims[s + 1] * dims[num];
+
+		if (left_buffer != NULL) left_buffer->in_use = 0;
+		if (right_buffer != NULL) right_buffer->in_use = 0;
+		free(dims);
+		free(cost);
+		free(split);
+	}
+
+	if (num_products == 0)
+		combine_addends(addends, num_addends, E->num_rows, E->num_cols, Z);
+
+	for (int t = 0; t < list.count; t++) {
+		for (int f = 0; f < list.terms[t].num_factors; f++)
+			if (list.terms[t].factors[f].buffer != NULL)
+				list.terms[t].factors[f].buffer->in_use = 0;
+		free(list.terms[t].factors);
+	}
+	free(list.terms);
+	free(addends);
+}
+
+/* 
+ * Function: evaluate_expr
+ * ---------------------------- 
+ *   Computes the value of an expression, see init_expr_graph. The graph can
+ *   be evaluated again after the arrays it reads have changed.
+ * 
+ *   G: the graph
+ *   E: the expression to evaluate
+ * 
+ *   returns: the value of E as a 2D array
+ */
+int** evaluate_expr(struct Expr_Graph *G, struct Matrix_Expr *E) {
+	int **Z = init_2d_array(E->num_rows, E->num_cols);
+	evaluate_expr_into(G, E, Z);
+	return Z;
+}
+
+/* 
+ * Function: free_expr_graph
+ * ---------------------------- 
+ *   Frees an expression graph, all of its nodes and its buffers. The arrays
+ *   of its leaves are not freed.
+ * 
+ *   G: the graph to free
+ */
+void free_expr_graph(struct Expr_Graph *G) {
+	while (G->nodes != NULL) {
+		struct Matrix_Expr *next = G->nodes->next;
+		free(G->nodes);
+		G->nodes = next;
+	}
+
+	while (G->buffers != NULL) {
+		struct Dense_Buffer *next = G->buffers->next;
+		free(G->buffers->data);
+		free(G->buffers->rows);
+		free(G->buffers);
+		G->buffers = next;
+	}
+
+	free(G);
+}
+
+/* 
+ * Function: matrix_chain_multiply
+ * ---------------------------- 
+ *   Computes the product of a chain of matrices, in the order that takes the
+ *   fewest multiplications (see matrix_chain_order).
+ * 
+ *   matrices: the 2D arrays to multiply, in order
+ *   dims: the num + 1 sizes of the chain; matrices[i] is dims[i] x dims[i + 1]
+ *   num: the number of matrices, at least 1
+ *   report: if not NULL, filled with the estimated and actual cost
+ * 
+ *   returns: the product as a 2D array
+ */
+int** matrix_chain_multiply(int ***matrices, const int *dims, int num,
+	struct Chain_Report *report) {
+	if (num < 1) {
+		fprintf(stderr, "A chain must have at least one matrix.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct timespec start, end;
+	timespec_get(&start, TIME_UTC);
+
+	struct Expr_Graph *G = init_expr_graph();
+	struct Matrix_Expr *E = expr_matrix(G, matrices[0], dims[0], dims[1]);
+	for (int i = 1; i < num; i++)
+		E = expr_multiply(G, E, expr_matrix(G, matrices[i], dims[i], dims[i + 1]));
+
+	int **Z = evaluate_expr(G, E);
+	timespec_get(&end, TIME_UTC);
+
+	if (report != NULL) {
+		double *cost = (double *) Malloc((size_t) num * num * sizeof(double));
+		int *split = (int *) Malloc((size_t) num * num * sizeof(int));
+		matrix_chain_order(dims, num, cost, split);
+
+		report->estimated_cost = cost[num - 1];
+		report->left_to_right_cost = 0;
+		for (int i = 1; i < num; i++)
+			report->left_to_right_cost += (double) dims[0] * dims[i] * dims[i + 1];
+		report->actual_cost = G->multiplications;
+		report->seconds = (end.tv_sec - start.tv_sec) + \
+			(end.tv_nsec - start.tv_nsec) * 1e-9;
+
+		free(cost);
+		free(split);
+	}
+
+	free_expr_graph(G);
+	return Z;
+}
+
+/* 
+ * Function: matrix_multiply_epilogue
+ * ---------------------------- 
+ *   Computes X * Y with the blocked kernel and applies an epilogue (biases,
+ *   activation, requantization and clamping) to each value as it is stored,
+ *   rather than in another pass over the product.
+ * 
+ *   X: 2D matrix to left-multiply
+ *   Y: 2D matrix to right-multiply
+ *   x_rows: the number of rows in X
+ *   x_cols: the number of columns in X
+ *   y_rows: the number of rows in Y
+ *   y_cols: the number of columns in Y
+ *   epilogue: what to apply to each value, see struct Dense_Epilogue
+ * 
+ *   returns: the result as a 2D array
+ */
+int** matrix_multiply_epilogue(int** X, int** Y, int x_rows, int x_cols, int y_rows,
+	int y_cols, const struct Dense_Epilogue *epilogue) {
+	// Check whether X and Y are compatible
+	if (x_cols != y_rows) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (epilogue->multiplier != 0 && (epilogue->shift < 0 || epilogue->shift > 62)) {
+		fprintf(stderr, "The requantization shift must be from 0 to 62.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int **Z = init_2d_array(x_rows, y_cols);
+	struct Dense_Operand left = {X, 0}, right = {Y, 0};
+	blocked_matrix_multiply(&left, &right, x_rows, x_cols, y_cols, 1, NULL, 0, 0,
+		epilogue, Z);
+
+	return Z;
+}
+
+/* The shapes (m, k, n) autotune_matrix_multiply times: square, tall and
+*  thin, and a long inner dimension */
+static const int gemm_tuning_shapes[][3] = {
+	{512, 512, 512},
+	{1536, 128, 512},
+	{256, 1536, 256}
+};
+#define GEMM_TUNING_SHAPES ((int) (sizeof(gemm_tuning_shapes) / sizeof(gemm_tuning_shapes[0])))
+
+/* A candidate must beat the best so far by this much, so that noise in the
+*  timings does not pick it */
+#ifndef GEMM_TUNING_MARGIN
+#define GEMM_TUNING_MARGIN 0.98
+#endif
+
+/* Each shape is run until this many seconds have passed (and at least three
+*  times), keeping the fastest run, so that one run's jitter is not the time */
+#ifndef GEMM_TUNING_SECONDS
+#define GEMM_TUNING_SECONDS 0.05
+#endif
+
+/* The number of times a candidate and the best so far are timed in turn
+*  before they are compared, so that drift in the clock or the load of the
+*  machine affects both alike */
+#ifndef GEMM_TUNING_ROUNDS
+#define GEMM_TUNING_ROUNDS 2
+#endif
+
+static double tuning_seconds() {
+	struct timespec t;
+	timespec_get(&t, TIME_UTC);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* 
+ * Function: time_gemm_tuning
+ * ---------------------------- 
+ *   Times the blocked kernel with some parameters on each of the tuning
+ *   shapes, the fastest of the runs in GEMM_TUNING_SECONDS each.
+ * 
+ *   T: the parameters
+ *   operands: X, Y and Z for each shape
+ *   seconds: the time of each shape, 0 if not yet timed, lowered to any
+ *   faster time found
+ */
+static void time_gemm_tuning(const struct Gemm_Tuning *T, int ***operands,
+	double *seconds) {
+	set_gemm_tuning(T);
+
+	for (int s = 0; s < GEMM_TUNING_SHAPES; s++) {
+		const int *shape = gemm_tuning_shapes[s];
+		struct Dense_Operand X = {operands[3 * s], 0}, Y = {operands[3 * s + 1], 0};
+		double first = tuning_seconds();
+
+		for (int run = 0; run < 3 || tuning_seconds() - first < GEMM_TUNING_SECONDS; run++) {
+			double start = tuning_seconds();
+			blocked_matrix_multiply(&X, &Y, shape[0], shape[1], shape[2], 1, NULL, 0, 0,
+				NULL, operands[3 * s + 2]);
+			double t = tuning_seconds() - start;
+			if (seconds[s] == 0 || t < seconds[s]) seconds[s] = t;
+		}
+	}
+}
+
+/* 
+ * Function: compare_gemm_tuning
+ * ---------------------------- 
+ *   Times a candidate set of parameters and the best so far in turn,
+ *   GEMM_TUNING_ROUNDS times each, after one untimed run of the candidate.
+ * 
+ *   T: the candidate
+ *   best: the best parameters so far
+ *   operands: X, Y and Z for each shape
+ * 
+ *   returns: the mean over the tuning shapes of the candidate's time
+ *   relative to that of the best
+ */
+static double compare_gemm_tuning(const struct Gemm_Tuning *T,
+	const struct Gemm_Tuning *best, int ***operands) {
+	double seconds[GEMM_TUNING_SHAPES] = {0}, best_seconds[GEMM_TUNING_SHAPES] = {0};
+
+	/* Warms up the candidate's threads and packed buffers */
+	double warm_up[GEMM_TUNING_SHAPES] = {0};
+	time_gemm_tuning(T, operands, warm_up);
+
+	for (int round = 0; round < GEMM_TUNING_ROUNDS; round++) {
+		time_gemm_tuning(T, operands, seconds);
+		time_gemm_tuning(best, operands, best_seconds);
+	}
+
+	double score = 0;
+	for (int s = 0; s < GEMM_TUNING_SHAPES; s++) score += seconds[s] / best_seconds[s];
+	return score / GEMM_TUNING_SHAPES;
+}
+
+/* 
+ * Function: autotune_matrix_multiply
+ * ---------------------------- 
+ *   Finds the parameters of the blocked kernel that run fastest on this
+ *   machine: the kernel, the rows of the micro-kernel, mc, kc, nc and the
+ *   number of threads, one at a time, keeping the others at the best found
+ *   so far, until a pass over all of them changes nothing (at most 3). Each
+ *   candidate is timed in turn with the best so far, see compare_gemm_tuning,
+ *   and must beat it by GEMM_TUNING_MARGIN twice in a row. Takes a minute or
+ *   so.
+ * 
+ *   The parameters found are used by the products from then on, and saved
+ *   for this CPU model so that later runs load them, see load_gemm_tuning.
+ * 
+ *   path: the tuning file to save to, or NULL to not save them
+ *   verbose: whether to print each improvement
+ * 
+ *   returns: the parameters found
+ */
+struct Gemm_Tuning autotune_matrix_multiply(const char *path, int verbose) {
+	int ***operands = (int ***) Malloc(3 * GEMM_TUNING_SHAPES * sizeof(int **));
+	for (int s = 0; s < GEMM_TUNING_SHAPES; s++) {
+		const int *shape = gemm_tuning_shapes[s];
+		int dims[3][2] = {{shape[0], shape[1]}, {shape[1], shape[2]}, {shape[0], shape[2]}};
+
+		for (int o = 0; o < 3; o++) {
+			int **R = init_2d_array(dims[o][0], dims[o][1]);
+			for (int i = 0; i < dims[o][0]; i++)
+				for (int j = 0; j < dims[o][1]; j++) R[i][j] = (i * 31 + j * 17) % 21 - 10;
+			operands[3 * s + o] = R;
+		}
+	}
+
+	/* The candidates for each parameter; mc is in multiples of mr */
+	int max_threads = omp_get_max_threads();
+	int kernels[] = {GEMM_KERNEL_GENERIC, GEMM_KERNEL_AVX2};
+	int num_kernels = 1;
+#ifdef GEMM_AVX2
+	if (__builtin_cpu_supports("avx2")) num_kernels = 2;
+#endif
+	int mrs[] = {4, GEMM_MR, GEMM_MAX_MR};
+	int mc_panels[] = {4, 8, 12, 16, 24};
+	int kcs[] = {64, 128, 256, 384, 512, 1024};
+	int ncs[] = {128, 256, 512, 1024, 2048};
+	int threads[8], num_thread_counts = 0;
+	for (int t = max_threads; t >= 1 && num_thread_counts < 8; t /= 2)
+		threads[num_thread_counts++] = t == max_threads ? 0 : t;
+
+	struct Gemm_Tuning best = gemm_tuning;
+	best.kernel = num_kernels == 2 ? GEMM_KERNEL_AVX2 : GEMM_KERNEL_GENERIC;
+	double total = 1;
+
+	for (int pass = 0, changed = 1; changed && pass < 3; pass++) {
+		changed = 0;
+
+		for (int param = 0; param < 6; param++) {
+			int num_values[] = {num_kernels, 3, 5, 6, 5, num_thread_counts};
+
+			for (int v = 0; v < num_values[param]; v++) {
+				struct Gemm_Tuning T = best;
+				switch (param) {
+				case 0: T.kernel = (enum Gemm_Kernel) kernels[v]; break;
+				case 1:
+					T.mr = mrs[v];
+					T.mc = (T.mc + T.mr / 2) / T.mr * T.mr;
+					if (T.mc < T.mr) T.mc = T.mr;
+					break;
+				case 2: T.mc = mc_panels[v] * T.mr; break;
+				case 3: T.kc = kcs[v]; break;
+				case 4: T.nc = ncs[v]; break;
+				case 5: T.num_threads = threads[v]; break;
+				}
+				if (memcmp(&T, &best, sizeof(T)) == 0) continue;
+
+				double score = compare_gemm_tuning(&T, &best, operands);
+
+				/* A win is timed again, so that one slow stretch of the machine
+				*  while the best was timed does not pick the candidate */
+				if (score < GEMM_TUNING_MARGIN) {
+					double again = compare_gemm_tuning(&T, &best, operands);
+					if (again > score) score = again;
+				}
+
+				if (score < GEMM_TUNING_MARGIN) {
+					best = T;
+					total *= score;
+					changed = 1;
+					if (verbose)
+						printf("mc %d kc %d nc %d mr %d threads %d %s: %.3f of the first time\n",
+							T.mc, T.kc, T.nc, T.mr, T.num_threads, gemm_kernel_names[T.kernel],
+							total);
+				}
+			}
+		}
+	}
+
+	set_gemm_tuning(&best);
+	if (path != NULL) save_gemm_tuning(path, &best);
+
+	for (int s = 0; s < GEMM_TUNING_SHAPES; s++) {
+		const int *shape = gemm_tuning_shapes[s];
+		free_2d_array(operands[3 * s], shape[0], shape[1]);
+		free_2d_array(operands[3 * s + 1], shape[1], shape[2]);
+		free_2d_array(operands[3 * s + 2], shape[0], shape[2]);
+	}
+	free(operands);
+
+	return best;
+}
+
+/* 
+ * Function: pack_int8_matrix
+ * ---------------------------- 
+ *   Packs the right operand of quantized_matrix_multiply, see struct
+ *   Packed_Int8_Matrix.
+ * 
+ *   Y: the 2D array to pack
+ *   num_rows: the number of rows in Y
+ *   num_cols: the number of columns in Y
+ * 
+ *   returns: the packed matrix
+ */
+struct Packed_Int8_Matrix *pack_int8_matrix(int8_t **Y, int num_rows, int num_cols) {
+	struct Packed_Int8_Matrix *P = (struct Packed_Int8_Matrix *) Malloc( \
+		sizeof(struct Packed_Int8_Matrix));
+	int num_panels = (num_cols + QGEMM_NR - 1) / QGEMM_NR;
+	TRACE_BEGIN(pack, "quantized_matrix_multiply", "pack");
+
+	P->num_rows = num_rows;
+	P->num_cols = num_cols;
+	P->padded_rows = (num_rows + 3) / 4 * 4;
+	P->size = (size_t) num_panels * P->padded_rows * QGEMM_NR + 1;
+	P->num_nodes = numa_node_count();
+	P->data = (int8_t **) Malloc(P->num_nodes * sizeof(int8_t *));
+	for (int node = 0; node < P->num_nodes; node++)
+		P->data[node] = (int8_t *) malloc_on_node(P->size, node);
+	P->col_sums = (int *) Malloc(((size_t) num_cols + 1) * sizeof(int));
+
+	#pragma omp parallel for schedule(static)
+	for (int panel = 0; panel < num_panels; panel++) {
+		int8_t *dst = P->data[0] + (size_t) panel * P->padded_rows * QGEMM_NR;
+
+		for (int c = 0; c < QGEMM_NR; c++) {
+			int col = panel * QGEMM_NR + c, sum = 0;
+
+			for (int p = 0; p < P->padded_rows; p++) {
+				int8_t value = col < num_cols && p < num_rows ? Y[p][col] : 0;
+				dst[(p / 4) * 4 * QGEMM_NR + 4 * c + p % 4] = value;
+				sum += value;
+			}
+			if (col < num_cols) P->col_sums[col] = sum;
+		}
+	}
+
+	for (int node = 1; node < P->num_nodes; node++) memcpy(P->data[node], P->data[0], P->size);
+
+	TRACE_COUNT(pack, 0, (double) num_rows * num_cols + (double) P->num_nodes * P->size);
+	TRACE_END(pack);
+	return P;
+}
+
+void free_packed_int8_matrix(struct Packed_Int8_Matrix *P) {
+	for (int node = 0; node < P->num_nodes; node++) free_on_node(P->data[node], P->size);
+	free(P->data);
+	free(P->col_sums);
+	free(P);
+}
+
+/* 
+ * Function: pack_uint8_block
+ * ---------------------------- 
+ *   Copies an mb x kb block of X in to micro-panels of QGEMM_MR rows, which
+ *   store for every 4 columns the 4 values of each row next to each other.
+ *   Rows past mb and columns past kb (up to a multiple of 4) are padded with
+ *   zeros.
+ * 
+ *   X: the left operand
+ *   i0: the first row of the block
+ *   mb: the number of rows in the block
+ *   p0: the first column of the block
+ *   kb: the number of columns in the block
+ *   buf: the GEMM_MC x QGEMM_KC buffer to pack in to
+ *   row_sums: if not NULL, the sum of each row of the block is added to it
+ */
+static void pack_uint8_block(uint8_t **X, int i0, int mb, int p0, int kb,
+	uint8_t *buf, int *row_sums) {
+	int kb_padded = (kb + 3) / 4 * 4;
+
+	for (int ir = 0; ir < mb; ir += QGEMM_MR) {
+		uint8_t *panel = buf + (size_t) ir * kb_padded;
+
+		for (int r = 0; r < QGEMM_MR; r++) {
+			const uint8_t *x_row = ir + r < mb ? X[i0 + ir + r] + p0 : NULL;
+			int sum = 0;
+
+			for (int p = 0; p < kb_padded; p++) {
+				uint8_t value = x_row != NULL && p < kb ? x_row[p] : 0;
+				panel[(p / 4) * 4 * QGEMM_MR + 4 * r + p % 4] = value;
+				sum += value;
+			}
+			if (row_sums != NULL && x_row != NULL) row_sums[ir + r] += sum;
+		}
+	}
+}
+
+/* 
+ * The quantized micro-kernels: each adds the product of a packed
+ * QGEMM_MR x (4 * k4) micro-panel of X and a packed (4 * k4) x QGEMM_NR
+ * micro-panel of Y to a QGEMM_MR x QGEMM_NR block of c, whose rows are ldc
+ * apart.
+ */
+typedef void (*Quantized_Kernel)(int k4, const uint8_t *a, const int8_t *b, int *c,
+	int ldc);
+
+static void quantized_kernel_generic(int k4, const uint8_t *a, const int8_t *b,
+	int *c, int ldc) {
+	int acc[QGEMM_MR][QGEMM_NR] = {{0}};
+
+	for (int p = 0; p < k4; p++)
+		for (int r = 0; r < QGEMM_MR; r++)
+			for (int col = 0; col < QGEMM_NR; col++)
+				for (int q = 0; q < 4; q++)
+					acc[r][col] += a[p * 4 * QGEMM_MR + 4 * r + q] * \
+						b[p * 4 * QGEMM_NR + 4 * col + q];
+
+	for (int r = 0; r < QGEMM_MR; r++)
+		for (int col = 0; col < QGEMM_NR; col++) c[r * ldc + col] += acc[r][col];
+}
+
+#ifdef GEMM_AVX2
+/* Reads the 4 values of row r of a micro-panel of X at step p, as one int32
+*  to broadcast */
+static inline int32_t packed_x_at(const uint8_t *a, int p, int r) {
+	int32_t x;
+	memcpy(&x, a + p * 4 * QGEMM_MR + 4 * r, sizeof(x));
+	return x;
+}
+
+/* Without VNNI, vpmaddubsw saturates the sum of two u8 x s8 products to 16
+*  bits. Splitting the u8 values in to their low 7 bits and their top bit
+*  keeps both sums in range, so the result is exact */
+__attribute__((target("avx2")))
+static void quantized_kernel_avx2(int k4, const uint8_t *a, const int8_t *b,
+	int *c, int ldc) {
+	const __m256i low_bits = _mm256_set1_epi8(0x7F), top_bit = _mm256_set1_epi8(-128);
+	const __m256i ones = _mm256_set1_epi16(1);
+
+	/* Half the rows at a time, so the accumulators fit in registers */
+	for (int r0 = 0; r0 < QGEMM_MR; r0 += 4) {
+		__m256i acc[4][2];
+		for (int r = 0; r < 4; r++) acc[r][0] = acc[r][1] = _mm256_setzero_si256();
+
+		for (int p = 0; p < k4; p++) {
+			__m256i b0 = _mm256_loadu_si256((const __m256i *) (b + p * 4 * QGEMM_NR));
+			__m256i b1 = _mm256_loadu_si256((const __m256i *) (b + p * 4 * QGEMM_NR + 32));
+
+			for (int r = 0; r < 4; r++) {
+				__m256i x = _mm256_set1_epi32(packed_x_at(a, p, r0 + r));
+				__m256i x_low = _mm256_and_si256(x, low_bits);
+				__m256i x_top = _mm256_and_si256(x, top_bit);
+
+				acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_add_epi32( \
+					_mm256_madd_epi16(_mm256_maddubs_epi16(x_low, b0), ones), \
+					_mm256_madd_epi16(_mm256_maddubs_epi16(x_top, b0), ones)));
+				acc[r][1] = _mm256_add_epi32(acc[r][1], _mm256_add_epi32( \
+					_mm256_madd_epi16(_mm256_maddubs_epi16(x_low, b1), ones), \
+					_mm256_madd_epi16(_mm256_maddubs_epi16(x_top, b1), ones)));
+			}
+		}
+
+		for (int r = 0; r < 4; r++) {
+			__m256i *c_row = (__m256i *) (c + (r0 + r) * ldc);
+			_mm256_storeu_si256(c_row, _mm256_add_epi32(_mm256_loadu_si256(c_row),
+				acc[r][0]));
+			_mm256_storeu_si256(c_row + 1, _mm256_add_epi32(_mm256_loadu_si256(c_row + 1),
+				acc[r][1]));
+		}
+	}
+}
+
+__attribute__((target("avx2,avxvnni")))
+static void quantized_kernel_avxvnni(int k4, const uint8_t *a, const int8_t *b,
+	int *c, int ldc) {
+	for (int r0 = 0; r0 < QGEMM_MR; r0 += 4) {
+		__m256i acc[4][2];
+		for (int r = 0; r < 4; r++) acc[r][0] = acc[r][1] = _mm256_setzero_si256();
+
+		for (int p = 0; p < k4; p++) {
+			__m256i b0 = _mm256_loadu_si256((const __m256i *) (b + p * 4 * QGEMM_NR));
+			__m256i b1 = _mm256_loadu_si256((const __m256i *) (b + p * 4 * QGEMM_NR + 32));
+
+			for (int r = 0; r < 4; r++) {
+				__m256i x = _mm256_set1_epi32(packed_x_at(a, p, r0 + r));
+				acc[r][0] = _mm256_dpbusd_avx_epi32(acc[r][0], x, b0);
+				acc[r][1] = _mm256_dpbusd_avx_epi32(acc[r][1], x, b1);
+			}
+		}
+
+		for (int r = 0; r < 4; r++) {
+			__m256i *c_row = (__m256i *) (c + (r0 + r) * ldc);
+			_mm256_storeu_si256(c_row, _mm256_add_epi32(_mm256_loadu_si256(c_row),
+				acc[r][0]));
+			_mm256_storeu_si256(c_row + 1, _mm256_add_epi32(_mm256_loadu_si256(c_row + 1),
+				acc[r][1]));
+		}
+	}
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void quantized_kernel_avx512vnni(int k4, const uint8_t *a, const int8_t *b,
+	int *c, int ldc) {
+	__m512i acc[QGEMM_MR];
+	for (int r = 0; r < QGEMM_MR; r++) acc[r] = _mm512_setzero_si512();
+
+	for (int p = 0; p < k4; p++) {
+		__m512i y = _mm512_loadu_si512(b + p * 4 * QGEMM_NR);
+		for (int r = 0; r < QGEMM_MR; r++)
+			acc[r] = _mm512_dpbusd_epi32(acc[r], _mm512_set1_epi32(packed_x_at(a, p, r)),
+				y);
+	}
+
+	for (int r = 0; r < QGEMM_MR; r++)
+		_mm512_storeu_si512(c + r * ldc, _mm512_add_epi32(_mm512_loadu_si512(c + r * ldc),
+			acc[r]));
+}
+#endif
+
+/* Picks the fastest quantized micro-kernel the CPU runs */
+static Quantized_Kernel choose_quantized_kernel() {
+#ifdef GEMM_AVX2
+	if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw"))
+		return quantized_kernel_avx512vnni;
+	if (__builtin_cpu_supports("avxvnni")) return quantized_kernel_avxvnni;
+	if (__builtin_cpu_supports("avx2")) return quantized_kernel_avx2;
+#endif
+	return quantized_kernel_generic;
+}
+
+/* 
+ * Function: quantized_matrix_multiply
+ * ---------------------------- 
+ *   Computes the product of a uint8 matrix X and an int8 matrix Y, both
+ *   quantized with a zero point, with int32 accumulation:
+ *     Z[i][j] = sum over p of (X[i][p] - x_zero_point) * (Y[p][j] - y_zero_point)
+ *   The zero points are not subtracted from the operands; instead the row
+ *   sums of X and the column sums of Y correct the product as it is stored.
+ *   The micro-kernel is picked at run time: AVX-512 VNNI, AVX-VNNI (both
+ *   vpdpbusd), AVX2 (vpmaddubsw) or portable C. The epilogue can requantize
+ *   the result, e.g. back to uint8 or int8.
+ * 
+ *   The int32 sums overflow only if x_cols is more than about 2^16.
+ * 
+ *   X: the 2D uint8 array to left-multiply
+ *   x_rows: the number of rows in X
+ *   x_cols: the number of columns in X
+ *   x_zero_point: the value of X that stands for 0
+ *   Y: the int8 matrix to right-multiply, from pack_int8_matrix
+ *   y_zero_point: the value of Y that stands for 0
+ *   epilogue: applied to each value of the product, or NULL
+ * 
+ *   returns: the result as a 2D array
+ */
+int** quantized_matrix_multiply(uint8_t **X, int x_rows, int x_cols,
+	uint8_t x_zero_point, const struct Packed_Int8_Matrix *Y, int8_t y_zero_point,
+	const struct Dense_Epilogue *epilogue) {
+	// Check whether X and Y are compatible
+	if (x_cols != Y->num_rows) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int m = x_rows, k = x_cols, n = Y->num_cols;
+	int **Z = init_2d_array(m, n);
+	int m_blocks = (m + GEMM_MC - 1) / GEMM_MC;
+	int n_blocks = (n + GEMM_NC - 1) / GEMM_NC;
+	int zero_point_product = k * x_zero_point * y_zero_point;
+	Quantized_Kernel kernel = choose_quantized_kernel();
+
+	struct Task_Queues queues;
+	init_task_queues(&queues, m_blocks, n_blocks);
+
+	#pragma omp parallel
+	{
+		uint8_t *x_pack = (uint8_t *) Malloc(GEMM_MC * QGEMM_KC);
+		int *tile = (int *) Malloc(GEMM_MC * GEMM_NC * sizeof(int));
+		int row_sums[GEMM_MC];
+		int thread = omp_get_thread_num();
+		start_task_queue(&queues);
+		const int8_t *y_data = Y->data[queues.node[thread] < Y->num_nodes ? \
+			queues.node[thread] : 0];
+		TRACE_BEGIN(compute, "quantized_matrix_multiply", "compute");
+
+		for (int task = next_task(&queues, thread); task >= 0;
+			task = next_task(&queues, thread)) {
+			int i0 = (task % m_blocks) * GEMM_MC, j0 = (task / m_blocks) * GEMM_NC;
+			int mb = m - i0 < GEMM_MC ? m - i0 : GEMM_MC;
+			int nb = n - j0 < GEMM_NC ? n - j0 : GEMM_NC;
+			int ld = (nb + QGEMM_NR - 1) / QGEMM_NR * QGEMM_NR;
+			int mb_padded = (mb + QGEMM_MR - 1) / QGEMM_MR * QGEMM_MR;
+			TRACE_COUNT(compute, 2.0 * mb * nb * k, (double) mb * k + (double) k * nb + \
+				(double) mb * nb * sizeof(int));
+
+			memset(tile, 0, (size_t) mb_padded * ld * sizeof(int));
+			memset(row_sums, 0, sizeof(row_sums));
+
+			for (int p0 = 0; p0 < k; p0 += QGEMM_KC) {
+				int kb = k - p0 < QGEMM_KC ? k - p0 : QGEMM_KC;
+				int k4 = (kb + 3) / 4;
+				pack_uint8_block(X, i0, mb, p0, kb, x_pack,
+					y_zero_point != 0 ? row_sums : NULL);
+
+				for (int jr = 0; jr < nb; jr += QGEMM_NR) {
+					const int8_t *y_panel = y_data + ((size_t) (j0 + jr) / QGEMM_NR * \
+						Y->padded_rows + p0) * QGEMM_NR;
+					for (int ir = 0; ir < mb; ir += QGEMM_MR)
+						kernel(k4, x_pack + (size_t) ir * k4 * 4, y_panel,
+							tile + (size_t) ir * ld + jr, ld);
+				}
+			}
+
+			/* Epilogue */
+			for (int i = 0; i < mb; i++) {
+				int *z_row = Z[i0 + i] + j0;
+				const int *t_row = tile + (size_t) i * ld;
+				int row_term = zero_point_product - y_zero_point * row_sums[i];
+
+				for (int j = 0; j < nb; j++)
+					z_row[j] = t_row[j] + row_term - x_zero_point * Y->col_sums[j0 + j];
+				if (epilogue != NULL) apply_epilogue(z_row, i0 + i, j0, nb, epilogue);
+			}
+		}
+
+		TRACE_END(compute);
+		free(x_pack);
+		free(tile);
+	}
+
+	free_task_queues(&queues);
+	return Z;
+}
+
+/* 
+ * Function: half_to_float
+ * ---------------------------- 
+ *   Widens a 16-bit float to a float, exactly.
+ * 
+ *   h: the bits of the 16-bit float
+ *   format: its format
+ * 
+ *   returns: the float
+ */
+float half_to_float(uint16_t h, enum Half_Format format) {
+	uint32_t bits;
+	float f;
+
+	if (format == HALF_BF16) bits = (uint32_t) h << 16;
+	else {
+		uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+		int exponent = (h >> 10) & 0x1F;
+		uint32_t mantissa = h & 0x3FF;
+
+		if (exponent == 0x1F) bits = sign | 0x7F800000 | mantissa << 13;
+		else if (exponent != 0) bits = sign | (uint32_t) (exponent + 112) << 23 | mantissa << 13;
+		else if (mantissa == 0) bits = sign;
+		else {
+			/* Subnormal: normalize the mantissa */
+			exponent = 113;
+			while (!(mantissa & 0x400)) {
+				mantissa <<= 1;
+				exponent--;
+			}
+			bits = sign | (uint32_t) exponent << 23 | (mantissa & 0x3FF) << 13;
+		}
+	}
+
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+/* 
+ * Function: float_to_half
+ * ---------------------------- 
+ *   Narrows a float to a 16-bit float, rounding to the nearest (ties to
+ *   even). Values too large for fp16 become infinities.
+ * 
+ *   f: the float
+ *   format: the format to narrow to
+ * 
+ *   returns: the bits of the 16-bit float
+ */
+uint16_t float_to_half(float f, enum Half_Format format) {
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+
+	if (format == HALF_BF16) {
+		if ((bits & 0x7FFFFFFF) > 0x7F800000) return (uint16_t) (bits >> 16 | 0x40);
+		return (uint16_t) ((bits + 0x7FFF + (bits >> 16 & 1)) >> 16);
+	}
+
+	uint16_t sign = (uint16_t) (bits >> 16 & 0x8000);
+	uint32_t magnitude = bits & 0x7FFFFFFF;
+
+	if (magnitude > 0x7F800000) return sign | 0x7E00;
+	if (magnitude >= 0x477FF000) return sign | 0x7C00;  /* Rounds past 65504 */
+
+	if (magnitude < 0x38800000) {
+		/* Subnormal (or zero): round the mantissa, with its implicit bit, at
+		*  the position of the smallest subnormal */
+		int shift = 126 - (int) (magnitude >> 23);
+		if (shift > 24) return sign;
+		uint32_t mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+		uint32_t half = mantissa >> shift, rest = mantissa & ((1u << shift) - 1);
+		uint32_t midpoint = 1u << (shift - 1);
+		if (rest > midpoint || (rest == midpoint && (half & 1))) half++;
+		return sign | (uint16_t) half;
+	}
+
+	magnitude -= 112u << 23;
+	magnitude += 0xFFF + (magnitude >> 13 & 1);
+	return sign | (uint16_t) (magnitude >> 13);
+}
+
+/* Widens count 16-bit floats of a row to floats */
+static void bf16_row_to_float(const uint16_t *src, float *dst, int count) {
+	for (int j = 0; j < count; j++) {
+		uint32_t bits = (uint32_t) src[j] << 16;
+		memcpy(dst + j, &bits, sizeof(float));
+	}
+}
+
+static void fp16_row_to_float(const uint16_t *src, float *dst, int count) {
+	for (int j = 0; j < count; j++) dst[j] = half_to_float(src[j], HALF_FP16);
+}
+
+#ifdef GEMM_AVX2
+__attribute__((target("avx,f16c")))
+static void fp16_row_to_float_f16c(const uint16_t *src, float *dst, int count) {
+	int j = 0;
+	for (; j + 8 <= count; j += 8)
+		_mm256_storeu_ps(dst + j, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (src + j))));
+	for (; j < count; j++) dst[j] = half_to_float(src[j], HALF_FP16);
+}
+#endif
+
+typedef void (*Half_Row_Converter)(const uint16_t *src, float *dst, int count);
+
+/* 
+ * Function: pack_half_x_block
+ * ---------------------------- 
+ *   pack_x_block for a 16-bit float X, widened to floats as it is packed.
+ * 
+ *   X: the left operand
+ *   i0, mb: the first row and the number of rows
+ *   p0, kb: the first column and the number of columns
+ *   convert: widens a row of X
+ *   row: scratch space for GEMM_KC floats
+ *   buf: the GEMM_MC x GEMM_KC buffer to pack in to
+ */
+static void pack_half_x_block(uint16_t **X, int i0, int mb, int p0, int kb,
+	Half_Row_Converter convert, float *row, float *buf) {
+	for (int ir = 0; ir < mb; ir += GEMM_MR) {
+		float *panel = buf + (size_t) ir * kb;
+
+		for (int r = 0; r < GEMM_MR; r++) {
+			if (ir + r < mb) convert(X[i0 + ir + r] + p0, row, kb);
+			else memset(row, 0, kb * sizeof(float));
+			for (int p = 0; p < kb; p++) panel[p * GEMM_MR + r] = row[p];
+		}
+	}
+}
+
+/* 
+ * Function: pack_half_y_panel
+ * ---------------------------- 
+ *   pack_y_panel for a 16-bit float Y, widened to floats as it is packed.
+ * 
+ *   Y: the right operand
+ *   p0, kb: the first row and the number of rows
+ *   j0, nb: the first column and the number of columns
+ *   convert: widens a row of Y
+ *   row: scratch space for GEMM_NC floats
+ *   buf: the GEMM_KC x GEMM_NC buffer to pack in to
+ */
+static void pack_half_y_panel(uint16_t **Y, int p0, int kb, int j0, int nb,
+	Half_Row_Converter convert, float *row, float *buf) {
+	for (int p = 0; p < kb; p++) {
+		convert(Y[p0 + p] + j0, row, nb);
+
+		for (int jr = 0; jr < nb; jr += GEMM_NR) {
+			float *dst = buf + (size_t) jr * kb + p * GEMM_NR;
+			int width = nb - jr < GEMM_NR ? nb - jr : GEMM_NR;
+			memcpy(dst, row + jr, width * sizeof(float));
+			for (int c = width; c < GEMM_NR; c++) dst[c] = 0;
+		}
+	}
+}
+
+/* 
+ * Function: float_micro_kernel
+ * ---------------------------- 
+ *   gemm_micro_kernel for floats.
+ */
+GEMM_INLINE void float_micro_kernel(int kb, const float *a, const float *b, float *c,
+	int ldc) {
+	float8_vector acc[GEMM_MR][2];
+	#pragma GCC unroll 8
+	for (int r = 0; r < GEMM_MR; r++) acc[r][0] = acc[r][1] = (float8_vector) {0};
+
+	for (int p = 0; p < kb; p++) {
+		float8_vector b0, b1;
+		memcpy(&b0, b + p * GEMM_NR, sizeof(b0));
+		memcpy(&b1, b + p * GEMM_NR + 8, sizeof(b1));
+
+		#pragma GCC unroll 8
+		for (int r = 0; r < GEMM_MR; r++) {
+			acc[r][0] += b0 * a[p * GEMM_MR + r];
+			acc[r][1] += b1 * a[p * GEMM_MR + r];
+		}
+	}
+
+	#pragma GCC unroll 8
+	for (int r = 0; r < GEMM_MR; r++) {
+		float8_vector c0, c1;
+		memcpy(&c0, c + r * ldc, sizeof(c0));
+		memcpy(&c1, c + r * ldc + 8, sizeof(c1));
+		c0 += acc[r][0];
+		c1 += acc[r][1];
+		memcpy(c + r * ldc, &c0, sizeof(c0));
+		memcpy(c + r * ldc + 8, &c1, sizeof(c1));
+	}
+}
+
+/* 
+ * Function: half_multiply_block
+ * ---------------------------- 
+ *   multiply_block for 16-bit float operands, which are widened to floats as
+ *   they are packed and then multiplied and summed as floats.
+ * 
+ *   X, Y: the operands
+ *   i0, mb: the first row and the number of rows
+ *   j0, nb: the first column and the number of columns
+ *   k: the length of the dot products
+ *   convert: widens a row of X or Y
+ *   x_pack: a GEMM_MC x GEMM_KC buffer to pack X in to
+ *   y_pack: a GEMM_KC x GEMM_NC buffer to pack Y in to
+ *   row: scratch space for GEMM_KC and GEMM_NC floats
+ *   tile: the tile to add to, with its rows padded to GEMM_MR
+ *   ld: the distance between rows of the tile, a multiple of GEMM_NR
+ */
+GEMM_INLINE void half_multiply_block(uint16_t **X, uint16_t **Y, int i0, int mb,
+	int j0, int nb, int k, Half_Row_Converter convert, void *x_pack, void *y_pack,
+	float *row, float *tile, int ld) {
+	for (int p0 = 0; p0 < k; p0 += GEMM_KC) {
+		int kb = k - p0 < GEMM_KC ? k - p0 : GEMM_KC;
+		pack_half_y_panel(Y, p0, kb, j0, nb, convert, row, (float *) y_pack);
+		pack_half_x_block(X, i0, mb, p0, kb, convert, row, (float *) x_pack);
+
+		for (int jr = 0; jr < nb; jr += GEMM_NR)
+			for (int ir = 0; ir < mb; ir += GEMM_MR)
+				float_micro_kernel(kb, (float *) x_pack + (size_t) ir * kb,
+					(float *) y_pack + (size_t) jr * kb, tile + (size_t) ir * ld + jr, ld);
+	}
+}
+
+typedef void (*Half_Block_Kernel)(uint16_t **X, uint16_t **Y, int i0, int mb,
+	int j0, int nb, int k, Half_Row_Converter convert, void *x_pack, void *y_pack,
+	float *row, float *tile, int ld);
 
+static void half_multiply_block_generic(uint16_t **X, uint16_t **Y, int i0, int mb,
+	int j0, int nb, int k, Half_Row_Converter convert, void *x_pack, void *y_pack,
+	float *row, float *tile, int ld) {
+	half_multiply_block(X, Y, i0, mb, j0, nb, k, convert, x_pack, y_pack, row, tile, ld);
+}
+
+#ifdef GEMM_AVX2
+__attribute__((target("avx2,fma")))
+static void half_multiply_block_avx2(uint16_t **X, uint16_t **Y, int i0, int mb,
+	int j0, int nb, int k, Half_Row_Converter convert, void *x_pack, void *y_pack,
+	float *row, float *tile, int ld) {
+	half_multiply_block(X, Y, i0, mb, j0, nb, k, convert, x_pack, y_pack, row, tile, ld);
+}
 
 /* 
- * Function: matrix_multiply
+ * Function: bf16_multiply_block_avx512
+ * ---------------------------- 
+ *   half_multiply_block for bf16 operands on CPUs with AVX-512 BF16, which
+ *   keeps them as bf16 and sums the products of two terms at a time in to
+ *   floats with vdpbf16ps. Both operands are packed with pairs of terms next
+ *   to each other: X in micro-panels of HGEMM_MR rows and Y in micro-panels
+ *   of QGEMM_NR columns, with an odd last term padded with zero. The row
+ *   scratch space is not used.
+ */
+__attribute__((target("avx512f,avx512bf16")))
+static void bf16_multiply_block_avx512(uint16_t **X, uint16_t **Y, int i0, int mb,
+	int j0, int nb, int k, Half_Row_Converter convert, void *x_pack, void *y_pack,
+	float *row, float *tile, int ld) {
+	(void) convert;
+	(void) row;
+	uint16_t *a_pack = (uint16_t *) x_pack, *b_pack = (uint16_t *) y_pack;
+
+	for (int p0 = 0; p0 < k; p0 += GEMM_KC) {
+		int kb = k - p0 < GEMM_KC ? k - p0 : GEMM_KC;
+		int k2 = (kb + 1) / 2;
+
+		for (int jr = 0; jr < nb; jr += QGEMM_NR) {
+			uint16_t *panel = b_pack + (size_t) jr * k2 * 2;
+			int width = nb - jr < QGEMM_NR ? nb - jr : QGEMM_NR;
+
+			for (int p = 0; p < 2 * k2; p++) {
+				const uint16_t *y_row = p < kb ? Y[p0 + p] + j0 + jr : NULL;
+				for (int c = 0; c < QGEMM_NR; c++)
+					panel[(p / 2) * 2 * QGEMM_NR + 2 * c + p % 2] = \
+						y_row != NULL && c < width ? y_row[c] : 0;
+			}
+		}
+
+		for (int ir = 0; ir < mb; ir += HGEMM_MR) {
+			uint16_t *panel = a_pack + (size_t) ir * k2 * 2;
+
+			for (int r = 0; r < HGEMM_MR; r++) {
+				const uint16_t *x_row = ir + r < mb ? X[i0 + ir + r] + p0 : NULL;
+				for (int p = 0; p < 2 * k2; p++)
+					panel[(p / 2) * 2 * HGEMM_MR + 2 * r + p % 2] = \
+						x_row != NULL && p < kb ? x_row[p] : 0;
+			}
+		}
+
+		for (int jr = 0; jr < nb; jr += QGEMM_NR)
+			for (int ir = 0; ir < mb; ir += HGEMM_MR) {
+				const uint16_t *a = a_pack + (size_t) ir * k2 * 2;
+				const uint16_t *b = b_pack + (size_t) jr * k2 * 2;
+				__m512 acc[HGEMM_MR];
+				for (int r = 0; r < HGEMM_MR; r++) acc[r] = _mm512_setzero_ps();
+
+				for (int p = 0; p < k2; p++) {
+					__m512i y = _mm512_loadu_si512(b + p * 2 * QGEMM_NR);
+					__m512bh y_pairs;
+					memcpy(&y_pairs, &y, sizeof(y_pairs));
+
+					for (int r = 0; r < HGEMM_MR; r++) {
+						int32_t pair;
+						memcpy(&pair, a + p * 2 * HGEMM_MR + 2 * r, sizeof(pair));
+						__m512i x = _mm512_set1_epi32(pair);
+						__m512bh x_pairs;
+						memcpy(&x_pairs, &x, sizeof(x_pairs));
+						acc[r] = _mm512_dpbf16_ps(acc[r], x_pairs, y_pairs);
+					}
+				}
+
+				for (int r = 0; r < HGEMM_MR; r++) {
+					float *c = tile + (size_t) (ir + r) * ld + jr;
+					_mm512_storeu_ps(c, _mm512_add_ps(_mm512_loadu_ps(c), acc[r]));
+				}
+			}
+	}
+}
+#endif
+
+/* 
+ * Function: half_matrix_multiply
  * ---------------------------- 
- *   Computes X * Y with an interative algorithm.
+ *   Computes X * Y for matrices of 16-bit floats, summing the products in
+ *   floats and returning floats. Reading half as many bytes as floats halves
+ *   the memory traffic of packing, which bounds the speed of thin products.
+ *   bf16 operands are multiplied with vdpbf16ps where the CPU has AVX-512
+ *   BF16. Otherwise the operands are widened to floats as they are packed
+ *   (fp16 with F16C where the CPU has it) and multiplied with the float
+ *   kernel, compiled for AVX2 and FMA where the CPU has them.
  * 
- *   X: 2D matrix to left-multiply
- *   Y: 2D matrix to right-multiply
+ *   X: the 2D array of 16-bit floats to left-multiply, see float_to_half
+ *   Y: the 2D array of 16-bit floats to right-multiply
  *   x_rows: the number of rows in X
  *   x_cols: the number of columns in X
  *   y_rows: the number of rows in Y
  *   y_cols: the number of columns in Y
+ *   format: the format of X and Y
  * 
- *   returns: the matrix X * Y as a 2D array
+ *   returns: the result as a 2D array of floats
  */
-int** matrix_multiply(int** X, int** Y, int x_rows, int x_cols, int y_rows, int y_cols) {
+float** half_matrix_multiply(uint16_t **X, uint16_t **Y, int x_rows, int x_cols,
+	int y_rows, int y_cols, enum Half_Format format) {
 	// Check whether X and Y are compatible
 	if (x_cols != y_rows) {
 		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	int z_rows = x_rows;
-	int z_cols = y_cols;
+	int m = x_rows, k = x_cols, n = y_cols;
+	float **Z = init_2d_float_array(m, n);
+	int m_blocks = (m + GEMM_MC - 1) / GEMM_MC;
+	int n_blocks = (n + GEMM_NC - 1) / GEMM_NC;
 
-	// Allocate the product array Z
-	int **Z = init_2d_array(z_rows, z_cols);
+	Half_Row_Converter convert = format == HALF_BF16 ? bf16_row_to_float : \
+		fp16_row_to_float;
+	Half_Block_Kernel multiply_block = half_multiply_block_generic;
+#ifdef GEMM_AVX2
+	if (format == HALF_FP16 && __builtin_cpu_supports("f16c"))
+		convert = fp16_row_to_float_f16c;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		multiply_block = half_multiply_block_avx2;
+	if (format == HALF_BF16 && __builtin_cpu_supports("avx512bf16"))
+		multiply_block = bf16_multiply_block_avx512;
+#endif
 
-	// Assume X and Y are initialized and filled such that for X[i][j] or
-	// Y[i][j], i refers to the row number and j refers to the column number
-	// This also means that X and Y are 2D arrays
-	for (int cur_z_row = 0; cur_z_row < z_rows; cur_z_row++) {
-		for (int cur_z_col = 0; cur_z_col < z_cols; cur_z_col++) {
-			int dot_product = 0;
+	struct Task_Queues queues;
+	init_task_queues(&queues, m_blocks, n_blocks);
 
-			for (int dot_index = 0; dot_index < x_cols; dot_index++)
-				// Assume that these are valid indices, that is, X contains
-				// exactly x_rows and x_cols, and Y contains exactly y_rows
-				// and y_cols
-				dot_product += X[cur_z_row][dot_index] * Y[dot_index][cur_z_col];
+	#pragma omp parallel
+	{
+		void *x_pack = Malloc(GEMM_MC * GEMM_KC * sizeof(float));
+		void *y_pack = Malloc(GEMM_KC * GEMM_NC * sizeof(float));
+		float *row = (float *) Malloc((GEMM_KC > GEMM_NC ? GEMM_KC : GEMM_NC) * \
+			sizeof(float));
+		float *tile = (float *) Malloc(GEMM_MC * GEMM_NC * sizeof(float));
+		int thread = omp_get_thread_num();
+		start_task_queue(&queues);
+		TRACE_BEGIN(compute, "half_matrix_multiply", "compute");
 
-			Z[cur_z_row][cur_z_col] = dot_product;
+		for (int task = next_task(&queues, thread); task >= 0;
+			task = next_task(&queues, thread)) {
+			int i0 = (task % m_blocks) * GEMM_MC, j0 = (task / m_blocks) * GEMM_NC;
+			int mb = m - i0 < GEMM_MC ? m - i0 : GEMM_MC;
+			int nb = n - j0 < GEMM_NC ? n - j0 : GEMM_NC;
+			int ld = (nb + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+			TRACE_COUNT(compute, 2.0 * mb * nb * k, ((double) mb * k + (double) k * nb) * \
+				sizeof(uint16_t) + (double) mb * nb * sizeof(float));
+
+			/* Both kernels pad the rows, to GEMM_MR or HGEMM_MR */
+			memset(tile, 0, (size_t) GEMM_MC * ld * sizeof(float));
+			multiply_block(X, Y, i0, mb, j0, nb, k, convert, x_pack, y_pack, row,
+				tile, ld);
+
+			for (int i = 0; i < mb; i++)
+				memcpy(Z[i0 + i] + j0, tile + (size_t) i * ld, nb * sizeof(float));
 		}
+
+		TRACE_END(compute);
+		free(x_pack);
+		free(y_pack);
+		free(row);
+		free(tile);
 	}
 
+	free_task_queues(&queues);
 	return Z;
 }
 
@@ -71,6 +3171,438 @@ int** init_2d_array(int num_rows, int num_cols) {
 	return R;
 }
 
+#ifdef USE_MPI
+/* 
+ * Function: init_process_grid
+ * ---------------------------- 
+ *   Arranges the processes of a communicator in a grid for
+ *   summa_matrix_multiply: layers layers, each as close to square as the
+ *   number of processes per layer allows. Rank r is process
+ *   (r % per layer / grid_cols, r % per layer % grid_cols) of layer
+ *   r / per layer.
+ * 
+ *   comm: the processes to use, all of which must call this
+ *   layers: the number of copies of the operands, 1 for 2D SUMMA; it must
+ *     divide the number of processes
+ * 
+ *   returns: the grid, to free with free_process_grid
+ */
+struct Process_Grid *init_process_grid(MPI_Comm comm, int layers) {
+	int size, rank;
+	MPI_Comm_size(comm, &size);
+	MPI_Comm_rank(comm, &rank);
+
+	if (layers < 1 || size % layers != 0) {
+		fprintf(stderr, "The number of layers must divide the number of processes.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct Process_Grid *G = (struct Process_Grid *) Malloc(sizeof(struct Process_Grid));
+	int per_layer = size / layers;
+
+	G->layers = layers;
+	G->grid_rows = 1;
+	for (int rows = 1; rows * rows <= per_layer; rows++)
+		if (per_layer % rows == 0) G->grid_rows = rows;
+	G->grid_cols = per_layer / G->grid_rows;
+
+	G->layer = rank / per_layer;
+	G->row = rank % per_layer / G->grid_cols;
+	G->col = rank % per_layer % G->grid_cols;
+
+	MPI_Comm_dup(comm, &G->comm);
+	MPI_Comm_split(comm, G->layer * G->grid_rows + G->row, G->col, &G->row_comm);
+	MPI_Comm_split(comm, G->layer * G->grid_cols + G->col, G->row, &G->col_comm);
+	MPI_Comm_split(comm, rank % per_layer, G->layer, &G->layer_comm);
+
+	return G;
+}
+
+void free_process_grid(struct Process_Grid *G) {
+	MPI_Comm_free(&G->row_comm);
+	MPI_Comm_free(&G->col_comm);
+	MPI_Comm_free(&G->layer_comm);
+	MPI_Comm_free(&G->comm);
+	free(G);
+}
+
+/* 
+ * Function: grid_block_range
+ * ---------------------------- 
+ *   Splits n rows (or columns) as evenly as possible in to parts blocks.
+ * 
+ *   n: the number to split
+ *   parts: the number of blocks
+ *   index: the block
+ *   first: set to the first row of the block
+ *   count: set to the number of rows in the block
+ */
+void grid_block_range(int n, int parts, int index, int *first, int *count) {
+	*first = (int) ((long long) n * index / parts);
+	*count = (int) ((long long) n * (index + 1) / parts) - *first;
+}
+
+/* Returns the block of a split that holds row (or column) i */
+static int grid_block_of(int n, int parts, int i) {
+	int block = (int) ((long long) i * parts / n);
+	int first, count;
+	/* The even split can put i one block later than the estimate */
+	grid_block_range(n, parts, block, &first, &count);
+	while (i >= first + count) grid_block_range(n, parts, ++block, &first, &count);
+	while (i < first) grid_block_range(n, parts, --block, &first, &count);
+	return block;
+}
+
+/* Copies an nr x nc block of R, from (r0, c0), in to a contiguous buffer */
+static void pack_2d_block(int **R, int r0, int nr, int c0, int nc, int *buf) {
+	for (int i = 0; i < nr; i++)
+		memcpy(buf + (size_t) i * nc, R[r0 + i] + c0, nc * sizeof(int));
+}
+
+/* Returns the row pointers of a contiguous nr x nc buffer, to free */
+static int **rows_of_buffer(int *buf, int nr, int nc) {
+	int **rows = (int **) Malloc(((size_t) nr + 1) * sizeof(int *));
+	for (int i = 0; i < nr; i++) rows[i] = buf + (size_t) i * nc;
+	return rows;
+}
+
+/* 
+ * Function: scatter_2d_array
+ * ---------------------------- 
+ *   Sends each process of the first layer of a grid its block of a 2D array
+ *   held by rank 0.
+ * 
+ *   G: the grid
+ *   R: the 2D array, on rank 0 (NULL elsewhere)
+ *   num_rows: the number of rows in R
+ *   num_cols: the number of columns in R
+ * 
+ *   returns: the block of the process as a 2D array, or NULL outside the
+ *     first layer
+ */
+int** scatter_2d_array(struct Process_Grid *G, int **R, int num_rows, int num_cols) {
+	if (G->layer != 0) return NULL;
+
+	int r0, nr, c0, nc;
+	grid_block_range(num_rows, G->grid_rows, G->row, &r0, &nr);
+	grid_block_range(num_cols, G->grid_cols, G->col, &c0, &nc);
+	int *buf = (int *) Malloc(((size_t) nr * nc + 1) * sizeof(int));
+
+	int rank;
+	MPI_Comm_rank(G->comm, &rank);
+
+	if (rank == 0) {
+		/* The first layer is ranks 0 to grid_rows * grid_cols - 1 */
+		for (int dest = 1; dest < G->grid_rows * G->grid_cols; dest++) {
+			int d_r0, d_nr, d_c0, d_nc;
+			grid_block_range(num_rows, G->grid_rows, dest / G->grid_cols, &d_r0, &d_nr);
+			grid_block_range(num_cols, G->grid_cols, dest % G->grid_cols, &d_c0, &d_nc);
+
+			int *send = (int *) Malloc(((size_t) d_nr * d_nc + 1) * sizeof(int));
+			pack_2d_block(R, d_r0, d_nr, d_c0, d_nc, send);
+			MPI_Send(send, d_nr * d_nc, MPI_INT, dest, 0, G->comm);
+			free(send);
+		}
+		pack_2d_block(R, r0, nr, c0, nc, buf);
+	} else MPI_Recv(buf, nr * nc, MPI_INT, 0, 0, G->comm, MPI_STATUS_IGNORE);
+
+	int **block = init_2d_array(nr, nc);
+	for (int i = 0; i < nr; i++) memcpy(block[i], buf + (size_t) i * nc, nc * sizeof(int));
+	free(buf);
+
+	return block;
+}
+
+/* 
+ * Function: gather_2d_array
+ * ---------------------------- 
+ *   Collects the blocks of a 2D array, held by the first layer of a grid,
+ *   on rank 0. See scatter_2d_array.
+ * 
+ *   G: the grid
+ *   block: the block of the process (ignored outside the first layer)
+ *   num_rows: the number of rows in the whole array
+ *   num_cols: the number of columns in the whole array
+ * 
+ *   returns: the whole array on rank 0, NULL elsewhere
+ */
+int** gather_2d_array(struct Process_Grid *G, int **block, int num_rows, int num_cols) {
+	if (G->layer != 0) return NULL;
+
+	int rank;
+	MPI_Comm_rank(G->comm, &rank);
+
+	if (rank != 0) {
+		int r0, nr, c0, nc;
+		grid_block_range(num_rows, G->grid_rows, G->row, &r0, &nr);
+		grid_block_range(num_cols, G->grid_cols, G->col, &c0, &nc);
+
+		int *buf = (int *) Malloc(((size_t) nr * nc + 1) * sizeof(int));
+		pack_2d_block(block, 0, nr, 0, nc, buf);
+		MPI_Send(buf, nr * nc, MPI_INT, 0, 0, G->comm);
+		free(buf);
+		return NULL;
+	}
+
+	int **R = init_2d_array(num_rows, num_cols);
+
+	for (int src = 0; src < G->grid_rows * G->grid_cols; src++) {
+		int r0, nr, c0, nc;
+		grid_block_range(num_rows, G->grid_rows, src / G->grid_cols, &r0, &nr);
+		grid_block_range(num_cols, G->grid_cols, src % G->grid_cols, &c0, &nc);
+
+		if (src == 0) {
+			for (int i = 0; i < nr; i++) memcpy(R[r0 + i] + c0, block[i], nc * sizeof(int));
+			continue;
+		}
+
+		int *buf = (int *) Malloc(((size_t) nr * nc + 1) * sizeof(int));
+		MPI_Recv(buf, nr * nc, MPI_INT, src, 0, G->comm, MPI_STATUS_IGNORE);
+		for (int i = 0; i < nr; i++)
+			memcpy(R[r0 + i] + c0, buf + (size_t) i * nc, nc * sizeof(int));
+		free(buf);
+	}
+
+	return R;
+}
+
+/* 
+ * Function: summa_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for matrices distributed in blocks over a process grid
+ *   (SUMMA). The shared dimension is cut at the block edges of both X and
+ *   Y; at each step, the process column holding that panel of X broadcasts
+ *   it along the process rows, the process row holding that panel of Y
+ *   broadcasts it along the process columns, and every process adds their
+ *   product to its block of the result with blocked_matrix_multiply.
+ * 
+ *   With more than one layer (2.5D), the first layer first broadcasts its
+ *   blocks of X and Y to the others; the layers then split the steps
+ *   between them and their partial results are summed on the first layer.
+ *   Each copy costs the memory of one set of blocks, and cuts the panels
+ *   each process receives by the number of layers.
+ * 
+ *   G: the grid, see init_process_grid
+ *   X: the block of the m x k left matrix held by this process, see
+ *     scatter_2d_array (ignored outside the first layer)
+ *   Y: the block of the k x n right matrix held by this process
+ *   m, k, n: the sizes of the product
+ *   report: if not NULL, filled with the communication and timings
+ * 
+ *   returns: the block of X * Y held by this process, or NULL outside the
+ *     first layer
+ */
+int** summa_matrix_multiply(struct Process_Grid *G, int **X, int **Y, int m, int k,
+	int n, struct Summa_Report *report) {
+	double start = MPI_Wtime(), communication = 0, compute = 0, bytes = 0, mark;
+
+	int r0, mb, c0, nb, xk0, xkb, yk0, ykb;
+	grid_block_range(m, G->grid_rows, G->row, &r0, &mb);
+	grid_block_range(n, G->grid_cols, G->col, &c0, &nb);
+	grid_block_range(k, G->grid_cols, G->col, &xk0, &xkb);
+	grid_block_range(k, G->grid_rows, G->row, &yk0, &ykb);
+
+	/* Contiguous copies of the blocks, shared with the other layers */
+	int *x_data = (int *) Malloc(((size_t) mb * xkb + 1) * sizeof(int));
+	int *y_data = (int *) Malloc(((size_t) ykb * nb + 1) * sizeof(int));
+	if (G->layer == 0) {
+		pack_2d_block(X, 0, mb, 0, xkb, x_data);
+		pack_2d_block(Y, 0, ykb, 0, nb, y_data);
+	}
+
+	if (G->layers > 1) {
+		mark = MPI_Wtime();
+		MPI_Bcast(x_data, mb * xkb, MPI_INT, 0, G->layer_comm);
+		MPI_Bcast(y_data, ykb * nb, MPI_INT, 0, G->layer_comm);
+		communication += MPI_Wtime() - mark;
+		if (G->layer != 0) bytes += ((double) mb * xkb + (double) ykb * nb) * sizeof(int);
+	}
+
+	int *z_data = (int *) calloc((size_t) mb * nb + 1, sizeof(int));
+	/* A step is at most as wide as the widest block of X and of Y */
+	int max_w = (k + G->grid_cols - 1) / G->grid_cols;
+	int *x_panel = (int *) Malloc(((size_t) mb * max_w + 1) * sizeof(int));
+	int *y_panel = (int *) Malloc(((size_t) max_w * nb + 1) * sizeof(int));
+	if (z_data == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	int **z_rows = rows_of_buffer(z_data, mb, nb);
+
+	/* The steps run from one block edge of X or Y to the next */
+	int step = 0;
+	for (int k0 = 0; k0 < k; step++) {
+		int x_owner = grid_block_of(k, G->grid_cols, k0);
+		int y_owner = grid_block_of(k, G->grid_rows, k0);
+		int x_first, x_count, y_first, y_count;
+		grid_block_range(k, G->grid_cols, x_owner, &x_first, &x_count);
+		grid_block_range(k, G->grid_rows, y_owner, &y_first, &y_count);
+		int k1 = x_first + x_count < y_first + y_count ? x_first + x_count : \
+			y_first + y_count;
+		int w = k1 - k0;
+
+		if (step % G->layers == G->layer) {
+			if (G->col == x_owner)
+				for (int i = 0; i < mb; i++)
+					memcpy(x_panel + (size_t) i * w, x_data + (size_t) i * xkb + (k0 - xk0),
+						w * sizeof(int));
+			if (G->row == y_owner)
+				memcpy(y_panel, y_data + (size_t) (k0 - yk0) * nb, (size_t) w * nb * sizeof(int));
+
+			mark = MPI_Wtime();
+			MPI_Bcast(x_panel, mb * w, MPI_INT, x_owner, G->row_comm);
+			MPI_Bcast(y_panel, w * nb, MPI_INT, y_owner, G->col_comm);
+			communication += MPI_Wtime() - mark;
+			if (G->col != x_owner) bytes += (double) mb * w * sizeof(int);
+			if (G->row != y_owner) bytes += (double) w * nb * sizeof(int);
+
+			mark = MPI_Wtime();
+			int **x_rows = rows_of_buffer(x_panel, mb, w);
+			int **y_rows = rows_of_buffer(y_panel, w, nb);
+			struct Dense_Operand left = {x_rows, 0}, right = {y_rows, 0};
+			blocked_matrix_multiply(&left, &right, mb, w, nb, 1, NULL, 0, 1, NULL, z_rows);
+			free(x_rows);
+			free(y_rows);
+			compute += MPI_Wtime() - mark;
+		}
+
+		k0 = k1;
+	}
+
+	if (G->layers > 1) {
+		mark = MPI_Wtime();
+		if (G->layer == 0)
+			MPI_Reduce(MPI_IN_PLACE, z_data, mb * nb, MPI_INT, MPI_SUM, 0, G->layer_comm);
+		else {
+			MPI_Reduce(z_data, NULL, mb * nb, MPI_INT, MPI_SUM, 0, G->layer_comm);
+			bytes += (double) mb * nb * sizeof(int);
+		}
+		communication += MPI_Wtime() - mark;
+	}
+
+	int **Z = NULL;
+	if (G->layer == 0) {
+		Z = init_2d_array(mb, nb);
+		for (int i = 0; i < mb; i++) memcpy(Z[i], z_rows[i], nb * sizeof(int));
+	}
+
+	free(x_data);
+	free(y_data);
+	free(x_panel);
+	free(y_panel);
+	free(z_rows);
+	free(z_data);
+
+	if (report != NULL) {
+		report->bytes = bytes;
+		MPI_Allreduce(&bytes, &report->total_bytes, 1, MPI_DOUBLE, MPI_SUM, G->comm);
+		report->compute_seconds = compute;
+		report->communication_seconds = communication;
+		report->seconds = MPI_Wtime() - start;
+	}
+
+	return Z;
+}
+#endif
+
+/* 
+ * Function: init_2d_array_numa
+ * ---------------------------- 
+ *   Allocates a 2D array of size num_rows x num_cols, zeroed, whose pages
+ *   are placed on the NUMA nodes that will use them. With NUMA_FIRST_TOUCH,
+ *   each thread zeroes the blocks of rows it owns in the blocked kernels
+ *   (see owned_row_blocks), so that they are placed on its node, whichever
+ *   thread fills the array later. Use it for the left operand and the
+ *   result of large products, run with the same number of threads.
+ *   NUMA_INTERLEAVE spreads the pages over all nodes, e.g. for an operand
+ *   every thread reads; without USE_LIBNUMA it falls back to first touch.
+ *   The rows are contiguous, and the array must be freed with
+ *   free_2d_array_numa.
+ * 
+ *   num_rows: the number of rows
+ *   num_cols: the number of columns
+ *   placement: where to place the pages
+ * 
+ *   returns: the allocated 2D array
+ */
+int** init_2d_array_numa(int num_rows, int num_cols, enum Numa_Placement placement) {
+	size_t size = (size_t) num_rows * num_cols * sizeof(int) + sizeof(int);
+	int *data = NULL;
+
+#ifdef USE_LIBNUMA
+	if (numa_available() >= 0) {
+		data = (int *) (placement == NUMA_INTERLEAVE ? numa_alloc_interleaved(size) : \
+			numa_alloc(size));
+		if (data == NULL) {
+			perror("numa_alloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+	if (data == NULL) data = (int *) Malloc(size);
+
+	/* The last entry keeps the block, even with no rows */
+	int **R = (int **) Malloc(((size_t) num_rows + 1) * sizeof(int *));
+	R[num_rows] = data;
+	for (int i = 0; i < num_rows; i++) R[i] = data + (size_t) i * num_cols;
+
+	if (placement == NUMA_INTERLEAVE && numa_node_count() > 1) {
+		memset(data, 0, size);
+		return R;
+	}
+
+	/* The same row blocks and threads as blocked_matrix_multiply */
+	const struct Gemm_Tuning *T = current_gemm_tuning();
+	int m_blocks = (num_rows + T->mc - 1) / T->mc;
+
+	#pragma omp parallel num_threads(gemm_thread_count(T))
+	{
+		int first, last;
+		owned_row_blocks(m_blocks, omp_get_thread_num(), omp_get_num_threads(), &first,
+			&last);
+		int first_row = first * T->mc;
+		int last_row = last * T->mc < num_rows ? last * T->mc : num_rows;
+		if (first_row < last_row)
+			memset(R[first_row], 0, (size_t) (last_row - first_row) * num_cols * sizeof(int));
+	}
+
+	return R;
+}
+
+void free_2d_array_numa(int** R, int num_rows, int num_cols) {
+	size_t size = (size_t) num_rows * num_cols * sizeof(int) + sizeof(int);
+#ifdef USE_LIBNUMA
+	if (numa_available() >= 0) numa_free(R[num_rows], size);
+	else free(R[num_rows]);
+#else
+	(void) size;
+	free(R[num_rows]);
+#endif
+	free(R);
+}
+
+/* 
+ * Function: init_2d_float_array
+ * ---------------------------- 
+ *   Allocates a 2D array of floats of size num_rows x num_cols.
+ * 
+ *   num_rows: the number of rows
+ *   num_cols: the number of columns
+ * 
+ *   returns: the allocated 2D array
+ */
+float** init_2d_float_array(int num_rows, int num_cols) {
+	float **R = (float **) Malloc(num_rows * sizeof(float *));
+	for (int i = 0; i < num_rows; i++)
+		R[i] = (float *) Malloc(num_cols * sizeof(float));
+
+	return R;
+}
+
+/* Both kernel files define Malloc, for when they are built together, see
+*  hybrid_matrix_multiply.c */
+#ifndef MATRIX_MALLOC
+#define MATRIX_MALLOC
 /* 
  * Function: Malloc
  * ---------------------------- 
@@ -88,6 +3620,7 @@ void* Malloc(size_t size) {
 	}
 	return to_ret;
 }
+#endif
 
 
 /* --------------------------------------------------------- */
@@ -115,7 +3648,387 @@ void print_matrix(int **R, int r_rows, int r_cols) {
 	}
 }
 
-int main() {
+/* Times matrix_vector_multiply and vector_matrix_multiply on an m x k matrix,
+*  against the bandwidth of copying it a row at a time, like STREAM's copy */
+void test_matrix_vector_multiply(int m, int k) {
+	int **X = init_2d_array(m, k);
+	fill_rand_2d_array(X, m, k, 10);
+	int *v = (int *) Malloc(((size_t) m + k) * sizeof(int));
+	int *z = (int *) Malloc(((size_t) m + k) * sizeof(int));
+	for (int i = 0; i < m + k; i++) v[i] = rand() % 10;
+	double bytes = (double) m * k * sizeof(int), best[3] = {1e30, 1e30, 1e30};
+	volatile int last_copied;
+
+	for (int repeat = 0; repeat < 5; repeat++) {
+		double start = tuning_seconds();
+		#pragma omp parallel
+		{
+			int *row = (int *) Malloc(((size_t) k + 1) * sizeof(int));
+			#pragma omp for schedule(static)
+			for (int i = 0; i < m; i++) memcpy(row, X[i], k * sizeof(int));
+			last_copied = row[0];
+			free(row);
+		}
+		double t = tuning_seconds() - start;
+		if (t < best[0]) best[0] = t;
+
+		start = tuning_seconds();
+		matrix_vector_multiply(X, v, m, k, z);
+		t = tuning_seconds() - start;
+		if (t < best[1]) best[1] = t;
+
+		start = tuning_seconds();
+		vector_matrix_multiply(v, X, m, k, z);
+		t = tuning_seconds() - start;
+		if (t < best[2]) best[2] = t;
+	}
+
+	printf("%dx%d: copy %.2f GB/s, matrix-vector %.2f GB/s, vector-matrix "
+		"%.2f GB/s\n", m, k, bytes / best[0] * 1e-9, bytes / best[1] * 1e-9,
+		bytes / best[2] * 1e-9);
+
+	(void) last_copied;
+	free_2d_array(X, m, k);
+	free(v);
+	free(z);
+}
+
+/* Checks each quantized micro-kernel the CPU runs against the portable one,
+*  on random and on extreme values, then quantized_matrix_multiply with
+*  non-zero zero points against a plain loop on an m x k by k x n product */
+int test_quantized_matrix_multiply(int m, int k, int n) {
+	const char *names[] = {"avx2", "avxvnni", "avx512vnni"};
+	Quantized_Kernel kernels[3] = {NULL, NULL, NULL};
+#ifdef GEMM_AVX2
+	if (__builtin_cpu_supports("avx2")) kernels[0] = quantized_kernel_avx2;
+	if (__builtin_cpu_supports("avxvnni")) kernels[1] = quantized_kernel_avxvnni;
+	if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw"))
+		kernels[2] = quantized_kernel_avx512vnni;
+#endif
+	int all_correct = 1;
+
+	int k4 = QGEMM_KC / 4, ldc = QGEMM_NR + 3;
+	uint8_t *a = (uint8_t *) Malloc((size_t) QGEMM_MR * 4 * k4);
+	int8_t *b = (int8_t *) Malloc((size_t) 4 * k4 * QGEMM_NR);
+	int *expected = (int *) Malloc((size_t) QGEMM_MR * ldc * sizeof(int));
+	int *c = (int *) Malloc((size_t) QGEMM_MR * ldc * sizeof(int));
+
+	for (int kernel = 0; kernel < 3; kernel++) {
+		if (kernels[kernel] == NULL) continue;
+		int correct = 1;
+
+		/* The first trial has the largest products of either sign, which
+		*  vpmaddubsw would saturate */
+		for (int trial = 0; trial < 4; trial++) {
+			for (int i = 0; i < QGEMM_MR * 4 * k4; i++) a[i] = trial == 0 ? 255 : rand() % 256;
+			for (int i = 0; i < 4 * k4 * QGEMM_NR; i++)
+				b[i] = trial == 0 ? (i % 3 == 0 ? 127 : -128) : rand() % 256 - 128;
+			for (int i = 0; i < QGEMM_MR * ldc; i++) expected[i] = c[i] = rand() % 1000;
+
+			int steps = trial == 0 ? k4 : 1 + rand() % k4;
+			quantized_kernel_generic(steps, a, b, expected, ldc);
+			kernels[kernel](steps, a, b, c, ldc);
+			if (memcmp(c, expected, (size_t) QGEMM_MR * ldc * sizeof(int)) != 0) correct = 0;
+		}
+
+		printf("Quantized kernel %s: %s\n", names[kernel], correct ? "correct" : "WRONG");
+		all_correct &= correct;
+	}
+
+	free(a);
+	free(b);
+	free(expected);
+	free(c);
+
+	uint8_t **X = (uint8_t **) Malloc(m * sizeof(uint8_t *));
+	for (int i = 0; i < m; i++) {
+		X[i] = (uint8_t *) Malloc(k);
+		for (int p = 0; p < k; p++) X[i][p] = rand() % 256;
+	}
+	int8_t **Y = (int8_t **) Malloc(k * sizeof(int8_t *));
+	for (int p = 0; p < k; p++) {
+		Y[p] = (int8_t *) Malloc(n);
+		for (int j = 0; j < n; j++) Y[p][j] = rand() % 256 - 128;
+	}
+
+	uint8_t x_zero_point = 131;
+	int8_t y_zero_point = -7;
+	struct Packed_Int8_Matrix *P = pack_int8_matrix(Y, k, n);
+	int **Z = quantized_matrix_multiply(X, m, k, x_zero_point, P, y_zero_point, NULL);
+	int correct = 1;
+
+	for (int i = 0; i < m; i++)
+		for (int j = 0; j < n; j++) {
+			int sum = 0;
+			for (int p = 0; p < k; p++)
+				sum += (X[i][p] - x_zero_point) * (Y[p][j] - y_zero_point);
+			if (Z[i][j] != sum) correct = 0;
+		}
+
+	printf("quantized_matrix_multiply %dx%dx%d: %s\n", m, k, n,
+		correct ? "correct" : "WRONG");
+	all_correct &= correct;
+
+	free_2d_array(Z, m, n);
+	free_packed_int8_matrix(P);
+	for (int i = 0; i < m; i++) free(X[i]);
+	free(X);
+	for (int p = 0; p < k; p++) free(Y[p]);
+	free(Y);
+
+	return all_correct;
+}
+
+/* Whether two floats have the same bits, or are both NaNs */
+static int same_float(float a, float b) {
+	return memcmp(&a, &b, sizeof(a)) == 0 || (a != a && b != b);
+}
+
+/* Checks the 16-bit float conversions on every bit pattern: that each value
+*  survives the round trip, that the points halfway between neighbours round
+*  to the even one and the floats next to them to the nearer one, and that
+*  F16C widens as half_to_float does */
+static int test_half_conversions(enum Half_Format format) {
+	Half_Row_Converter convert = format == HALF_BF16 ? bf16_row_to_float : \
+		fp16_row_to_float;
+#ifdef GEMM_AVX2
+	if (format == HALF_FP16 && __builtin_cpu_supports("f16c"))
+		convert = fp16_row_to_float_f16c;
+#endif
+	uint16_t *bits = (uint16_t *) Malloc(65536 * sizeof(uint16_t));
+	float *widened = (float *) Malloc(65536 * sizeof(float));
+	for (int h = 0; h < 65536; h++) bits[h] = (uint16_t) h;
+	convert(bits, widened, 65536);
+
+	int correct = 1;
+	for (int h = 0; h < 65536; h++) {
+		float f = half_to_float((uint16_t) h, format);
+		uint16_t back = float_to_half(f, format);
+		float again = half_to_float(back, format);
+		if (!same_float(widened[h], f)) correct = 0;
+		/* NaNs need only stay NaNs, as narrowing quiets them */
+		if (f == f ? back != h : again == again) correct = 0;
+	}
+
+	/* The largest finite value; the one after it is infinity */
+	uint16_t largest = format == HALF_BF16 ? 0x7F7F : 0x7BFF;
+	for (uint16_t h = 0; h < largest; h++) {
+		float low = half_to_float(h, format), high = half_to_float(h + 1, format);
+		float middle = low + (high - low) / 2;
+		uint32_t middle_bits;
+		memcpy(&middle_bits, &middle, sizeof(middle_bits));
+
+		for (int sign = 0; sign < 2; sign++) {
+			uint16_t sign_bit = sign ? 0x8000 : 0;
+			uint32_t float_sign = sign ? 0x80000000u : 0;
+			uint32_t below_bits = (middle_bits - 1) | float_sign;
+			uint32_t above_bits = (middle_bits + 1) | float_sign;
+			uint32_t tie_bits = middle_bits | float_sign;
+			float below, above, tie;
+			memcpy(&below, &below_bits, sizeof(below));
+			memcpy(&above, &above_bits, sizeof(above));
+			memcpy(&tie, &tie_bits, sizeof(tie));
+
+			if (float_to_half(below, format) != (h | sign_bit)) correct = 0;
+			if (float_to_half(above, format) != ((h + 1) | sign_bit)) correct = 0;
+			if (float_to_half(tie, format) != (((h & 1) ? h + 1 : h) | sign_bit)) correct = 0;
+		}
+	}
+	if (format == HALF_FP16 && (float_to_half(65520.0f, format) != 0x7C00 || \
+		float_to_half(65519.99f, format) != 0x7BFF)) correct = 0;
+
+	printf("%s conversions: %s\n", format == HALF_BF16 ? "bf16" : "fp16",
+		correct ? "correct" : "WRONG");
+
+	free(bits);
+	free(widened);
+	return correct;
+}
+
+/* Checks the conversions, each block kernel half_matrix_multiply picks from
+*  that the CPU runs, and half_matrix_multiply itself, against a plain float
+*  sum of the widened operands on an m x k by k x n product. The values are
+*  small multiples of 1/4, so that every sum is exact in any order */
+int test_half_matrix_multiply(int m, int k, int n) {
+	const char *names[] = {"generic", "avx2", "avx512bf16"};
+	Half_Block_Kernel kernels[3] = {half_multiply_block_generic, NULL, NULL};
+#ifdef GEMM_AVX2
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		kernels[1] = half_multiply_block_avx2;
+	if (__builtin_cpu_supports("avx512bf16")) kernels[2] = bf16_multiply_block_avx512;
+#endif
+	int all_correct = 1;
+
+	for (int f = 0; f < 2; f++) {
+		enum Half_Format format = f == 0 ? HALF_BF16 : HALF_FP16;
+		all_correct &= test_half_conversions(format);
+
+		uint16_t **X = (uint16_t **) Malloc(m * sizeof(uint16_t *));
+		for (int i = 0; i < m; i++) {
+			X[i] = (uint16_t *) Malloc(k * sizeof(uint16_t));
+			for (int p = 0; p < k; p++) X[i][p] = float_to_half((rand() % 33 - 16) / 4.0f, format);
+		}
+		uint16_t **Y = (uint16_t **) Malloc(k * sizeof(uint16_t *));
+		for (int p = 0; p < k; p++) {
+			Y[p] = (uint16_t *) Malloc(n * sizeof(uint16_t));
+			for (int j = 0; j < n; j++) Y[p][j] = float_to_half((rand() % 33 - 16) / 4.0f, format);
+		}
+
+		float **expected = init_2d_float_array(m, n);
+		for (int i = 0; i < m; i++)
+			for (int j = 0; j < n; j++) {
+				float sum = 0;
+				for (int p = 0; p < k; p++)
+					sum += half_to_float(X[i][p], format) * half_to_float(Y[p][j], format);
+				expected[i][j] = sum;
+			}
+
+		/* One block of each kernel, at an offset so the edges are ragged */
+		Half_Row_Converter convert = format == HALF_BF16 ? bf16_row_to_float : \
+			fp16_row_to_float;
+		int i0 = m > 1 ? 1 : 0, j0 = n > 3 ? 3 : 0;
+		int mb = m - i0 < GEMM_MC ? m - i0 : GEMM_MC;
+		int nb = n - j0 < GEMM_NC ? n - j0 : GEMM_NC;
+		int ld = (nb + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+		void *x_pack = Malloc(GEMM_MC * GEMM_KC * sizeof(float));
+		void *y_pack = Malloc(GEMM_KC * GEMM_NC * sizeof(float));
+		float *row = (float *) Malloc((GEMM_KC > GEMM_NC ? GEMM_KC : GEMM_NC) * sizeof(float));
+		float *tile = (float *) Malloc(GEMM_MC * GEMM_NC * sizeof(float));
+
+		for (int kernel = 0; kernel < 3; kernel++) {
+			if (kernels[kernel] == NULL || (kernel == 2 && format != HALF_BF16)) continue;
+
+			memset(tile, 0, (size_t) GEMM_MC * ld * sizeof(float));
+			kernels[kernel](X, Y, i0, mb, j0, nb, k, convert, x_pack, y_pack, row, tile, ld);
+			int correct = 1;
+			for (int i = 0; i < mb; i++)
+				if (memcmp(tile + (size_t) i * ld, expected[i0 + i] + j0, nb * sizeof(float)) != 0)
+					correct = 0;
+
+			printf("%s block kernel %s: %s\n", format == HALF_BF16 ? "bf16" : "fp16",
+				names[kernel], correct ? "correct" : "WRONG");
+			all_correct &= correct;
+		}
+
+		float **Z = half_matrix_multiply(X, Y, m, k, k, n, format);
+		int correct = 1;
+		for (int i = 0; i < m; i++)
+			if (memcmp(Z[i], expected[i], n * sizeof(float)) != 0) correct = 0;
+
+		printf("half_matrix_multiply %s %dx%dx%d: %s\n", format == HALF_BF16 ? "bf16" : \
+			"fp16", m, k, n, correct ? "correct" : "WRONG");
+		all_correct &= correct;
+
+		free(x_pack);
+		free(y_pack);
+		free(row);
+		free(tile);
+		for (int i = 0; i < m; i++) {
+			free(X[i]);
+			free(expected[i]);
+			free(Z[i]);
+		}
+		free(X);
+		free(expected);
+		free(Z);
+		for (int p = 0; p < k; p++) free(Y[p]);
+		free(Y);
+	}
+
+	return all_correct;
+}
+
+#ifdef USE_MPI
+/* Checks summa_matrix_multiply against matrix_multiply on rank 0 */
+void test_summa_matrix_multiply(int m, int k, int n, int layers) {
+	int rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	struct Process_Grid *G = init_process_grid(MPI_COMM_WORLD, layers);
+
+	int **X = NULL, **Y = NULL;
+	if (rank == 0) {
+		X = init_2d_array(m, k);
+		fill_rand_2d_array(X, m, k, 10);
+		Y = init_2d_array(k, n);
+		fill_rand_2d_array(Y, k, n, 10);
+	}
+
+	int **X_block = scatter_2d_array(G, X, m, k);
+	int **Y_block = scatter_2d_array(G, Y, k, n);
+
+	struct Summa_Report report;
+	int **Z_block = summa_matrix_multiply(G, X_block, Y_block, m, k, n, &report);
+	int **Z = gather_2d_array(G, Z_block, m, n);
+
+	if (rank == 0) {
+		int **expected = matrix_multiply(X, Y, m, k, k, n);
+		int correct = 1;
+		for (int i = 0; i < m; i++)
+			if (memcmp(Z[i], expected[i], n * sizeof(int)) != 0) correct = 0;
+
+		printf("SUMMA %dx%dx%d on %dx%dx%d: %s, %.0f bytes moved, %.4fs "
+			"(rank 0: %.4fs compute, %.4fs communication)\n", m, k, n, G->grid_rows,
+			G->grid_cols, G->layers, correct ? "correct" : "WRONG", report.total_bytes,
+			report.seconds, report.compute_seconds, report.communication_seconds);
+
+		free_2d_array(X, m, k);
+		free_2d_array(Y, k, n);
+		free_2d_array(Z, m, n);
+		free_2d_array(expected, m, n);
+	}
+
+	if (G->layer == 0) {
+		int r0, mb, c0, nb, k0, kb;
+		grid_block_range(m, G->grid_rows, G->row, &r0, &mb);
+		grid_block_range(n, G->grid_cols, G->col, &c0, &nb);
+		grid_block_range(k, G->grid_cols, G->col, &k0, &kb);
+		free_2d_array(X_block, mb, kb);
+		grid_block_range(k, G->grid_rows, G->row, &k0, &kb);
+		free_2d_array(Y_block, kb, nb);
+		free_2d_array(Z_block, mb, nb);
+	}
+
+	free_process_grid(G);
+}
+#endif
+
+/* Left out when the file is included in another, see hybrid_matrix_multiply.c */
+#ifndef MATRIX_LIBRARY
+int main(int argc, char **argv) {
+	/* "tune [file]" finds the parameters of the blocked kernel for this CPU */
+	if (argc > 1 && strcmp(argv[1], "tune") == 0) {
+		const char *path = argc > 2 ? argv[2] : "gemm_tuning.txt";
+		struct Gemm_Tuning T = autotune_matrix_multiply(path, 1);
+		printf("Saved mc %d kc %d nc %d mr %d threads %d %s to %s\n", T.mc, T.kc, T.nc,
+			T.mr, T.num_threads, gemm_kernel_names[T.kernel], path);
+		return 0;
+	}
+
+	/* "gemv [rows cols]" measures the matrix-vector kernels' bandwidth */
+	if (argc > 1 && strcmp(argv[1], "gemv") == 0) {
+		int rows = argc > 2 ? atoi(argv[2]) : 16384, cols = argc > 3 ? atoi(argv[3]) : 8192;
+		test_matrix_vector_multiply(rows, cols);
+		return 0;
+	}
+
+	/* "check" compares the kernels picked at run time with portable C */
+	if (argc > 1 && strcmp(argv[1], "check") == 0) {
+		int correct = test_quantized_matrix_multiply(37, QGEMM_KC + 301, 83);
+		correct &= test_half_matrix_multiply(2 * GEMM_MC + 5, GEMM_KC + 77, GEMM_NC + 21);
+		return correct ? 0 : EXIT_FAILURE;
+	}
+
+#ifdef USE_MPI
+	/* Run with e.g. mpirun -np 8: 2D SUMMA, then 2.5D with two layers */
+	MPI_Init(NULL, NULL);
+	int size;
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	test_summa_matrix_multiply(300, 200, 250, 1);
+	if (size % 2 == 0) test_summa_matrix_multiply(300, 200, 250, 2);
+	MPI_Finalize();
+	return 0;
+#endif
+
 	int x_rows = 4, x_cols = 5;
 	int y_rows = 5, y_cols = 3;
 
@@ -140,3 +4053,4 @@ int main() {
 	free_2d_array(Y, y_rows, y_cols);
 	free_2d_array(Z, x_rows, y_cols);
 }
+#endif
@@ -1,150 +1,4306 @@
+/* Compile with -DKERNEL_TRACE to time the phases of the kernels, see
+*  kernel_trace.h */
+#include "kernel_trace.h"
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+/* Compile with -fopenmp to run the parallel sections on multiple threads */
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#define omp_get_thread_num() 0
+#endif
+
+/* Compile with -DUSE_MPI (using mpicc) for the distributed product, see
+*  sparse_summa_matrix_multiply */
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+/* 
+ * Index types used by the compressed formats.
+ * sparse_ptr_t holds offsets into val (row_ptr / col_ptr) and the number of
+ * non-zero values, so it is always 64 bits wide; it is only num_rows + 1 long,
+ * so the extra width costs next to nothing.
+ * sparse_ind_t holds row/column indices (col_ind / row_ind) and the
+ * dimensions. It is one entry per non-zero value, so it stays 32 bits unless
+ * SPARSE_INDEX_64 is defined, to avoid doubling the index bandwidth for
+ * matrices that do not need it.
+ */
+#ifdef SPARSE_INDEX_64
+typedef int64_t sparse_ind_t;
+#define SPARSE_IND_MAX INT64_MAX
+#else
+typedef int32_t sparse_ind_t;
+#define SPARSE_IND_MAX INT32_MAX
+#endif
+typedef int64_t sparse_ptr_t;
+
+#ifdef USE_MPI
+#ifdef SPARSE_INDEX_64
+#define MPI_SPARSE_IND MPI_INT64_T
+#else
+#define MPI_SPARSE_IND MPI_INT32_T
+#endif
+#define MPI_SPARSE_PTR MPI_INT64_T
+#endif
+
+struct CSR_Matrix *init_CSR_matrix(sparse_ptr_t num_val, sparse_ind_t num_rows,
+	sparse_ind_t num_cols);
+struct CCS_Matrix *init_CCS_matrix(sparse_ptr_t num_val, sparse_ind_t num_rows,
+	sparse_ind_t num_cols);
+void free_CSR_matrix(struct CSR_Matrix *R);
+void* Malloc(size_t size);
+void* Realloc(void *ptr, size_t size);
+
+
+/* 
+ * A matrix in Compressed Row Storage format, which stores just the non-zero
+ * values of a matrix in row-major order.
+ * Saves on a lot of memory over a 2D array representation when the number of
+ * non-zero values are less than (m * (n - 1) - 1) / 2 for an m x n matrix,
+ * which would normally require m x n space.
+ * Saves time on matrix computations as not all comparisons have to be made,
+ * just the comparisons of non-zero values.
+ */
+struct CSR_Matrix {
+	int *val;  /* The non-zero values in the matrix */
+	sparse_ind_t *col_ind;  /* The column indices of the corresponding values in val */
+
+	/* Points to the non-zero values at the start of each row */
+	/* Defined recursively as
+		i) row_ptr[0] = 0
+		ii) row_ptr[i] = row_ptr[i - 1] + the number of non-zero values in the
+			ith row */
+	sparse_ptr_t *row_ptr;
+	sparse_ind_t num_rows;
+	sparse_ind_t num_cols;
+};
+
+/* 
+ * A matrix in Compressed Column Storage format. Similar to CSR except in
+ * column-major order.
+ */
+struct CCS_Matrix {
+	int *val;
+	sparse_ind_t *row_ind;
+	sparse_ptr_t *col_ptr;
+	sparse_ind_t num_rows;
+	sparse_ind_t num_cols;
+};
+
+/* 
+ * A matrix in Coordinate format: an unordered list of (row, column, value)
+ * triples. Easy to produce, but has to be sorted in to CSR or CCS before it
+ * can be used in computations.
+ */
+struct COO_Matrix {
+	int *val;
+	sparse_ind_t *row_ind;
+	sparse_ind_t *col_ind;
+	sparse_ptr_t num_val;
+	sparse_ind_t num_rows;
+	sparse_ind_t num_cols;
+};
+
+/* 
+ * A matrix in Doubly Compressed Sparse Row format, for hypersparse matrices
+ * where most rows are empty. Like CSR, but only the non-empty rows are
+ * stored, so row_ptr has one entry per non-empty row rather than per row
+ * and no time is spent scanning empty ones.
+ */
+struct DCSR_Matrix {
+	int *val;
+	sparse_ind_t *col_ind;
+	sparse_ind_t *row_ind;  /* The non-empty rows, in increasing order */
+
+	/* Points to the non-zero values at the start of each non-empty row:
+	*  row row_ind[i] spans row_ptr[i] to row_ptr[i + 1] - 1 */
+	sparse_ptr_t *row_ptr;
+	sparse_ind_t num_nonempty_rows;
+	sparse_ind_t num_rows;
+	sparse_ind_t num_cols;
+};
+
+/* 
+ * A matrix in Doubly Compressed Sparse Column format. Similar to DCSR except
+ * in column-major order.
+ */
+struct DCSC_Matrix {
+	int *val;
+	sparse_ind_t *row_ind;
+	sparse_ind_t *col_ind;  /* The non-empty columns, in increasing order */
+	sparse_ptr_t *col_ptr;
+	sparse_ind_t num_nonempty_cols;
+	sparse_ind_t num_rows;
+	sparse_ind_t num_cols;
+};
+
+/* 
+ * Collects (row, column, value) triples in any order, over any number of
+ * batches, to be built in to a CSR or CCS matrix in one go. The triples are
+ * kept in a COO matrix whose arrays grow geometrically, with triples.num_val
+ * the number collected so far.
+ */
+struct COO_Builder {
+	struct COO_Matrix triples;
+	sparse_ptr_t capacity;
+};
+
+/* 
+ * A CSR matrix that can be updated in place. Each row has room to grow past
+ * its values, so an insert only shifts the rest of its own row. A row that
+ * runs out of room is moved to the end of the arrays with twice the room,
+ * and once the arrays are full the rows are laid out afresh, which also
+ * reclaims the space left behind by moved rows. Rows are kept sorted, and
+ * the matrix can be multiplied as it is.
+ */
+struct Dynamic_CSR_Matrix {
+	int *val;
+	sparse_ind_t *col_ind;
+
+	/* Row i holds col_ind[row_begin[i]] to col_ind[row_end[i] - 1], and has
+	*  room up to col_ind[row_limit[i] - 1] */
+	sparse_ptr_t *row_begin;
+	sparse_ptr_t *row_end;
+	sparse_ptr_t *row_limit;
+	sparse_ptr_t num_slots;  /* The slots given to rows so far */
+	sparse_ptr_t capacity;  /* The slots allocated */
+	sparse_ptr_t num_val;
+	sparse_ind_t num_rows;
+	sparse_ind_t num_cols;
+};
+
+/* 
+ * How many non-zero values X * Y will have, before computing it. See
+ * estimate_product_nnz.
+ */
+struct NNZ_Estimate {
+	sparse_ptr_t flops;  /* The multiplications, an upper bound on nnz */
+	double nnz;
+	double compression;  /* nnz / flops */
+};
+
+/* 
+ * What a chain of sparse products was estimated to cost, and what it did
+ * cost. The cost of a product is its number of multiplications (flops).
+ */
+struct Sparse_Chain_Report {
+	double estimated_cost;  /* In the order chosen */
+	double left_to_right_cost;  /* Estimated, in the order written */
+	double actual_cost;
+	double estimated_nnz;  /* Of the product of the whole chain */
+	sparse_ptr_t actual_nnz;
+	double seconds;
+};
+
+#ifdef USE_MPI
+/* 
+ * A grid_rows x grid_cols grid of MPI processes for the distributed sparse
+ * product. Process (row, col) holds block (row, col) of each distributed
+ * matrix, see sparse_grid_block_range, with its rows and columns numbered
+ * from the start of the block.
+ */
+struct Sparse_Process_Grid {
+	MPI_Comm comm;
+	MPI_Comm row_comm;  /* The processes of this grid row, by column */
+	MPI_Comm col_comm;  /* The processes of this grid column, by row */
+	int grid_rows;
+	int grid_cols;
+	int row;
+	int col;
+};
+
+/* 
+ * What a distributed sparse product cost, as seen by one process. The stage
+ * arrays have num_stages entries; free them with free_sparse_summa_report.
+ */
+struct Sparse_Summa_Report {
+	int num_stages;
+	double *stage_bytes;  /* Received by this process in each stage */
+	double *stage_broadcast_seconds;
+	double *stage_multiply_seconds;
+	double bytes;  /* Received by this process in all stages */
+	double total_bytes;  /* By all the processes */
+	double broadcast_seconds;
+	double multiply_seconds;
+	double merge_seconds;  /* Summing the partial products */
+	double seconds;
+};
+#endif
+
+/* 
+ * Tuning for the accumulators of rowwise_sparse_matrix_multiply, see
+ * choose_accumulator.
+ */
+#ifndef SPGEMM_HEAP_MAX_FLOPS
+#define SPGEMM_HEAP_MAX_FLOPS 64
+#endif
+#ifndef SPGEMM_DENSE_RATIO
+#define SPGEMM_DENSE_RATIO 16
+#endif
+
+/* 
+ * The rows of a product sampled to estimate its number of non-zero values,
+ * see estimate_product_nnz. rowwise_sparse_matrix_multiply only samples
+ * products with more than SPGEMM_NNZ_SAMPLE_RATIO times as many rows.
+ */
+#ifndef SPGEMM_NNZ_SAMPLES
+#define SPGEMM_NNZ_SAMPLES 256
+#endif
+#ifndef SPGEMM_NNZ_SAMPLE_RATIO
+#define SPGEMM_NNZ_SAMPLE_RATIO 8
+#endif
+
+/* 
+ * Tuning for the intersection of a row and a column in the dot product
+ * kernels, see sparse_dot_product.
+ */
+#ifndef SPARSE_GALLOP_RATIO
+#define SPARSE_GALLOP_RATIO 32
+#endif
+#ifndef SPARSE_SIMD_MIN_LENGTH
+#define SPARSE_SIMD_MIN_LENGTH 16
+#endif
+
+/* The vector intersection compares 32-bit indices, so needs x86 and
+*  sparse_ind_t to be 32 bits */
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(SPARSE_INDEX_64)
+#define SPARSE_SIMD_INTERSECT
+#define SPARSE_SIMD_MATCHES 64
+#include <immintrin.h>
+#endif
+
+enum Accumulator { HEAP_ACCUMULATOR, HASH_ACCUMULATOR, DENSE_ACCUMULATOR };
+
+/* One row of Y being merged by the heap accumulator */
+struct Heap_Entry {
+	sparse_ind_t col;  /* The column of the current value in the row of Y */
+	int x_val;  /* The value in X that scales the row of Y */
+	sparse_ptr_t y_pos;
+	sparse_ptr_t y_end;
+};
+
+/* 
+ * Per-thread scratch space of the accumulators, allocated the first time
+ * each one is needed and reused for every row after that.
+ */
+struct Row_Accumulator {
+	int *dense_val;
+	uint64_t *dense_flag;
+	sparse_ind_t *hash_key;
+	int *hash_val;
+	sparse_ptr_t hash_capacity;
+	struct Heap_Entry *heap;
+	sparse_ptr_t heap_capacity;
+};
+
+/* The rows of the product computed by one thread, back to back */
+struct Row_Output {
+	int *val;
+	sparse_ind_t *col_ind;
+	sparse_ptr_t count;
+	sparse_ptr_t capacity;
+};
+
+/* 
+ * The rows of a sparse matrix as the row-wise kernels read them: row i is
+ * col_ind[row_begin[i]] to col_ind[row_end[i] - 1], with the rows in any
+ * order and possibly with gaps between them. A CSR matrix is the case
+ * row_end = row_ptr + 1.
+ */
+struct CSR_View {
+	int *val;
+	sparse_ind_t *col_ind;
+	sparse_ptr_t *row_begin;
+	sparse_ptr_t *row_end;
+	sparse_ind_t num_rows;
+	sparse_ind_t num_cols;
+};
+
+static inline struct CSR_View view_of_CSR(struct CSR_Matrix *R) {
+	struct CSR_View V = {R->val, R->col_ind, R->row_ptr, R->row_ptr + 1, R->num_rows,
+		R->num_cols};
+	return V;
+}
+
+/* 
+ * The semiring that a sparse product is computed over: the "addition" that
+ * combines the products and the "multiplication" that forms them. Implicit
+ * entries of a sparse matrix are the semiring's zero, and values of the
+ * product equal to it are not stored.
+ *  - PLUS_TIMES: ordinary arithmetic, zero 0
+ *  - MIN_PLUS: shortest paths, zero "infinity" (INT_MAX)
+ *  - MAX_MIN: bottleneck (widest) paths, zero INT_MIN
+ *  - MAX_TIMES: most reliable paths, for non-negative values, zero 0
+ *  - OR_AND: reachability, any non-zero value is true, zero 0
+ */
+enum Semiring { PLUS_TIMES, MIN_PLUS, MAX_MIN, MAX_TIMES, OR_AND };
+
+/* 
+ * The kernels take the semiring as an argument but are always inlined in to
+ * a switch over a constant semiring, so each case compiles to its own kernel
+ * with the semiring operations folded in to the inner loops.
+ */
+#define SEMIRING_INLINE static inline __attribute__((always_inline))
+
+/* The identity of the semiring's addition */
+SEMIRING_INLINE int semiring_zero(enum Semiring semiring) {
+	switch (semiring) {
+	case MIN_PLUS: return INT_MAX;
+	case MAX_MIN: return INT_MIN;
+	default: return 0;
+	}
+}
+
+SEMIRING_INLINE int semiring_add(enum Semiring semiring, int a, int b) {
+	switch (semiring) {
+	case MIN_PLUS: return a < b ? a : b;
+	case MAX_MIN:
+	case MAX_TIMES: return a > b ? a : b;
+	case OR_AND: return a | b;
+	default: return a + b;
+	}
+}
+
+SEMIRING_INLINE int semiring_multiply(enum Semiring semiring, int a, int b) {
+	int sum;
+	switch (semiring) {
+	case MIN_PLUS:
+		/* Saturate rather than wrap around past infinity */
+		if (__builtin_add_overflow(a, b, &sum)) return a < 0 ? INT_MIN : INT_MAX;
+		return sum;
+	case MAX_MIN: return a < b ? a : b;
+	case OR_AND: return a != 0 && b != 0;
+	default: return a * b;
+	}
+}
+
+struct CSR_Matrix *semiring_masked_sparse_matrix_multiply(struct CSR_Matrix *X,
+	struct CCS_Matrix *Y, struct CSR_Matrix *M, int complement,
+	enum Semiring semiring);
+
+
+/* 
+ * Function: sparse_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y sparse matrices. The benefits of multiplying a CSR matrix
+ *   with a CCS matrix are optimal; CSR matrices are fast at directly traversing
+ *   rows, and CCS matrices are fast at directly traversing columns. Both of
+ *   these corresponding tasks are required in the compuation X * Y.
+ *   Each dot product merges a row of X with a column of Y, see
+ *   semiring_masked_sparse_matrix_multiply.
+ * 
+ *   X: 2D sparse matrix to left-multiply
+ *   Y: 2D sparse matrix to right-multiply
+ * 
+ *   returns: the matrix X * Y as a CSR matrix
+ */
+struct CSR_Matrix *sparse_matrix_multiply(struct CSR_Matrix *X, struct CCS_Matrix *Y) {
+	return semiring_masked_sparse_matrix_multiply(X, Y, NULL, 0, PLUS_TIMES);
+}
+
+/* 
+ * Function: sort_row_entries
+ * ---------------------------- 
+ *   Sorts the entries of one row (or column) by index, moving the values
+ *   along. Insertion sort for short rows, quicksort otherwise.
+ * 
+ *   ind: the indices to sort by
+ *   val: the values of the corresponding indices
+ *   n: the number of entries
+ */
+static void sort_row_entries(sparse_ind_t *ind, int *val, sparse_ptr_t n) {
+	while (n > 16) {
+		/* Median of three as the pivot */
+		sparse_ptr_t mid = n / 2;
+		sparse_ind_t a = ind[0], b = ind[mid], c = ind[n - 1];
+		sparse_ind_t pivot = a < b ? (b < c ? b : (a < c ? c : a)) : \
+			(a < c ? a : (b < c ? c : b));
+
+		sparse_ptr_t i = 0, j = n - 1;
+		while (i <= j) {
+			while (ind[i] < pivot) i++;
+			while (ind[j] > pivot) j--;
+			if (i <= j) {
+				sparse_ind_t t_ind = ind[i]; ind[i] = ind[j]; ind[j] = t_ind;
+				int t_val = val[i]; val[i] = val[j]; val[j] = t_val;
+				i++;
+				j--;
+			}
+		}
+
+		/* Recurse on the smaller side, loop on the larger */
+		if (j + 1 < n - i) {
+			sort_row_entries(ind, val, j + 1);
+			ind += i;
+			val += i;
+			n -= i;
+		} else {
+			sort_row_entries(ind + i, val + i, n - i);
+			n = j + 1;
+		}
+	}
+
+	for (sparse_ptr_t i = 1; i < n; i++) {
+		sparse_ind_t cur_ind = ind[i];
+		int cur_val = val[i];
+		sparse_ptr_t j = i;
+		for (; j > 0 && ind[j - 1] > cur_ind; j--) {
+			ind[j] = ind[j - 1];
+			val[j] = val[j - 1];
+		}
+		ind[j] = cur_ind;
+		val[j] = cur_val;
+	}
+}
+
+/* 
+ * Function: choose_accumulator
+ * ---------------------------- 
+ *   Picks how to accumulate one row of X * Y from the number of
+ *   multiplications it needs (its flops) and the number of non-zero values
+ *   it is expected to have.
+ *    - Very short rows are merged with a heap over the rows of Y they use,
+ *      whose scratch space is one entry per non-zero value in the row of X,
+ *      O(nnz of the row) rather than O(num_cols).
+ *    - Rows that will fill a good part of num_cols, or whose flops alone
+ *      would make a hash table as wide, go in to a dense array as wide as Y
+ *      that is reset through a bitmap of the touched columns.
+ *    - Everything in between goes in to a hash table sized by the flops, so
+ *      its cost does not depend on num_cols.
+ * 
+ *   flops: the number of multiplications in the row
+ *   nnz: the expected number of non-zero values in the row, at most flops
+ *   num_cols: the number of columns in the product
+ * 
+ *   returns: the accumulator to use for the row
+ */
+static enum Accumulator choose_accumulator(sparse_ptr_t flops, double nnz,
+	sparse_ind_t num_cols) {
+	if (flops <= SPGEMM_HEAP_MAX_FLOPS) return HEAP_ACCUMULATOR;
+	if (nnz * SPGEMM_DENSE_RATIO >= num_cols || flops >= num_cols)
+		return DENSE_ACCUMULATOR;
+	return HASH_ACCUMULATOR;
+}
+
+/* 
+ * Function: estimate_row_cost
+ * ---------------------------- 
+ *   Estimates the steps taken to compute one row of X * Y, for splitting
+ *   the rows between threads: the multiplications, plus setting up and
+ *   reading back the accumulator, plus writing out (and for the hash table
+ *   sorting) the non-zero values.
+ * 
+ *   flops: the number of multiplications in the row
+ *   compression: the expected ratio of non-zero values to flops
+ *   num_cols: the number of columns in the product
+ * 
+ *   returns: the estimated cost of the row
+ */
+static sparse_ptr_t estimate_row_cost(sparse_ptr_t flops, double compression,
+	sparse_ind_t num_cols) {
+	double nnz = flops * compression;
+	if (nnz > num_cols) nnz = num_cols;
+	sparse_ptr_t bound = flops < num_cols ? flops : num_cols;
+
+	switch (choose_accumulator(flops, nnz, num_cols)) {
+	case HEAP_ACCUMULATOR:
+		return flops + (sparse_ptr_t) nnz;
+	case HASH_ACCUMULATOR:
+		return flops + 4 * bound + 2 * (sparse_ptr_t) nnz;
+	case DENSE_ACCUMULATOR:
+		return flops + (bound < num_cols / 64 ? bound : num_cols / 64) + \
+			(sparse_ptr_t) nnz;
+	}
+	return flops;
+}
+
+/* Makes room for at least extra more values in a thread's output */
+static void reserve_row_output(struct Row_Output *out, sparse_ptr_t extra) {
+	if (out->count + extra <= out->capacity) return;
+
+	out->capacity = out->capacity * 2 > out->count + extra ? out->capacity * 2 : \
+		out->count + extra;
+	out->val = (int *) Realloc(out->val, out->capacity * sizeof(int));
+	out->col_ind = (sparse_ind_t *) Realloc(out->col_ind, out->capacity * \
+		sizeof(sparse_ind_t));
+}
+
+/* Restores the heap order from position i down, by column */
+static void sift_down_heap(struct Heap_Entry *heap, sparse_ptr_t size, sparse_ptr_t i) {
+	struct Heap_Entry cur = heap[i];
+	for (;;) {
+		sparse_ptr_t child = 2 * i + 1;
+		if (child >= size) break;
+		if (child + 1 < size && heap[child + 1].col < heap[child].col) child++;
+		if (heap[child].col >= cur.col) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = cur;
+}
+
+/* 
+ * Function: partition_rows
+ * ---------------------------- 
+ *   Splits the rows of a product (or a list of them) between the threads so
+ *   that each gets a contiguous range of rows with an equal share of the
+ *   total cost.
+ * 
+ *   row_cost: row_cost[i + 1] holds the cost of row i; it is turned in to a
+ *     prefix sum, in which every row costs at least one step, even when empty
+ *   num_rows: the number of rows
+ *   first_row: set to a new array of num_threads + 1 entries; thread t gets
+ *     rows first_row[t] to first_row[t + 1] - 1
+ * 
+ *   returns: the number of threads to use
+ */
+static int partition_rows(sparse_ptr_t *row_cost, sparse_ind_t num_rows,
+	sparse_ind_t **first_row) {
+	row_cost[0] = 0;
+	for (sparse_ind_t i = 0; i < num_rows; i++) row_cost[i + 1] += row_cost[i] + 1;
+
+	int num_threads = omp_get_max_threads();
+	if (num_threads > num_rows) num_threads = num_rows > 0 ? num_rows : 1;
+
+	*first_row = (sparse_ind_t *) Malloc((num_threads + 1) * sizeof(sparse_ind_t));
+
+	/* Thread t gets the rows whose cost falls in the tth equal share */
+	for (int t = 0; t <= num_threads; t++) {
+		sparse_ptr_t target = row_cost[num_rows] * t / num_threads;
+		sparse_ind_t lo = 0, hi = num_rows;
+		while (lo < hi) {
+			sparse_ind_t mid = lo + (hi - lo) / 2;
+			if (row_cost[mid] < target) lo = mid + 1;
+			else hi = mid;
+		}
+		(*first_row)[t] = lo;
+	}
+
+	return num_threads;
+}
+
+/* 
+ * Function: stitch_row_outputs
+ * ---------------------------- 
+ *   Copies the rows computed by each thread in to an exactly sized CSR
+ *   matrix, and frees the threads' buffers.
+ * 
+ *   outputs: the rows computed by each thread, as split by partition_rows
+ *   first_row: the first row of each thread, from partition_rows
+ *   num_threads: the number of threads
+ *   z_row_ptr: z_row_ptr[i + 1] holds the number of non-zero values in row i;
+ *     it is turned in to the row_ptr of the result
+ *   z_rows: the number of rows in the result
+ *   z_cols: the number of columns in the result
+ * 
+ *   returns: the stitched CSR matrix
+ */
+static struct CSR_Matrix *stitch_row_outputs(struct Row_Output *outputs,
+	sparse_ind_t *first_row, int num_threads, sparse_ptr_t *z_row_ptr,
+	sparse_ind_t z_rows, sparse_ind_t z_cols) {
+	z_row_ptr[0] = 0;
+	for (sparse_ind_t i = 0; i < z_rows; i++) z_row_ptr[i + 1] += z_row_ptr[i];
+
+	struct CSR_Matrix *Z = init_CSR_matrix(z_row_ptr[z_rows], z_rows, z_cols);
+	memcpy(Z->row_ptr, z_row_ptr, ((size_t) z_rows + 1) * sizeof(sparse_ptr_t));
+
+	#pragma omp parallel for num_threads(num_threads)
+	for (int t = 0; t < num_threads; t++) {
+		sparse_ptr_t start = z_row_ptr[first_row[t]];
+
+		/* A thread without any values never allocated its buffers */
+		if (outputs[t].count > 0) {
+			memcpy(Z->val + start, outputs[t].val, outputs[t].count * sizeof(int));
+			memcpy(Z->col_ind + start, outputs[t].col_ind,
+				outputs[t].count * sizeof(sparse_ind_t));
+		}
+		free(outputs[t].val);
+		free(outputs[t].col_ind);
+	}
+
+	return Z;
+}
+
+/* 
+ * Function: merge_dot_product
+ * ---------------------------- 
+ *   Computes the dot product of two sparse vectors by merging their sorted
+ *   indices one step at a time. Best when they have similar lengths.
+ * 
+ *   a_ind, a_val, a_len: the indices, values and length of the first vector
+ *   b_ind, b_val, b_len: the indices, values and length of the second vector
+ *   semiring: the semiring to compute over
+ * 
+ *   returns: the dot product
+ */
+SEMIRING_INLINE int merge_dot_product(const sparse_ind_t *a_ind, const int *a_val,
+	sparse_ptr_t a_len, const sparse_ind_t *b_ind, const int *b_val,
+	sparse_ptr_t b_len, enum Semiring semiring) {
+	int dot_product = semiring_zero(semiring);
+
+	/* For traversing the second vector */
+	sparse_ptr_t j = 0;
+
+	/* Traverse the first vector */
+	for (sparse_ptr_t i = 0; i < a_len; i++) {
+		while (j < b_len && b_ind[j] < a_ind[i]) j++;
+
+		/* There are no more non-zero values in the second vector, no need to
+		*  continue */
+		if (j >= b_len) break;
+
+		if (b_ind[j] == a_ind[i])
+			dot_product = semiring_add(semiring, dot_product,
+				semiring_multiply(semiring, a_val[i], b_val[j]));
+	}
+
+	return dot_product;
+}
+
+/* 
+ * Function: gallop_dot_product
+ * ---------------------------- 
+ *   Computes the dot product of a short and a much longer sparse vector.
+ *   Each index of the short vector is looked up in the rest of the long one
+ *   by doubling the step until it is overshot, then binary searching the last
+ *   step, so the cost grows with the log of the gaps rather than with the
+ *   length of the long vector.
+ * 
+ *   a_ind, a_val, a_len: the indices, values and length of the short vector
+ *   b_ind, b_val, b_len: the indices, values and length of the long vector
+ *   semiring: the semiring to compute over
+ * 
+ *   returns: the dot product
+ */
+SEMIRING_INLINE int gallop_dot_product(const sparse_ind_t *a_ind, const int *a_val,
+	sparse_ptr_t a_len, const sparse_ind_t *b_ind, const int *b_val,
+	sparse_ptr_t b_len, enum Semiring semiring) {
+	int dot_product = semiring_zero(semiring);
+	sparse_ptr_t j = 0;
+
+	for (sparse_ptr_t i = 0; i < a_len && j < b_len; i++) {
+		sparse_ind_t target = a_ind[i];
+
+		/* b_ind[lo] < target <= b_ind[hi], with hi = b_len meaning past the
+		*  end */
+		if (b_ind[j] >= target) {
+			if (b_ind[j] == target)
+				dot_product = semiring_add(semiring, dot_product,
+					semiring_multiply(semiring, a_val[i], b_val[j]));
+			continue;
+		}
+
+		sparse_ptr_t lo = j, step = 1;
+		while (lo + step < b_len && b_ind[lo + step] < target) {
+			lo += step;
+			step *= 2;
+		}
+		sparse_ptr_t hi = lo + step < b_len ? lo + step : b_len;
+
+		while (hi - lo > 1) {
+			sparse_ptr_t mid = lo + (hi - lo) / 2;
+			if (b_ind[mid] < target) lo = mid;
+			else hi = mid;
+		}
+
+		j = hi;
+		if (j < b_len && b_ind[j] == target)
+			dot_product = semiring_add(semiring, dot_product,
+				semiring_multiply(semiring, a_val[i], b_val[j]));
+	}
+
+	return dot_product;
+}
+
+#ifdef SPARSE_SIMD_INTERSECT
+/* 
+ * Function: intersect_blocks_avx2
+ * ---------------------------- 
+ *   Finds the common indices of two sorted index lists, 8 x 8 at a time: a
+ *   block of each list is loaded in to a vector, and the second block is
+ *   rotated through all 8 lanes, comparing all 64 pairs in 8 instructions.
+ *   Whichever block ends on the smaller index is done and is replaced by the
+ *   next one. Stops when either list has fewer than 8 indices left, or when
+ *   the match buffers might not fit another block.
+ * 
+ *   a, a_len: the first list and its length
+ *   a_pos: where to start in the first list, set to where it stopped
+ *   b, b_len: the second list and its length
+ *   b_pos: where to start in the second list, set to where it stopped
+ *   a_match, b_match: filled with the positions of each common index, in
+ *     buffers of SPARSE_SIMD_MATCHES entries
+ * 
+ *   returns: the number of common indices found
+ */
+__attribute__((target("avx2")))
+static int intersect_blocks_avx2(const sparse_ind_t *a, sparse_ptr_t a_len,
+	sparse_ptr_t *a_pos, const sparse_ind_t *b, sparse_ptr_t b_len,
+	sparse_ptr_t *b_pos, sparse_ptr_t *a_match, sparse_ptr_t *b_match) {
+	const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+	sparse_ptr_t i = *a_pos, j = *b_pos;
+	int count = 0;
+
+	while (i + 8 <= a_len && j + 8 <= b_len && count <= SPARSE_SIMD_MATCHES - 8) {
+		__m256i a_block = _mm256_loadu_si256((const __m256i *) (a + i));
+		__m256i b_block = _mm256_loadu_si256((const __m256i *) (b + j));
+
+		/* After r rotations, lane l of b_block holds b[j + (l + r) % 8] */
+		for (int r = 0; r < 8; r++) {
+			int mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+				_mm256_cmpeq_epi32(a_block, b_block)));
+
+			while (mask) {
+				int lane = __builtin_ctz(mask);
+				mask &= mask - 1;
+				a_match[count] = i + lane;
+				b_match[count] = j + ((lane + r) & 7);
+				count++;
+			}
+
+			b_block = _mm256_permutevar8x32_epi32(b_block, rotate);
+		}
+
+		sparse_ind_t a_last = a[i + 7], b_last = b[j + 7];
+		if (a_last <= b_last) i += 8;
+		if (b_last <= a_last) j += 8;
+	}
+
+	*a_pos = i;
+	*b_pos = j;
+	return count;
+}
+
+/* 
+ * Function: simd_dot_product
+ * ---------------------------- 
+ *   Computes the dot product of two sparse vectors of similar, moderate
+ *   lengths by intersecting their indices with intersect_blocks_avx2, then
+ *   merging whatever is left over at the ends.
+ * 
+ *   a_ind, a_val, a_len: the indices, values and length of the first vector
+ *   b_ind, b_val, b_len: the indices, values and length of the second vector
+ *   semiring: the semiring to compute over
+ * 
+ *   returns: the dot product
+ */
+SEMIRING_INLINE int simd_dot_product(const sparse_ind_t *a_ind, const int *a_val,
+	sparse_ptr_t a_len, const sparse_ind_t *b_ind, const int *b_val,
+	sparse_ptr_t b_len, enum Semiring semiring) {
+	int dot_product = semiring_zero(semiring);
+	sparse_ptr_t a_match[SPARSE_SIMD_MATCHES], b_match[SPARSE_SIMD_MATCHES];
+	sparse_ptr_t i = 0, j = 0;
+
+	while (i + 8 <= a_len && j + 8 <= b_len) {
+		int count = intersect_blocks_avx2(a_ind, a_len, &i, b_ind, b_len, &j,
+			a_match, b_match);
+
+		for (int c = 0; c < count; c++)
+			dot_product = semiring_add(semiring, dot_product,
+				semiring_multiply(semiring, a_val[a_match[c]], b_val[b_match[c]]));
+	}
+
+	return semiring_add(semiring, dot_product, merge_dot_product(a_ind + i,
+		a_val + i, a_len - i, b_ind + j, b_val + j, b_len - j, semiring));
+}
+#endif
+
+/* 
+ * Function: sparse_dot_product
+ * ---------------------------- 
+ *   Computes the dot product of a row of X and a column of Y by intersecting
+ *   their sorted indices, with the method that suits their lengths:
+ *    - galloping when one is more than SPARSE_GALLOP_RATIO times longer than
+ *      the other
+ *    - 8 x 8 vector block compares when both have at least
+ *      SPARSE_SIMD_MIN_LENGTH values and the CPU supports AVX2
+ *    - a plain merge otherwise
+ *   The semirings here all multiply commutatively, so the row and column can
+ *   be swapped freely.
+ * 
+ *   X: the CSR matrix holding the row
+ *   x_row: the row of X
+ *   Y: the CCS matrix holding the column
+ *   y_col: the column of Y
+ *   semiring: the semiring to compute over
+ * 
+ *   returns: the dot product
+ */
+SEMIRING_INLINE int sparse_dot_product(struct CSR_Matrix *X, sparse_ind_t x_row,
+	struct CCS_Matrix *Y, sparse_ind_t y_col, enum Semiring semiring) {
+	const sparse_ind_t *x_ind = X->col_ind + X->row_ptr[x_row];
+	const int *x_val = X->val + X->row_ptr[x_row];
+	sparse_ptr_t x_len = X->row_ptr[x_row + 1] - X->row_ptr[x_row];
+	const sparse_ind_t *y_ind = Y->row_ind + Y->col_ptr[y_col];
+	const int *y_val = Y->val + Y->col_ptr[y_col];
+	sparse_ptr_t y_len = Y->col_ptr[y_col + 1] - Y->col_ptr[y_col];
+
+	/* Nothing in common if either is empty or their ranges do not overlap */
+	if (x_len == 0 || y_len == 0 || x_ind[x_len - 1] < y_ind[0] || \
+		y_ind[y_len - 1] < x_ind[0]) return semiring_zero(semiring);
+
+	if (x_len * SPARSE_GALLOP_RATIO < y_len)
+		return gallop_dot_product(x_ind, x_val, x_len, y_ind, y_val, y_len, semiring);
+	if (y_len * SPARSE_GALLOP_RATIO < x_len)
+		return gallop_dot_product(y_ind, y_val, y_len, x_ind, x_val, x_len, semiring);
+
+#ifdef SPARSE_SIMD_INTERSECT
+	if (x_len >= SPARSE_SIMD_MIN_LENGTH && y_len >= SPARSE_SIMD_MIN_LENGTH && \
+		__builtin_cpu_supports("avx2"))
+		return simd_dot_product(x_ind, x_val, x_len, y_ind, y_val, y_len, semiring);
+#endif
+
+	return merge_dot_product(x_ind, x_val, x_len, y_ind, y_val, y_len, semiring);
+}
+
+/* 
+ * Function: boolean_dot_product
+ * ---------------------------- 
+ *   Computes the OR_AND dot product of a row of X, packed in to a bitmap over
+ *   its columns, and a column of Y. Each index of the column is a single bit
+ *   test, and the first one shared with the row decides the result.
+ * 
+ *   x_bits: the bitmap of the non-zero values in the row of X
+ *   Y: the CCS matrix holding the column
+ *   y_col: the column of Y
+ * 
+ *   returns: 1 if the row and column share a non-zero index, 0 otherwise
+ */
+static inline int boolean_dot_product(const uint64_t *x_bits, struct CCS_Matrix *Y,
+	sparse_ind_t y_col) {
+	for (sparse_ptr_t y_row = Y->col_ptr[y_col]; y_row < Y->col_ptr[y_col + 1]; y_row++) {
+		sparse_ind_t k = Y->row_ind[y_row];
+		if (Y->val[y_row] != 0 && (x_bits[k >> 6] >> (k & 63) & 1)) return 1;
+	}
+
+	return 0;
+}
+
+/* 
+ * Function: nonempty_indices
+ * ---------------------------- 
+ *   Lists the rows (or columns) of a compressed matrix that hold at least one
+ *   value.
+ * 
+ *   ptr: the row_ptr (or col_ptr) of the matrix
+ *   n: the number of rows (or columns)
+ *   list: filled with the non-empty rows (or columns), in order
+ * 
+ *   returns: the number of non-empty rows (or columns)
+ */
+static sparse_ind_t nonempty_indices(const sparse_ptr_t *ptr, sparse_ind_t n,
+	sparse_ind_t *list) {
+	sparse_ind_t count = 0;
+	for (sparse_ind_t i = 0; i < n; i++)
+		if (ptr[i] != ptr[i + 1]) list[count++] = i;
+	return count;
+}
+
+/* 
+ * Function: dot_product_rows
+ * ---------------------------- 
+ *   Computes the rows x_rows[first] to x_rows[last - 1] of (X * Y) .* M one
+ *   dot product at a time, appending them to out. Only the non-empty columns
+ *   of Y are visited. For OR_AND, each row of X is packed in to x_bits and
+ *   the columns of Y are tested against it instead.
+ * 
+ *   X, Y, M, complement: as in semiring_masked_sparse_matrix_multiply
+ *   x_rows: the non-empty rows of X
+ *   first: the first entry of x_rows to compute
+ *   last: one past the last entry of x_rows to compute
+ *   y_cols: the non-empty columns of Y
+ *   num_y_cols: the number of entries in y_cols
+ *   z_row_ptr: z_row_ptr[i + 1] is set to the number of values in row i
+ *   x_bits: for OR_AND, a zeroed bitmap as wide as X
+ *   out: the thread's output
+ *   semiring: the semiring to compute over
+ */
+SEMIRING_INLINE void dot_product_rows(struct CSR_Matrix *X, struct CCS_Matrix *Y,
+	struct CSR_Matrix *M, int complement, const sparse_ind_t *x_rows,
+	sparse_ind_t first, sparse_ind_t last, const sparse_ind_t *y_cols,
+	sparse_ind_t num_y_cols, sparse_ptr_t *z_row_ptr, uint64_t *x_bits,
+	struct Row_Output *out, enum Semiring semiring) {
+	int zero = semiring_zero(semiring);
+
+	for (sparse_ind_t cur = first; cur < last; cur++) {
+		sparse_ind_t cur_z_row = x_rows[cur];
+		sparse_ptr_t row_start = out->count;
+		sparse_ptr_t m_first = M != NULL ? M->row_ptr[cur_z_row] : 0;
+		sparse_ptr_t m_last = M != NULL ? M->row_ptr[cur_z_row + 1] : 0;
+
+		if (semiring == OR_AND)
+			for (sparse_ptr_t x_col = X->row_ptr[cur_z_row];
+				x_col < X->row_ptr[cur_z_row + 1]; x_col++)
+				if (X->val[x_col] != 0)
+					x_bits[X->col_ind[x_col] >> 6] |= (uint64_t) 1 << (X->col_ind[x_col] & 63);
+
+		if (M != NULL && !complement) {
+			reserve_row_output(out, m_last - m_first);
+
+			for (sparse_ptr_t m_col = m_first; m_col < m_last; m_col++) {
+				sparse_ind_t cur_z_col = M->col_ind[m_col];
+				int dot_product = semiring == OR_AND ? \
+					boolean_dot_product(x_bits, Y, cur_z_col) : \
+					sparse_dot_product(X, cur_z_row, Y, cur_z_col, semiring);
+
+				if (dot_product != zero) {
+					out->col_ind[out->count] = cur_z_col;
+					out->val[out->count] = dot_product;
+					out->count++;
+				}
+			}
+		} else {
+			reserve_row_output(out, num_y_cols);
+
+			/* Walk the row of the mask (if any) alongside, skipping its
+			*  columns */
+			sparse_ptr_t m_col = m_first;
+			for (sparse_ind_t cur_y_col = 0; cur_y_col < num_y_cols; cur_y_col++) {
+				sparse_ind_t cur_z_col = y_cols[cur_y_col];
+
+				while (m_col < m_last && M->col_ind[m_col] < cur_z_col) m_col++;
+				if (m_col < m_last && M->col_ind[m_col] == cur_z_col) continue;
+
+				int dot_product = semiring == OR_AND ? \
+					boolean_dot_product(x_bits, Y, cur_z_col) : \
+					sparse_dot_product(X, cur_z_row, Y, cur_z_col, semiring);
+
+				if (dot_product != zero) {
+					out->col_ind[out->count] = cur_z_col;
+					out->val[out->count] = dot_product;
+					out->count++;
+				}
+			}
+		}
+
+		if (semiring == OR_AND)
+			for (sparse_ptr_t x_col = X->row_ptr[cur_z_row];
+				x_col < X->row_ptr[cur_z_row + 1]; x_col++)
+				x_bits[X->col_ind[x_col] >> 6] = 0;
+
+		z_row_ptr[cur_z_row + 1] = out->count - row_start;
+	}
+}
+
+/* 
+ * Function: semiring_masked_sparse_matrix_multiply
+ * ---------------------------- 
+ *   Computes (X * Y) .* M over a semiring, the product restricted to the
+ *   sparsity pattern of a mask M (its values are ignored), or to everything
+ *   outside of it when complement is set. Only the dot products of the kept
+ *   positions are ever computed, each by merging a row of X with a column of
+ *   Y, so the work is proportional to the number of positions in the mask
+ *   rather than to z_rows * z_cols. Without a mask, or with a complemented
+ *   one, only the non-empty rows of X and columns of Y are visited.
+ * 
+ *   X: 2D sparse matrix to left-multiply
+ *   Y: 2D sparse matrix to right-multiply
+ *   M: the mask, of the same size as X * Y, or NULL for no mask
+ *   complement: if non-zero, compute the positions not in M instead
+ *   semiring: the semiring to compute over
+ * 
+ *   returns: the matrix (X * Y) .* M as a CSR matrix
+ */
+struct CSR_Matrix *semiring_masked_sparse_matrix_multiply(struct CSR_Matrix *X,
+	struct CCS_Matrix *Y, struct CSR_Matrix *M, int complement,
+	enum Semiring semiring) {
+	// Check whether X and Y are compatible
+	if (X->num_cols != Y->num_rows) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	sparse_ind_t z_rows = X->num_rows;
+	sparse_ind_t z_cols = Y->num_cols;
+
+	if (M != NULL && (M->num_rows != z_rows || M->num_cols != z_cols)) {
+		fprintf(stderr, "Mask size does not match the product.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The number of non-zero values in Z is not known up front, and
+	*  z_rows * z_cols can be far larger than both the memory available and
+	*  the range of sparse_ind_t, so each thread collects its rows in buffers
+	*  on the heap that grow as needed, and they are copied in to a struct
+	*  later */
+	/* Although more time-consuming, ensures the structs are space efficient */
+	/* Space efficiency is important in compressed formats for future
+	*  computations */
+	sparse_ptr_t *z_row_ptr = (sparse_ptr_t *) calloc((size_t) z_rows + 1,
+		sizeof(sparse_ptr_t));
+	if (z_row_ptr == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Only the non-empty rows of X and columns of Y can produce values, so
+	*  the work scales with them rather than with z_rows * z_cols */
+	sparse_ind_t *x_rows = (sparse_ind_t *) Malloc(((size_t) z_rows + 1) * \
+		sizeof(sparse_ind_t));
+	sparse_ind_t num_x_rows = nonempty_indices(X->row_ptr, z_rows, x_rows);
+	sparse_ind_t *y_cols = (sparse_ind_t *) Malloc(((size_t) z_cols + 1) * \
+		sizeof(sparse_ind_t));
+	sparse_ind_t num_y_cols = nonempty_indices(Y->col_ptr, z_cols, y_cols);
+
+	TRACE_BEGIN(symbolic, "sparse_matrix_multiply", "symbolic");
+
+	/* Each row costs one merge per kept position */
+	sparse_ptr_t *row_cost = (sparse_ptr_t *) Malloc(((size_t) num_x_rows + 1) * \
+		sizeof(sparse_ptr_t));
+	for (sparse_ind_t cur = 0; cur < num_x_rows; cur++) {
+		sparse_ind_t i = x_rows[cur];
+		sparse_ptr_t kept = M != NULL ? M->row_ptr[i + 1] - M->row_ptr[i] : 0;
+		if (M == NULL || complement)
+			kept = num_y_cols > kept ? num_y_cols - kept : 0;
+		row_cost[cur + 1] = kept * (X->row_ptr[i + 1] - X->row_ptr[i]);
+	}
+
+	/* Split the non-empty rows between the threads, then widen each share to
+	*  the range of rows it covers for stitching */
+	sparse_ind_t *first_row;
+	int num_threads = partition_rows(row_cost, num_x_rows, &first_row);
+	sparse_ind_t *first_x_row = (sparse_ind_t *) Malloc((num_threads + 1) * \
+		sizeof(sparse_ind_t));
+	memcpy(first_x_row, first_row, (num_threads + 1) * sizeof(sparse_ind_t));
+	for (int t = 0; t <= num_threads; t++)
+		first_row[t] = t == 0 ? 0 : (first_x_row[t] < num_x_rows ? \
+			x_rows[first_x_row[t]] : z_rows);
+
+	struct Row_Output *outputs = (struct Row_Output *) Malloc(num_threads * \
+		sizeof(struct Row_Output));
+	TRACE_END(symbolic);
+
+	#pragma omp parallel num_threads(num_threads)
+	{
+		int thread = omp_get_thread_num();
+		struct Row_Output *out = &outputs[thread];
+		memset(out, 0, sizeof(struct Row_Output));
+		sparse_ind_t first = first_x_row[thread], last = first_x_row[thread + 1];
+
+		/* The merges bound the multiplications from above */
+		TRACE_BEGIN(numeric, "sparse_matrix_multiply", "numeric");
+		TRACE_COUNT(numeric, 2 * (row_cost[last] - row_cost[first]), \
+			(row_cost[last] - row_cost[first]) * 2 * (sizeof(sparse_ind_t) + sizeof(int)));
+
+		uint64_t *x_bits = NULL;
+		if (semiring == OR_AND) {
+			x_bits = (uint64_t *) Malloc(((size_t) X->num_cols / 64 + 1) * sizeof(uint64_t));
+			memset(x_bits, 0, ((size_t) X->num_cols / 64 + 1) * sizeof(uint64_t));
+		}
+
+		switch (semiring) {
+		case PLUS_TIMES:
+			dot_product_rows(X, Y, M, complement, x_rows, first, last, y_cols,
+				num_y_cols, z_row_ptr, x_bits, out, PLUS_TIMES);
+			break;
+		case MIN_PLUS:
+			dot_product_rows(X, Y, M, complement, x_rows, first, last, y_cols,
+				num_y_cols, z_row_ptr, x_bits, out, MIN_PLUS);
+			break;
+		case MAX_MIN:
+			dot_product_rows(X, Y, M, complement, x_rows, first, last, y_cols,
+				num_y_cols, z_row_ptr, x_bits, out, MAX_MIN);
+			break;
+		case MAX_TIMES:
+			dot_product_rows(X, Y, M, complement, x_rows, first, last, y_cols,
+				num_y_cols, z_row_ptr, x_bits, out, MAX_TIMES);
+			break;
+		case OR_AND:
+			dot_product_rows(X, Y, M, complement, x_rows, first, last, y_cols,
+				num_y_cols, z_row_ptr, x_bits, out, OR_AND);
+			break;
+		}
+
+		TRACE_END(numeric);
+		free(x_bits);
+	}
+
+	TRACE_BEGIN(stitch, "sparse_matrix_multiply", "stitch");
+	struct CSR_Matrix *Z = stitch_row_outputs(outputs, first_row, num_threads,
+		z_row_ptr, z_rows, z_cols);
+	TRACE_COUNT(stitch, 0, Z->row_ptr[z_rows] * 2 * (sizeof(sparse_ind_t) + sizeof(int)));
+	TRACE_END(stitch);
+
+	free(z_row_ptr);
+	free(row_cost);
+	free(outputs);
+	free(first_row);
+	free(first_x_row);
+	free(x_rows);
+	free(y_cols);
+
+	return Z;
+}
+
+/* 
+ * Function: semiring_sparse_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y sparse matrices over a semiring, e.g. MIN_PLUS for one
+ *   step of shortest paths. See sparse_matrix_multiply.
+ * 
+ *   X: 2D sparse matrix to left-multiply
+ *   Y: 2D sparse matrix to right-multiply
+ *   semiring: the semiring to compute over
+ * 
+ *   returns: the matrix X * Y as a CSR matrix
+ */
+struct CSR_Matrix *semiring_sparse_matrix_multiply(struct CSR_Matrix *X,
+	struct CCS_Matrix *Y, enum Semiring semiring) {
+	return semiring_masked_sparse_matrix_multiply(X, Y, NULL, 0, semiring);
+}
+
+/* 
+ * Function: masked_sparse_matrix_multiply
+ * ---------------------------- 
+ *   Computes (X * Y) .* M, see semiring_masked_sparse_matrix_multiply.
+ * 
+ *   X: 2D sparse matrix to left-multiply
+ *   Y: 2D sparse matrix to right-multiply
+ *   M: the mask, of the same size as X * Y
+ *   complement: if non-zero, compute the positions not in M instead
+ * 
+ *   returns: the matrix (X * Y) .* M as a CSR matrix
+ */
+struct CSR_Matrix *masked_sparse_matrix_multiply(struct CSR_Matrix *X,
+	struct CCS_Matrix *Y, struct CSR_Matrix *M, int complement) {
+	return semiring_masked_sparse_matrix_multiply(X, Y, M, complement, PLUS_TIMES);
+}
+
+/* 
+ * Function: accumulate_row_heap
+ * ---------------------------- 
+ *   Computes one row of X * Y as a k-way merge of the rows of Y selected by
+ *   the row of X, appending its non-zero values to out in column order.
+ * 
+ *   X: the left matrix
+ *   Y: the right matrix
+ *   row: the row of X to compute
+ *   acc: the thread's scratch space
+ *   out: the thread's output
+ *   semiring: the semiring to compute over
+ */
+SEMIRING_INLINE void accumulate_row_heap(struct CSR_View *X, struct CSR_View *Y,
+	sparse_ind_t row, struct Row_Accumulator *acc, struct Row_Output *out,
+	enum Semiring semiring) {
+	sparse_ptr_t size = 0;
+
+	for (sparse_ptr_t x_col = X->row_begin[row]; x_col < X->row_end[row]; x_col++) {
+		sparse_ind_t y_row = X->col_ind[x_col];
+		if (Y->row_begin[y_row] == Y->row_end[y_row]) continue;
+
+		if (size == acc->heap_capacity) {
+			acc->heap_capacity = acc->heap_capacity ? acc->heap_capacity * 2 : 16;
+			acc->heap = (struct Heap_Entry *) Realloc(acc->heap,
+				acc->heap_capacity * sizeof(struct Heap_Entry));
+		}
+
+		struct Heap_Entry entry = {Y->col_ind[Y->row_begin[y_row]], X->val[x_col],
+			Y->row_begin[y_row], Y->row_end[y_row]};
+		acc->heap[size++] = entry;
+	}
+
+	for (sparse_ptr_t i = size / 2; i-- > 0;) sift_down_heap(acc->heap, size, i);
+
+	sparse_ptr_t row_start = out->count;
+	while (size > 0) {
+		struct Heap_Entry *top = &acc->heap[0];
+		int product = semiring_multiply(semiring, top->x_val, Y->val[top->y_pos]);
+
+		if (out->count > row_start && out->col_ind[out->count - 1] == top->col)
+			out->val[out->count - 1] = semiring_add(semiring, out->val[out->count - 1],
+				product);
+		else {
+			out->col_ind[out->count] = top->col;
+			out->val[out->count] = product;
+			out->count++;
+		}
+
+		if (++top->y_pos < top->y_end) top->col = Y->col_ind[top->y_pos];
+		else *top = acc->heap[--size];
+		sift_down_heap(acc->heap, size, 0);
+	}
+
+	/* Drop the values that added up to the semiring's zero */
+	sparse_ptr_t kept = row_start;
+	for (sparse_ptr_t i = row_start; i < out->count; i++) {
+		if (out->val[i] == semiring_zero(semiring)) continue;
+		out->col_ind[kept] = out->col_ind[i];
+		out->val[kept] = out->val[i];
+		kept++;
+	}
+	out->count = kept;
+}
+
+/* 
+ * Function: accumulate_row_hash
+ * ---------------------------- 
+ *   Computes one row of X * Y in an open addressing hash table with linear
+ *   probing, appending its non-zero values to out in column order.
+ * 
+ *   X: the left matrix
+ *   Y: the right matrix
+ *   row: the row of X to compute
+ *   flops: the number of multiplications in the row
+ *   acc: the thread's scratch space
+ *   out: the thread's output
+ *   semiring: the semiring to compute over
+ */
+SEMIRING_INLINE void accumulate_row_hash(struct CSR_View *X, struct CSR_View *Y,
+	sparse_ind_t row, sparse_ptr_t flops, struct Row_Accumulator *acc,
+	struct Row_Output *out, enum Semiring semiring) {
+	/* At most half full, so probe sequences stay short */
+	sparse_ptr_t bound = flops < Y->num_cols ? flops : Y->num_cols;
+	sparse_ptr_t size = 16;
+	while (size < 2 * bound) size *= 2;
+	sparse_ptr_t mask = size - 1;
+
+	if (size > acc->hash_capacity) {
+		acc->hash_capacity = size;
+		acc->hash_key = (sparse_ind_t *) Realloc(acc->hash_key, size * sizeof(sparse_ind_t));
+		acc->hash_val = (int *) Realloc(acc->hash_val, size * sizeof(int));
+	}
+	for (sparse_ptr_t h = 0; h < size; h++) acc->hash_key[h] = -1;
+
+	for (sparse_ptr_t x_col = X->row_begin[row]; x_col < X->row_end[row]; x_col++) {
+		sparse_ind_t y_row = X->col_ind[x_col];
+		int x_val = X->val[x_col];
+
+		for (sparse_ptr_t y_col = Y->row_begin[y_row]; y_col < Y->row_end[y_row]; y_col++) {
+			sparse_ind_t col = Y->col_ind[y_col];
+			int product = semiring_multiply(semiring, x_val, Y->val[y_col]);
+			sparse_ptr_t h = ((uint64_t) col * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+
+			while (acc->hash_key[h] != -1 && acc->hash_key[h] != col) h = (h + 1) & mask;
+
+			if (acc->hash_key[h] == -1) {
+				acc->hash_key[h] = col;
+				acc->hash_val[h] = product;
+			} else acc->hash_val[h] = semiring_add(semiring, acc->hash_val[h], product);
+		}
+	}
+
+	sparse_ptr_t row_start = out->count;
+	for (sparse_ptr_t h = 0; h < size; h++) {
+		if (acc->hash_key[h] == -1 || acc->hash_val[h] == semiring_zero(semiring))
+			continue;
+		out->col_ind[out->count] = acc->hash_key[h];
+		out->val[out->count] = acc->hash_val[h];
+		out->count++;
+	}
+
+	sort_row_entries(out->col_ind + row_start, out->val + row_start,
+		out->count - row_start);
+}
+
+/* 
+ * Function: accumulate_row_dense
+ * ---------------------------- 
+ *   Computes one row of X * Y in a dense array as wide as Y, appending its
+ *   non-zero values to out in column order. A bitmap marks the touched
+ *   columns, so reading them back out (and resetting them) costs num_cols / 64
+ *   words rather than num_cols values. For OR_AND the bitmap is the whole
+ *   result and the array of values is not touched at all.
+ * 
+ *   X: the left matrix
+ *   Y: the right matrix
+ *   row: the row of X to compute
+ *   acc: the thread's scratch space
+ *   out: the thread's output
+ *   semiring: the semiring to compute over
+ */
+SEMIRING_INLINE void accumulate_row_dense(struct CSR_View *X, struct CSR_View *Y,
+	sparse_ind_t row, struct Row_Accumulator *acc, struct Row_Output *out,
+	enum Semiring semiring) {
+	if (acc->dense_val == NULL) {
+		acc->dense_val = (int *) Malloc(((size_t) Y->num_cols + 1) * sizeof(int));
+		acc->dense_flag = (uint64_t *) calloc((size_t) Y->num_cols / 64 + 1,
+			sizeof(uint64_t));
+		if (acc->dense_flag == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	sparse_ind_t first_word = Y->num_cols / 64, last_word = 0;
+
+	for (sparse_ptr_t x_col = X->row_begin[row]; x_col < X->row_end[row]; x_col++) {
+		sparse_ind_t y_row = X->col_ind[x_col];
+		int x_val = X->val[x_col];
+
+		if (semiring == OR_AND && x_val == 0) continue;
+
+		for (sparse_ptr_t y_col = Y->row_begin[y_row]; y_col < Y->row_end[y_row]; y_col++) {
+			sparse_ind_t col = Y->col_ind[y_col];
+			uint64_t bit = (uint64_t) 1 << (col & 63);
+
+			if (semiring == OR_AND) {
+				if (Y->val[y_col] != 0) acc->dense_flag[col >> 6] |= bit;
+			} else if (acc->dense_flag[col >> 6] & bit)
+				acc->dense_val[col] = semiring_add(semiring, acc->dense_val[col],
+					semiring_multiply(semiring, x_val, Y->val[y_col]));
+			else {
+				acc->dense_flag[col >> 6] |= bit;
+				acc->dense_val[col] = semiring_multiply(semiring, x_val, Y->val[y_col]);
+			}
+
+			if ((col >> 6) < first_word) first_word = col >> 6;
+			if ((col >> 6) > last_word) last_word = col >> 6;
+		}
+	}
+
+	for (sparse_ind_t word = first_word; word <= last_word; word++) {
+		uint64_t flags = acc->dense_flag[word];
+		acc->dense_flag[word] = 0;
+
+		while (flags) {
+			sparse_ind_t col = word * 64 + __builtin_ctzll(flags);
+			flags &= flags - 1;
+
+			int val = semiring == OR_AND ? 1 : acc->dense_val[col];
+			if (val == semiring_zero(semiring)) continue;
+			out->col_ind[out->count] = col;
+			out->val[out->count] = val;
+			out->count++;
+		}
+	}
+}
+
+/* 
+ * Function: rowwise_rows
+ * ---------------------------- 
+ *   Computes rows first_row to last_row - 1 of X * Y, each with the
+ *   accumulator picked by its flops, appending them to out.
+ * 
+ *   X: the left matrix
+ *   Y: the right matrix
+ *   first_row: the first row to compute
+ *   last_row: one past the last row to compute
+ *   z_row_ptr: z_row_ptr[i + 1] holds the flops of row i, and is set to the
+ *     number of values in row i
+ *   compression: the expected ratio of non-zero values to flops
+ *   acc: the thread's scratch space
+ *   out: the thread's output
+ *   semiring: the semiring to compute over
+ */
+SEMIRING_INLINE void rowwise_rows(struct CSR_View *X, struct CSR_View *Y,
+	sparse_ind_t first_row, sparse_ind_t last_row, sparse_ptr_t *z_row_ptr,
+	double compression, struct Row_Accumulator *acc, struct Row_Output *out,
+	enum Semiring semiring) {
+	sparse_ind_t z_cols = Y->num_cols;
+
+	for (sparse_ind_t cur_z_row = first_row; cur_z_row < last_row; cur_z_row++) {
+		sparse_ptr_t flops = z_row_ptr[cur_z_row + 1];
+		sparse_ptr_t row_start = out->count;
+
+		reserve_row_output(out, flops < z_cols ? flops : z_cols);
+
+		switch (choose_accumulator(flops, flops * compression, z_cols)) {
+		case HEAP_ACCUMULATOR:
+			accumulate_row_heap(X, Y, cur_z_row, acc, out, semiring);
+			break;
+		case HASH_ACCUMULATOR:
+			accumulate_row_hash(X, Y, cur_z_row, flops, acc, out, semiring);
+			break;
+		case DENSE_ACCUMULATOR:
+			accumulate_row_dense(X, Y, cur_z_row, acc, out, semiring);
+			break;
+		}
+
+		z_row_ptr[cur_z_row + 1] = out->count - row_start;
+	}
+}
+
+/* 
+ * Function: count_row_nnz
+ * ---------------------------- 
+ *   Counts the columns that row i of X * Y has an entry in, without
+ *   computing their values.
+ * 
+ *   X: the left matrix
+ *   Y: the right matrix
+ *   row: the row to count
+ *   seen: a bitmap of Y->num_cols bits, all clear; it is left clear
+ * 
+ *   returns: the number of columns in the row
+ */
+static sparse_ptr_t count_row_nnz(struct CSR_View *X, struct CSR_View *Y,
+	sparse_ind_t row, uint64_t *seen) {
+	sparse_ptr_t count = 0;
+
+	for (sparse_ptr_t x_col = X->row_begin[row]; x_col < X->row_end[row]; x_col++) {
+		sparse_ind_t y_row = X->col_ind[x_col];
+		for (sparse_ptr_t y_col = Y->row_begin[y_row]; y_col < Y->row_end[y_row]; y_col++) {
+			sparse_ind_t col = Y->col_ind[y_col];
+			uint64_t bit = (uint64_t) 1 << (col & 63);
+			if (!(seen[col >> 6] & bit)) {
+				seen[col >> 6] |= bit;
+				count++;
+			}
+		}
+	}
+
+	for (sparse_ptr_t x_col = X->row_begin[row]; x_col < X->row_end[row]; x_col++) {
+		sparse_ind_t y_row = X->col_ind[x_col];
+		for (sparse_ptr_t y_col = Y->row_begin[y_row]; y_col < Y->row_end[y_row]; y_col++)
+			seen[Y->col_ind[y_col] >> 6] = 0;
+	}
+
+	return count;
+}
+
+/* 
+ * Function: sample_compression
+ * ---------------------------- 
+ *   Estimates the ratio of non-zero values to flops in X * Y by counting
+ *   the non-zero values of some of its rows. The rows are picked at even
+ *   steps through the running total of the flops, so that each is picked
+ *   in proportion to its flops, which makes the mean of their ratios an
+ *   unbiased estimate of the ratio for the whole product. A row picked
+ *   more than once is only counted once. With no more rows than samples,
+ *   every row is counted and the ratio is exact.
+ * 
+ *   X: the left matrix
+ *   Y: the right matrix
+ *   row_flops: row_flops[i] holds the flops of row i of X * Y
+ *   num_samples: the number of rows to sample
+ * 
+ *   returns: the estimated ratio, from 0 to 1; 1 if X * Y has no flops
+ */
+static double sample_compression(struct CSR_View *X, struct CSR_View *Y,
+	const sparse_ptr_t *row_flops, int num_samples) {
+	sparse_ind_t num_rows = X->num_rows;
+	int exact = num_samples <= 0 || num_rows <= num_samples;
+	if (exact) num_samples = num_rows;
+
+	sparse_ptr_t *prefix = (sparse_ptr_t *) Malloc(((size_t) num_rows + 1) * \
+		sizeof(sparse_ptr_t));
+	prefix[0] = 0;
+	for (sparse_ind_t i = 0; i < num_rows; i++) prefix[i + 1] = prefix[i] + row_flops[i];
+	sparse_ptr_t total = prefix[num_rows];
+
+	if (total == 0) {
+		free(prefix);
+		return 1;
+	}
+
+	/* The sampled rows in increasing order, each with how often it was picked */
+	sparse_ind_t *rows = (sparse_ind_t *) Malloc((size_t) num_samples * sizeof(sparse_ind_t));
+	int *picks = (int *) Malloc((size_t) num_samples * sizeof(int));
+	int num_rows_picked = 0;
+
+	for (int s = 0; s < num_samples; s++) {
+		sparse_ind_t row = s;
+		if (!exact) {
+			/* The row whose share of the running total holds the target */
+			sparse_ptr_t target = (sparse_ptr_t) ((s + 0.5) * total / num_samples);
+			sparse_ind_t lo = 0, hi = num_rows - 1;
+			while (lo < hi) {
+				sparse_ind_t mid = lo + (hi - lo) / 2;
+				if (prefix[mid + 1] <= target) lo = mid + 1;
+				else hi = mid;
+			}
+			row = lo;
+		} else if (row_flops[row] == 0) continue;
+
+		if (num_rows_picked > 0 && rows[num_rows_picked - 1] == row) {
+			picks[num_rows_picked - 1]++;
+			continue;
+		}
+		rows[num_rows_picked] = row;
+		picks[num_rows_picked] = 1;
+		num_rows_picked++;
+	}
+
+	double sum = 0;
+
+	#pragma omp parallel reduction(+:sum)
+	{
+		uint64_t *seen = (uint64_t *) calloc((size_t) Y->num_cols / 64 + 1,
+			sizeof(uint64_t));
+		if (seen == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+
+		#pragma omp for schedule(dynamic, 1)
+		for (int r = 0; r < num_rows_picked; r++) {
+			sparse_ptr_t nnz = count_row_nnz(X, Y, rows[r], seen);
+			/* Exactly, the total nnz; sampled, the sum of the ratios */
+			sum += exact ? (double) nnz : (double) picks[r] * nnz / row_flops[rows[r]];
+		}
+
+		free(seen);
+	}
+
+	free(prefix);
+	free(rows);
+	free(picks);
+
+	return exact ? sum / total : sum / num_samples;
+}
+
+/* 
+ * Function: rowwise_multiply_views
+ * ---------------------------- 
+ *   Computes X * Y over a semiring one row of the product at a time, for
+ *   matrices whose rows need not be contiguous. See
+ *   semiring_rowwise_sparse_matrix_multiply.
+ * 
+ *   X: 2D sparse matrix to left-multiply
+ *   Y: 2D sparse matrix to right-multiply
+ *   semiring: the semiring to compute over
+ * 
+ *   returns: the matrix X * Y as a CSR matrix
+ */
+static struct CSR_Matrix *rowwise_multiply_views(struct CSR_View *X,
+	struct CSR_View *Y, enum Semiring semiring) {
+	// Check whether X and Y are compatible
+	if (X->num_cols != Y->num_rows) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	sparse_ind_t z_rows = X->num_rows;
+	sparse_ind_t z_cols = Y->num_cols;
+
+	/* Symbolic phase */
+	TRACE_BEGIN(symbolic, "rowwise_sparse_matrix_multiply", "symbolic");
+	/* z_row_ptr holds the flops of each row for now, and the number of
+	*  non-zero values of each row once the numeric phase is done */
+	sparse_ptr_t *z_row_ptr = (sparse_ptr_t *) Malloc(((size_t) z_rows + 1) * \
+		sizeof(sparse_ptr_t));
+	sparse_ptr_t *row_cost = (sparse_ptr_t *) Malloc(((size_t) z_rows + 1) * \
+		sizeof(sparse_ptr_t));
+
+	#pragma omp parallel for schedule(static)
+	for (sparse_ind_t cur_z_row = 0; cur_z_row < z_rows; cur_z_row++) {
+		sparse_ptr_t flops = 0;
+		for (sparse_ptr_t x_col = X->row_begin[cur_z_row];
+			x_col < X->row_end[cur_z_row]; x_col++)
+			flops += Y->row_end[X->col_ind[x_col]] - Y->row_begin[X->col_ind[x_col]];
+		z_row_ptr[cur_z_row + 1] = flops;
+	}
+
+	/* Without enough rows to sample, assume no two products share a column */
+	int sampled = z_rows > (sparse_ptr_t) SPGEMM_NNZ_SAMPLE_RATIO * SPGEMM_NNZ_SAMPLES;
+	double compression = sampled ? sample_compression(X, Y, z_row_ptr + 1,
+		SPGEMM_NNZ_SAMPLES) : 1;
+
+	for (sparse_ind_t i = 0; i < z_rows; i++)
+		row_cost[i + 1] = estimate_row_cost(z_row_ptr[i + 1], compression, z_cols);
+
+	sparse_ind_t *first_row;
+	int num_threads = partition_rows(row_cost, z_rows, &first_row);
+	struct Row_Output *outputs = (struct Row_Output *) Malloc(num_threads * \
+		sizeof(struct Row_Output));
+	TRACE_END(symbolic);
+
+	/* Numeric phase */
+	#pragma omp parallel num_threads(num_threads)
+	{
+		int thread = omp_get_thread_num();
+		struct Row_Accumulator acc = {0};
+		struct Row_Output *out = &outputs[thread];
+		memset(out, 0, sizeof(struct Row_Output));
+		sparse_ind_t first = first_row[thread], last = first_row[thread + 1];
+		TRACE_BEGIN(numeric, "rowwise_sparse_matrix_multiply", "numeric");
+
+		sparse_ptr_t flops = 0;
+		for (sparse_ind_t i = first; i < last; i++) flops += z_row_ptr[i + 1];
+		/* Each multiplication reads one value of Y and its column */
+		TRACE_COUNT(numeric, 2 * flops, flops * (sizeof(sparse_ind_t) + sizeof(int)));
+
+		/* Sized up front from the estimate, rather than grown by doubling */
+		if (sampled) reserve_row_output(out, (sparse_ptr_t) (flops * compression * 1.1));
+
+		switch (semiring) {
+		case PLUS_TIMES:
+			rowwise_rows(X, Y, first, last, z_row_ptr, compression, &acc, out,
+				PLUS_TIMES);
+			break;
+		case MIN_PLUS:
+			rowwise_rows(X, Y, first, last, z_row_ptr, compression, &acc, out,
+				MIN_PLUS);
+			break;
+		case MAX_MIN:
+			rowwise_rows(X, Y, first, last, z_row_ptr, compression, &acc, out,
+				MAX_MIN);
+			break;
+		case MAX_TIMES:
+			rowwise_rows(X, Y, first, last, z_row_ptr, compression, &acc, out,
+				MAX_TIMES);
+			break;
+		case OR_AND:
+			rowwise_rows(X, Y, first, last, z_row_ptr, compression, &acc, out,
+				OR_AND);
+			break;
+		}
+
+		TRACE_END(numeric);
+		free(acc.dense_val);
+		free(acc.dense_flag);
+		free(acc.hash_key);
+		free(acc.hash_val);
+		free(acc.heap);
+	}
+
+	/* Stitch phase */
+	TRACE_BEGIN(stitch, "rowwise_sparse_matrix_multiply", "stitch");
+	struct CSR_Matrix *Z = stitch_row_outputs(outputs, first_row, num_threads,
+		z_row_ptr, z_rows, z_cols);
+	TRACE_COUNT(stitch, 0, Z->row_ptr[z_rows] * 2 * (sizeof(sparse_ind_t) + sizeof(int)));
+	TRACE_END(stitch);
+
+	free(z_row_ptr);
+	free(row_cost);
+	free(outputs);
+	free(first_row);
+
+	return Z;
+}
+
+/* 
+ * Function: semiring_rowwise_sparse_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y over a semiring for two CSR matrices, one row of the
+ *   product at a time (Gustavson's algorithm): row i of X * Y is the sum of
+ *   the rows of Y selected by the non-zero values in row i of X, scaled by
+ *   them. Unlike sparse_matrix_multiply, the work is proportional to the
+ *   number of multiplications rather than to z_rows * z_cols.
+ * 
+ *   Runs in three phases:
+ *    - symbolic: counts the multiplications (flops) in each row and, for
+ *      large products, samples some rows to estimate the ratio of non-zero
+ *      values to flops (see estimate_product_nnz). Together they pick the
+ *      accumulator for each row and split the rows between the threads so
+ *      that each gets an equal share of the estimated cost
+ *    - numeric: each thread computes its rows in to its own buffer, sized
+ *      up front from the estimate
+ *    - stitch: the buffers are copied in to an exactly sized CSR matrix
+ * 
+ *   A CCS matrix can be used as Y after convert_CCS_to_CSR.
+ * 
+ *   X: 2D sparse matrix to left-multiply
+ *   Y: 2D sparse matrix to right-multiply
+ *   semiring: the semiring to compute over
+ * 
+ *   returns: the matrix X * Y as a CSR matrix
+ */
+struct CSR_Matrix *semiring_rowwise_sparse_matrix_multiply(struct CSR_Matrix *X,
+	struct CSR_Matrix *Y, enum Semiring semiring) {
+	struct CSR_View x_view = view_of_CSR(X), y_view = view_of_CSR(Y);
+	return rowwise_multiply_views(&x_view, &y_view, semiring);
+}
+
+/* 
+ * Function: rowwise_sparse_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for two CSR matrices one row of the product at a time,
+ *   see semiring_rowwise_sparse_matrix_multiply.
+ * 
+ *   X: 2D sparse matrix to left-multiply
+ *   Y: 2D sparse matrix to right-multiply
+ * 
+ *   returns: the matrix X * Y as a CSR matrix
+ */
+struct CSR_Matrix *rowwise_sparse_matrix_multiply(struct CSR_Matrix *X,
+	struct CSR_Matrix *Y) {
+	return semiring_rowwise_sparse_matrix_multiply(X, Y, PLUS_TIMES);
+}
+
+/* 
+ * Function: estimate_product_nnz
+ * ---------------------------- 
+ *   Estimates the number of non-zero values in X * Y without computing it,
+ *   e.g. to size its output or to choose between kernels. The flops of the
+ *   product bound its number of non-zero values from above; the estimate
+ *   scales them by the ratio of non-zero values to flops in a sample of
+ *   rows, picked in proportion to their flops. The cost is one pass over
+ *   X plus computing the pattern of at most num_samples rows of X * Y.
+ * 
+ *   Values of the product that cancel to zero are counted, so the estimate
+ *   is of the pattern of X * Y.
+ * 
+ *   X: the left CSR matrix
+ *   Y: the right CSR matrix
+ *   num_samples: the number of rows to sample, e.g. SPGEMM_NNZ_SAMPLES; with
+ *     as many as X has rows (or 0), the estimate is exact
+ * 
+ *   returns: the flops, the estimated number of non-zero values, and their
+ *     ratio
+ */
+struct NNZ_Estimate estimate_product_nnz(struct CSR_Matrix *X, struct CSR_Matrix *Y,
+	int num_samples) {
+	if (X->num_cols != Y->num_rows) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct CSR_View x_view = view_of_CSR(X), y_view = view_of_CSR(Y);
+	sparse_ptr_t *row_flops = (sparse_ptr_t *) Malloc(((size_t) X->num_rows + 1) * \
+		sizeof(sparse_ptr_t));
+	sparse_ptr_t flops = 0;
+
+	#pragma omp parallel for reduction(+:flops)
+	for (sparse_ind_t i = 0; i < X->num_rows; i++) {
+		row_flops[i] = 0;
+		for (sparse_ptr_t x_col = X->row_ptr[i]; x_col < X->row_ptr[i + 1]; x_col++)
+			row_flops[i] += Y->row_ptr[X->col_ind[x_col] + 1] - Y->row_ptr[X->col_ind[x_col]];
+		flops += row_flops[i];
+	}
+
+	struct NNZ_Estimate estimate;
+	estimate.flops = flops;
+	estimate.compression = sample_compression(&x_view, &y_view, row_flops, num_samples);
+	estimate.nnz = flops * estimate.compression;
+
+	free(row_flops);
+	return estimate;
+}
+
+/* 
+ * Function: init_CSR_matrix
+ * ---------------------------- 
+ *   Allocates a CSR matrix of size num_rows x num_cols and num_val non-zero
+ *   values.
+ * 
+ *   num_val: the number of non-zero values
+ *   num_rows: the number of rows
+ *   num_cols: the number of columns
+ * 
+ *   returns: the allocated CSR matrix
+ */
+struct CSR_Matrix *init_CSR_matrix(sparse_ptr_t num_val, sparse_ind_t num_rows,
+	sparse_ind_t num_cols) {
+	if (num_val < 0 || num_rows < 0 || num_cols < 0) {
+		fprintf(stderr, "Matrix sizes must be non-negative.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct CSR_Matrix *R = (struct CSR_Matrix *) Malloc(sizeof(struct CSR_Matrix));
+	R->val = (int *) Malloc(num_val * sizeof(int));
+	R->col_ind = (sparse_ind_t *) Malloc(num_val * sizeof(sparse_ind_t));
+	R->row_ptr = (sparse_ptr_t *) Malloc(((size_t) num_rows + 1) * sizeof(sparse_ptr_t));
+	R->num_rows = num_rows;
+	R->num_cols = num_cols;
+
+	return R;
+}
+
+/* 
+ * Function: copy_CSR_matrix
+ * ---------------------------- 
+ *   Allocates a copy of a CSR matrix.
+ * 
+ *   R: the CSR matrix to copy
+ * 
+ *   returns: the copy
+ */
+struct CSR_Matrix *copy_CSR_matrix(struct CSR_Matrix *R) {
+	sparse_ptr_t num_val = R->row_ptr[R->num_rows];
+	struct CSR_Matrix *C = init_CSR_matrix(num_val, R->num_rows, R->num_cols);
+	memcpy(C->val, R->val, num_val * sizeof(int));
+	memcpy(C->col_ind, R->col_ind, num_val * sizeof(sparse_ind_t));
+	memcpy(C->row_ptr, R->row_ptr, ((size_t) R->num_rows + 1) * sizeof(sparse_ptr_t));
+
+	return C;
+}
+
+/* 
+ * Function: init_CCS_matrix
+ * ---------------------------- 
+ *   Allocates a CCS matrix of size num_rows x num_cols and num_val non-zero
+ *   values.
+ * 
+ *   num_val: the number of non-zero values
+ *   num_rows: the number of rows
+ *   num_cols: the number of columns
+ * 
+ *   returns: the allocated CCS matrix
+ */
+struct CCS_Matrix *init_CCS_matrix(sparse_ptr_t num_val, sparse_ind_t num_rows,
+	sparse_ind_t num_cols) {
+	if (num_val < 0 || num_rows < 0 || num_cols < 0) {
+		fprintf(stderr, "Matrix sizes must be non-negative.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct CCS_Matrix *R = (struct CCS_Matrix *) Malloc(sizeof(struct CCS_Matrix));
+	R->val = (int *) Malloc(num_val * sizeof(int));
+	R->row_ind = (sparse_ind_t *) Malloc(num_val * sizeof(sparse_ind_t));
+	R->col_ptr = (sparse_ptr_t *) Malloc(((size_t) num_cols + 1) * sizeof(sparse_ptr_t));
+	R->num_rows = num_rows;
+	R->num_cols = num_cols;
+
+	return R;
+}
+
+/* 
+ * Function: init_COO_matrix
+ * ---------------------------- 
+ *   Allocates a COO matrix of size num_rows x num_cols and num_val
+ *   (row, column, value) triples.
+ * 
+ *   num_val: the number of triples
+ *   num_rows: the number of rows
+ *   num_cols: the number of columns
+ * 
+ *   returns: the allocated COO matrix
+ */
+struct COO_Matrix *init_COO_matrix(sparse_ptr_t num_val, sparse_ind_t num_rows,
+	sparse_ind_t num_cols) {
+	if (num_val < 0 || num_rows < 0 || num_cols < 0) {
+		fprintf(stderr, "Matrix sizes must be non-negative.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct COO_Matrix *R = (struct COO_Matrix *) Malloc(sizeof(struct COO_Matrix));
+	R->val = (int *) Malloc(num_val * sizeof(int));
+	R->row_ind = (sparse_ind_t *) Malloc(num_val * sizeof(sparse_ind_t));
+	R->col_ind = (sparse_ind_t *) Malloc(num_val * sizeof(sparse_ind_t));
+	R->num_val = num_val;
+	R->num_rows = num_rows;
+	R->num_cols = num_cols;
+
+	return R;
+}
+
+/* 
+ * Function: init_DCSR_matrix
+ * ---------------------------- 
+ *   Allocates a DCSR matrix of size num_rows x num_cols with num_val non-zero
+ *   values in num_nonempty_rows non-empty rows.
+ * 
+ *   num_val: the number of non-zero values
+ *   num_nonempty_rows: the number of non-empty rows
+ *   num_rows: the number of rows
+ *   num_cols: the number of columns
+ * 
+ *   returns: the allocated DCSR matrix
+ */
+struct DCSR_Matrix *init_DCSR_matrix(sparse_ptr_t num_val,
+	sparse_ind_t num_nonempty_rows, sparse_ind_t num_rows, sparse_ind_t num_cols) {
+	if (num_val < 0 || num_nonempty_rows < 0 || num_nonempty_rows > num_rows || \
+		num_cols < 0) {
+		fprintf(stderr, "Matrix sizes must be non-negative.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct DCSR_Matrix *R = (struct DCSR_Matrix *) Malloc(sizeof(struct DCSR_Matrix));
+	R->val = (int *) Malloc(num_val * sizeof(int));
+	R->col_ind = (sparse_ind_t *) Malloc(num_val * sizeof(sparse_ind_t));
+	R->row_ind = (sparse_ind_t *) Malloc(((size_t) num_nonempty_rows + 1) * \
+		sizeof(sparse_ind_t));
+	R->row_ptr = (sparse_ptr_t *) Malloc(((size_t) num_nonempty_rows + 1) * \
+		sizeof(sparse_ptr_t));
+	R->num_nonempty_rows = num_nonempty_rows;
+	R->num_rows = num_rows;
+	R->num_cols = num_cols;
+
+	return R;
+}
+
+/* 
+ * Function: init_DCSC_matrix
+ * ---------------------------- 
+ *   Allocates a DCSC matrix of size num_rows x num_cols with num_val non-zero
+ *   values in num_nonempty_cols non-empty columns.
+ * 
+ *   num_val: the number of non-zero values
+ *   num_nonempty_cols: the number of non-empty columns
+ *   num_rows: the number of rows
+ *   num_cols: the number of columns
+ * 
+ *   returns: the allocated DCSC matrix
+ */
+struct DCSC_Matrix *init_DCSC_matrix(sparse_ptr_t num_val,
+	sparse_ind_t num_nonempty_cols, sparse_ind_t num_rows, sparse_ind_t num_cols) {
+	if (num_val < 0 || num_nonempty_cols < 0 || num_nonempty_cols > num_cols || \
+		num_rows < 0) {
+		fprintf(stderr, "Matrix sizes must be non-negative.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct DCSC_Matrix *R = (struct DCSC_Matrix *) Malloc(sizeof(struct DCSC_Matrix));
+	R->val = (int *) Malloc(num_val * sizeof(int));
+	R->row_ind = (sparse_ind_t *) Malloc(num_val * sizeof(sparse_ind_t));
+	R->col_ind = (sparse_ind_t *) Malloc(((size_t) num_nonempty_cols + 1) * \
+		sizeof(sparse_ind_t));
+	R->col_ptr = (sparse_ptr_t *) Malloc(((size_t) num_nonempty_cols + 1) * \
+		sizeof(sparse_ptr_t));
+	R->num_nonempty_cols = num_nonempty_cols;
+	R->num_rows = num_rows;
+	R->num_cols = num_cols;
+
+	return R;
+}
+
+/* 
+ * Keys at or below this count are sorted with one counting pass; its
+ * histogram (one per thread) still fits in cache. Above it, the keys are
+ * first partitioned by their high bits in to at most this many buckets.
+ */
+#define SORT_DIRECT_KEYS 65536
+
+/* 
+ * Function: counting_sort_by_index
+ * ---------------------------- 
+ *   Stable counting sort of num_val entries by key, in parallel. This is the
+ *   building block of every conversion between the compressed formats: the
+ *   entries are bucketed by key (e.g. by column index to go from CSR to CCS)
+ *   and each entry carries its other index and its value along.
+ * 
+ *   The entries are split in to one contiguous range per thread. Each thread
+ *   counts the keys in its range in a private histogram, the histograms are
+ *   turned in to per-thread starting offsets, and each thread then scatters
+ *   its range in order, so the result is stable without any atomics.
+ * 
+ *   Scattering straight in to millions of keys misses the cache on nearly
+ *   every write, so for more than SORT_DIRECT_KEYS keys this is done as a two
+ *   pass radix sort: the entries are scattered in to buckets of keys sharing
+ *   their high bits, then each bucket is sorted by the low bits while its
+ *   histogram and its part of the output are in cache. The first pass writes
+ *   straight in to the output arrays, so the only extra memory is the 16-bit
+ *   low part of each key plus one bucket's worth of entries per thread.
+ * 
+ *   num_val: the number of entries
+ *   key: the index to sort by for each entry
+ *   num_keys: the number of distinct keys (the size of the sorted dimension)
+ *   num_outer: the number of rows (or columns) in outer_ptr
+ *   outer_ptr: if not NULL, the entries are in compressed form and the other
+ *     index of entry p is the outer row (or column) whose range contains p
+ *   outer_ind: if outer_ptr is NULL, the other index of each entry
+ *   val: the value of each entry
+ *   key_ptr: filled with num_keys + 1 offsets to the start of each key
+ *   sorted_outer: filled with the other index of each sorted entry
+ *   sorted_val: filled with the value of each sorted entry
+ */
+static void counting_sort_by_index(sparse_ptr_t num_val, const sparse_ind_t *key,
+	sparse_ind_t num_keys, sparse_ind_t num_outer, const sparse_ptr_t *outer_ptr,
+	const sparse_ind_t *outer_ind, const int *val, sparse_ptr_t *key_ptr,
+	sparse_ind_t *sorted_outer, int *sorted_val) {
+	/* Keys are bucketed by key >> shift; shift is 0 when sorting directly */
+	int shift = 0;
+	while (num_keys > SORT_DIRECT_KEYS && ((num_keys - 1) >> shift) >= \
+		SORT_DIRECT_KEYS / 64 && shift < 16) shift++;
+	sparse_ind_t num_buckets = num_keys > 0 ? ((num_keys - 1) >> shift) + 1 : 0;
+
+	int num_threads = omp_get_max_threads();
+	if (num_buckets > 0 && num_threads > num_val / num_buckets)
+		num_threads = num_val / num_buckets > 1 ? (int) (num_val / num_buckets) : 1;
+
+	sparse_ptr_t *count = (sparse_ptr_t *) Malloc((size_t) num_threads * \
+		num_buckets * sizeof(sparse_ptr_t));
+	sparse_ptr_t *bucket_ptr = shift == 0 ? key_ptr : (sparse_ptr_t *) Malloc(
+		((size_t) num_buckets + 1) * sizeof(sparse_ptr_t));
+	uint16_t *low_key = shift == 0 ? NULL : (uint16_t *) Malloc(num_val * \
+		sizeof(uint16_t));
+
+	#pragma omp parallel num_threads(num_threads)
+	{
+		int thread = omp_get_thread_num();
+		sparse_ptr_t *my_count = count + (size_t) thread * num_buckets;
+		sparse_ptr_t first = num_val * thread / num_threads;
+		sparse_ptr_t last = num_val * (thread + 1) / num_threads;
+
+		memset(my_count, 0, num_buckets * sizeof(sparse_ptr_t));
+		for (sparse_ptr_t p = first; p < last; p++) my_count[key[p] >> shift]++;
+
+		#pragma omp barrier
+
+		/* Turn the counts in to the offset of each thread within each bucket */
+		#pragma omp for
+		for (sparse_ind_t b = 0; b < num_buckets; b++) {
+			sparse_ptr_t sum = 0;
+			for (int t = 0; t < num_threads; t++) {
+				sparse_ptr_t c = count[(size_t) t * num_buckets + b];
+				count[(size_t) t * num_buckets + b] = sum;
+				sum += c;
+			}
+			bucket_ptr[b + 1] = sum;
+		}
+
+		#pragma omp single
+		{
+			bucket_ptr[0] = 0;
+			for (sparse_ind_t b = 0; b < num_buckets; b++)
+				bucket_ptr[b + 1] += bucket_ptr[b];
+		}
+
+		for (sparse_ind_t b = 0; b < num_buckets; b++) my_count[b] += bucket_ptr[b];
+
+		/* Find the outer row containing the first entry of this range */
+		sparse_ind_t outer = 0;
+		if (outer_ptr != NULL) {
+			sparse_ind_t lo = 0, hi = num_outer;
+			while (lo < hi) {
+				sparse_ind_t mid = lo + (hi - lo) / 2;
+				if (outer_ptr[mid + 1] <= first) lo = mid + 1;
+				else hi = mid;
+			}
+			outer = lo;
+		}
+
+		for (sparse_ptr_t p = first; p < last; p++) {
+			sparse_ptr_t pos = my_count[key[p] >> shift]++;
+
+			if (outer_ptr != NULL) {
+				while (outer_ptr[outer + 1] <= p) outer++;
+				sorted_outer[pos] = outer;
+			} else sorted_outer[pos] = outer_ind[p];
+
+			sorted_val[pos] = val[p];
+			if (shift != 0) low_key[pos] = key[p] & ((1 << shift) - 1);
+		}
+
+		if (shift != 0) {
+			/* Sort each bucket by the low bits of its keys */
+			sparse_ind_t bucket_keys = (sparse_ind_t) 1 << shift;
+			sparse_ptr_t *low_count = (sparse_ptr_t *) Malloc(((size_t) bucket_keys + 1) * \
+				sizeof(sparse_ptr_t));
+			sparse_ptr_t buffer_size = 0;
+			sparse_ind_t *outer_buffer = NULL;
+			int *val_buffer = NULL;
+			uint16_t *low_buffer = NULL;
+
+			#pragma omp barrier
+			#pragma omp for schedule(dynamic)
+			for (sparse_ind_t b = 0; b < num_buckets; b++) {
+				sparse_ptr_t start = bucket_ptr[b];
+				sparse_ptr_t size = bucket_ptr[b + 1] - start;
+				sparse_ind_t base = b << shift;
+
+				/* An empty bucket has nothing to copy, and the buffers may not be
+				*  allocated yet */
+				if (size == 0) {
+					for (sparse_ind_t k = 0; k < bucket_keys && base + k < num_keys; k++)
+						key_ptr[base + k] = start;
+					continue;
+				}
+
+				if (size > buffer_size) {
+					buffer_size = size;
+					outer_buffer = (sparse_ind_t *) Realloc(outer_buffer,
+						size * sizeof(sparse_ind_t));
+					val_buffer = (int *) Realloc(val_buffer, size * sizeof(int));
+					low_buffer = (uint16_t *) Realloc(low_buffer, size * sizeof(uint16_t));
+				}
+
+				memcpy(outer_buffer, sorted_outer + start, size * sizeof(sparse_ind_t));
+				memcpy(val_buffer, sorted_val + start, size * sizeof(int));
+				memcpy(low_buffer, low_key + start, size * sizeof(uint16_t));
+
+				memset(low_count, 0, ((size_t) bucket_keys + 1) * sizeof(sparse_ptr_t));
+				for (sparse_ptr_t i = 0; i < size; i++) low_count[low_buffer[i] + 1]++;
+
+				low_count[0] = start;
+				for (sparse_ind_t k = 0; k < bucket_keys; k++) {
+					if (base + k < num_keys) key_ptr[base + k] = low_count[k];
+					low_count[k + 1] += low_count[k];
+				}
+
+				for (sparse_ptr_t i = 0; i < size; i++) {
+					sparse_ptr_t pos = low_count[low_buffer[i]]++;
+					sorted_outer[pos] = outer_buffer[i];
+					sorted_val[pos] = val_buffer[i];
+				}
+			}
+
+			free(low_count);
+			free(outer_buffer);
+			free(val_buffer);
+			free(low_buffer);
+		}
+	}
+
+	key_ptr[num_keys] = num_val;
+
+	free(count);
+	if (shift != 0) {
+		free(bucket_ptr);
+		free(low_key);
+	}
+}
+
+/* 
+ * Function: convert_CSR_to_CCS
+ * ---------------------------- 
+ *   Converts a CSR matrix to CCS. The row indices within each column of the
+ *   result are sorted.
+ * 
+ *   R: the CSR matrix to convert
+ * 
+ *   returns: the same matrix as a newly allocated CCS matrix
+ */
+struct CCS_Matrix *convert_CSR_to_CCS(struct CSR_Matrix *R) {
+	sparse_ptr_t num_val = R->row_ptr[R->num_rows];
+	struct CCS_Matrix *C = init_CCS_matrix(num_val, R->num_rows, R->num_cols);
+
+	counting_sort_by_index(num_val, R->col_ind, R->num_cols, R->num_rows,
+		R->row_ptr, NULL, R->val, C->col_ptr, C->row_ind, C->val);
+
+	return C;
+}
+
+/* 
+ * Function: convert_CCS_to_CSR
+ * ---------------------------- 
+ *   Converts a CCS matrix to CSR. The column indices within each row of the
+ *   result are sorted.
+ * 
+ *   R: the CCS matrix to convert
+ * 
+ *   returns: the same matrix as a newly allocated CSR matrix
+ */
+struct CSR_Matrix *convert_CCS_to_CSR(struct CCS_Matrix *R) {
+	sparse_ptr_t num_val = R->col_ptr[R->num_cols];
+	struct CSR_Matrix *C = init_CSR_matrix(num_val, R->num_rows, R->num_cols);
+
+	counting_sort_by_index(num_val, R->row_ind, R->num_rows, R->num_cols,
+		R->col_ptr, NULL, R->val, C->row_ptr, C->col_ind, C->val);
+
+	return C;
+}
+
+/* 
+ * Function: transpose_CSR_matrix
+ * ---------------------------- 
+ *   Computes the transpose of a CSR matrix. The CSR arrays of R^T are exactly
+ *   the CCS arrays of R, so this is the same work as convert_CSR_to_CCS.
+ *   When a copy is not needed, use CSR_transpose_view instead.
+ * 
+ *   R: the CSR matrix to transpose
+ * 
+ *   returns: R^T as a newly allocated CSR matrix
+ */
+struct CSR_Matrix *transpose_CSR_matrix(struct CSR_Matrix *R) {
+	sparse_ptr_t num_val = R->row_ptr[R->num_rows];
+	struct CSR_Matrix *T = init_CSR_matrix(num_val, R->num_cols, R->num_rows);
+
+	counting_sort_by_index(num_val, R->col_ind, R->num_cols, R->num_rows,
+		R->row_ptr, NULL, R->val, T->row_ptr, T->col_ind, T->val);
+
+	return T;
+}
+
+/* 
+ * Function: transpose_CCS_matrix
+ * ---------------------------- 
+ *   Computes the transpose of a CCS matrix.
+ * 
+ *   R: the CCS matrix to transpose
+ * 
+ *   returns: R^T as a newly allocated CCS matrix
+ */
+struct CCS_Matrix *transpose_CCS_matrix(struct CCS_Matrix *R) {
+	sparse_ptr_t num_val = R->col_ptr[R->num_cols];
+	struct CCS_Matrix *T = init_CCS_matrix(num_val, R->num_cols, R->num_rows);
+
+	counting_sort_by_index(num_val, R->row_ind, R->num_rows, R->num_cols,
+		R->col_ptr, NULL, R->val, T->col_ptr, T->row_ind, T->val);
+
+	return T;
+}
+
+/* 
+ * Function: CSR_transpose_view
+ * ---------------------------- 
+ *   Reinterprets a CSR matrix as the CCS form of its transpose, without
+ *   copying anything. The view shares its arrays with R, so it must not be
+ *   freed and is only valid as long as R is.
+ * 
+ *   R: the CSR matrix to view
+ * 
+ *   returns: R^T as a CCS matrix sharing R's arrays
+ */
+struct CCS_Matrix CSR_transpose_view(struct CSR_Matrix *R) {
+	struct CCS_Matrix T = {R->val, R->col_ind, R->row_ptr, R->num_cols, R->num_rows};
+	return T;
+}
+
+/* 
+ * Function: CCS_transpose_view
+ * ---------------------------- 
+ *   Reinterprets a CCS matrix as the CSR form of its transpose, without
+ *   copying anything. The view shares its arrays with R, so it must not be
+ *   freed and is only valid as long as R is.
+ * 
+ *   R: the CCS matrix to view
+ * 
+ *   returns: R^T as a CSR matrix sharing R's arrays
+ */
+struct CSR_Matrix CCS_transpose_view(struct CCS_Matrix *R) {
+	struct CSR_Matrix T = {R->val, R->row_ind, R->col_ptr, R->num_cols, R->num_rows};
+	return T;
+}
+
+/* 
+ * Function: sort_COO_matrix
+ * ---------------------------- 
+ *   Sorts COO triples in to compressed form with a two pass LSD radix sort,
+ *   each pass being a counting sort: first by the minor index, then (stably)
+ *   by the major index. The minor indices within each major row (or column)
+ *   of the result are therefore sorted. Duplicates are kept, and end up next
+ *   to each other.
+ * 
+ *   R: the COO matrix to sort
+ *   major_ind: the index to compress by (R->row_ind for CSR)
+ *   num_major: the size of the major dimension
+ *   minor_ind: the other index (R->col_ind for CSR)
+ *   num_minor: the size of the minor dimension
+ *   major_ptr: filled with num_major + 1 offsets
+ *   sorted_minor: filled with the sorted minor indices
+ *   sorted_val: filled with the sorted values
+ */
+static void sort_COO_matrix(struct COO_Matrix *R, sparse_ind_t *major_ind,
+	sparse_ind_t num_major, sparse_ind_t *minor_ind, sparse_ind_t num_minor,
+	sparse_ptr_t *major_ptr, sparse_ind_t *sorted_minor, int *sorted_val) {
+	/* The first pass leaves the triples compressed by the minor index */
+	sparse_ptr_t *minor_ptr = (sparse_ptr_t *) Malloc(((size_t) num_minor + 1) * \
+		sizeof(sparse_ptr_t));
+	sparse_ind_t *by_minor_major = (sparse_ind_t *) Malloc(R->num_val * \
+		sizeof(sparse_ind_t));
+	int *by_minor_val = (int *) Malloc(R->num_val * sizeof(int));
+
+	counting_sort_by_index(R->num_val, minor_ind, num_minor, 0, NULL, major_ind,
+		R->val, minor_ptr, by_minor_major, by_minor_val);
+
+	counting_sort_by_index(R->num_val, by_minor_major, num_major, num_minor,
+		minor_ptr, NULL, by_minor_val, major_ptr, sorted_minor, sorted_val);
+
+	free(minor_ptr);
+	free(by_minor_major);
+	free(by_minor_val);
+}
+
+/* 
+ * Function: convert_COO_to_CSR
+ * ---------------------------- 
+ *   Converts unsorted COO triples to CSR with a radix sort. The column indices
+ *   within each row of the result are sorted. Duplicate triples are kept as
+ *   separate entries; build_CSR_matrix sums them instead.
+ * 
+ *   R: the COO matrix to convert
+ * 
+ *   returns: the same matrix as a newly allocated CSR matrix
+ */
+struct CSR_Matrix *convert_COO_to_CSR(struct COO_Matrix *R) {
+	struct CSR_Matrix *C = init_CSR_matrix(R->num_val, R->num_rows, R->num_cols);
+
+	sort_COO_matrix(R, R->row_ind, R->num_rows, R->col_ind, R->num_cols,
+		C->row_ptr, C->col_ind, C->val);
+
+	return C;
+}
+
+/* 
+ * Function: convert_COO_to_CCS
+ * ---------------------------- 
+ *   Converts unsorted COO triples to CCS with a radix sort. The row indices
+ *   within each column of the result are sorted. Duplicate triples are kept
+ *   as separate entries; build_CCS_matrix sums them instead.
+ * 
+ *   R: the COO matrix to convert
+ * 
+ *   returns: the same matrix as a newly allocated CCS matrix
+ */
+struct CCS_Matrix *convert_COO_to_CCS(struct COO_Matrix *R) {
+	struct CCS_Matrix *C = init_CCS_matrix(R->num_val, R->num_rows, R->num_cols);
+
+	sort_COO_matrix(R, R->col_ind, R->num_cols, R->row_ind, R->num_rows,
+		C->col_ptr, C->row_ind, C->val);
+
+	return C;
+}
+
+/* 
+ * Function: init_COO_builder
+ * ---------------------------- 
+ *   Allocates an empty builder for a num_rows x num_cols matrix.
+ * 
+ *   num_rows: the number of rows
+ *   num_cols: the number of columns
+ *   capacity: the number of triples to make room for up front, which can be
+ *     0 if unknown
+ * 
+ *   returns: the allocated builder
+ */
+struct COO_Builder *init_COO_builder(sparse_ind_t num_rows, sparse_ind_t num_cols,
+	sparse_ptr_t capacity) {
+	if (num_rows < 0 || num_cols < 0 || capacity < 0) {
+		fprintf(stderr, "Matrix sizes must be non-negative.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (capacity < 1024) capacity = 1024;
+
+	struct COO_Builder *B = (struct COO_Builder *) Malloc(sizeof(struct COO_Builder));
+	B->triples.val = (int *) Malloc(capacity * sizeof(int));
+	B->triples.row_ind = (sparse_ind_t *) Malloc(capacity * sizeof(sparse_ind_t));
+	B->triples.col_ind = (sparse_ind_t *) Malloc(capacity * sizeof(sparse_ind_t));
+	B->triples.num_val = 0;
+	B->triples.num_rows = num_rows;
+	B->triples.num_cols = num_cols;
+	B->capacity = capacity;
+
+	return B;
+}
+
+/* 
+ * Function: add_COO_triples
+ * ---------------------------- 
+ *   Appends a batch of triples to a builder. Explicit zeros are dropped here;
+ *   duplicates are kept until the matrix is built. Exits with an error if any
+ *   index is out of range, before anything is appended.
+ * 
+ *   B: the builder to append to
+ *   row_ind: the row index of each triple
+ *   col_ind: the column index of each triple
+ *   val: the value of each triple
+ *   count: the number of triples in the batch
+ */
+void add_COO_triples(struct COO_Builder *B, const sparse_ind_t *row_ind,
+	const sparse_ind_t *col_ind, const int *val, sparse_ptr_t count) {
+	struct COO_Matrix *T = &B->triples;
+	int out_of_range = 0;
+
+	#pragma omp parallel for reduction(|:out_of_range)
+	for (sparse_ptr_t p = 0; p < count; p++)
+		out_of_range |= row_ind[p] < 0 || row_ind[p] >= T->num_rows || \
+			col_ind[p] < 0 || col_ind[p] >= T->num_cols;
+
+	if (out_of_range) {
+		fprintf(stderr, "Triple index is out of range of the matrix.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (T->num_val + count > B->capacity) {
+		while (T->num_val + count > B->capacity) B->capacity *= 2;
+		T->val = (int *) Realloc(T->val, B->capacity * sizeof(int));
+		T->row_ind = (sparse_ind_t *) Realloc(T->row_ind, B->capacity * \
+			sizeof(sparse_ind_t));
+		T->col_ind = (sparse_ind_t *) Realloc(T->col_ind, B->capacity * \
+			sizeof(sparse_ind_t));
+	}
+
+	sparse_ptr_t num_val = T->num_val;
+	for (sparse_ptr_t p = 0; p < count; p++) {
+		T->row_ind[num_val] = row_ind[p];
+		T->col_ind[num_val] = col_ind[p];
+		T->val[num_val] = val[p];
+		num_val += val[p] != 0;
+	}
+	T->num_val = num_val;
+}
+
+/* 
+ * Function: sum_duplicates
+ * ---------------------------- 
+ *   Sums the runs of equal indices in each row (or column) of sorted,
+ *   compressed entries in to one entry each, and drops the entries that sum
+ *   to zero. Each row is compacted in place at the start of its old range.
+ * 
+ *   ptr: the n + 1 offsets of the rows (or columns)
+ *   ind: the sorted indices within each row (or column)
+ *   val: the values of the entries
+ *   n: the number of rows (or columns)
+ *   count: filled with the number of entries left in each row (or column)
+ * 
+ *   returns: the number of entries left in total
+ */
+static sparse_ptr_t sum_duplicates(const sparse_ptr_t *ptr, sparse_ind_t *ind,
+	int *val, sparse_ind_t n, sparse_ptr_t *count) {
+	sparse_ptr_t total = 0;
+
+	#pragma omp parallel for schedule(dynamic, 1024) reduction(+:total)
+	for (sparse_ind_t i = 0; i < n; i++) {
+		sparse_ptr_t w = ptr[i];
+
+		for (sparse_ptr_t p = ptr[i]; p < ptr[i + 1]; p++) {
+			if (w > ptr[i] && ind[w - 1] == ind[p]) {
+				val[w - 1] += val[p];
+				continue;
+			}
+
+			/* The previous run is complete; overwrite it if it summed to zero */
+			if (w > ptr[i] && val[w - 1] == 0) w--;
+			ind[w] = ind[p];
+			val[w] = val[p];
+			w++;
+		}
+		if (w > ptr[i] && val[w - 1] == 0) w--;
+
+		count[i] = w - ptr[i];
+		total += count[i];
+	}
+
+	return total;
+}
+
+/* 
+ * Function: gather_rows
+ * ---------------------------- 
+ *   Copies the first count[i] entries of each row (or column) i in to
+ *   exactly sized compressed arrays.
+ * 
+ *   ptr, ind, val: the rows (or columns) to copy from
+ *   count: the number of entries to copy from each row (or column)
+ *   n: the number of rows (or columns)
+ *   out_ptr, out_ind, out_val: the compressed arrays to fill
+ */
+static void gather_rows(const sparse_ptr_t *ptr, const sparse_ind_t *ind,
+	const int *val, const sparse_ptr_t *count, sparse_ind_t n,
+	sparse_ptr_t *out_ptr, sparse_ind_t *out_ind, int *out_val) {
+	out_ptr[0] = 0;
+	for (sparse_ind_t i = 0; i < n; i++) out_ptr[i + 1] = out_ptr[i] + count[i];
+
+	#pragma omp parallel for schedule(dynamic, 1024)
+	for (sparse_ind_t i = 0; i < n; i++) {
+		memcpy(out_ind + out_ptr[i], ind + ptr[i], count[i] * sizeof(sparse_ind_t));
+		memcpy(out_val + out_ptr[i], val + ptr[i], count[i] * sizeof(int));
+	}
+}
+
+/* 
+ * Function: build_CSR_matrix
+ * ---------------------------- 
+ *   Builds a CSR matrix from the triples collected so far: radix sorts them,
+ *   sums duplicates, drops the values that sum to zero and copies the rest in
+ *   to a CSR matrix of exactly the right size. The builder is left as it was,
+ *   so more batches can be added and built again.
+ * 
+ *   B: the builder to build from
+ * 
+ *   returns: the newly allocated CSR matrix
+ */
+struct CSR_Matrix *build_CSR_matrix(struct COO_Builder *B) {
+	struct COO_Matrix *T = &B->triples;
+	sparse_ptr_t *row_ptr = (sparse_ptr_t *) Malloc(((size_t) T->num_rows + 1) * \
+		sizeof(sparse_ptr_t));
+	sparse_ptr_t *count = (sparse_ptr_t *) Malloc(((size_t) T->num_rows + 1) * \
+		sizeof(sparse_ptr_t));
+	sparse_ind_t *col_ind = (sparse_ind_t *) Malloc(T->num_val * sizeof(sparse_ind_t));
+	int *val = (int *) Malloc(T->num_val * sizeof(int));
+
+	sort_COO_matrix(T, T->row_ind, T->num_rows, T->col_ind, T->num_cols, row_ptr,
+		col_ind, val);
+	sparse_ptr_t num_val = sum_duplicates(row_ptr, col_ind, val, T->num_rows, count);
+
+	struct CSR_Matrix *C = init_CSR_matrix(num_val, T->num_rows, T->num_cols);
+	gather_rows(row_ptr, col_ind, val, count, T->num_rows, C->row_ptr, C->col_ind,
+		C->val);
+
+	free(row_ptr);
+	free(count);
+	free(col_ind);
+	free(val);
+	return C;
+}
+
+/* 
+ * Function: build_CCS_matrix
+ * ---------------------------- 
+ *   Builds a CCS matrix from the triples collected so far, as in
+ *   build_CSR_matrix.
+ * 
+ *   B: the builder to build from
+ * 
+ *   returns: the newly allocated CCS matrix
+ */
+struct CCS_Matrix *build_CCS_matrix(struct COO_Builder *B) {
+	struct COO_Matrix *T = &B->triples;
+	sparse_ptr_t *col_ptr = (sparse_ptr_t *) Malloc(((size_t) T->num_cols + 1) * \
+		sizeof(sparse_ptr_t));
+	sparse_ptr_t *count = (sparse_ptr_t *) Malloc(((size_t) T->num_cols + 1) * \
+		sizeof(sparse_ptr_t));
+	sparse_ind_t *row_ind = (sparse_ind_t *) Malloc(T->num_val * sizeof(sparse_ind_t));
+	int *val = (int *) Malloc(T->num_val * sizeof(int));
+
+	sort_COO_matrix(T, T->col_ind, T->num_cols, T->row_ind, T->num_rows, col_ptr,
+		row_ind, val);
+	sparse_ptr_t num_val = sum_duplicates(col_ptr, row_ind, val, T->num_cols, count);
+
+	struct CCS_Matrix *C = init_CCS_matrix(num_val, T->num_rows, T->num_cols);
+	gather_rows(col_ptr, row_ind, val, count, T->num_cols, C->col_ptr, C->row_ind,
+		C->val);
+
+	free(col_ptr);
+	free(count);
+	free(row_ind);
+	free(val);
+	return C;
+}
+
+/* 
+ * Function: free_COO_builder
+ * ---------------------------- 
+ *   Frees a builder and the triples collected in it.
+ * 
+ *   B: the builder to free
+ */
+void free_COO_builder(struct COO_Builder *B) {
+	free(B->triples.val);
+	free(B->triples.row_ind);
+	free(B->triples.col_ind);
+	free(B);
+}
+
+/* 
+ * The room given to a row of a dynamic CSR matrix past its values, on top
+ * of a quarter of its length, whenever the rows are laid out.
+ */
+#ifndef DYNAMIC_CSR_SLACK
+#define DYNAMIC_CSR_SLACK 4
+#endif
+
+static inline sparse_ptr_t dynamic_row_room(sparse_ptr_t len) {
+	return len + len / 4 + DYNAMIC_CSR_SLACK;
+}
+
+/* 
+ * Function: layout_dynamic_CSR_matrix
+ * ---------------------------- 
+ *   Lays the rows of a dynamic CSR matrix out afresh in new arrays, in order
+ *   and each with the usual room, leaving half as many slots again free at
+ *   the end for rows that outgrow their room. The old arrays are not freed.
+ * 
+ *   D: the matrix to lay out; row_begin and row_end locate the rows in val
+ *     and col_ind
+ *   val: the values to copy the rows from
+ *   col_ind: the column indices to copy the rows from
+ *   extra: slots to keep free at the end on top of that
+ */
+static void layout_dynamic_CSR_matrix(struct Dynamic_CSR_Matrix *D,
+	const int *val, const sparse_ind_t *col_ind, sparse_ptr_t extra) {
+	sparse_ptr_t *new_begin = (sparse_ptr_t *) Malloc(((size_t) D->num_rows + 1) * \
+		sizeof(sparse_ptr_t));
+	sparse_ptr_t num_slots = 0;
+
+	for (sparse_ind_t i = 0; i < D->num_rows; i++) {
+		new_begin[i] = num_slots;
+		num_slots += dynamic_row_room(D->row_end[i] - D->row_begin[i]);
+	}
+
+	D->capacity = num_slots + num_slots / 2 + extra;
+	D->num_slots = num_slots;
+	D->val = (int *) Malloc(D->capacity * sizeof(int));
+	D->col_ind = (sparse_ind_t *) Malloc(D->capacity * sizeof(sparse_ind_t));
+
+	#pragma omp parallel for schedule(dynamic, 1024)
+	for (sparse_ind_t i = 0; i < D->num_rows; i++) {
+		sparse_ptr_t len = D->row_end[i] - D->row_begin[i];
+		memcpy(D->val + new_begin[i], val + D->row_begin[i], len * sizeof(int));
+		memcpy(D->col_ind + new_begin[i], col_ind + D->row_begin[i],
+			len * sizeof(sparse_ind_t));
+
+		D->row_begin[i] = new_begin[i];
+		D->row_end[i] = new_begin[i] + len;
+		D->row_limit[i] = new_begin[i] + dynamic_row_room(len);
+	}
+
+	free(new_begin);
+}
+
+/* 
+ * Function: reserve_dynamic_row
+ * ---------------------------- 
+ *   Makes sure a row of a dynamic CSR matrix has room for len values, moving
+ *   it to the end of the arrays with more room if it does not.
+ * 
+ *   D: the matrix
+ *   row: the row to make room in
+ *   len: the number of values the row must have room for
+ */
+static void reserve_dynamic_row(struct Dynamic_CSR_Matrix *D, sparse_ind_t row,
+	sparse_ptr_t len) {
+	if (D->row_limit[row] - D->row_begin[row] >= len) return;
+
+	sparse_ptr_t room = 2 * (D->row_limit[row] - D->row_begin[row]);
+	if (room < dynamic_row_room(len)) room = dynamic_row_room(len);
+
+	/* The last row can simply grow in to the free slots after it */
+	if (D->row_limit[row] == D->num_slots && \
+		D->row_begin[row] + room <= D->capacity) {
+		D->row_limit[row] = D->row_begin[row] + room;
+		D->num_slots = D->row_limit[row];
+		return;
+	}
+
+	if (D->num_slots + room > D->capacity) {
+		int *old_val = D->val;
+		sparse_ind_t *old_col_ind = D->col_ind;
+
+		layout_dynamic_CSR_matrix(D, old_val, old_col_ind, room);
+		free(old_val);
+		free(old_col_ind);
+		if (D->row_limit[row] - D->row_begin[row] >= len) return;
+	}
+
+	sparse_ptr_t old_len = D->row_end[row] - D->row_begin[row];
+	memcpy(D->val + D->num_slots, D->val + D->row_begin[row], old_len * sizeof(int));
+	memcpy(D->col_ind + D->num_slots, D->col_ind + D->row_begin[row],
+		old_len * sizeof(sparse_ind_t));
+
+	D->row_begin[row] = D->num_slots;
+	D->row_end[row] = D->num_slots + old_len;
+	D->row_limit[row] = D->num_slots + room;
+	D->num_slots += room;
+}
+
+/* 
+ * Function: init_dynamic_CSR_matrix
+ * ---------------------------- 
+ *   Allocates a dynamic CSR matrix holding a copy of a CSR matrix.
+ * 
+ *   R: the CSR matrix to copy, with sorted rows
+ * 
+ *   returns: the allocated dynamic CSR matrix
+ */
+struct Dynamic_CSR_Matrix *init_dynamic_CSR_matrix(struct CSR_Matrix *R) {
+	struct Dynamic_CSR_Matrix *D = (struct Dynamic_CSR_Matrix *) \
+		Malloc(sizeof(struct Dynamic_CSR_Matrix));
+	size_t ptr_size = ((size_t) R->num_rows + 1) * sizeof(sparse_ptr_t);
+
+	D->row_begin = (sparse_ptr_t *) Malloc(ptr_size);
+	D->row_end = (sparse_ptr_t *) Malloc(ptr_size);
+	D->row_limit = (sparse_ptr_t *) Malloc(ptr_size);
+	D->num_val = R->row_ptr[R->num_rows];
+	D->num_rows = R->num_rows;
+	D->num_cols = R->num_cols;
+
+	/* R is a dynamic matrix without any room, to be laid out */
+	memcpy(D->row_begin, R->row_ptr, R->num_rows * sizeof(sparse_ptr_t));
+	memcpy(D->row_end, R->row_ptr + 1, R->num_rows * sizeof(sparse_ptr_t));
+	layout_dynamic_CSR_matrix(D, R->val, R->col_ind, 0);
+
+	return D;
+}
+
+/* 
+ * Function: find_dynamic_CSR_entry
+ * ---------------------------- 
+ *   Binary searches a row of a dynamic CSR matrix for a column.
+ * 
+ *   D: the matrix
+ *   row: the row to search
+ *   col: the column to search for
+ * 
+ *   returns: the position of the column in the row's arrays if it is there,
+ *     otherwise the position it would be inserted at
+ */
+static sparse_ptr_t find_dynamic_CSR_entry(struct Dynamic_CSR_Matrix *D,
+	sparse_ind_t row, sparse_ind_t col) {
+	if (row < 0 || row >= D->num_rows || col < 0 || col >= D->num_cols) {
+		fprintf(stderr, "Entry index is out of range of the matrix.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	sparse_ptr_t lo = D->row_begin[row], hi = D->row_end[row];
+	while (lo < hi) {
+		sparse_ptr_t mid = lo + (hi - lo) / 2;
+		if (D->col_ind[mid] < col) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* 
+ * Function: remove_dynamic_CSR_entry
+ * ---------------------------- 
+ *   Removes one value from a dynamic CSR matrix. The room it took stays with
+ *   its row.
+ * 
+ *   D: the matrix to update
+ *   row: the row of the value
+ *   col: the column of the value
+ * 
+ *   returns: 1 if there was a value to remove, otherwise 0
+ */
+int remove_dynamic_CSR_entry(struct Dynamic_CSR_Matrix *D, sparse_ind_t row,
+	sparse_ind_t col) {
+	sparse_ptr_t pos = find_dynamic_CSR_entry(D, row, col);
+	if (pos == D->row_end[row] || D->col_ind[pos] != col) return 0;
+
+	memmove(D->val + pos, D->val + pos + 1, (D->row_end[row] - pos - 1) * sizeof(int));
+	memmove(D->col_ind + pos, D->col_ind + pos + 1,
+		(D->row_end[row] - pos - 1) * sizeof(sparse_ind_t));
+	D->row_end[row]--;
+	D->num_val--;
+
+	return 1;
+}
+
+/* 
+ * Function: set_dynamic_CSR_entry
+ * ---------------------------- 
+ *   Sets one value of a dynamic CSR matrix, inserting it if it was zero.
+ *   Setting a value to zero removes it.
+ * 
+ *   D: the matrix to update
+ *   row: the row of the value
+ *   col: the column of the value
+ *   val: the new value
+ */
+void set_dynamic_CSR_entry(struct Dynamic_CSR_Matrix *D, sparse_ind_t row,
+	sparse_ind_t col, int val) {
+	sparse_ptr_t pos = find_dynamic_CSR_entry(D, row, col);
+
+	if (pos < D->row_end[row] && D->col_ind[pos] == col) {
+		if (val != 0) D->val[pos] = val;
+		else remove_dynamic_CSR_entry(D, row, col);
+		return;
+	}
+	if (val == 0) return;
+
+	/* The row may move, so find the position again relative to its start */
+	sparse_ptr_t offset = pos - D->row_begin[row];
+	reserve_dynamic_row(D, row, D->row_end[row] - D->row_begin[row] + 1);
+	pos = D->row_begin[row] + offset;
+
+	memmove(D->val + pos + 1, D->val + pos, (D->row_end[row] - pos) * sizeof(int));
+	memmove(D->col_ind + pos + 1, D->col_ind + pos,
+		(D->row_end[row] - pos) * sizeof(sparse_ind_t));
+	D->val[pos] = val;
+	D->col_ind[pos] = col;
+	D->row_end[row]++;
+	D->num_val++;
+}
+
+/* 
+ * Function: replace_dynamic_CSR_row
+ * ---------------------------- 
+ *   Replaces a whole row of a dynamic CSR matrix.
+ * 
+ *   D: the matrix to update
+ *   row: the row to replace
+ *   col_ind: the sorted column indices of the new row
+ *   val: the values of the new row
+ *   len: the number of values in the new row
+ */
+void replace_dynamic_CSR_row(struct Dynamic_CSR_Matrix *D, sparse_ind_t row,
+	const sparse_ind_t *col_ind, const int *val, sparse_ptr_t len) {
+	reserve_dynamic_row(D, row, len);
+
+	memcpy(D->val + D->row_begin[row], val, len * sizeof(int));
+	memcpy(D->col_ind + D->row_begin[row], col_ind, len * sizeof(sparse_ind_t));
+	D->num_val += len - (D->row_end[row] - D->row_begin[row]);
+	D->row_end[row] = D->row_begin[row] + len;
+}
+
+/* 
+ * Function: convert_dynamic_CSR_to_CSR
+ * ---------------------------- 
+ *   Copies a dynamic CSR matrix in to a CSR matrix of exactly the right size,
+ *   for the kernels that only take CSR.
+ * 
+ *   D: the dynamic CSR matrix to convert
+ * 
+ *   returns: the same matrix as a newly allocated CSR matrix
+ */
+struct CSR_Matrix *convert_dynamic_CSR_to_CSR(struct Dynamic_CSR_Matrix *D) {
+	struct CSR_Matrix *C = init_CSR_matrix(D->num_val, D->num_rows, D->num_cols);
+
+	C->row_ptr[0] = 0;
+	for (sparse_ind_t i = 0; i < D->num_rows; i++)
+		C->row_ptr[i + 1] = C->row_ptr[i] + (D->row_end[i] - D->row_begin[i]);
+
+	#pragma omp parallel for schedule(dynamic, 1024)
+	for (sparse_ind_t i = 0; i < D->num_rows; i++) {
+		sparse_ptr_t len = D->row_end[i] - D->row_begin[i];
+		memcpy(C->val + C->row_ptr[i], D->val + D->row_begin[i], len * sizeof(int));
+		memcpy(C->col_ind + C->row_ptr[i], D->col_ind + D->row_begin[i],
+			len * sizeof(sparse_ind_t));
+	}
+
+	return C;
+}
+
+/* 
+ * Function: dynamic_sparse_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for two dynamic CSR matrices with the row-wise kernels of
+ *   rowwise_sparse_matrix_multiply, reading the rows where they are.
+ * 
+ *   X: 2D sparse matrix to left-multiply
+ *   Y: 2D sparse matrix to right-multiply
+ * 
+ *   returns: the matrix X * Y as a CSR matrix
+ */
+struct CSR_Matrix *dynamic_sparse_matrix_multiply(struct Dynamic_CSR_Matrix *X,
+	struct Dynamic_CSR_Matrix *Y) {
+	struct CSR_View x_view = {X->val, X->col_ind, X->row_begin, X->row_end,
+		X->num_rows, X->num_cols};
+	struct CSR_View y_view = {Y->val, Y->col_ind, Y->row_begin, Y->row_end,
+		Y->num_rows, Y->num_cols};
+
+	return rowwise_multiply_views(&x_view, &y_view, PLUS_TIMES);
+}
+
+/* 
+ * Function: update_sparse_product
+ * ---------------------------- 
+ *   Brings Z = X * Y up to date after some rows of X and Y have changed, by
+ *   recomputing only the rows of Z that can have changed: the changed rows
+ *   of X, and the rows of X with a value in a column matching a changed row
+ *   of Y. Finding the latter takes a read of X's column indices, which is
+ *   skipped when no row of Y has changed.
+ * 
+ *   Z: the product to update, as computed by dynamic_sparse_matrix_multiply
+ *     before the changes
+ *   X: the left matrix, after the changes
+ *   Y: the right matrix, after the changes
+ *   x_rows: the rows of X that have changed
+ *   num_x_rows: the number of entries in x_rows
+ *   y_rows: the rows of Y that have changed
+ *   num_y_rows: the number of entries in y_rows
+ * 
+ *   returns: the number of rows of Z recomputed
+ */
+sparse_ind_t update_sparse_product(struct Dynamic_CSR_Matrix *Z,
+	struct Dynamic_CSR_Matrix *X, struct Dynamic_CSR_Matrix *Y,
+	const sparse_ind_t *x_rows, sparse_ind_t num_x_rows,
+	const sparse_ind_t *y_rows, sparse_ind_t num_y_rows) {
+	if (X->num_cols != Y->num_rows || Z->num_rows != X->num_rows || \
+		Z->num_cols != Y->num_cols) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned char *affected = (unsigned char *) calloc((size_t) X->num_rows + 1, 1);
+	if (affected == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (sparse_ind_t i = 0; i < num_x_rows; i++) affected[x_rows[i]] = 1;
+
+	if (num_y_rows > 0) {
+		unsigned char *changed = (unsigned char *) calloc((size_t) Y->num_rows + 1, 1);
+		if (changed == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for (sparse_ind_t i = 0; i < num_y_rows; i++) changed[y_rows[i]] = 1;
+
+		#pragma omp parallel for schedule(dynamic, 1024)
+		for (sparse_ind_t i = 0; i < X->num_rows; i++) {
+			for (sparse_ptr_t p = X->row_begin[i]; p < X->row_end[i] && !affected[i]; p++)
+				if (changed[X->col_ind[p]]) affected[i] = 1;
+		}
+
+		free(changed);
+	}
+
+	/* A view of just the affected rows of X gives the affected rows of Z */
+	sparse_ind_t num_affected = 0;
+	for (sparse_ind_t i = 0; i < X->num_rows; i++) num_affected += affected[i];
+
+	sparse_ind_t *rows = (sparse_ind_t *) Malloc(((size_t) num_affected + 1) * \
+		sizeof(sparse_ind_t));
+	sparse_ptr_t *begin = (sparse_ptr_t *) Malloc(((size_t) num_affected + 1) * \
+		sizeof(sparse_ptr_t));
+	sparse_ptr_t *end = (sparse_ptr_t *) Malloc(((size_t) num_affected + 1) * \
+		sizeof(sparse_ptr_t));
+
+	num_affected = 0;
+	for (sparse_ind_t i = 0; i < X->num_rows; i++) {
+		if (!affected[i]) continue;
+		rows[num_affected] = i;
+		begin[num_affected] = X->row_begin[i];
+		end[num_affected] = X->row_end[i];
+		num_affected++;
+	}
+
+	struct CSR_View x_view = {X->val, X->col_ind, begin, end, num_affected,
+		X->num_cols};
+	struct CSR_View y_view = {Y->val, Y->col_ind, Y->row_begin, Y->row_end,
+		Y->num_rows, Y->num_cols};
+	struct CSR_Matrix *W = rowwise_multiply_views(&x_view, &y_view, PLUS_TIMES);
+
+	for (sparse_ind_t i = 0; i < num_affected; i++)
+		replace_dynamic_CSR_row(Z, rows[i], W->col_ind + W->row_ptr[i],
+			W->val + W->row_ptr[i], W->row_ptr[i + 1] - W->row_ptr[i]);
+
+	free(affected);
+	free(rows);
+	free(begin);
+	free(end);
+	free_CSR_matrix(W);
+
+	return num_affected;
+}
+
+/* 
+ * Function: free_dynamic_CSR_matrix
+ * ---------------------------- 
+ *   Frees a dynamic CSR matrix.
+ * 
+ *   D: the matrix to free
+ */
+void free_dynamic_CSR_matrix(struct Dynamic_CSR_Matrix *D) {
+	free(D->val);
+	free(D->col_ind);
+	free(D->row_begin);
+	free(D->row_end);
+	free(D->row_limit);
+	free(D);
+}
+
+/* 
+ * Function: doubly_compress
+ * ---------------------------- 
+ *   Drops the empty rows (or columns) of a compressed matrix: fills in the
+ *   doubly compressed arrays from ptr, ind and val.
+ * 
+ *   ptr, ind, val: the arrays of the compressed matrix
+ *   n: the number of rows (or columns) in ptr
+ *   nonempty: the non-empty rows (or columns), from nonempty_indices
+ *   num_nonempty: the number of entries in nonempty
+ *   nonempty_map: if not NULL, maps each entry of nonempty to the index to
+ *     store instead
+ *   d_ind, d_ptr, d_minor, d_val: the doubly compressed arrays to fill
+ */
+static void doubly_compress(const sparse_ptr_t *ptr, const sparse_ind_t *ind,
+	const int *val, const sparse_ind_t *nonempty, sparse_ind_t num_nonempty,
+	const sparse_ind_t *nonempty_map, sparse_ind_t *d_ind, sparse_ptr_t *d_ptr,
+	sparse_ind_t *d_minor, int *d_val) {
+	sparse_ptr_t num_val = 0;
+
+	for (sparse_ind_t i = 0; i < num_nonempty; i++) {
+		sparse_ind_t r = nonempty[i];
+		d_ind[i] = nonempty_map != NULL ? nonempty_map[r] : r;
+		d_ptr[i] = num_val;
+		num_val += ptr[r + 1] - ptr[r];
+	}
+	d_ptr[num_nonempty] = num_val;
+
+	#pragma omp parallel for schedule(dynamic, 1024)
+	for (sparse_ind_t i = 0; i < num_nonempty; i++) {
+		sparse_ind_t r = nonempty[i];
+		memcpy(d_minor + d_ptr[i], ind + ptr[r], (ptr[r + 1] - ptr[r]) * \
+			sizeof(sparse_ind_t));
+		memcpy(d_val + d_ptr[i], val + ptr[r], (ptr[r + 1] - ptr[r]) * sizeof(int));
+	}
+}
+
+/* 
+ * Function: convert_CSR_to_DCSR
+ * ---------------------------- 
+ *   Converts a CSR matrix to DCSR by dropping its empty rows.
+ * 
+ *   R: the CSR matrix to convert
+ * 
+ *   returns: the same matrix as a newly allocated DCSR matrix
+ */
+struct DCSR_Matrix *convert_CSR_to_DCSR(struct CSR_Matrix *R) {
+	sparse_ind_t *rows = (sparse_ind_t *) Malloc(((size_t) R->num_rows + 1) * \
+		sizeof(sparse_ind_t));
+	sparse_ind_t num_nonempty = nonempty_indices(R->row_ptr, R->num_rows, rows);
+
+	struct DCSR_Matrix *D = init_DCSR_matrix(R->row_ptr[R->num_rows], num_nonempty,
+		R->num_rows, R->num_cols);
+	doubly_compress(R->row_ptr, R->col_ind, R->val, rows, num_nonempty, NULL,
+		D->row_ind, D->row_ptr, D->col_ind, D->val);
+
+	free(rows);
+	return D;
+}
+
+/* 
+ * Function: convert_CCS_to_DCSC
+ * ---------------------------- 
+ *   Converts a CCS matrix to DCSC by dropping its empty columns.
+ * 
+ *   R: the CCS matrix to convert
+ * 
+ *   returns: the same matrix as a newly allocated DCSC matrix
+ */
+struct DCSC_Matrix *convert_CCS_to_DCSC(struct CCS_Matrix *R) {
+	sparse_ind_t *cols = (sparse_ind_t *) Malloc(((size_t) R->num_cols + 1) * \
+		sizeof(sparse_ind_t));
+	sparse_ind_t num_nonempty = nonempty_indices(R->col_ptr, R->num_cols, cols);
+
+	struct DCSC_Matrix *D = init_DCSC_matrix(R->col_ptr[R->num_cols], num_nonempty,
+		R->num_rows, R->num_cols);
+	doubly_compress(R->col_ptr, R->row_ind, R->val, cols, num_nonempty, NULL,
+		D->col_ind, D->col_ptr, D->row_ind, D->val);
+
+	free(cols);
+	return D;
+}
+
+/* 
+ * Function: expand_doubly_compressed
+ * ---------------------------- 
+ *   Fills in the ptr array of a compressed matrix from the ptr array of a
+ *   doubly compressed one, giving the missing rows (or columns) no values.
+ * 
+ *   d_ind, d_ptr: the non-empty rows (or columns) and their offsets
+ *   num_nonempty: the number of non-empty rows (or columns)
+ *   n: the number of rows (or columns)
+ *   ptr: the n + 1 offsets to fill
+ */
+static void expand_doubly_compressed(const sparse_ind_t *d_ind,
+	const sparse_ptr_t *d_ptr, sparse_ind_t num_nonempty, sparse_ind_t n,
+	sparse_ptr_t *ptr) {
+	sparse_ind_t i = 0;
+	for (sparse_ind_t r = 0; r <= n; r++) {
+		/* Row r starts where the first non-empty row at or after it does */
+		while (i < num_nonempty && d_ind[i] < r) i++;
+		ptr[r] = d_ptr[i];
+	}
+}
+
+/* 
+ * Function: convert_DCSR_to_CSR
+ * ---------------------------- 
+ *   Converts a DCSR matrix to CSR.
+ * 
+ *   R: the DCSR matrix to convert
+ * 
+ *   returns: the same matrix as a newly allocated CSR matrix
+ */
+struct CSR_Matrix *convert_DCSR_to_CSR(struct DCSR_Matrix *R) {
+	sparse_ptr_t num_val = R->row_ptr[R->num_nonempty_rows];
+	struct CSR_Matrix *C = init_CSR_matrix(num_val, R->num_rows, R->num_cols);
+
+	expand_doubly_compressed(R->row_ind, R->row_ptr, R->num_nonempty_rows,
+		R->num_rows, C->row_ptr);
+	memcpy(C->val, R->val, num_val * sizeof(int));
+	memcpy(C->col_ind, R->col_ind, num_val * sizeof(sparse_ind_t));
+
+	return C;
+}
+
+/* 
+ * Function: convert_DCSC_to_CCS
+ * ---------------------------- 
+ *   Converts a DCSC matrix to CCS.
+ * 
+ *   R: the DCSC matrix to convert
+ * 
+ *   returns: the same matrix as a newly allocated CCS matrix
+ */
+struct CCS_Matrix *convert_DCSC_to_CCS(struct DCSC_Matrix *R) {
+	sparse_ptr_t num_val = R->col_ptr[R->num_nonempty_cols];
+	struct CCS_Matrix *C = init_CCS_matrix(num_val, R->num_rows, R->num_cols);
+
+	expand_doubly_compressed(R->col_ind, R->col_ptr, R->num_nonempty_cols,
+		R->num_cols, C->col_ptr);
+	memcpy(C->val, R->val, num_val * sizeof(int));
+	memcpy(C->row_ind, R->row_ind, num_val * sizeof(sparse_ind_t));
+
+	return C;
+}
+
+/* 
+ * Function: compact_product_to_DCSR
+ * ---------------------------- 
+ *   Turns a product computed over only the non-empty rows (and columns) of
+ *   its operands in to a DCSR matrix of the full size, mapping the compact
+ *   rows and columns back to the original ones. Frees the compact product.
+ * 
+ *   Z: the compact product
+ *   row_ids: the original row of each row of Z
+ *   col_ids: the original column of each column of Z, or NULL if they are
+ *     already the original ones
+ *   num_rows: the number of rows in the result
+ *   num_cols: the number of columns in the result
+ * 
+ *   returns: the product as a DCSR matrix
+ */
+static struct DCSR_Matrix *compact_product_to_DCSR(struct CSR_Matrix *Z,
+	const sparse_ind_t *row_ids, const sparse_ind_t *col_ids,
+	sparse_ind_t num_rows, sparse_ind_t num_cols) {
+	sparse_ind_t *rows = (sparse_ind_t *) Malloc(((size_t) Z->num_rows + 1) * \
+		sizeof(sparse_ind_t));
+	sparse_ind_t num_nonempty = nonempty_indices(Z->row_ptr, Z->num_rows, rows);
+
+	struct DCSR_Matrix *D = init_DCSR_matrix(Z->row_ptr[Z->num_rows], num_nonempty,
+		num_rows, num_cols);
+	doubly_compress(Z->row_ptr, Z->col_ind, Z->val, rows, num_nonempty, row_ids,
+		D->row_ind, D->row_ptr, D->col_ind, D->val);
+
+	if (col_ids != NULL) {
+		#pragma omp parallel for
+		for (sparse_ptr_t p = 0; p < D->row_ptr[num_nonempty]; p++)
+			D->col_ind[p] = col_ids[D->col_ind[p]];
+	}
+
+	free(rows);
+	free_CSR_matrix(Z);
+	return D;
+}
+
+/* 
+ * Function: hypersparse_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for a DCSR X and a DCSC Y with dot products, like
+ *   sparse_matrix_multiply, without ever touching an empty row of X or an
+ *   empty column of Y. The doubly compressed arrays are used as they are,
+ *   as a CSR (CCS) matrix of just the non-empty rows (columns), and only the
+ *   rows and columns of the product are mapped back at the end.
+ * 
+ *   X: 2D hypersparse matrix to left-multiply
+ *   Y: 2D hypersparse matrix to right-multiply
+ * 
+ *   returns: the matrix X * Y as a DCSR matrix
+ */
+struct DCSR_Matrix *hypersparse_matrix_multiply(struct DCSR_Matrix *X,
+	struct DCSC_Matrix *Y) {
+	// Check whether X and Y are compatible
+	if (X->num_cols != Y->num_rows) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct CSR_Matrix compact_X = {X->val, X->col_ind, X->row_ptr,
+		X->num_nonempty_rows, X->num_cols};
+	struct CCS_Matrix compact_Y = {Y->val, Y->row_ind, Y->col_ptr, Y->num_rows,
+		Y->num_nonempty_cols};
+
+	struct CSR_Matrix *Z = sparse_matrix_multiply(&compact_X, &compact_Y);
+
+	return compact_product_to_DCSR(Z, X->row_ind, Y->col_ind, X->num_rows,
+		Y->num_cols);
+}
+
+/* 
+ * Function: rowwise_hypersparse_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for two DCSR matrices one row of the product at a time,
+ *   like rowwise_sparse_matrix_multiply. The column indices of X are mapped
+ *   to the positions of the matching non-empty rows of Y (dropping those
+ *   that match an empty row), after which both sets of doubly compressed
+ *   arrays are used as CSR matrices of just their non-empty rows.
+ * 
+ *   X: 2D hypersparse matrix to left-multiply
+ *   Y: 2D hypersparse matrix to right-multiply
+ * 
+ *   returns: the matrix X * Y as a DCSR matrix
+ */
+struct DCSR_Matrix *rowwise_hypersparse_matrix_multiply(struct DCSR_Matrix *X,
+	struct DCSR_Matrix *Y) {
+	// Check whether X and Y are compatible
+	if (X->num_cols != Y->num_rows) {
+		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	sparse_ptr_t x_num_val = X->row_ptr[X->num_nonempty_rows];
+	struct CSR_Matrix *compact_X = init_CSR_matrix(x_num_val, X->num_nonempty_rows,
+		Y->num_nonempty_rows);
+	sparse_ptr_t num_val = 0;
+
+	/* The columns of each row of X are sorted, so each binary search over the
+	*  non-empty rows of Y can start where the previous one ended */
+	for (sparse_ind_t i = 0; i < X->num_nonempty_rows; i++) {
+		compact_X->row_ptr[i] = num_val;
+		sparse_ind_t y_row = 0;
+
+		for (sparse_ptr_t x_col = X->row_ptr[i]; x_col < X->row_ptr[i + 1]; x_col++) {
+			sparse_ind_t hi = Y->num_nonempty_rows;
+			while (y_row < hi) {
+				sparse_ind_t mid = y_row + (hi - y_row) / 2;
+				if (Y->row_ind[mid] < X->col_ind[x_col]) y_row = mid + 1;
+				else hi = mid;
+			}
+			if (y_row >= Y->num_nonempty_rows) break;
+
+			if (Y->row_ind[y_row] == X->col_ind[x_col]) {
+				compact_X->col_ind[num_val] = y_row;
+				compact_X->val[num_val] = X->val[x_col];
+				num_val++;
+			}
+		}
+	}
+	compact_X->row_ptr[X->num_nonempty_rows] = num_val;
+
+	struct CSR_Matrix compact_Y = {Y->val, Y->col_ind, Y->row_ptr,
+		Y->num_nonempty_rows, Y->num_cols};
+
+	struct CSR_Matrix *Z = rowwise_sparse_matrix_multiply(compact_X, &compact_Y);
+	free_CSR_matrix(compact_X);
+
+	return compact_product_to_DCSR(Z, X->row_ind, NULL, X->num_rows, Y->num_cols);
+}
+
+/* 
+ * Below this many rows, recursive bisection stops splitting a part and
+ * keeps it in the breadth-first order it was given.
+ */
+#ifndef SPARSE_BISECT_LEAF
+#define SPARSE_BISECT_LEAF 64
+#endif
+
+/* 
+ * Function: invert_permutation
+ * ---------------------------- 
+ *   Inverts a permutation.
+ * 
+ *   perm: the permutation, perm[new] = old
+ *   n: the length of perm
+ * 
+ *   returns: the newly allocated inverse, inverse[old] = new
+ */
+static sparse_ind_t *invert_permutation(const sparse_ind_t *perm, sparse_ind_t n) {
+	sparse_ind_t *inverse = (sparse_ind_t *) Malloc(((size_t) n + 1) * \
+		sizeof(sparse_ind_t));
+
+	#pragma omp parallel for
+	for (sparse_ind_t i = 0; i < n; i++) inverse[perm[i]] = i;
+
+	return inverse;
+}
+
+/* 
+ * Function: permute_CSR_matrix
+ * ---------------------------- 
+ *   Computes P * R * Q^T, where row i of P is row row_perm[i] of the identity
+ *   and likewise for Q and col_perm. That is, row i of the result is row
+ *   row_perm[i] of R, and column j of the result is column col_perm[j] of R.
+ *   For a symmetric reordering, pass the same permutation for both.
+ * 
+ *   R: the CSR matrix to permute
+ *   row_perm: the new order of the rows, or NULL to keep them
+ *   col_perm: the new order of the columns, or NULL to keep them
+ * 
+ *   returns: the permuted matrix as a newly allocated CSR matrix
+ */
+struct CSR_Matrix *permute_CSR_matrix(struct CSR_Matrix *R,
+	const sparse_ind_t *row_perm, const sparse_ind_t *col_perm) {
+	struct CSR_Matrix *P = init_CSR_matrix(R->row_ptr[R->num_rows], R->num_rows,
+		R->num_cols);
+	sparse_ind_t *col_map = col_perm != NULL ? \
+		invert_permutation(col_perm, R->num_cols) : NULL;
+
+	P->row_ptr[0] = 0;
+	for (sparse_ind_t i = 0; i < R->num_rows; i++) {
+		sparse_ind_t r = row_perm != NULL ? row_perm[i] : i;
+		P->row_ptr[i + 1] = P->row_ptr[i] + (R->row_ptr[r + 1] - R->row_ptr[r]);
+	}
+
+	#pragma omp parallel for schedule(dynamic, 256)
+	for (sparse_ind_t i = 0; i < R->num_rows; i++) {
+		sparse_ind_t r = row_perm != NULL ? row_perm[i] : i;
+		sparse_ptr_t len = R->row_ptr[r + 1] - R->row_ptr[r];
+
+		memcpy(P->val + P->row_ptr[i], R->val + R->row_ptr[r], len * sizeof(int));
+		if (col_map == NULL) {
+			memcpy(P->col_ind + P->row_ptr[i], R->col_ind + R->row_ptr[r],
+				len * sizeof(sparse_ind_t));
+			continue;
+		}
+
+		for (sparse_ptr_t p = 0; p < len; p++)
+			P->col_ind[P->row_ptr[i] + p] = col_map[R->col_ind[R->row_ptr[r] + p]];
+		sort_row_entries(P->col_ind + P->row_ptr[i], P->val + P->row_ptr[i], len);
+	}
+
+	free(col_map);
+	return P;
+}
+
+/* 
+ * Function: permute_CCS_matrix
+ * ---------------------------- 
+ *   Computes P * R * Q^T for a CCS matrix, as in permute_CSR_matrix. Works on
+ *   the CSR view of R^T, which is the same matrix with the permutations
+ *   swapped.
+ * 
+ *   R: the CCS matrix to permute
+ *   row_perm: the new order of the rows, or NULL to keep them
+ *   col_perm: the new order of the columns, or NULL to keep them
+ * 
+ *   returns: the permuted matrix as a newly allocated CCS matrix
+ */
+struct CCS_Matrix *permute_CCS_matrix(struct CCS_Matrix *R,
+	const sparse_ind_t *row_perm, const sparse_ind_t *col_perm) {
+	struct CSR_Matrix T = CCS_transpose_view(R);
+	struct CSR_Matrix *P = permute_CSR_matrix(&T, col_perm, row_perm);
+
+	struct CCS_Matrix *C = (struct CCS_Matrix *) Malloc(sizeof(struct CCS_Matrix));
+	*C = CSR_transpose_view(P);
+	free(P);
+
+	return C;
+}
+
+/* 
+ * Function: symmetric_pattern
+ * ---------------------------- 
+ *   Builds the adjacency structure of the undirected graph of a square
+ *   matrix: the pattern of R + R^T without the diagonal. The values of the
+ *   result are left unset.
+ * 
+ *   R: the square CSR matrix
+ * 
+ *   returns: the pattern as a newly allocated CSR matrix
+ */
+static struct CSR_Matrix *symmetric_pattern(struct CSR_Matrix *R) {
+	if (R->num_rows != R->num_cols) {
+		fprintf(stderr, "Matrix must be square to be reordered symmetrically.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	sparse_ind_t n = R->num_rows;
+	struct CSR_Matrix *T = transpose_CSR_matrix(R);
+	sparse_ptr_t *count = (sparse_ptr_t *) Malloc(((size_t) n + 1) * \
+		sizeof(sparse_ptr_t));
+
+	/* Merge each row with the same row of the transpose, once to count and
+	*  once to fill */
+	struct CSR_Matrix *G = NULL;
+	for (int pass = 0; pass < 2; pass++) {
+		#pragma omp parallel for schedule(dynamic, 256)
+		for (sparse_ind_t i = 0; i < n; i++) {
+			sparse_ptr_t a = R->row_ptr[i], a_end = R->row_ptr[i + 1];
+			sparse_ptr_t b = T->row_ptr[i], b_end = T->row_ptr[i + 1];
+			sparse_ptr_t k = 0;
+
+			while (a < a_end || b < b_end) {
+				sparse_ind_t j;
+				if (b >= b_end || (a < a_end && R->col_ind[a] < T->col_ind[b]))
+					j = R->col_ind[a++];
+				else if (a >= a_end || T->col_ind[b] < R->col_ind[a])
+					j = T->col_ind[b++];
+				else {
+					j = R->col_ind[a++];
+					b++;
+				}
+
+				if (j == i) continue;
+				if (pass == 1) G->col_ind[G->row_ptr[i] + k] = j;
+				k++;
+			}
+
+			if (pass == 0) count[i] = k;
+		}
+
+		if (pass == 0) {
+			sparse_ptr_t num_val = 0;
+			for (sparse_ind_t i = 0; i < n; i++) num_val += count[i];
+
+			G = init_CSR_matrix(num_val, n, n);
+			G->row_ptr[0] = 0;
+			for (sparse_ind_t i = 0; i < n; i++) G->row_ptr[i + 1] = G->row_ptr[i] + count[i];
+		}
+	}
+
+	free(count);
+	free_CSR_matrix(T);
+	return G;
+}
+
+/* 
+ * Function: breadth_first_levels
+ * ---------------------------- 
+ *   Visits the vertices reachable from start in breadth-first order, only
+ *   stepping to vertices in the same part as start.
+ * 
+ *   G: the adjacency structure, from symmetric_pattern
+ *   start: the vertex to start from
+ *   part: the part of each vertex, or NULL if the whole graph is one part
+ *   mark: mark[v] is set to stamp once v is visited
+ *   stamp: the value marking vertices visited by this search
+ *   queue: filled with the visited vertices, in order
+ *   last_level: set to the position in queue where the last level starts
+ *   num_levels: set to the number of levels
+ * 
+ *   returns: the number of vertices visited
+ */
+static sparse_ind_t breadth_first_levels(struct CSR_Matrix *G, sparse_ind_t start,
+	const sparse_ind_t *part, sparse_ind_t *mark, sparse_ind_t stamp,
+	sparse_ind_t *queue, sparse_ind_t *last_level, sparse_ind_t *num_levels) {
+	sparse_ind_t head = 0, tail = 0, level_end = 1;
+
+	queue[tail++] = start;
+	mark[start] = stamp;
+	*last_level = 0;
+	*num_levels = 1;
+
+	while (head < tail) {
+		if (head == level_end) {
+			*last_level = head;
+			(*num_levels)++;
+			level_end = tail;
+		}
+
+		sparse_ind_t v = queue[head++];
+		for (sparse_ptr_t p = G->row_ptr[v]; p < G->row_ptr[v + 1]; p++) {
+			sparse_ind_t u = G->col_ind[p];
+			if (mark[u] == stamp || (part != NULL && part[u] != part[start])) continue;
+			mark[u] = stamp;
+			queue[tail++] = u;
+		}
+	}
+
+	return tail;
+}
+
+/* 
+ * Function: pseudo_peripheral_vertex
+ * ---------------------------- 
+ *   Finds a vertex far from the centre of its component (George and Liu):
+ *   repeatedly moves to the lowest degree vertex of the last breadth-first
+ *   level for as long as that makes the search deeper.
+ * 
+ *   G, part: as in breadth_first_levels
+ *   start: the vertex to start from
+ *   mark: scratch marks, not shared with the caller's search
+ *   stamp: the last stamp used in mark, advanced by each search
+ *   queue: scratch space for the searches
+ * 
+ *   returns: the pseudo-peripheral vertex
+ */
+static sparse_ind_t pseudo_peripheral_vertex(struct CSR_Matrix *G,
+	sparse_ind_t start, const sparse_ind_t *part, sparse_ind_t *mark,
+	sparse_ind_t *stamp, sparse_ind_t *queue) {
+	sparse_ind_t last_level, depth;
+	sparse_ind_t count = breadth_first_levels(G, start, part, mark, ++*stamp, queue,
+		&last_level, &depth);
+
+	for (;;) {
+		sparse_ind_t best = queue[last_level];
+		for (sparse_ind_t i = last_level + 1; i < count; i++) {
+			sparse_ind_t v = queue[i];
+			if (G->row_ptr[v + 1] - G->row_ptr[v] < G->row_ptr[best + 1] - G->row_ptr[best])
+				best = v;
+		}
+
+		sparse_ind_t next_last, next_depth;
+		sparse_ind_t next_count = breadth_first_levels(G, best, part, mark, ++*stamp,
+			queue, &next_last, &next_depth);
+		if (next_depth <= depth) break;
+
+		start = best;
+		count = next_count;
+		last_level = next_last;
+		depth = next_depth;
+	}
+
+	return start;
+}
+
+/* 
+ * Function: rcm_ordering
+ * ---------------------------- 
+ *   Computes the reverse Cuthill-McKee ordering of a square matrix, which
+ *   keeps the non-zero values close to the diagonal. Each component is
+ *   visited breadth first from a pseudo-peripheral vertex, taking the
+ *   unvisited neighbours of each vertex in order of increasing degree, and
+ *   the result is reversed.
+ * 
+ *   R: the square CSR matrix to order; its pattern is symmetrised first
+ * 
+ *   returns: the newly allocated permutation, perm[new] = old, for use with
+ *     permute_CSR_matrix
+ */
+sparse_ind_t *rcm_ordering(struct CSR_Matrix *R) {
+	struct CSR_Matrix *G = symmetric_pattern(R);
+	sparse_ind_t n = G->num_rows;
+	size_t size = ((size_t) n + 1) * sizeof(sparse_ind_t);
+
+	sparse_ind_t *perm = (sparse_ind_t *) Malloc(size);
+	sparse_ind_t *visited = (sparse_ind_t *) Malloc(size);
+	sparse_ind_t *mark = (sparse_ind_t *) Malloc(size);
+	sparse_ind_t *queue = (sparse_ind_t *) Malloc(size);
+	sparse_ind_t stamp = 0;
+
+	for (sparse_ind_t v = 0; v < n; v++) {
+		visited[v] = 0;
+		mark[v] = 0;
+	}
+
+	sparse_ind_t count = 0;
+	for (sparse_ind_t v = 0; v < n; v++) {
+		if (visited[v]) continue;
+
+		sparse_ind_t start = pseudo_peripheral_vertex(G, v, NULL, mark, &stamp, queue);
+		perm[count++] = start;
+		visited[start] = 1;
+
+		for (sparse_ind_t head = count - 1; head < count; head++) {
+			sparse_ind_t u = perm[head];
+			sparse_ind_t first = count;
+
+			for (sparse_ptr_t p = G->row_ptr[u]; p < G->row_ptr[u + 1]; p++) {
+				sparse_ind_t w = G->col_ind[p];
+				if (visited[w]) continue;
+				visited[w] = 1;
+
+				/* Insert by degree; neighbour lists are short */
+				sparse_ptr_t degree = G->row_ptr[w + 1] - G->row_ptr[w];
+				sparse_ind_t i = count++;
+				while (i > first && G->row_ptr[perm[i - 1] + 1] - G->row_ptr[perm[i - 1]] > degree) {
+					perm[i] = perm[i - 1];
+					i--;
+				}
+				perm[i] = w;
+			}
+		}
+	}
+
+	for (sparse_ind_t i = 0; i < n / 2; i++) {
+		sparse_ind_t t = perm[i];
+		perm[i] = perm[n - 1 - i];
+		perm[n - 1 - i] = t;
+	}
+
+	free(visited);
+	free(mark);
+	free(queue);
+	free_CSR_matrix(G);
+	return perm;
+}
+
+/* 
+ * Function: degree_ordering
+ * ---------------------------- 
+ *   Orders the rows of a matrix by decreasing number of non-zero values,
+ *   keeping rows of equal length in their original order. Grouping the
+ *   heavy rows together keeps the rows of Y they reach hot in the cache,
+ *   which matters most for matrices with a few very dense rows.
+ * 
+ *   R: the CSR matrix to order
+ * 
+ *   returns: the newly allocated permutation, perm[new] = old
+ */
+sparse_ind_t *degree_ordering(struct CSR_Matrix *R) {
+	sparse_ind_t n = R->num_rows;
+	sparse_ptr_t max_degree = 0;
+
+	for (sparse_ind_t i = 0; i < n; i++)
+		if (R->row_ptr[i + 1] - R->row_ptr[i] > max_degree)
+			max_degree = R->row_ptr[i + 1] - R->row_ptr[i];
+
+	/* Counting sort on the degree, with bucket 0 holding the longest rows */
+	sparse_ind_t *bucket = (sparse_ind_t *) calloc((size_t) max_degree + 2,
+		sizeof(sparse_ind_t));
+	if (bucket == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (sparse_ind_t i = 0; i < n; i++)
+		bucket[max_degree - (R->row_ptr[i + 1] - R->row_ptr[i]) + 1]++;
+	for (sparse_ptr_t d = 0; d <= max_degree; d++) bucket[d + 1] += bucket[d];
+
+	sparse_ind_t *perm = (sparse_ind_t *) Malloc(((size_t) n + 1) * \
+		sizeof(sparse_ind_t));
+	for (sparse_ind_t i = 0; i < n; i++)
+		perm[bucket[max_degree - (R->row_ptr[i + 1] - R->row_ptr[i])]++] = i;
+
+	free(bucket);
+	return perm;
+}
+
+/* 
+ * Function: bisection_ordering
+ * ---------------------------- 
+ *   Orders a square matrix by recursive graph bisection: each part is laid
+ *   out breadth first from a pseudo-peripheral vertex and cut in half along
+ *   that order, so both halves are well connected inside and touch mostly
+ *   along the cut. Parts stop splitting at SPARSE_BISECT_LEAF rows. Rows
+ *   that end up close together in the order are then close in the graph,
+ *   which is what a cache wants, at every scale.
+ * 
+ *   R: the square CSR matrix to order; its pattern is symmetrised first
+ * 
+ *   returns: the newly allocated permutation, perm[new] = old
+ */
+sparse_ind_t *bisection_ordering(struct CSR_Matrix *R) {
+	struct CSR_Matrix *G = symmetric_pattern(R);
+	sparse_ind_t n = G->num_rows;
+	size_t size = ((size_t) n + 1) * sizeof(sparse_ind_t);
+
+	sparse_ind_t *perm = (sparse_ind_t *) Malloc(size);
+	sparse_ind_t *part = (sparse_ind_t *) Malloc(size);
+	sparse_ind_t *visited = (sparse_ind_t *) Malloc(size);
+	sparse_ind_t *mark = (sparse_ind_t *) Malloc(size);
+	sparse_ind_t *queue = (sparse_ind_t *) Malloc(size);
+	sparse_ind_t *order = (sparse_ind_t *) Malloc(size);
+	sparse_ind_t visit_stamp = 0, mark_stamp = 0, num_parts = 1;
+
+	for (sparse_ind_t v = 0; v < n; v++) {
+		perm[v] = v;
+		part[v] = 0;
+		visited[v] = 0;
+		mark[v] = 0;
+	}
+
+	/* Each part holds perm[lo] to perm[hi - 1] */
+	sparse_ind_t stack[2 * 8 * sizeof(sparse_ind_t) + 2][2];
+	int top = 0;
+	stack[top][0] = 0;
+	stack[top][1] = n;
+	top++;
+
+	while (top > 0) {
+		top--;
+		sparse_ind_t lo = stack[top][0], hi = stack[top][1];
+		if (hi - lo <= SPARSE_BISECT_LEAF) continue;
+
+		/* Lay the part out breadth first, one connected piece at a time */
+		visit_stamp++;
+		sparse_ind_t count = 0;
+		for (sparse_ind_t i = lo; i < hi; i++) {
+			if (visited[perm[i]] == visit_stamp) continue;
+
+			sparse_ind_t start = pseudo_peripheral_vertex(G, perm[i], part, mark,
+				&mark_stamp, queue);
+			sparse_ind_t last_level, num_levels;
+			count += breadth_first_levels(G, start, part, visited, visit_stamp,
+				order + count, &last_level, &num_levels);
+		}
+		memcpy(perm + lo, order, (size_t) (hi - lo) * sizeof(sparse_ind_t));
+
+		sparse_ind_t mid = lo + (hi - lo) / 2;
+		for (sparse_ind_t i = mid; i < hi; i++) part[perm[i]] = num_parts;
+		num_parts++;
+
+		/* The halves are the same size, so the stack holds at most one
+		*  waiting range per level of the recursion */
+		stack[top][0] = mid;
+		stack[top][1] = hi;
+		top++;
+		stack[top][0] = lo;
+		stack[top][1] = mid;
+		top++;
+	}
+
+	free(part);
+	free(visited);
+	free(mark);
+	free(queue);
+	free(order);
+	free_CSR_matrix(G);
+	return perm;
+}
+
+/* 
+ * Function: count_flops
+ * ---------------------------- 
+ *   X: the left CSR matrix
+ *   Y: the right CSR matrix
+ * 
+ *   returns: the number of multiplications in X * Y
+ */
+static sparse_ptr_t count_flops(struct CSR_Matrix *X, struct CSR_Matrix *Y) {
+	sparse_ptr_t flops = 0;
 
-struct CSR_Matrix *init_CSR_matrix(int num_val, int num_rows, int num_cols);
-void* Malloc(size_t size);
+	#pragma omp parallel for reduction(+:flops)
+	for (sparse_ptr_t p = 0; p < X->row_ptr[X->num_rows]; p++)
+		flops += Y->row_ptr[X->col_ind[p] + 1] - Y->row_ptr[X->col_ind[p]];
 
+	return flops;
+}
 
 /* 
- * A matrix in Compressed Row Storage format, which stores just the non-zero
- * values of a matrix in row-major order.
- * Saves on a lot of memory over a 2D array representation when the number of
- * non-zero values are less than (m * (n - 1) - 1) / 2 for an m x n matrix,
- * which would normally require m x n space.
- * Saves time on matrix computations as not all comparisons have to be made,
- * just the comparisons of non-zero values.
+ * Function: product_density
+ * ---------------------------- 
+ *   Estimates the fraction of non-zero values in X * Y, assuming those of X
+ *   and Y are spread uniformly at random: each value of the product is a
+ *   sum of inner terms, each non-zero with probability x_density * y_density.
+ * 
+ *   x_density: the fraction of non-zero values in X
+ *   y_density: the fraction of non-zero values in Y
+ *   inner: the number of columns of X
+ * 
+ *   returns: the estimated fraction of non-zero values in X * Y
  */
-struct CSR_Matrix {
-	int *val;  /* The non-zero values in the matrix */
-	int *col_ind;  /* The column indices of the corresponding values in val */
+static double product_density(double x_density, double y_density, sparse_ind_t inner) {
+	/* 1 - (1 - x_density * y_density)^inner, by repeated squaring */
+	double base = 1 - x_density * y_density, zero = 1;
+	for (sparse_ind_t e = inner; e > 0; e >>= 1) {
+		if (e & 1) zero *= base;
+		base *= base;
+	}
+	return 1 - zero;
+}
 
-	/* Points to the non-zero values at the start of each row */
-	/* Defined recursively as
-		i) row_ptr[0] = 0
-		ii) row_ptr[i] = row_ptr[i - 1] + the number of non-zero values in the
-			ith row */
-	int *row_ptr;
-	int num_rows;
-	int num_cols;
-};
+/* 
+ * Function: sparse_chain_order
+ * ---------------------------- 
+ *   Finds the cheapest order to multiply a chain of sparse matrices in, by
+ *   the same dynamic programming as for dense chains, but with the cost of
+ *   each product being its expected number of multiplications,
+ *   x_density * y_density * m * k * n. The density of each sub-chain's
+ *   product is estimated along the way with product_density.
+ * 
+ *   matrices: the chain
+ *   num: the number of matrices
+ *   cost: a num x num array, filled with the least cost of each sub-chain
+ *   density: a num x num array, filled with the estimated density of each
+ *     sub-chain's product
+ *   split: a num x num array, filled with the split of each sub-chain; the
+ *     last factor of the left side of factors i to j is split[i * num + j]
+ */
+static void sparse_chain_order(struct CSR_Matrix **matrices, int num, double *cost,
+	double *density, int *split) {
+	for (int i = 0; i < num; i++) {
+		struct CSR_Matrix *R = matrices[i];
+		double size = (double) R->num_rows * R->num_cols;
+		cost[i * num + i] = 0;
+		density[i * num + i] = size > 0 ? R->row_ptr[R->num_rows] / size : 0;
+	}
+
+	for (int len = 2; len <= num; len++) {
+		for (int i = 0; i + len - 1 < num; i++) {
+			int j = i + len - 1;
+			double m = matrices[i]->num_rows, n = matrices[j]->num_cols;
+			cost[i * num + j] = -1;
+
+			for (int s = i; s < j; s++) {
+				double k = matrices[s]->num_cols;
+				double c = cost[i * num + s] + cost[(s + 1) * num + j] + \
+					density[i * num + s] * density[(s + 1) * num + j] * m * k * n;
+
+				if (cost[i * num + j] < 0 || c < cost[i * num + j]) {
+					cost[i * num + j] = c;
+					split[i * num + j] = s;
+					density[i * num + j] = product_density(density[i * num + s],
+						density[(s + 1) * num + j], matrices[s]->num_cols);
+				}
+			}
+		}
+	}
+}
 
 /* 
- * A matrix in Compressed Column Storage format. Similar to CSR except in
- * column-major order.
+ * Function: multiply_sparse_sub_chain
+ * ---------------------------- 
+ *   Multiplies matrices i to j of a chain in the order found by
+ *   sparse_chain_order, freeing the intermediate products as it goes.
+ * 
+ *   matrices, num, split: as in sparse_chain_order
+ *   i: the first matrix
+ *   j: the last matrix
+ *   flops: the multiplications done are added to this
+ * 
+ *   returns: the product, which is matrices[i] itself if i == j
  */
-struct CCS_Matrix {
-	int *val;
-	int *row_ind;
-	int *col_ptr;
-	int num_rows;
-	int num_cols;
-};
+static struct CSR_Matrix *multiply_sparse_sub_chain(struct CSR_Matrix **matrices,
+	int num, const int *split, int i, int j, double *flops) {
+	if (i == j) return matrices[i];
+
+	int s = split[i * num + j];
+	struct CSR_Matrix *X = multiply_sparse_sub_chain(matrices, num, split, i, s, flops);
+	struct CSR_Matrix *Y = multiply_sparse_sub_chain(matrices, num, split, s + 1, j,
+		flops);
+
+	*flops += count_flops(X, Y);
+	struct CSR_Matrix *Z = rowwise_sparse_matrix_multiply(X, Y);
 
+	if (i != s) free_CSR_matrix(X);
+	if (s + 1 != j) free_CSR_matrix(Y);
+	return Z;
+}
 
 /* 
- * Function: sparse_matrix_multiply
+ * Function: sparse_matrix_chain_multiply
  * ---------------------------- 
- *   Computes X * Y sparse matrices. The benefits of multiplying a CSR matrix
- *   with a CCS matrix are optimal; CSR matrices are fast at directly traversing
- *   rows, and CCS matrices are fast at directly traversing columns. Both of
- *   these corresponding tasks are required in the compuation X * Y.
+ *   Computes the product of a chain of CSR matrices with
+ *   rowwise_sparse_matrix_multiply, in the order expected to take the fewest
+ *   multiplications (see sparse_chain_order). For sparse matrices the order
+ *   matters even when the shapes are all the same, as it decides how dense
+ *   the intermediate products get.
  * 
- *   X: 2D sparse matrix to left-multiply
- *   Y: 2D sparse matrix to right-multiply
+ *   matrices: the CSR matrices to multiply, in order
+ *   num: the number of matrices, at least 1
+ *   report: if not NULL, filled with the estimated and actual cost
  * 
- *   returns: the matrix X * Y as a CSR matrix
+ *   returns: the product as a newly allocated CSR matrix
  */
-struct CSR_Matrix *sparse_matrix_multiply(struct CSR_Matrix *X, struct CCS_Matrix *Y) {
-	// Check whether X and Y are compatible
-	if (X->num_cols != Y->num_rows) {
-		fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+struct CSR_Matrix *sparse_matrix_chain_multiply(struct CSR_Matrix **matrices,
+	int num, struct Sparse_Chain_Report *report) {
+	if (num < 1) {
+		fprintf(stderr, "A chain must have at least one matrix.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	int z_rows = X->num_rows;
-	int z_cols = Y->num_cols;
+	for (int i = 1; i < num; i++) {
+		// Check whether each pair is compatible
+		if (matrices[i - 1]->num_cols != matrices[i]->num_rows) {
+			fprintf(stderr, "Matrix sizes are incompatible for multiplication.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	/* Create these on the stack and fill them in to a struct later */
-	/* Although more time-consuming, ensures the structs are space efficient */
-	/* Space efficiency is important in compressed formats for future
-	*  computations */
-	int z_val[z_rows * z_cols];
-	int z_col_ind[z_rows * z_cols];
-	int z_row_ptr[z_rows + 1];
-	int z_val_count = 0;
+	struct timespec start, end;
+	timespec_get(&start, TIME_UTC);
 
-	z_row_ptr[0] = 0;
+	double *cost = (double *) Malloc((size_t) num * num * sizeof(double));
+	double *density = (double *) Malloc((size_t) num * num * sizeof(double));
+	int *split = (int *) Malloc((size_t) num * num * sizeof(int));
+	sparse_chain_order(matrices, num, cost, density, split);
 
-	for (int cur_z_row = 0; cur_z_row < z_rows; cur_z_row++) {
-		int cur_row_val_count = 0;
+	double flops = 0;
+	struct CSR_Matrix *Z = multiply_sparse_sub_chain(matrices, num, split, 0,
+		num - 1, &flops);
+	/* A chain of one matrix is that matrix, which the caller still owns */
+	if (num == 1) Z = copy_CSR_matrix(Z);
 
-		for (int cur_z_col = 0; cur_z_col < z_cols; cur_z_col++) {
-			int dot_product = 0;
+	timespec_get(&end, TIME_UTC);
 
-			/* For traversing the row in Y */
-			int y_row = Y->col_ptr[cur_z_col];
+	if (report != NULL) {
+		report->estimated_cost = cost[num - 1];
+		report->actual_cost = flops;
+		report->estimated_nnz = density[num - 1] * Z->num_rows * (double) Z->num_cols;
+		report->actual_nnz = Z->row_ptr[Z->num_rows];
+		report->seconds = (end.tv_sec - start.tv_sec) + \
+			(end.tv_nsec - start.tv_nsec) * 1e-9;
 
-			/* Traverse the column in X */
-			for (int x_col = X->row_ptr[cur_z_row];
-				x_col < X->row_ptr[cur_z_row + 1]; x_col++) {
-				while (Y->row_ind[y_row] < X->col_ind[x_col] && \
-					y_row < Y->col_ptr[cur_z_col + 1]) y_row++;
+		/* The same estimates, multiplying left to right */
+		double left_density = density[0];
+		report->left_to_right_cost = 0;
+		for (int i = 1; i < num; i++) {
+			report->left_to_right_cost += left_density * density[i * num + i] * \
+				matrices[0]->num_rows * (double) matrices[i]->num_rows * \
+				matrices[i]->num_cols;
+			left_density = product_density(left_density, density[i * num + i],
+				matrices[i]->num_rows);
+		}
+	}
 
-				/* There are no more non-zero values in the row in Y, no need to
-				*  continue */
-				if (y_row >= Y->col_ptr[cur_z_col + 1]) break;
+	free(cost);
+	free(density);
+	free(split);
+	return Z;
+}
 
-				if (Y->row_ind[y_row] == X->col_ind[x_col])
-					dot_product += X->val[x_col] * Y->val[y_row];
-			}
+#ifdef USE_MPI
+/* 
+ * Function: init_sparse_process_grid
+ * ---------------------------- 
+ *   Arranges the processes of a communicator in a grid as close to square as
+ *   their number allows, for sparse_summa_matrix_multiply. Rank r is process
+ *   (r / grid_cols, r % grid_cols).
+ * 
+ *   comm: the processes to use, all of which must call this
+ * 
+ *   returns: the grid, to free with free_sparse_process_grid
+ */
+struct Sparse_Process_Grid *init_sparse_process_grid(MPI_Comm comm) {
+	int size, rank;
+	MPI_Comm_size(comm, &size);
+	MPI_Comm_rank(comm, &rank);
 
-			if (dot_product != 0) {
-				z_val[z_val_count] = dot_product;
-				z_col_ind[z_val_count] = cur_z_col;
-				z_val_count++;
-				cur_row_val_count++;
-			}
+	struct Sparse_Process_Grid *G = (struct Sparse_Process_Grid *) Malloc( \
+		sizeof(struct Sparse_Process_Grid));
+	G->grid_rows = 1;
+	for (int rows = 1; rows * rows <= size; rows++)
+		if (size % rows == 0) G->grid_rows = rows;
+	G->grid_cols = size / G->grid_rows;
+	G->row = rank / G->grid_cols;
+	G->col = rank % G->grid_cols;
+
+	MPI_Comm_dup(comm, &G->comm);
+	MPI_Comm_split(comm, G->row, G->col, &G->row_comm);
+	MPI_Comm_split(comm, G->col, G->row, &G->col_comm);
+
+	return G;
+}
+
+void free_sparse_process_grid(struct Sparse_Process_Grid *G) {
+	MPI_Comm_free(&G->row_comm);
+	MPI_Comm_free(&G->col_comm);
+	MPI_Comm_free(&G->comm);
+	free(G);
+}
+
+void free_sparse_summa_report(struct Sparse_Summa_Report *report) {
+	free(report->stage_bytes);
+	free(report->stage_broadcast_seconds);
+	free(report->stage_multiply_seconds);
+}
+
+/* 
+ * Function: sparse_grid_block_range
+ * ---------------------------- 
+ *   Splits n rows (or columns) as evenly as possible in to parts blocks.
+ * 
+ *   n: the number to split
+ *   parts: the number of blocks
+ *   index: the block
+ *   first: set to the first row of the block
+ *   count: set to the number of rows in the block
+ */
+void sparse_grid_block_range(sparse_ind_t n, int parts, int index, sparse_ind_t *first,
+	sparse_ind_t *count) {
+	*first = (sparse_ind_t) ((int64_t) n * index / parts);
+	*count = (sparse_ind_t) ((int64_t) n * (index + 1) / parts) - *first;
+}
+
+/* Returns the block of a split that holds row (or column) i */
+static int sparse_grid_block_of(sparse_ind_t n, int parts, sparse_ind_t i) {
+	int block = (int) ((int64_t) i * parts / n);
+	sparse_ind_t first, count;
+	/* The even split can put i one block away from the estimate */
+	sparse_grid_block_range(n, parts, block, &first, &count);
+	while (i >= first + count) sparse_grid_block_range(n, parts, ++block, &first, &count);
+	while (i < first) sparse_grid_block_range(n, parts, --block, &first, &count);
+	return block;
+}
+
+/* 
+ * Function: CSR_block
+ * ---------------------------- 
+ *   Copies rows r0 to r0 + nr - 1 and columns c0 to c0 + nc - 1 of a CSR
+ *   matrix, numbering them from 0.
+ * 
+ *   R: the matrix
+ *   r0, nr: the first row and the number of rows
+ *   c0, nc: the first column and the number of columns
+ * 
+ *   returns: the block as a new CSR matrix
+ */
+static struct CSR_Matrix *CSR_block(struct CSR_Matrix *R, sparse_ind_t r0,
+	sparse_ind_t nr, sparse_ind_t c0, sparse_ind_t nc) {
+	sparse_ptr_t *first = (sparse_ptr_t *) Malloc(((size_t) nr + 1) * sizeof(sparse_ptr_t));
+	sparse_ptr_t *row_ptr = (sparse_ptr_t *) Malloc(((size_t) nr + 1) * sizeof(sparse_ptr_t));
+
+	/* The columns of a row are sorted, so the block's are one run of them */
+	#pragma omp parallel for schedule(static)
+	for (sparse_ind_t i = 0; i < nr; i++) {
+		sparse_ptr_t lo = R->row_ptr[r0 + i], hi = R->row_ptr[r0 + i + 1];
+		while (lo < hi && R->col_ind[lo] < c0) lo++;
+		sparse_ptr_t end = lo;
+		while (end < hi && R->col_ind[end] < c0 + nc) end++;
+		first[i] = lo;
+		row_ptr[i + 1] = end - lo;
+	}
+
+	row_ptr[0] = 0;
+	for (sparse_ind_t i = 0; i < nr; i++) row_ptr[i + 1] += row_ptr[i];
+
+	struct CSR_Matrix *B = init_CSR_matrix(row_ptr[nr], nr, nc);
+	memcpy(B->row_ptr, row_ptr, ((size_t) nr + 1) * sizeof(sparse_ptr_t));
+
+	#pragma omp parallel for schedule(static)
+	for (sparse_ind_t i = 0; i < nr; i++)
+		for (sparse_ptr_t p = 0; p < row_ptr[i + 1] - row_ptr[i]; p++) {
+			B->col_ind[row_ptr[i] + p] = R->col_ind[first[i] + p] - c0;
+			B->val[row_ptr[i] + p] = R->val[first[i] + p];
 		}
 
-		z_row_ptr[cur_z_row + 1] = z_row_ptr[cur_z_row] + cur_row_val_count;
+	free(first);
+	free(row_ptr);
+	return B;
+}
+
+/* MPI counts are ints, so longer arrays are sent SPARSE_MPI_CHUNK elements at
+*  a time by send_array, recv_array and bcast_array */
+#ifndef SPARSE_MPI_CHUNK
+#define SPARSE_MPI_CHUNK INT_MAX
+#endif
+
+static void send_array(const void *buf, sparse_ptr_t count, MPI_Datatype type,
+	size_t size, int dest, MPI_Comm comm) {
+	for (sparse_ptr_t p = 0; p < count; p += SPARSE_MPI_CHUNK) {
+		sparse_ptr_t chunk = count - p < SPARSE_MPI_CHUNK ? count - p : SPARSE_MPI_CHUNK;
+		MPI_Send((const char *) buf + p * size, (int) chunk, type, dest, 0, comm);
 	}
+}
 
-	struct CSR_Matrix *Z = init_CSR_matrix(z_val_count, z_rows, z_cols);
+static void recv_array(void *buf, sparse_ptr_t count, MPI_Datatype type, size_t size,
+	int src, MPI_Comm comm) {
+	for (sparse_ptr_t p = 0; p < count; p += SPARSE_MPI_CHUNK) {
+		sparse_ptr_t chunk = count - p < SPARSE_MPI_CHUNK ? count - p : SPARSE_MPI_CHUNK;
+		MPI_Recv((char *) buf + p * size, (int) chunk, type, src, 0, comm,
+			MPI_STATUS_IGNORE);
+	}
+}
 
-	/* Fill in the CSR matrix */
-	for (int i = 0; i < z_val_count; i++) {
-		Z->val[i] = z_val[i];
-		Z->col_ind[i] = z_col_ind[i];
+static void bcast_array(void *buf, sparse_ptr_t count, MPI_Datatype type, size_t size,
+	int root, MPI_Comm comm) {
+	for (sparse_ptr_t p = 0; p < count; p += SPARSE_MPI_CHUNK) {
+		sparse_ptr_t chunk = count - p < SPARSE_MPI_CHUNK ? count - p : SPARSE_MPI_CHUNK;
+		MPI_Bcast((char *) buf + p * size, (int) chunk, type, root, comm);
 	}
+}
 
-	for (int i = 0; i < z_rows + 1; i++) Z->row_ptr[i] = z_row_ptr[i];
+/* Sends a CSR matrix whose size the receiver knows, see recv_CSR_matrix */
+static void send_CSR_matrix(struct CSR_Matrix *R, int dest, MPI_Comm comm) {
+	sparse_ptr_t num_val = R->row_ptr[R->num_rows];
+	MPI_Send(&num_val, 1, MPI_SPARSE_PTR, dest, 0, comm);
+	send_array(R->row_ptr, (sparse_ptr_t) R->num_rows + 1, MPI_SPARSE_PTR,
+		sizeof(sparse_ptr_t), dest, comm);
+	send_array(R->col_ind, num_val, MPI_SPARSE_IND, sizeof(sparse_ind_t), dest, comm);
+	send_array(R->val, num_val, MPI_INT, sizeof(int), dest, comm);
+}
 
-	return Z;
+static struct CSR_Matrix *recv_CSR_matrix(sparse_ind_t num_rows, sparse_ind_t num_cols,
+	int src, MPI_Comm comm) {
+	sparse_ptr_t num_val;
+	MPI_Recv(&num_val, 1, MPI_SPARSE_PTR, src, 0, comm, MPI_STATUS_IGNORE);
+
+	struct CSR_Matrix *R = init_CSR_matrix(num_val, num_rows, num_cols);
+	recv_array(R->row_ptr, (sparse_ptr_t) num_rows + 1, MPI_SPARSE_PTR,
+		sizeof(sparse_ptr_t), src, comm);
+	recv_array(R->col_ind, num_val, MPI_SPARSE_IND, sizeof(sparse_ind_t), src, comm);
+	recv_array(R->val, num_val, MPI_INT, sizeof(int), src, comm);
+	return R;
 }
 
 /* 
- * Function: init_CSR_matrix
+ * Function: bcast_CSR_matrix
  * ---------------------------- 
- *   Allocates a CSR matrix of size num_rows x num_cols and num_val non-zero
- *   values.
+ *   Broadcasts a CSR matrix whose size all the processes know.
  * 
- *   num_val: the number of non-zero values
- *   num_rows: the number of rows
- *   num_cols: the number of columns
+ *   R: the matrix on the root, ignored elsewhere
+ *   num_rows: the number of rows in the matrix
+ *   num_cols: the number of columns in the matrix
+ *   root: the rank of the root in comm
+ *   comm: the processes to broadcast to
+ *   bytes: the bytes received are added to it, except on the root
  * 
- *   returns: the allocated CSR matrix
+ *   returns: R on the root, a new CSR matrix elsewhere
  */
-struct CSR_Matrix *init_CSR_matrix(int num_val, int num_rows, int num_cols) {
-	struct CSR_Matrix *R = (struct CSR_Matrix *) Malloc(sizeof(struct CSR_Matrix));
-	R->val = (int *) Malloc(num_val * sizeof(int));
-	R->col_ind = (int *) Malloc(num_val * sizeof(int));
-	R->row_ptr = (int *) Malloc((num_rows + 1) * sizeof(int));
-	R->num_rows = num_rows;
-	R->num_cols = num_cols;
+static struct CSR_Matrix *bcast_CSR_matrix(struct CSR_Matrix *R, sparse_ind_t num_rows,
+	sparse_ind_t num_cols, int root, MPI_Comm comm, double *bytes) {
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+
+	sparse_ptr_t num_val = rank == root ? R->row_ptr[num_rows] : 0;
+	MPI_Bcast(&num_val, 1, MPI_SPARSE_PTR, root, comm);
+	if (rank != root) R = init_CSR_matrix(num_val, num_rows, num_cols);
+
+	bcast_array(R->row_ptr, (sparse_ptr_t) num_rows + 1, MPI_SPARSE_PTR,
+		sizeof(sparse_ptr_t), root, comm);
+	bcast_array(R->col_ind, num_val, MPI_SPARSE_IND, sizeof(sparse_ind_t), root, comm);
+	bcast_array(R->val, num_val, MPI_INT, sizeof(int), root, comm);
+
+	if (rank != root)
+		*bytes += ((double) num_rows + 2) * sizeof(sparse_ptr_t) + \
+			(double) num_val * (sizeof(sparse_ind_t) + sizeof(int));
+	return R;
+}
 
+/* 
+ * Function: scatter_CSR_matrix
+ * ---------------------------- 
+ *   Sends each process of a grid its block of a CSR matrix held by rank 0.
+ * 
+ *   G: the grid
+ *   R: the matrix, on rank 0 (NULL elsewhere)
+ *   num_rows: the number of rows in R
+ *   num_cols: the number of columns in R
+ * 
+ *   returns: the block of the process, with its rows and columns numbered
+ *     from the start of the block
+ */
+struct CSR_Matrix *scatter_CSR_matrix(struct Sparse_Process_Grid *G, struct CSR_Matrix *R,
+	sparse_ind_t num_rows, sparse_ind_t num_cols) {
+	sparse_ind_t r0, nr, c0, nc;
+	sparse_grid_block_range(num_rows, G->grid_rows, G->row, &r0, &nr);
+	sparse_grid_block_range(num_cols, G->grid_cols, G->col, &c0, &nc);
+
+	int rank;
+	MPI_Comm_rank(G->comm, &rank);
+	if (rank != 0) return recv_CSR_matrix(nr, nc, 0, G->comm);
+
+	for (int dest = 1; dest < G->grid_rows * G->grid_cols; dest++) {
+		sparse_ind_t d_r0, d_nr, d_c0, d_nc;
+		sparse_grid_block_range(num_rows, G->grid_rows, dest / G->grid_cols, &d_r0, &d_nr);
+		sparse_grid_block_range(num_cols, G->grid_cols, dest % G->grid_cols, &d_c0, &d_nc);
+
+		struct CSR_Matrix *B = CSR_block(R, d_r0, d_nr, d_c0, d_nc);
+		send_CSR_matrix(B, dest, G->comm);
+		free_CSR_matrix(B);
+	}
+
+	return CSR_block(R, r0, nr, c0, nc);
+}
+
+/* 
+ * Function: gather_CSR_matrix
+ * ---------------------------- 
+ *   Collects the blocks of a distributed CSR matrix on rank 0. See
+ *   scatter_CSR_matrix.
+ * 
+ *   G: the grid
+ *   block: the block of the process
+ *   num_rows: the number of rows in the whole matrix
+ *   num_cols: the number of columns in the whole matrix
+ * 
+ *   returns: the whole matrix on rank 0, NULL elsewhere
+ */
+struct CSR_Matrix *gather_CSR_matrix(struct Sparse_Process_Grid *G,
+	struct CSR_Matrix *block, sparse_ind_t num_rows, sparse_ind_t num_cols) {
+	int rank;
+	MPI_Comm_rank(G->comm, &rank);
+
+	if (rank != 0) {
+		send_CSR_matrix(block, 0, G->comm);
+		return NULL;
+	}
+
+	struct COO_Builder *B = init_COO_builder(num_rows, num_cols, 0);
+
+	for (int src = 0; src < G->grid_rows * G->grid_cols; src++) {
+		sparse_ind_t r0, nr, c0, nc;
+		sparse_grid_block_range(num_rows, G->grid_rows, src / G->grid_cols, &r0, &nr);
+		sparse_grid_block_range(num_cols, G->grid_cols, src % G->grid_cols, &c0, &nc);
+
+		struct CSR_Matrix *R = src == 0 ? block : recv_CSR_matrix(nr, nc, src, G->comm);
+		sparse_ptr_t num_val = R->row_ptr[nr];
+		sparse_ind_t *row_ind = (sparse_ind_t *) Malloc((num_val + 1) * sizeof(sparse_ind_t));
+		sparse_ind_t *col_ind = (sparse_ind_t *) Malloc((num_val + 1) * sizeof(sparse_ind_t));
+
+		for (sparse_ind_t i = 0; i < nr; i++)
+			for (sparse_ptr_t p = R->row_ptr[i]; p < R->row_ptr[i + 1]; p++) {
+				row_ind[p] = r0 + i;
+				col_ind[p] = c0 + R->col_ind[p];
+			}
+		add_COO_triples(B, row_ind, col_ind, R->val, num_val);
+
+		free(row_ind);
+		free(col_ind);
+		if (src != 0) free_CSR_matrix(R);
+	}
+
+	struct CSR_Matrix *R = build_CSR_matrix(B);
+	free_COO_builder(B);
 	return R;
 }
 
+/* 
+ * Function: sparse_summa_matrix_multiply
+ * ---------------------------- 
+ *   Computes X * Y for CSR matrices distributed in blocks over a process
+ *   grid (Sparse SUMMA). The shared dimension is cut in to stages at the
+ *   block edges of both X and Y. At each stage, the process column holding
+ *   that panel of X broadcasts it along the process rows, and the process
+ *   row holding that panel of Y broadcasts it along the process columns.
+ *   Every process multiplies the two panels with
+ *   rowwise_sparse_matrix_multiply. The partial products are collected as
+ *   triples and summed once, in build_CSR_matrix, at the end.
+ * 
+ *   G: the grid, see init_sparse_process_grid
+ *   X: the block of the m x k left matrix held by this process, see
+ *     scatter_CSR_matrix
+ *   Y: the block of the k x n right matrix held by this process
+ *   m, k, n: the sizes of the product
+ *   report: if not NULL, filled with the communication and timings of each
+ *     stage
+ * 
+ *   returns: the block of X * Y held by this process
+ */
+struct CSR_Matrix *sparse_summa_matrix_multiply(struct Sparse_Process_Grid *G,
+	struct CSR_Matrix *X, struct CSR_Matrix *Y, sparse_ind_t m, sparse_ind_t k,
+	sparse_ind_t n, struct Sparse_Summa_Report *report) {
+	double start = MPI_Wtime(), broadcast = 0, multiply = 0, bytes = 0;
+
+	sparse_ind_t r0, mb, c0, nb, xk0, xkb, yk0, ykb;
+	sparse_grid_block_range(m, G->grid_rows, G->row, &r0, &mb);
+	sparse_grid_block_range(n, G->grid_cols, G->col, &c0, &nb);
+	sparse_grid_block_range(k, G->grid_cols, G->col, &xk0, &xkb);
+	sparse_grid_block_range(k, G->grid_rows, G->row, &yk0, &ykb);
+
+	if (X->num_rows != mb || X->num_cols != xkb || Y->num_rows != ykb || \
+		Y->num_cols != nb) {
+		fprintf(stderr, "Matrix blocks do not match the grid.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* At most one stage per block edge of X and of Y */
+	int max_stages = G->grid_rows + G->grid_cols;
+	if (report != NULL) {
+		report->stage_bytes = (double *) Malloc(max_stages * sizeof(double));
+		report->stage_broadcast_seconds = (double *) Malloc(max_stages * sizeof(double));
+		report->stage_multiply_seconds = (double *) Malloc(max_stages * sizeof(double));
+	}
+
+	struct COO_Builder *B = init_COO_builder(mb, nb, 0);
+	sparse_ind_t *row_ind = NULL;
+	sparse_ptr_t row_ind_capacity = 0;
+	int stage = 0;
+
+	for (sparse_ind_t k0 = 0; k0 < k; stage++) {
+		int x_owner = sparse_grid_block_of(k, G->grid_cols, k0);
+		int y_owner = sparse_grid_block_of(k, G->grid_rows, k0);
+		sparse_ind_t x_first, x_count, y_first, y_count;
+		sparse_grid_block_range(k, G->grid_cols, x_owner, &x_first, &x_count);
+		sparse_grid_block_range(k, G->grid_rows, y_owner, &y_first, &y_count);
+		sparse_ind_t k1 = x_first + x_count < y_first + y_count ? x_first + x_count : \
+			y_first + y_count;
+		sparse_ind_t w = k1 - k0;
+
+		/* Broadcast the panels, cut from the blocks unless they are whole */
+		double mark = MPI_Wtime(), stage_bytes = 0;
+		struct CSR_Matrix *x_panel = NULL, *y_panel = NULL;
+		if (G->col == x_owner)
+			x_panel = w == xkb ? X : CSR_block(X, 0, mb, k0 - xk0, w);
+		if (G->row == y_owner)
+			y_panel = w == ykb ? Y : CSR_block(Y, k0 - yk0, w, 0, nb);
+		struct CSR_Matrix *x_recv = bcast_CSR_matrix(x_panel, mb, w, x_owner, G->row_comm,
+			&stage_bytes);
+		struct CSR_Matrix *y_recv = bcast_CSR_matrix(y_panel, w, nb, y_owner, G->col_comm,
+			&stage_bytes);
+		double stage_broadcast = MPI_Wtime() - mark;
+
+		mark = MPI_Wtime();
+		struct CSR_Matrix *partial = rowwise_sparse_matrix_multiply(x_recv, y_recv);
+		sparse_ptr_t num_val = partial->row_ptr[mb];
+
+		if (num_val > row_ind_capacity) {
+			row_ind_capacity = num_val;
+			row_ind = (sparse_ind_t *) Realloc(row_ind, num_val * sizeof(sparse_ind_t));
+		}
+		#pragma omp parallel for schedule(static)
+		for (sparse_ind_t i = 0; i < mb; i++)
+			for (sparse_ptr_t p = partial->row_ptr[i]; p < partial->row_ptr[i + 1]; p++)
+				row_ind[p] = i;
+		add_COO_triples(B, row_ind, partial->col_ind, partial->val, num_val);
+		double stage_multiply = MPI_Wtime() - mark;
+
+		free_CSR_matrix(partial);
+		if (x_recv != X) free_CSR_matrix(x_recv);
+		if (y_recv != Y) free_CSR_matrix(y_recv);
+
+		broadcast += stage_broadcast;
+		multiply += stage_multiply;
+		bytes += stage_bytes;
+		if (report != NULL) {
+			report->stage_bytes[stage] = stage_bytes;
+			report->stage_broadcast_seconds[stage] = stage_broadcast;
+			report->stage_multiply_seconds[stage] = stage_multiply;
+		}
+
+		k0 = k1;
+	}
+
+	double mark = MPI_Wtime();
+	struct CSR_Matrix *Z = build_CSR_matrix(B);
+	double merge = MPI_Wtime() - mark;
+
+	free_COO_builder(B);
+	free(row_ind);
+
+	if (report != NULL) {
+		report->num_stages = stage;
+		report->bytes = bytes;
+		MPI_Allreduce(&bytes, &report->total_bytes, 1, MPI_DOUBLE, MPI_SUM, G->comm);
+		report->broadcast_seconds = broadcast;
+		report->multiply_seconds = multiply;
+		report->merge_seconds = merge;
+		report->seconds = MPI_Wtime() - start;
+	}
+
+	return Z;
+}
+#endif
+
+/* Both kernel files define Malloc, for when they are built together, see
+*  hybrid_matrix_multiply.c */
+#ifndef MATRIX_MALLOC
+#define MATRIX_MALLOC
 /* 
  * Function: Malloc
  * ---------------------------- 
@@ -162,44 +4318,173 @@ void* Malloc(size_t size) {
 	}
 	return to_ret;
 }
+#endif
+
+/* 
+ * Function: Realloc
+ * ---------------------------- 
+ *   Calls realloc with error checking. Exits with error code on failure.
+ * 
+ *   ptr: the memory to resize
+ *   size: the new size of the memory
+ * 
+ *   returns: the resized memory
+ */
+void* Realloc(void *ptr, size_t size) {
+	void *to_ret;
+	if ((to_ret = realloc(ptr, size)) == NULL) {
+		perror("Realloc");
+		exit(EXIT_FAILURE);
+	}
+	return to_ret;
+}
 
 
 /* --------------------------------------------------------- */
 /* Below are additional functions that were used for testing */
 /* --------------------------------------------------------- */
 
-struct CCS_Matrix *init_CCS_matrix(int num_val, int num_rows, int num_cols) {
-	struct CCS_Matrix *R = (struct CCS_Matrix *) Malloc(sizeof(struct CCS_Matrix));
-	R->val = (int *) Malloc(num_val * sizeof(int));
-	R->row_ind = (int *) Malloc(num_val * sizeof(int));
-	R->col_ptr = (int *) Malloc((num_rows + 1) * sizeof(int));
-	R->num_rows = num_rows;
-	R->num_cols = num_cols;
+void free_CSR_matrix(struct CSR_Matrix *R) {
+	free(R->val);
+	free(R->col_ind);
+	free(R->row_ptr);
+	free(R);
+}
 
-	return R;
+void free_CCS_matrix(struct CCS_Matrix *R) {
+	free(R->val);
+	free(R->row_ind);
+	free(R->col_ptr);
+	free(R);
 }
 
-void free_CSR_matrix(struct CSR_Matrix *R) {
+void free_DCSR_matrix(struct DCSR_Matrix *R) {
 	free(R->val);
 	free(R->col_ind);
+	free(R->row_ind);
 	free(R->row_ptr);
 	free(R);
 }
 
-void free_CCS_matrix(struct CCS_Matrix *R) {
+void free_DCSC_matrix(struct DCSC_Matrix *R) {
 	free(R->val);
 	free(R->row_ind);
+	free(R->col_ind);
 	free(R->col_ptr);
 	free(R);
 }
 
+/* Wall clock time in seconds */
+double wall_time() {
+	struct timespec t;
+	timespec_get(&t, TIME_UTC);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* The 5-point stencil of a grid_size x grid_size grid, with its rows and
+*  columns shuffled the same way, like a mesh read in some arbitrary order */
+struct CSR_Matrix *scrambled_grid_matrix(sparse_ind_t grid_size) {
+	sparse_ind_t n = grid_size * grid_size;
+	sparse_ind_t *shuffle = (sparse_ind_t *) Malloc(((size_t) n + 1) * \
+		sizeof(sparse_ind_t));
+
+	for (sparse_ind_t i = 0; i < n; i++) shuffle[i] = i;
+	for (sparse_ind_t i = n - 1; i > 0; i--) {
+		sparse_ind_t j = (sparse_ind_t) (((long long) rand() * RAND_MAX + rand()) % (i + 1));
+		sparse_ind_t t = shuffle[i]; shuffle[i] = shuffle[j]; shuffle[j] = t;
+	}
+
+	struct COO_Matrix *C = init_COO_matrix(5 * (sparse_ptr_t) n, n, n);
+	sparse_ptr_t k = 0;
+	for (sparse_ind_t r = 0; r < grid_size; r++) {
+		for (sparse_ind_t c = 0; c < grid_size; c++) {
+			sparse_ind_t dr[5] = {0, -1, 1, 0, 0}, dc[5] = {0, 0, 0, -1, 1};
+
+			for (int d = 0; d < 5; d++) {
+				sparse_ind_t r2 = r + dr[d], c2 = c + dc[d];
+				if (r2 < 0 || r2 >= grid_size || c2 < 0 || c2 >= grid_size) continue;
+
+				C->row_ind[k] = shuffle[r * grid_size + c];
+				C->col_ind[k] = shuffle[r2 * grid_size + c2];
+				C->val[k] = rand() % 9 + 1;
+				k++;
+			}
+		}
+	}
+	C->num_val = k;
+
+	struct CSR_Matrix *R = convert_COO_to_CSR(C);
+	free(C->val);
+	free(C->row_ind);
+	free(C->col_ind);
+	free(C);
+	free(shuffle);
+	return R;
+}
+
+/* Times A * A, both row-wise and masked by A (only the positions the dot
+*  products can reach), against the cost of reordering A first */
+void benchmark_reordering(sparse_ind_t grid_size, int repeats) {
+	const char *names[4] = {"none", "rcm", "degree", "bisection"};
+	srand(1);
+	struct CSR_Matrix *A = scrambled_grid_matrix(grid_size);
+	double base_time = 0;
+
+	printf("%d x %d grid, %lld rows, %lld non-zero values, best of %d\n",
+		(int) grid_size, (int) grid_size, (long long) A->num_rows,
+		(long long) A->row_ptr[A->num_rows], repeats);
+	printf("%-10s %10s %10s %10s %8s %10s\n", "ordering", "reorder", "rowwise",
+		"masked", "speedup", "break-even");
+
+	for (int method = 0; method < 4; method++) {
+		double start = wall_time();
+		sparse_ind_t *perm = method == 1 ? rcm_ordering(A) : \
+			method == 2 ? degree_ordering(A) : \
+			method == 3 ? bisection_ordering(A) : NULL;
+		struct CSR_Matrix *P = permute_CSR_matrix(A, perm, perm);
+		double reorder_time = method == 0 ? 0 : wall_time() - start;
+
+		struct CCS_Matrix *P_ccs = convert_CSR_to_CCS(P);
+		double rowwise_time = 0, masked_time = 0;
+
+		for (int r = 0; r < repeats; r++) {
+			start = wall_time();
+			struct CSR_Matrix *Z = rowwise_sparse_matrix_multiply(P, P);
+			double t = wall_time() - start;
+			if (r == 0 || t < rowwise_time) rowwise_time = t;
+			free_CSR_matrix(Z);
+
+			start = wall_time();
+			Z = masked_sparse_matrix_multiply(P, P_ccs, P, 0);
+			t = wall_time() - start;
+			if (r == 0 || t < masked_time) masked_time = t;
+			free_CSR_matrix(Z);
+		}
+
+		/* Reordering pays for itself after this many multiplies */
+		double total = rowwise_time + masked_time;
+		if (method == 0) base_time = total;
+		printf("%-10s %10.4f %10.4f %10.4f %7.2fx ", names[method], reorder_time,
+			rowwise_time, masked_time, base_time / total);
+		if (method == 0) printf("%10s\n", "-");
+		else if (total < base_time) printf("%10.1f\n", reorder_time / (base_time - total));
+		else printf("%10s\n", "never");
+
+		free(perm);
+		free_CSR_matrix(P);
+		free_CCS_matrix(P_ccs);
+	}
+
+	free_CSR_matrix(A);
+}
+
 void print_CSR_matrix(struct CSR_Matrix *R) {
-	for (int cur_row = 0; cur_row < R->num_rows; cur_row++) {
-		int cur_ptr = R->row_ptr[cur_row];
+	for (sparse_ind_t cur_row = 0; cur_row < R->num_rows; cur_row++) {
+		sparse_ptr_t cur_ptr = R->row_ptr[cur_row];
 
-		for (int cur_col = 0; cur_col < R->num_cols; cur_col++) {
-			if (cur_col == R->col_ind[cur_ptr] && \
-				cur_ptr < R->row_ptr[cur_row + 1]) {
+		for (sparse_ind_t cur_col = 0; cur_col < R->num_cols; cur_col++) {
+			if (cur_ptr < R->row_ptr[cur_row + 1] && \
+				cur_col == R->col_ind[cur_ptr]) {
 				printf("%d ", R->val[cur_ptr]);
 				cur_ptr++;
 			} else printf("0 ");
@@ -212,11 +4497,11 @@ void print_CSR_matrix(struct CSR_Matrix *R) {
 /* Not very time efficient, but sufficient for the purposes of testing small
 *  matrices */
 void print_CCS_matrix(struct CCS_Matrix *R) {
-	for (int cur_row = 0; cur_row < R->num_rows; cur_row++) {
-		for (int cur_col = 0; cur_col < R->num_cols; cur_col++) {
+	for (sparse_ind_t cur_row = 0; cur_row < R->num_rows; cur_row++) {
+		for (sparse_ind_t cur_col = 0; cur_col < R->num_cols; cur_col++) {
 			int val = 0;
 
-			for (int cur_ptr = R->col_ptr[cur_col];
+			for (sparse_ptr_t cur_ptr = R->col_ptr[cur_col];
 				cur_ptr < R->col_ptr[cur_col + 1] && \
 				R->row_ind[cur_ptr] <= cur_row;
 				cur_ptr++) {
@@ -230,9 +4515,76 @@ void print_CCS_matrix(struct CCS_Matrix *R) {
 	}
 }
 
-int main() {
-	int x_rows = 7, x_cols = 5;
-	int y_rows = 5, y_cols = 6;
+#ifdef USE_MPI
+/* Checks sparse_summa_matrix_multiply against rowwise_sparse_matrix_multiply
+*  on rank 0, for the square of a scrambled grid_size x grid_size grid */
+void test_sparse_summa(sparse_ind_t grid_size) {
+	int rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	struct Sparse_Process_Grid *G = init_sparse_process_grid(MPI_COMM_WORLD);
+	sparse_ind_t n = grid_size * grid_size;
+
+	struct CSR_Matrix *A = rank == 0 ? scrambled_grid_matrix(grid_size) : NULL;
+	struct CSR_Matrix *X = scatter_CSR_matrix(G, A, n, n);
+	/* The same blocks serve as Y, as A is square and the grid cuts k like n */
+	struct CSR_Matrix *Y = scatter_CSR_matrix(G, A, n, n);
+
+	struct Sparse_Summa_Report report;
+	struct CSR_Matrix *Z_block = sparse_summa_matrix_multiply(G, X, Y, n, n, n, &report);
+	struct CSR_Matrix *Z = gather_CSR_matrix(G, Z_block, n, n);
+
+	if (rank == 0) {
+		struct CSR_Matrix *expected = rowwise_sparse_matrix_multiply(A, A);
+		sparse_ptr_t num_val = expected->row_ptr[n];
+		int correct = Z->row_ptr[n] == num_val && \
+			memcmp(Z->row_ptr, expected->row_ptr, ((size_t) n + 1) * sizeof(sparse_ptr_t)) == 0 && \
+			memcmp(Z->col_ind, expected->col_ind, num_val * sizeof(sparse_ind_t)) == 0 && \
+			memcmp(Z->val, expected->val, num_val * sizeof(int)) == 0;
+
+		printf("Sparse SUMMA of a %ld x %ld grid on %dx%d: %s, %.0f bytes moved, "
+			"%.4fs\n", (long) grid_size, (long) grid_size, G->grid_rows, G->grid_cols,
+			correct ? "correct" : "WRONG", report.total_bytes, report.seconds);
+		for (int s = 0; s < report.num_stages; s++)
+			printf("  rank 0 stage %d: %.0f bytes, %.4fs broadcast, %.4fs multiply\n", s,
+				report.stage_bytes[s], report.stage_broadcast_seconds[s],
+				report.stage_multiply_seconds[s]);
+		printf("  rank 0 merge: %.4fs\n", report.merge_seconds);
+
+		free_CSR_matrix(A);
+		free_CSR_matrix(Z);
+		free_CSR_matrix(expected);
+	}
+
+	free_sparse_summa_report(&report);
+	free_CSR_matrix(X);
+	free_CSR_matrix(Y);
+	free_CSR_matrix(Z_block);
+	free_sparse_process_grid(G);
+}
+#endif
+
+/* Left out when the file is included in another, see hybrid_matrix_multiply.c */
+#ifndef MATRIX_LIBRARY
+int main(int argc, char **argv) {
+#ifdef USE_MPI
+	/* "summa [grid size]" runs the distributed product, e.g. with mpirun -np 4 */
+	if (argc > 1 && strcmp(argv[1], "summa") == 0) {
+		MPI_Init(&argc, &argv);
+		test_sparse_summa(argc > 2 ? atoi(argv[2]) : 100);
+		MPI_Finalize();
+		return 0;
+	}
+#endif
+
+	/* "bench [grid size] [repeats]" compares the reorderings instead */
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		benchmark_reordering(argc > 2 ? atoi(argv[2]) : 1000,
+			argc > 3 ? atoi(argv[3]) : 3);
+		return 0;
+	}
+
+	sparse_ind_t x_rows = 7, x_cols = 5;
+	sparse_ind_t y_rows = 5, y_cols = 6;
 
 	/* Manually create X and Y matrices for one test case */
 	struct CSR_Matrix *X = init_CSR_matrix(6, x_rows, x_cols);
@@ -297,3 +4649,4 @@ int main() {
 	free_CCS_matrix(Y);
 	free_CSR_matrix(Z);
 }
+#endif